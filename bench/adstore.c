@@ -0,0 +1,186 @@
+/*
+ * Measures the Windows attribute stream engine on plain files.
+ *
+ * Streams of 16 to 4096 attributes are written in v1 format, looked up with
+ * linear scans, migrated to v2 and looked up again with binary searches.
+ * Updates in place, updates which move values and full reads are timed on
+ * v2 streams. The engine reaches files through the same callbacks it uses
+ * for alternate data streams, so results carry over up to syscall cost.
+ *
+ *     make bench/adstore && XATTR_BENCH_DIR=/tmp bench/adstore
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adstore.h"
+
+#define LOOKUPS 20000
+#define UPDATES 5000
+#define VALUE_SIZE 64
+
+/* The engine only allocates memory through NIF API */
+
+void *enif_alloc(size_t size) { return malloc(size); }
+
+void enif_free(void *ptr) { free(ptr); }
+
+static int fd;
+
+static bool file_read(void *ctx, uint32_t offset, void *buff, size_t size) {
+  (void)ctx;
+  return pread(fd, buff, size, offset) == (ssize_t)size;
+}
+
+static bool file_write(void *ctx, uint32_t offset, const void *buff,
+                       size_t size) {
+  (void)ctx;
+  return pwrite(fd, buff, size, offset) == (ssize_t)size;
+}
+
+static bool file_size(void *ctx, uint32_t *size) {
+  off_t end = lseek(fd, 0, SEEK_END);
+  (void)ctx;
+  *size = (uint32_t)end;
+  return end != -1;
+}
+
+static bool file_truncate(void *ctx, uint32_t size) {
+  (void)ctx;
+  return ftruncate(fd, size) == 0;
+}
+
+static const adstore_io_t io = {NULL, file_read, file_write, file_size,
+                                file_truncate};
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void name_of(int n, char *name) { sprintf(name, "s$attribute%d", n); }
+
+static void write_cell(const void *data, unsigned size) {
+  unsigned char cell[4];
+
+  cell[0] = size & 0xff;
+  cell[1] = (size >> 8) & 0xff;
+  cell[2] = (size >> 16) & 0xff;
+  cell[3] = (size >> 24) & 0xff;
+  if (write(fd, cell, 4) != 4 || write(fd, data, size) != (ssize_t)size) {
+    perror("write");
+    exit(1);
+  }
+}
+
+static double lookups(int count) {
+  char name[64];
+  adstore_value_t value;
+  double start = now_us();
+  int i;
+
+  for (i = 0; i < LOOKUPS; i++) {
+    name_of(rand() % count, name);
+    if (adstore_find(&io, name, &value) != ADSTORE_OK) {
+      fprintf(stderr, "lookup of %s failed\n", name);
+      exit(1);
+    }
+  }
+
+  return (now_us() - start) / LOOKUPS;
+}
+
+static double updates(int count, size_t size) {
+  unsigned char value[4 * VALUE_SIZE];
+  char name[64];
+  double start = now_us();
+  int i;
+
+  memset(value, 'u', sizeof(value));
+  for (i = 0; i < UPDATES; i++) {
+    name_of(rand() % count, name);
+    if (adstore_set(&io, name, value, size + i % 2, SET_ANY) != ADSTORE_OK) {
+      fprintf(stderr, "update of %s failed\n", name);
+      exit(1);
+    }
+  }
+
+  return (now_us() - start) / UPDATES;
+}
+
+static adstore_result_t visit(void *acc, const char *name, size_t len,
+                              const unsigned char *value, size_t size) {
+  (void)name;
+  (void)len;
+  (void)value;
+  (void)size;
+  (*(int *)acc)++;
+  return ADSTORE_OK;
+}
+
+static double read_all(void) {
+  double start = now_us();
+  int seen = 0;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    adstore_each(&io, visit, &seen);
+  }
+
+  return (now_us() - start) / 100;
+}
+
+int main(void) {
+  static const int counts[] = {16, 64, 256, 1024, 4096};
+  unsigned char value[VALUE_SIZE];
+  char path[4096];
+  char name[64];
+  const char *dir = getenv("XATTR_BENCH_DIR");
+  double v1_get;
+  size_t i;
+  int n;
+
+  sprintf(path, "%s/xattr_adstore_bench", dir != NULL ? dir : "/tmp");
+  memset(value, 'v', sizeof(value));
+
+  printf("%6s %10s %10s %10s %10s %10s\n", "attrs", "v1 get us",
+         "v2 get us", "set us", "grow us", "each us");
+
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+      perror(path);
+      return 1;
+    }
+
+    for (n = 0; n < counts[i]; n++) {
+      name_of(n, name);
+      write_cell(name, strlen(name) + 1);
+      write_cell(value, sizeof(value));
+    }
+
+    v1_get = lookups(counts[i]);
+
+    /* migrates the stream */
+    if (adstore_set(&io, "s$migrate", value, 1, SET_ANY) != ADSTORE_OK) {
+      fprintf(stderr, "migration failed\n");
+      return 1;
+    }
+
+    printf("%6d %10.2f %10.2f", counts[i], v1_get, lookups(counts[i]));
+    printf(" %10.2f", updates(counts[i], VALUE_SIZE / 2));
+    printf(" %10.2f", updates(counts[i], 3 * VALUE_SIZE));
+    printf(" %10.2f\n", read_all());
+
+    close(fd);
+  }
+
+  unlink(path);
+  return 0;
+}
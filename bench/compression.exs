@@ -0,0 +1,124 @@
+# Measures compression ratio and read latency of compressed values.
+#
+# Values of several shapes are written to fresh files with compression off
+# and on (`:compress_names`), then read back with `get/2` with the cache
+# disabled. Read latency depends on where the file system keeps the value, so
+# point the benchmark at an ext4 mount to see the effect of values moving into
+# the inode (e.g. a loopback image made with `mkfs.ext4 -I 1024`):
+#
+#     XATTR_BENCH_DIR=/mnt/ext4 mix run bench/compression.exs
+#
+# Page cache is dropped before each read pass if the benchmark runs as root,
+# otherwise reads are served from memory and mostly show codec overhead.
+
+defmodule Xattr.Bench.Compression do
+  @files 200
+  @reads 10
+  @values [
+    {"json 1 KiB", :json, 1024},
+    {"json 4 KiB", :json, 4096},
+    {"json 32 KiB", :json, 32 * 1024},
+    {"term 4 KiB", :term, 4096},
+    {"random 4 KiB", :random, 4096}
+  ]
+
+  def run do
+    dir = System.get_env("XATTR_BENCH_DIR") || System.tmp_dir!()
+    dir = Path.join(dir, "xattr_compression_bench")
+    File.mkdir_p!(dir)
+
+    try do
+      IO.puts("directory: #{dir}\n")
+
+      IO.puts(
+        String.pad_trailing("value", 14) <>
+          String.pad_leading("ratio", 8) <>
+          String.pad_leading("plain us", 10) <> String.pad_leading("compressed us", 15)
+      )
+
+      for {name, kind, size} <- @values do
+        value = value(kind, size)
+
+        reload(compress_names: [])
+        plain = measure(dir, value)
+
+        reload(compress_names: ["value"])
+        compressed = measure(dir, value)
+
+        IO.puts(
+          String.pad_trailing(name, 14) <>
+            String.pad_leading(ratio(dir, value), 8) <>
+            String.pad_leading(:erlang.float_to_binary(plain, decimals: 1), 10) <>
+            String.pad_leading(:erlang.float_to_binary(compressed, decimals: 1), 15)
+        )
+      end
+    after
+      File.rm_rf!(dir)
+    end
+  end
+
+  defp value(:json, size) do
+    1..size
+    |> Stream.map(fn n ->
+      ~s({"id": #{n}, "owner": "user#{rem(n * 7, 97)}", "state": "active"})
+    end)
+    |> Enum.join(",")
+    |> binary_part(0, size)
+  end
+
+  defp value(:term, size) do
+    1..size
+    |> Enum.map(fn n -> {:entry, n, "user#{rem(n, 13)}", [:read, :write]} end)
+    |> :erlang.term_to_binary()
+    |> binary_part(0, size)
+  end
+
+  defp value(:random, size) do
+    for _ <- 1..size, into: "", do: <<:rand.uniform(256) - 1>>
+  end
+
+  # compressed value is read back in its stored form
+  defp ratio(dir, value) do
+    path = Path.join(dir, "ratio")
+    File.write!(path, "")
+    :ok = Xattr.set(path, "value", value)
+    {:ok, stored} = Xattr.Nif.getxattr_nif(path <> <<0>>, "z$s$value\0")
+    :erlang.float_to_binary(byte_size(stored) / byte_size(value), decimals: 3)
+  end
+
+  defp measure(dir, value) do
+    paths =
+      for n <- 1..@files do
+        path = Path.join(dir, "file#{n}")
+        File.rm(path)
+        File.write!(path, "")
+        :ok = Xattr.set(path, "value", value)
+        path
+      end
+
+    times =
+      for _ <- 1..@reads, path <- drop_caches(paths) do
+        {time, {:ok, _}} = :timer.tc(Xattr, :get, [path, "value"])
+        time
+      end
+
+    Enum.sum(times) / length(times)
+  end
+
+  defp drop_caches(paths) do
+    File.write("/proc/sys/vm/drop_caches", "3")
+    paths
+  end
+
+  defp reload(config) do
+    Application.put_env(:xattr, :cache_max_bytes, 0)
+    for {key, value} <- config, do: Application.put_env(:xattr, key, value)
+
+    :code.purge(Xattr.Nif)
+    :code.delete(Xattr.Nif)
+    :code.purge(Xattr.Nif)
+    {:module, Xattr.Nif} = :code.load_file(Xattr.Nif)
+  end
+end
+
+Xattr.Bench.Compression.run()
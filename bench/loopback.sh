@@ -0,0 +1,41 @@
+#!/bin/sh
+# Makes ext4 and xfs loopback images for `mix xattr.bench` and
+# `bench/xattr_bench`, mounts them under the given directory and prints
+# directory arguments for the benchmarks, tmpfs included. Has to be run as
+# root; the mounts are left in place until unmounted:
+#
+#     sudo bench/loopback.sh /mnt/xattr_bench
+#     mix xattr.bench --output bench.json $(cat /mnt/xattr_bench/dirs)
+#
+# IMAGE_SIZE sets size of each image (512M).
+
+set -e
+
+root=${1:-/mnt/xattr_bench}
+size=${IMAGE_SIZE:-512M}
+owner=${SUDO_USER:-$(id -un)}
+dirs="tmpfs=/dev/shm"
+
+mkdir -p "$root"
+
+for fs in ext4 xfs; do
+  image="$root/$fs.img"
+  dir="$root/$fs"
+
+  if ! mountpoint -q "$dir" 2>/dev/null; then
+    mkdir -p "$dir"
+    truncate -s "$size" "$image"
+
+    case $fs in
+    ext4) mkfs.ext4 -q -F "$image" ;;
+    xfs) mkfs.xfs -q -f "$image" ;;
+    esac
+
+    mount -o loop "$image" "$dir"
+    chown "$owner" "$dir"
+  fi
+
+  dirs="$dirs $fs=$dir"
+done
+
+echo "$dirs" | tee "$root/dirs"
@@ -0,0 +1,828 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "nif_env.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Terms
+ */
+
+typedef enum {
+  TERM_ATOM,
+  TERM_INT,
+  TERM_BINARY,
+  TERM_TUPLE,
+  TERM_LIST,
+  TERM_NIL,
+  TERM_MAP,
+  TERM_RESOURCE
+} kind_t;
+
+typedef struct {
+  kind_t kind;
+  /* length of atom or binary, arity of tuple, number of map pairs */
+  size_t size;
+  union {
+    unsigned char *data;
+    ERL_NIF_TERM *elems;
+    void *resource;
+    ErlNifUInt64 value;
+  } u;
+} term_t;
+
+#define TERM(term) ((term_t *)(term))
+
+/*
+ * Environments
+ */
+
+#define CHUNK_SIZE 65536
+#define ALIGNMENT 16
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t size;
+  size_t used;
+  unsigned char *data;
+} chunk_t;
+
+typedef struct owned {
+  struct owned *next;
+  void *data;
+} owned_t;
+
+struct enif_environment_t {
+  chunk_t *chunks;
+  owned_t *owned;
+};
+
+static chunk_t *new_chunk(size_t size) {
+  chunk_t *chunk;
+
+  if ((chunk = malloc(sizeof(chunk_t) + size)) == NULL) {
+    abort();
+  }
+
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->data = (unsigned char *)(chunk + 1);
+  return chunk;
+}
+
+static void *arena_alloc(ErlNifEnv *env, size_t size) {
+  chunk_t *chunk = env->chunks;
+  void *ptr;
+
+  size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+  if (chunk->size - chunk->used < size) {
+    chunk = new_chunk(size > CHUNK_SIZE ? size : CHUNK_SIZE);
+    chunk->next = env->chunks;
+    env->chunks = chunk;
+  }
+
+  ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+static ERL_NIF_TERM make_term(ErlNifEnv *env, kind_t kind, size_t size) {
+  term_t *term = arena_alloc(env, sizeof(term_t));
+
+  term->kind = kind;
+  term->size = size;
+  return (ERL_NIF_TERM)term;
+}
+
+ErlNifEnv *nif_env_new(void) {
+  ErlNifEnv *env;
+
+  if ((env = malloc(sizeof(ErlNifEnv))) == NULL) {
+    abort();
+  }
+
+  env->chunks = new_chunk(CHUNK_SIZE);
+  env->owned = NULL;
+  return env;
+}
+
+void nif_env_clear(ErlNifEnv *env) {
+  chunk_t *chunk;
+  owned_t *owned;
+
+  for (owned = env->owned; owned != NULL; owned = owned->next) {
+    free(owned->data);
+  }
+  env->owned = NULL;
+
+  /* the oldest chunk is kept for next terms */
+  while ((chunk = env->chunks)->next != NULL) {
+    env->chunks = chunk->next;
+    free(chunk);
+  }
+  chunk->used = 0;
+}
+
+void nif_env_free(ErlNifEnv *env) {
+  nif_env_clear(env);
+  free(env->chunks);
+  free(env);
+}
+
+/*
+ * Memory
+ */
+
+void *enif_alloc(size_t size) { return malloc(size); }
+
+void *enif_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+
+void enif_free(void *ptr) { free(ptr); }
+
+/*
+ * Time
+ */
+
+ErlNifTime enif_monotonic_time(ErlNifTimeUnit unit) {
+  struct timespec ts;
+  ErlNifTime ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = (ErlNifTime)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+  switch (unit) {
+  case ERL_NIF_SEC: return ns / 1000000000;
+  case ERL_NIF_MSEC: return ns / 1000000;
+  case ERL_NIF_USEC: return ns / 1000;
+  default: return ns;
+  }
+}
+
+/*
+ * Atoms
+ */
+
+#define MAX_ATOMS 1024
+
+static term_t atoms[MAX_ATOMS];
+static size_t atom_count;
+static pthread_mutex_t atoms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool find_atom(const char *name, size_t len, bool create,
+                      ERL_NIF_TERM *atom) {
+  bool found = false;
+  size_t i;
+
+  pthread_mutex_lock(&atoms_lock);
+
+  for (i = 0; i < atom_count && !found; i++) {
+    found = atoms[i].size == len && memcmp(atoms[i].u.data, name, len) == 0;
+  }
+
+  if (found) {
+    *atom = (ERL_NIF_TERM)&atoms[i - 1];
+  } else if (create && atom_count < MAX_ATOMS &&
+             (atoms[atom_count].u.data = malloc(len + 1)) != NULL) {
+    memcpy(atoms[atom_count].u.data, name, len);
+    atoms[atom_count].u.data[len] = '\0';
+    atoms[atom_count].kind = TERM_ATOM;
+    atoms[atom_count].size = len;
+    *atom = (ERL_NIF_TERM)&atoms[atom_count++];
+    found = true;
+  }
+
+  pthread_mutex_unlock(&atoms_lock);
+  return found;
+}
+
+ERL_NIF_TERM enif_make_atom(ErlNifEnv *env, const char *name) {
+  ERL_NIF_TERM atom;
+
+  (void)env;
+  if (!find_atom(name, strlen(name), true, &atom)) {
+    abort();
+  }
+  return atom;
+}
+
+ERL_NIF_TERM enif_make_atom_len(ErlNifEnv *env, const char *name,
+                                size_t len) {
+  ERL_NIF_TERM atom;
+
+  (void)env;
+  if (!find_atom(name, len, true, &atom)) {
+    abort();
+  }
+  return atom;
+}
+
+int enif_make_existing_atom(ErlNifEnv *env, const char *name,
+                            ERL_NIF_TERM *atom, ErlNifCharEncoding encoding) {
+  (void)env;
+  (void)encoding;
+  return find_atom(name, strlen(name), false, atom);
+}
+
+int enif_make_existing_atom_len(ErlNifEnv *env, const char *name, size_t len,
+                                ERL_NIF_TERM *atom,
+                                ErlNifCharEncoding encoding) {
+  (void)env;
+  (void)encoding;
+  return find_atom(name, len, false, atom);
+}
+
+int enif_make_new_atom_len(ErlNifEnv *env, const char *name, size_t len,
+                           ERL_NIF_TERM *atom, ErlNifCharEncoding encoding) {
+  (void)env;
+  (void)encoding;
+  return len < 256 && find_atom(name, len, true, atom);
+}
+
+int enif_get_atom(ErlNifEnv *env, ERL_NIF_TERM term, char *buff,
+                  unsigned size, ErlNifCharEncoding encoding) {
+  (void)env;
+  (void)encoding;
+  if (TERM(term)->kind != TERM_ATOM || TERM(term)->size >= size) {
+    return 0;
+  }
+
+  memcpy(buff, TERM(term)->u.data, TERM(term)->size + 1);
+  return (int)TERM(term)->size + 1;
+}
+
+ERL_NIF_TERM enif_make_badarg(ErlNifEnv *env) {
+  return enif_make_atom(env, "badarg");
+}
+
+int enif_is_atom(ErlNifEnv *env, ERL_NIF_TERM term) {
+  (void)env;
+  return TERM(term)->kind == TERM_ATOM;
+}
+
+/*
+ * Integers
+ */
+
+static ERL_NIF_TERM make_int(ErlNifEnv *env, ErlNifUInt64 value) {
+  ERL_NIF_TERM term = make_term(env, TERM_INT, 0);
+
+  TERM(term)->u.value = value;
+  return term;
+}
+
+int enif_get_int(ErlNifEnv *env, ERL_NIF_TERM term, int *value) {
+  (void)env;
+  if (TERM(term)->kind != TERM_INT) {
+    return 0;
+  }
+
+  *value = (int)TERM(term)->u.value;
+  return 1;
+}
+
+int enif_get_ulong(ErlNifEnv *env, ERL_NIF_TERM term, unsigned long *value) {
+  (void)env;
+  if (TERM(term)->kind != TERM_INT) {
+    return 0;
+  }
+
+  *value = (unsigned long)TERM(term)->u.value;
+  return 1;
+}
+
+ERL_NIF_TERM enif_make_ulong(ErlNifEnv *env, unsigned long value) {
+  return make_int(env, value);
+}
+
+/* erl_nif.h aliases 64-bit variants to long ones where long has 64 bits */
+#ifndef enif_get_uint64
+int enif_get_uint64(ErlNifEnv *env, ERL_NIF_TERM term, ErlNifUInt64 *value) {
+  (void)env;
+  if (TERM(term)->kind != TERM_INT) {
+    return 0;
+  }
+
+  *value = TERM(term)->u.value;
+  return 1;
+}
+
+ERL_NIF_TERM enif_make_uint64(ErlNifEnv *env, ErlNifUInt64 value) {
+  return make_int(env, value);
+}
+#endif
+
+/*
+ * Binaries
+ */
+
+int enif_alloc_binary(size_t size, ErlNifBinary *bin) {
+  memset(bin, 0, sizeof(ErlNifBinary));
+  if ((bin->data = malloc(size > 0 ? size : 1)) == NULL) {
+    return 0;
+  }
+
+  bin->size = size;
+  return 1;
+}
+
+int enif_realloc_binary(ErlNifBinary *bin, size_t size) {
+  unsigned char *data;
+
+  if ((data = realloc(bin->data, size > 0 ? size : 1)) == NULL) {
+    return 0;
+  }
+
+  bin->data = data;
+  bin->size = size;
+  return 1;
+}
+
+void enif_release_binary(ErlNifBinary *bin) { free(bin->data); }
+
+ERL_NIF_TERM enif_make_binary(ErlNifEnv *env, ErlNifBinary *bin) {
+  ERL_NIF_TERM term = make_term(env, TERM_BINARY, bin->size);
+  owned_t *owned = arena_alloc(env, sizeof(owned_t));
+
+  TERM(term)->u.data = bin->data;
+  owned->data = bin->data;
+  owned->next = env->owned;
+  env->owned = owned;
+  return term;
+}
+
+unsigned char *enif_make_new_binary(ErlNifEnv *env, size_t size,
+                                    ERL_NIF_TERM *term) {
+  *term = make_term(env, TERM_BINARY, size);
+  return TERM(*term)->u.data = arena_alloc(env, size);
+}
+
+ERL_NIF_TERM enif_make_sub_binary(ErlNifEnv *env, ERL_NIF_TERM bin_term,
+                                  size_t pos, size_t size) {
+  ERL_NIF_TERM term = make_term(env, TERM_BINARY, size);
+
+  TERM(term)->u.data = TERM(bin_term)->u.data + pos;
+  return term;
+}
+
+ERL_NIF_TERM enif_make_string(ErlNifEnv *env, const char *string,
+                              ErlNifCharEncoding encoding) {
+  size_t len = strlen(string);
+  ERL_NIF_TERM term;
+
+  (void)encoding;
+  memcpy(enif_make_new_binary(env, len, &term), string, len);
+  return term;
+}
+
+int enif_inspect_binary(ErlNifEnv *env, ERL_NIF_TERM term, ErlNifBinary *bin) {
+  (void)env;
+  if (TERM(term)->kind != TERM_BINARY) {
+    return 0;
+  }
+
+  memset(bin, 0, sizeof(ErlNifBinary));
+  bin->data = TERM(term)->u.data;
+  bin->size = TERM(term)->size;
+  return 1;
+}
+
+int enif_inspect_iolist_as_binary(ErlNifEnv *env, ERL_NIF_TERM term,
+                                  ErlNifBinary *bin) {
+  return enif_inspect_binary(env, term, bin);
+}
+
+int enif_is_binary(ErlNifEnv *env, ERL_NIF_TERM term) {
+  (void)env;
+  return TERM(term)->kind == TERM_BINARY;
+}
+
+/*
+ * Tuples and lists
+ */
+
+static ERL_NIF_TERM make_tuple(ErlNifEnv *env, unsigned arity, va_list args) {
+  ERL_NIF_TERM term = make_term(env, TERM_TUPLE, arity);
+  unsigned i;
+
+  TERM(term)->u.elems = arena_alloc(env, arity * sizeof(ERL_NIF_TERM));
+  for (i = 0; i < arity; i++) {
+    TERM(term)->u.elems[i] = va_arg(args, ERL_NIF_TERM);
+  }
+  return term;
+}
+
+ERL_NIF_TERM enif_make_tuple(ErlNifEnv *env, unsigned arity, ...) {
+  ERL_NIF_TERM term;
+  va_list args;
+
+  va_start(args, arity);
+  term = make_tuple(env, arity, args);
+  va_end(args);
+  return term;
+}
+
+/* erl_nif.h defines fixed arity variants as macros */
+#ifndef enif_make_tuple2
+ERL_NIF_TERM enif_make_tuple2(ErlNifEnv *env, ERL_NIF_TERM e1,
+                              ERL_NIF_TERM e2) {
+  return enif_make_tuple(env, 2, e1, e2);
+}
+
+ERL_NIF_TERM enif_make_tuple3(ErlNifEnv *env, ERL_NIF_TERM e1, ERL_NIF_TERM e2,
+                              ERL_NIF_TERM e3) {
+  return enif_make_tuple(env, 3, e1, e2, e3);
+}
+#endif
+
+int enif_get_tuple(ErlNifEnv *env, ERL_NIF_TERM term, int *arity,
+                   const ERL_NIF_TERM **array) {
+  (void)env;
+  if (TERM(term)->kind != TERM_TUPLE) {
+    return 0;
+  }
+
+  *arity = (int)TERM(term)->size;
+  *array = TERM(term)->u.elems;
+  return 1;
+}
+
+ERL_NIF_TERM enif_make_list_cell(ErlNifEnv *env, ERL_NIF_TERM head,
+                                 ERL_NIF_TERM tail) {
+  ERL_NIF_TERM term = make_term(env, TERM_LIST, 2);
+
+  TERM(term)->u.elems = arena_alloc(env, 2 * sizeof(ERL_NIF_TERM));
+  TERM(term)->u.elems[0] = head;
+  TERM(term)->u.elems[1] = tail;
+  return term;
+}
+
+ERL_NIF_TERM enif_make_list(ErlNifEnv *env, unsigned count, ...) {
+  ERL_NIF_TERM *elems = arena_alloc(env, count * sizeof(ERL_NIF_TERM) + 1);
+  ERL_NIF_TERM list = make_term(env, TERM_NIL, 0);
+  va_list args;
+  unsigned i;
+
+  va_start(args, count);
+  for (i = 0; i < count; i++) {
+    elems[i] = va_arg(args, ERL_NIF_TERM);
+  }
+  va_end(args);
+
+  while (count > 0) {
+    list = enif_make_list_cell(env, elems[--count], list);
+  }
+  return list;
+}
+
+int enif_get_list_cell(ErlNifEnv *env, ERL_NIF_TERM term, ERL_NIF_TERM *head,
+                       ERL_NIF_TERM *tail) {
+  (void)env;
+  if (TERM(term)->kind != TERM_LIST) {
+    return 0;
+  }
+
+  *head = TERM(term)->u.elems[0];
+  *tail = TERM(term)->u.elems[1];
+  return 1;
+}
+
+int enif_get_list_length(ErlNifEnv *env, ERL_NIF_TERM term, unsigned *len) {
+  unsigned count = 0;
+
+  (void)env;
+  while (TERM(term)->kind == TERM_LIST) {
+    term = TERM(term)->u.elems[1];
+    count++;
+  }
+
+  if (TERM(term)->kind != TERM_NIL) {
+    return 0;
+  }
+
+  *len = count;
+  return 1;
+}
+
+int enif_is_list(ErlNifEnv *env, ERL_NIF_TERM term) {
+  (void)env;
+  return TERM(term)->kind == TERM_LIST || TERM(term)->kind == TERM_NIL;
+}
+
+int enif_is_empty_list(ErlNifEnv *env, ERL_NIF_TERM term) {
+  (void)env;
+  return TERM(term)->kind == TERM_NIL;
+}
+
+/*
+ * Maps
+ */
+
+ERL_NIF_TERM enif_make_new_map(ErlNifEnv *env) {
+  return make_term(env, TERM_MAP, 0);
+}
+
+int enif_is_map(ErlNifEnv *env, ERL_NIF_TERM term) {
+  (void)env;
+  return TERM(term)->kind == TERM_MAP;
+}
+
+int enif_is_identical(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs) {
+  term_t *a = TERM(lhs);
+  term_t *b = TERM(rhs);
+  size_t i;
+
+  if (a == b) {
+    return 1;
+  } else if (a->kind != b->kind || a->size != b->size) {
+    return 0;
+  }
+
+  switch (a->kind) {
+  case TERM_BINARY:
+    return memcmp(a->u.data, b->u.data, a->size) == 0;
+  case TERM_INT:
+    return a->u.value == b->u.value;
+  case TERM_NIL:
+    return 1;
+  case TERM_TUPLE:
+  case TERM_LIST:
+    for (i = 0; i < (a->kind == TERM_LIST ? 2 : a->size); i++) {
+      if (!enif_is_identical(a->u.elems[i], b->u.elems[i])) {
+        return 0;
+      }
+    }
+    return 1;
+  default:
+    /* atoms are interned, maps and resources compared by identity */
+    return 0;
+  }
+}
+
+int enif_get_map_value(ErlNifEnv *env, ERL_NIF_TERM map, ERL_NIF_TERM key,
+                       ERL_NIF_TERM *value) {
+  size_t i;
+
+  (void)env;
+  if (TERM(map)->kind != TERM_MAP) {
+    return 0;
+  }
+
+  for (i = 0; i < TERM(map)->size; i++) {
+    if (enif_is_identical(TERM(map)->u.elems[2 * i], key)) {
+      *value = TERM(map)->u.elems[2 * i + 1];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int enif_make_map_put(ErlNifEnv *env, ERL_NIF_TERM map_in, ERL_NIF_TERM key,
+                      ERL_NIF_TERM value, ERL_NIF_TERM *map_out) {
+  size_t size = TERM(map_in)->size;
+  ERL_NIF_TERM *elems;
+  size_t i;
+
+  if (TERM(map_in)->kind != TERM_MAP) {
+    return 0;
+  }
+
+  elems = arena_alloc(env, 2 * (size + 1) * sizeof(ERL_NIF_TERM));
+  memcpy(elems, TERM(map_in)->u.elems, 2 * size * sizeof(ERL_NIF_TERM));
+
+  for (i = 0; i < size && !enif_is_identical(elems[2 * i], key); i++) {
+  }
+
+  elems[2 * i] = key;
+  elems[2 * i + 1] = value;
+
+  *map_out = make_term(env, TERM_MAP, i == size ? size + 1 : size);
+  TERM(*map_out)->u.elems = elems;
+  return 1;
+}
+
+int enif_make_map_from_arrays(ErlNifEnv *env, ERL_NIF_TERM keys[],
+                              ERL_NIF_TERM values[], size_t cnt,
+                              ERL_NIF_TERM *map_out) {
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  ERL_NIF_TERM value;
+  size_t i;
+
+  for (i = 0; i < cnt; i++) {
+    if (enif_get_map_value(env, map, keys[i], &value)) {
+      return 0;
+    }
+    enif_make_map_put(env, map, keys[i], values[i], &map);
+  }
+
+  *map_out = map;
+  return 1;
+}
+
+/*
+ * Resources
+ */
+
+struct enif_resource_type_t {
+  ErlNifResourceDtor *dtor;
+};
+
+typedef struct {
+  ErlNifResourceType *type;
+  int refs;
+  /* keeps the object aligned */
+  double align;
+} resource_t;
+
+#define RESOURCE(obj) ((resource_t *)(obj)-1)
+
+ErlNifResourceType *enif_open_resource_type(ErlNifEnv *env,
+                                            const char *module_str,
+                                            const char *name_str,
+                                            ErlNifResourceDtor *dtor,
+                                            ErlNifResourceFlags flags,
+                                            ErlNifResourceFlags *tried) {
+  ErlNifResourceType *type = malloc(sizeof(ErlNifResourceType));
+
+  (void)env;
+  (void)module_str;
+  (void)name_str;
+  (void)flags;
+  if (type != NULL) {
+    type->dtor = dtor;
+  }
+  if (tried != NULL) {
+    *tried = flags;
+  }
+  return type;
+}
+
+void *enif_alloc_resource(ErlNifResourceType *type, size_t size) {
+  resource_t *resource = malloc(sizeof(resource_t) + size);
+
+  if (resource == NULL) {
+    return NULL;
+  }
+
+  resource->type = type;
+  resource->refs = 1;
+  return resource + 1;
+}
+
+void enif_release_resource(void *obj) {
+  resource_t *resource = RESOURCE(obj);
+
+  if (__sync_sub_and_fetch(&resource->refs, 1) == 0) {
+    if (resource->type->dtor != NULL) {
+      resource->type->dtor(NULL, obj);
+    }
+    free(resource);
+  }
+}
+
+ERL_NIF_TERM enif_make_resource(ErlNifEnv *env, void *obj) {
+  ERL_NIF_TERM term = make_term(env, TERM_RESOURCE, 0);
+
+  /* the reference of the term is never released */
+  __sync_add_and_fetch(&RESOURCE(obj)->refs, 1);
+  TERM(term)->u.resource = obj;
+  return term;
+}
+
+int enif_get_resource(ErlNifEnv *env, ERL_NIF_TERM term,
+                      ErlNifResourceType *type, void **objp) {
+  (void)env;
+  if (TERM(term)->kind != TERM_RESOURCE ||
+      RESOURCE(TERM(term)->u.resource)->type != type) {
+    return 0;
+  }
+
+  *objp = TERM(term)->u.resource;
+  return 1;
+}
+
+/*
+ * Threads
+ */
+
+ErlNifMutex *enif_mutex_create(char *name) {
+  pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+
+  (void)name;
+  if (mutex != NULL) {
+    pthread_mutex_init(mutex, NULL);
+  }
+  return (ErlNifMutex *)mutex;
+}
+
+void enif_mutex_destroy(ErlNifMutex *mtx) {
+  pthread_mutex_destroy((pthread_mutex_t *)mtx);
+  free(mtx);
+}
+
+void enif_mutex_lock(ErlNifMutex *mtx) {
+  pthread_mutex_lock((pthread_mutex_t *)mtx);
+}
+
+void enif_mutex_unlock(ErlNifMutex *mtx) {
+  pthread_mutex_unlock((pthread_mutex_t *)mtx);
+}
+
+ErlNifCond *enif_cond_create(char *name) {
+  pthread_cond_t *cond = malloc(sizeof(pthread_cond_t));
+
+  (void)name;
+  if (cond != NULL) {
+    pthread_cond_init(cond, NULL);
+  }
+  return (ErlNifCond *)cond;
+}
+
+void enif_cond_destroy(ErlNifCond *cnd) {
+  pthread_cond_destroy((pthread_cond_t *)cnd);
+  free(cnd);
+}
+
+void enif_cond_signal(ErlNifCond *cnd) {
+  pthread_cond_signal((pthread_cond_t *)cnd);
+}
+
+void enif_cond_wait(ErlNifCond *cnd, ErlNifMutex *mtx) {
+  pthread_cond_wait((pthread_cond_t *)cnd, (pthread_mutex_t *)mtx);
+}
+
+ErlNifRWLock *enif_rwlock_create(char *name) {
+  pthread_rwlock_t *lock = malloc(sizeof(pthread_rwlock_t));
+
+  (void)name;
+  if (lock != NULL) {
+    pthread_rwlock_init(lock, NULL);
+  }
+  return (ErlNifRWLock *)lock;
+}
+
+void enif_rwlock_destroy(ErlNifRWLock *rwlck) {
+  pthread_rwlock_destroy((pthread_rwlock_t *)rwlck);
+  free(rwlck);
+}
+
+void enif_rwlock_rlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_rdlock((pthread_rwlock_t *)rwlck);
+}
+
+void enif_rwlock_runlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_unlock((pthread_rwlock_t *)rwlck);
+}
+
+void enif_rwlock_rwlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_wrlock((pthread_rwlock_t *)rwlck);
+}
+
+void enif_rwlock_rwunlock(ErlNifRWLock *rwlck) {
+  pthread_rwlock_unlock((pthread_rwlock_t *)rwlck);
+}
+
+int enif_thread_create(char *name, ErlNifTid *tid, void *(*func)(void *),
+                       void *args, ErlNifThreadOpts *opts) {
+  pthread_t thread;
+  int result;
+
+  (void)name;
+  (void)opts;
+  if ((result = pthread_create(&thread, NULL, func, args)) == 0) {
+    *tid = (ErlNifTid)thread;
+  }
+  return result;
+}
+
+int enif_thread_join(ErlNifTid tid, void **respp) {
+  return pthread_join((pthread_t)tid, respp);
+}
+
+int enif_tsd_key_create(char *name, ErlNifTSDKey *key) {
+  pthread_key_t pkey;
+  int result;
+
+  (void)name;
+  if ((result = pthread_key_create(&pkey, NULL)) == 0) {
+    *key = (ErlNifTSDKey)pkey;
+  }
+  return result;
+}
+
+void enif_tsd_key_destroy(ErlNifTSDKey key) {
+  pthread_key_delete((pthread_key_t)key);
+}
+
+void *enif_tsd_get(ErlNifTSDKey key) {
+  return pthread_getspecific((pthread_key_t)key);
+}
+
+void enif_tsd_set(ErlNifTSDKey key, void *data) {
+  pthread_setspecific((pthread_key_t)key, data);
+}
@@ -0,0 +1,25 @@
+#ifndef ELIXIR_XATTR_BENCH_NIF_ENV_H
+#define ELIXIR_XATTR_BENCH_NIF_ENV_H
+
+#include <erl_nif.h>
+
+/*
+ * Minimal implementation of erl_nif API, just enough to call `*_impl`
+ * functions of the library outside of the VM. Terms are allocated in an arena
+ * of the environment and released all at once by `nif_env_clear`, so that
+ * a measured call does not pay for freeing terms of previous ones. Atoms are
+ * interned globally and outlive environments.
+ *
+ * Only binaries are accepted where iodata is; resources are never collected.
+ */
+
+ErlNifEnv *nif_env_new(void);
+
+/**
+ * Releases all terms made in \a env, including binaries it took ownership of.
+ */
+void nif_env_clear(ErlNifEnv *env);
+
+void nif_env_free(ErlNifEnv *env);
+
+#endif
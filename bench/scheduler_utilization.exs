@@ -0,0 +1,174 @@
+# Measures how xattr calls affect other work running on the same schedulers.
+#
+# Mixed workload: xattr workers hammer get/set on a set of files while CPU
+# workers spin on pure computation and a probe process measures how late its
+# timer messages are delivered. Run it against a local and a remote directory:
+#
+#     XATTR_BENCH_DIR=/mnt/nfs/tmp mix run bench/scheduler_utilization.exs
+#
+# Each variant reports xattr throughput, CPU work done, probe lateness and
+# average normal / dirty I/O scheduler utilization.
+
+defmodule Xattr.Bench.SchedulerUtilization do
+  @duration 5_000
+  @files 64
+  @probe_interval 1
+
+  def run do
+    dir = System.get_env("XATTR_BENCH_DIR") || System.tmp_dir!()
+    schedulers = System.schedulers_online()
+    paths = setup_files(dir)
+
+    IO.puts("directory:  #{dir}")
+
+    IO.puts(
+      "schedulers: #{schedulers} normal, " <>
+        "#{:erlang.system_info(:dirty_io_schedulers)} dirty I/O"
+    )
+
+    IO.puts("mode:       #{inspect(Application.get_env(:xattr, :scheduler, :adaptive))}")
+    IO.puts("")
+
+    variants = [
+      {"configured", &Xattr.get(&1, "bench"), &Xattr.set(&1, "bench", &2)},
+      {"dirty", &Xattr.Nif.getxattr_dirty_nif(&1 <> <<0>>, "s$bench\0"),
+       &Xattr.Nif.setxattr_dirty_nif(&1 <> <<0>>, "s$bench\0", &2)}
+    ]
+
+    try do
+      for {name, get, set} <- variants do
+        report(name, measure(paths, schedulers, get, set))
+      end
+    after
+      Enum.each(paths, &File.rm/1)
+    end
+  end
+
+  defp setup_files(dir) do
+    for i <- 1..@files do
+      path = Path.join(dir, "xattr_bench_#{System.os_time()}_#{i}")
+      File.write!(path, "")
+      :ok = Xattr.set(path, "bench", "initial")
+      path
+    end
+  end
+
+  defp measure(paths, schedulers, get, set) do
+    parent = self()
+    deadline = System.monotonic_time(:millisecond) + @duration
+
+    sample = :scheduler.sample_all()
+
+    for i <- 1..schedulers do
+      spawn_link(fn ->
+        send(parent, {:xattr, xattr_loop(paths, i, get, set, deadline, 0)})
+      end)
+
+      spawn_link(fn -> send(parent, {:cpu, cpu_loop(deadline, 0)}) end)
+    end
+
+    spawn_link(fn -> send(parent, {:probe, probe_loop(deadline, [])}) end)
+
+    xattr_ops = collect(:xattr, schedulers)
+    cpu_ops = collect(:cpu, schedulers)
+
+    lateness =
+      receive do
+        {:probe, lateness} -> Enum.sort(lateness)
+      end
+
+    utilization = :scheduler.utilization(sample, :scheduler.sample_all())
+
+    %{
+      xattr_ops: xattr_ops,
+      cpu_ops: cpu_ops,
+      lateness: lateness,
+      normal: average_utilization(utilization, :normal),
+      dirty_io: average_utilization(utilization, :io)
+    }
+  end
+
+  defp xattr_loop(paths, seed, get, set, deadline, count) do
+    if System.monotonic_time(:millisecond) >= deadline do
+      count
+    else
+      path = Enum.at(paths, rem(seed + count, length(paths)))
+
+      if rem(count, 4) == 0 do
+        :ok = set.(path, Integer.to_string(count))
+      else
+        {:ok, _} = get.(path)
+      end
+
+      xattr_loop(paths, seed, get, set, deadline, count + 1)
+    end
+  end
+
+  defp cpu_loop(deadline, count) do
+    if System.monotonic_time(:millisecond) >= deadline do
+      count
+    else
+      Enum.reduce(1..1_000, 0, &(&1 * &1 + &2))
+      cpu_loop(deadline, count + 1)
+    end
+  end
+
+  defp probe_loop(deadline, acc) do
+    now = System.monotonic_time(:microsecond)
+
+    if div(now, 1000) >= deadline do
+      acc
+    else
+      Process.send_after(self(), :tick, @probe_interval)
+
+      receive do
+        :tick ->
+          late = System.monotonic_time(:microsecond) - now - @probe_interval * 1000
+          probe_loop(deadline, [max(late, 0) | acc])
+      end
+    end
+  end
+
+  defp collect(tag, n) do
+    Enum.reduce(1..n, 0, fn _, acc ->
+      receive do
+        {^tag, count} -> acc + count
+      end
+    end)
+  end
+
+  defp average_utilization(utilization, type) do
+    values = for {^type, _id, util, _percent} <- utilization, do: util
+
+    case values do
+      [] -> 0.0
+      _ -> Enum.sum(values) / length(values)
+    end
+  end
+
+  defp percentile([], _p), do: 0
+
+  defp percentile(sorted, p) do
+    Enum.at(sorted, min(length(sorted) - 1, trunc(length(sorted) * p)))
+  end
+
+  defp report(name, result) do
+    seconds = @duration / 1000
+
+    IO.puts("#{name}:")
+    IO.puts("  xattr ops/s:           #{round(result.xattr_ops / seconds)}")
+    IO.puts("  cpu work units/s:      #{round(result.cpu_ops / seconds)}")
+
+    IO.puts(
+      "  probe lateness (us):   p50 #{percentile(result.lateness, 0.5)}, " <>
+        "p99 #{percentile(result.lateness, 0.99)}, " <>
+        "max #{List.last(result.lateness) || 0}"
+    )
+
+    IO.puts("  normal utilization:    #{Float.round(result.normal * 100, 1)}%")
+    IO.puts("  dirty I/O utilization: #{Float.round(result.dirty_io * 100, 1)}%")
+    IO.puts("")
+  end
+end
+
+Xattr.Bench.SchedulerUtilization.run()
@@ -0,0 +1,97 @@
+# Counts extended attribute syscalls made per xattr call.
+#
+# The benchmark attaches strace to all threads of the running VM, performs
+# a number of calls of each kind and divides syscall counts reported by
+# `strace -c` by the number of calls. strace has to be installed and allowed
+# to attach to the VM (see `kernel.yama.ptrace_scope`):
+#
+#     mix run bench/syscalls.exs
+#
+# Expected result is 1 syscall per get and ls, regardless of value size.
+
+defmodule Xattr.Bench.Syscalls do
+  @calls 1_000
+  @syscalls ~w(getxattr lgetxattr fgetxattr listxattr llistxattr flistxattr)
+
+  def run do
+    strace = System.find_executable("strace") || raise "strace not found"
+    dir = System.get_env("XATTR_BENCH_DIR") || System.tmp_dir!()
+    path = Path.join(dir, "xattr_syscalls_bench")
+    File.write!(path, "")
+
+    try do
+      :ok = Xattr.set(path, "small", "value")
+      :ok = Xattr.set(path, "large", :binary.copy(<<0>>, 16 * 1024))
+
+      for n <- 1..32, do: :ok = Xattr.set(path, "name#{n}", "")
+
+      variants = [
+        {"get (5 B)", fn -> {:ok, _} = Xattr.get(path, "small") end},
+        {"get (16 KiB)", fn -> {:ok, _} = Xattr.get(path, "large") end},
+        {"has", fn -> {:ok, true} = Xattr.has(path, "small") end},
+        {"ls (34 names)", fn -> {:ok, _} = Xattr.ls(path) end}
+      ]
+
+      IO.puts(String.pad_trailing("operation", 16) <> "syscalls/call")
+
+      for {name, fun} <- variants do
+        counts = trace(strace, fn -> for _ <- 1..@calls, do: fun.() end)
+        total = counts |> Map.values() |> Enum.sum()
+
+        detail =
+          counts
+          |> Enum.map(fn {syscall, n} -> "#{syscall}: #{n / @calls}" end)
+          |> Enum.join(", ")
+
+        IO.puts(
+          String.pad_trailing(name, 16) <>
+            :erlang.float_to_binary(total / @calls, decimals: 2) <> "  (#{detail})"
+        )
+      end
+    after
+      File.rm!(path)
+    end
+  end
+
+  defp trace(strace, fun) do
+    pid = System.pid()
+    threads = File.ls!("/proc/#{pid}/task") |> Enum.flat_map(&["-p", &1])
+    args = ["-c", "-e", "trace=" <> Enum.join(@syscalls, ",") | threads]
+
+    port =
+      Port.open({:spawn_executable, strace}, [
+        :binary,
+        :exit_status,
+        :stderr_to_stdout,
+        args: args
+      ])
+
+    {:os_pid, strace_pid} = Port.info(port, :os_pid)
+
+    # give strace time to attach to all threads
+    Process.sleep(1_000)
+    fun.()
+    System.cmd("kill", ["-INT", Integer.to_string(strace_pid)])
+
+    port |> collect("") |> parse()
+  end
+
+  defp collect(port, acc) do
+    receive do
+      {^port, {:data, data}} -> collect(port, acc <> data)
+      {^port, {:exit_status, _}} -> acc
+    end
+  end
+
+  defp parse(output) do
+    row = ~r/^\s*[\d.]+\s+[\d.]+\s+\d+\s+(\d+)\s+(?:\d+\s+)?(\w+)\s*$/
+
+    for line <- String.split(output, "\n"),
+        [_, calls, syscall] <- [Regex.run(row, line)],
+        syscall in @syscalls,
+        into: %{},
+        do: {syscall, String.to_integer(calls)}
+  end
+end
+
+Xattr.Bench.Syscalls.run()
@@ -0,0 +1,84 @@
+# Compares batch operation throughput with and without io_uring.
+#
+# The NIF library is reloaded for each variant with different `:uring` and
+# `:uring_depth` settings, then `get_many/2` and `set_many/2` are called on
+# a file with many small attributes. Requires Linux 5.19 or newer, on older
+# kernels all variants fall back to plain syscalls:
+#
+#     mix run bench/uring.exs
+#
+# Expected result is throughput growing with depth up to the batch size, as
+# fewer syscalls are made per attribute.
+
+defmodule Xattr.Bench.Uring do
+  @duration 3_000
+  @names 256
+  @variants [
+    {"syscalls", uring: false},
+    {"depth 1", uring: true, uring_depth: 1},
+    {"depth 8", uring: true, uring_depth: 8},
+    {"depth 32", uring: true, uring_depth: 32},
+    {"depth 64", uring: true, uring_depth: 64},
+    {"depth 256", uring: true, uring_depth: 256}
+  ]
+
+  def run do
+    dir = System.get_env("XATTR_BENCH_DIR") || System.tmp_dir!()
+    path = Path.join(dir, "xattr_uring_bench")
+    File.write!(path, "")
+
+    pairs = for n <- 1..@names, do: {"name#{n}", "value#{n}"}
+    names = Enum.map(pairs, &elem(&1, 0))
+
+    try do
+      IO.puts("directory:  #{dir}")
+      IO.puts("batch size: #{@names}\n")
+
+      IO.puts(
+        String.pad_trailing("variant", 12) <>
+          String.pad_leading("get attrs/s", 14) <> String.pad_leading("set attrs/s", 14)
+      )
+
+      for {name, config} <- @variants do
+        reload(config)
+        get = measure(fn -> {:ok, _} = Xattr.get_many(path, names) end)
+        set = measure(fn -> {:ok, _} = Xattr.set_many(path, pairs) end)
+
+        IO.puts(
+          String.pad_trailing(name, 12) <>
+            String.pad_leading(Integer.to_string(get), 14) <>
+            String.pad_leading(Integer.to_string(set), 14)
+        )
+      end
+    after
+      File.rm!(path)
+    end
+  end
+
+  defp reload(config) do
+    Application.delete_env(:xattr, :uring_depth)
+    for {key, value} <- config, do: Application.put_env(:xattr, key, value)
+
+    :code.purge(Xattr.Nif)
+    :code.delete(Xattr.Nif)
+    :code.purge(Xattr.Nif)
+    {:module, Xattr.Nif} = :code.load_file(Xattr.Nif)
+  end
+
+  defp measure(fun) do
+    deadline = System.monotonic_time(:millisecond) + @duration
+    calls = loop(fun, deadline, 0)
+    div(calls * @names * 1_000, @duration)
+  end
+
+  defp loop(fun, deadline, calls) do
+    if System.monotonic_time(:millisecond) < deadline do
+      fun.()
+      loop(fun, deadline, calls + 1)
+    else
+      calls
+    end
+  end
+end
+
+Xattr.Bench.Uring.run()
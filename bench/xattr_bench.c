@@ -0,0 +1,441 @@
+/*
+ * Measures throughput and latency of attribute operations, calling functions
+ * of `impl_xattr.c` directly, without the VM. Complements `mix xattr.bench`,
+ * which measures the same cases through NIFs, and produces results in the
+ * same JSON format, so that the overhead of the VM can be told apart from
+ * the cost of the native code and the filesystem.
+ *
+ * Every case of operation, value size, number of attributes per file and
+ * number of threads is measured in every given directory, labelled with its
+ * filesystem. Each thread works on its own file and makes the given number
+ * of calls, timing each of them.
+ *
+ *     make bench/xattr_bench
+ *     bench/xattr_bench -o bench.json tmpfs=/dev/shm ext4=/mnt/ext4
+ *
+ * Options (defaults in parentheses):
+ *
+ *     -n CALLS    calls per thread and case (2000)
+ *     -s SIZES    comma-separated value sizes in bytes (16,256,4096,65536)
+ *     -a COUNTS   comma-separated attribute counts (1,10,100,1000)
+ *     -t THREADS  comma-separated thread counts (1,2,4,...,online CPUs)
+ *     -o FILE     JSON output file (standard output)
+ *
+ * Without directories, XATTR_BENCH_DIR or /tmp is used. See
+ * `bench/loopback.sh` for making ext4 and xfs images to run on.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "codec.h"
+#include "dirstore.h"
+#include "impl.h"
+#include "impl_uring.h"
+#include "index.h"
+#include "nif_env.h"
+#include "stats.h"
+#include "util.h"
+
+#define MAX_CASES 32
+#define MAX_THREADS 1024
+
+typedef enum { OP_LS, OP_GET, OP_HAS, OP_SET, OP_RM, OP_COUNT } op_t;
+
+static const char *op_names[OP_COUNT] = {"ls", "get", "has", "set", "rm"};
+
+typedef struct {
+  op_t op;
+  size_t size;
+  unsigned count;
+  unsigned calls;
+  unsigned seed;
+  char path[PATH_BUFFER_SIZE];
+  /* nanoseconds of each call */
+  double *latencies;
+  int error;
+} worker_t;
+
+/* Threads wait here until all of them are ready */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static unsigned gate_waiting;
+static bool gate_open;
+
+static double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned next_random(unsigned *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
+
+static void attr_name(unsigned n, char *name) {
+  sprintf(name, "s$bench%u", n);
+}
+
+static void *worker_run(void *arg) {
+  worker_t *worker = arg;
+  ErlNifEnv *env = nif_env_new();
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+  ERL_NIF_TERM term;
+  ERL_NIF_TERM rest;
+  bool result = true;
+  bool has;
+  double start;
+  unsigned i;
+
+  if ((value.data = malloc(worker->size)) != NULL) {
+    memset(value.data, 'v', worker->size);
+    value.size = worker->size;
+  } else {
+    worker->error = ENOMEM;
+    result = false;
+  }
+
+  pthread_mutex_lock(&gate_lock);
+  gate_waiting++;
+  pthread_cond_broadcast(&gate_cond);
+  while (!gate_open) {
+    pthread_cond_wait(&gate_cond, &gate_lock);
+  }
+  pthread_mutex_unlock(&gate_lock);
+
+  for (i = 0; i < worker->calls && result; i++) {
+    attr_name(next_random(&worker->seed) % worker->count, name);
+
+    if (worker->op == OP_RM) {
+      strcpy(name, "s$bench_rm");
+      if (!(result = setxattr_impl(env, worker->path, name, value))) {
+        break;
+      }
+    }
+
+    start = now_ns();
+    switch (worker->op) {
+    case OP_LS: result = listxattr_impl(env, worker->path, &term, &rest); break;
+    case OP_GET: result = getxattr_impl(env, worker->path, name, &term); break;
+    case OP_HAS: result = hasxattr_impl(env, worker->path, name, &has); break;
+    case OP_SET: result = setxattr_impl(env, worker->path, name, value); break;
+    default: result = removexattr_impl(env, worker->path, name); break;
+    }
+    worker->latencies[i] = now_ns() - start;
+
+    nif_env_clear(env);
+  }
+
+  if (!result && worker->error == 0) {
+    worker->error = errno;
+  }
+
+  free(value.data);
+  nif_env_free(env);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t count, double p) {
+  return sorted[(size_t)(p * (count - 1))] / 1e3;
+}
+
+/**
+ * Writes \a count attributes of \a size bytes to a new file at \a path.
+ */
+static bool populate(ErlNifEnv *env, const char *path, unsigned count,
+                     size_t size) {
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+  bool result = true;
+  FILE *file;
+  unsigned i;
+
+  if ((file = fopen(path, "w")) == NULL) {
+    return false;
+  }
+  fclose(file);
+
+  if ((value.data = malloc(size)) == NULL) {
+    return false;
+  }
+  memset(value.data, 'v', size);
+  value.size = size;
+
+  for (i = 0; i < count && result; i++) {
+    attr_name(i, name);
+    result = setxattr_impl(env, path, name, value);
+  }
+
+  free(value.data);
+  return result;
+}
+
+static bool first_result = true;
+
+static void print_result(FILE *out, const char *fs, const char *dir, op_t op,
+                         size_t size, unsigned count, unsigned threads) {
+  fprintf(out,
+          "%s\n    {\"fs\": \"%s\", \"dir\": \"%s\", \"op\": \"%s\", "
+          "\"value_size\": %lu, \"attrs\": %u, \"concurrency\": %u",
+          first_result ? "" : ",", fs, dir, op_names[op],
+          (unsigned long)size, count, threads);
+  first_result = false;
+}
+
+static void run_case(FILE *out, ErlNifEnv *env, const char *fs,
+                     const char *dir, op_t op, size_t size, unsigned count,
+                     unsigned threads, unsigned calls) {
+  static worker_t workers[MAX_THREADS];
+  static pthread_t tids[MAX_THREADS];
+  double *latencies;
+  size_t total = (size_t)threads * calls;
+  double start;
+  double elapsed = 0;
+  int error = 0;
+  unsigned i;
+
+  if ((latencies = malloc(total * sizeof(double))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  for (i = 0; i < threads && error == 0; i++) {
+    workers[i].op = op;
+    workers[i].size = size;
+    workers[i].count = count;
+    workers[i].calls = calls;
+    workers[i].seed = i + 1;
+    workers[i].latencies = latencies + (size_t)i * calls;
+    workers[i].error = 0;
+    sprintf(workers[i].path, "%s/xattr_bench.%u", dir, i);
+
+    if (!populate(env, workers[i].path, count, size)) {
+      error = errno;
+    }
+    nif_env_clear(env);
+  }
+
+  if (error == 0) {
+    gate_waiting = 0;
+    gate_open = false;
+
+    for (i = 0; i < threads; i++) {
+      pthread_create(&tids[i], NULL, worker_run, &workers[i]);
+    }
+
+    pthread_mutex_lock(&gate_lock);
+    while (gate_waiting < threads) {
+      pthread_cond_wait(&gate_cond, &gate_lock);
+    }
+    gate_open = true;
+    start = now_ns();
+    pthread_cond_broadcast(&gate_cond);
+    pthread_mutex_unlock(&gate_lock);
+
+    for (i = 0; i < threads; i++) {
+      pthread_join(tids[i], NULL);
+      if (workers[i].error != 0) {
+        error = workers[i].error;
+      }
+    }
+    elapsed = (now_ns() - start) / 1e9;
+  }
+
+  for (i = 0; i < threads; i++) {
+    sprintf(workers[i].path, "%s/xattr_bench.%u", dir, i);
+    unlink(workers[i].path);
+  }
+
+  print_result(out, fs, dir, op, size, count, threads);
+  if (error != 0) {
+    fprintf(out, ", \"error\": \"%s\"}", strerror(error));
+    fprintf(stderr, "%s %s %lu B x %u, %u threads: %s\n", fs, op_names[op],
+            (unsigned long)size, count, threads, strerror(error));
+  } else {
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    fprintf(out,
+            ", \"calls\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+            "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+            (unsigned long)total, elapsed, total / elapsed,
+            percentile(latencies, total, 0.5),
+            percentile(latencies, total, 0.99),
+            percentile(latencies, total, 0.999));
+    fprintf(stderr, "%s %s %lu B x %u, %u threads: %.0f ops/s\n", fs,
+            op_names[op], (unsigned long)size, count, threads,
+            total / elapsed);
+  }
+
+  free(latencies);
+}
+
+/**
+ * Parses comma-separated list of positive numbers \a arg into \a values.
+ *
+ * \return Number of values, or 0 if the list is malformed.
+ */
+static size_t parse_list(const char *arg, unsigned long *values) {
+  size_t count = 0;
+  char *end;
+
+  do {
+    if (count == MAX_CASES) {
+      return 0;
+    }
+
+    values[count] = strtoul(arg, &end, 10);
+    if (end == arg || values[count++] == 0) {
+      return 0;
+    }
+
+    arg = end + 1;
+  } while (*end == ',');
+
+  return *end == '\0' ? count : 0;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-n calls] [-s sizes] [-a counts] [-t threads] "
+          "[-o file] [label=dir ...]\n",
+          program);
+  exit(2);
+}
+
+static bool init_library(ErlNifEnv *env) {
+  ERL_NIF_TERM load_info = enif_make_new_map(env);
+
+  atoms_init(env);
+
+  return names_init(env, load_info) && scratch_init() && inode_locks_init() &&
+         cache_init(env, load_info) && uring_init(env, load_info) &&
+         codec_init(env, load_info) && dirstore_init(env, load_info) &&
+         index_init(env, load_info) && stats_init(env, load_info);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long sizes[MAX_CASES] = {16, 256, 4096, 65536};
+  unsigned long counts[MAX_CASES] = {1, 10, 100, 1000};
+  unsigned long threads[MAX_CASES];
+  size_t size_count = 4;
+  size_t count_count = 4;
+  size_t thread_count = 0;
+  unsigned long calls = 2000;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *default_dir = getenv("XATTR_BENCH_DIR");
+  FILE *out = stdout;
+  ErlNifEnv *env;
+  size_t s, c, t;
+  op_t op;
+  char *dir;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:a:t:o:")) != -1) {
+    switch (opt) {
+    case 'n':
+      if ((calls = strtoul(optarg, NULL, 10)) == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 's':
+      if ((size_count = parse_list(optarg, sizes)) == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'a':
+      if ((count_count = parse_list(optarg, counts)) == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 't':
+      if ((thread_count = parse_list(optarg, threads)) == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'o':
+      if ((out = fopen(optarg, "w")) == NULL) {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (thread_count == 0) {
+    for (t = 1; (long)t < cpus && thread_count < MAX_CASES - 1; t *= 2) {
+      threads[thread_count++] = t;
+    }
+    threads[thread_count++] = cpus > 0 ? cpus : 1;
+  }
+
+  for (t = 0; t < thread_count; t++) {
+    if (threads[t] > MAX_THREADS) {
+      usage(argv[0]);
+    }
+  }
+
+  env = nif_env_new();
+  if (!init_library(env)) {
+    perror("init");
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"harness\": \"c\",\n  \"calls\": %lu,\n  \"results\": [",
+          calls);
+
+  do {
+    if (optind < argc) {
+      if ((dir = strchr(argv[optind], '=')) == NULL) {
+        usage(argv[0]);
+      }
+      *dir++ = '\0';
+    } else {
+      dir = (char *)(default_dir != NULL ? default_dir : "/tmp");
+    }
+
+    for (op = 0; op < OP_COUNT; op++) {
+      for (s = 0; s < size_count; s++) {
+        for (c = 0; c < count_count; c++) {
+          for (t = 0; t < thread_count; t++) {
+            run_case(out, env, optind < argc ? argv[optind] : "default", dir,
+                     op, sizes[s], counts[c], threads[t], calls);
+          }
+        }
+      }
+    }
+  } while (++optind < argc);
+
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  stats_destroy();
+  index_destroy();
+  dirstore_destroy();
+  codec_destroy();
+  uring_destroy();
+  cache_destroy();
+  inode_locks_destroy();
+  scratch_destroy();
+  nif_env_free(env);
+  return 0;
+}
@@ -0,0 +1,1115 @@
+#include "adstore.h"
+
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * Format v1 is a contiguous list of size:data cells (32-bit little endian
+ * size), alternating NUL-terminated names and values. Every lookup is a
+ * linear scan and every update rewrites the tail of the stream.
+ *
+ * Format v2 starts with a header (magic, number of attributes, capacity of
+ * the offset table, end of data, bytes of unused slots, check of the header
+ * and table), followed by the offset table and slots. The table holds offsets
+ * of slots sorted by name, so lookups are binary searches. A slot holds name
+ * length, value length and value capacity, then the name and room for the
+ * value. Values which fit their slot are overwritten in place; longer ones
+ * move to a new slot with some room to grow at the end of data. Unused slots
+ * are reclaimed by compaction, which rewrites the stream once they take half
+ * of the data or the table is full. All numbers are 32-bit little endian.
+ *
+ * Updates write slots first and the header last. An update interrupted
+ * halfway leaves the stream longer or shorter than the end of data, or the
+ * table not matching the check, and the table is then rebuilt from slots
+ * themselves. Removed slots are marked dead before the table drops them,
+ * superseded ones after, so the newest live slot of a name is its value.
+ *
+ * Streams in v1 format are read as they are and migrated to v2 on first
+ * write.
+ */
+
+#define MAGIC "XATTRAD2"
+#define MAGIC_SIZE 8
+#define HEADER_SIZE 28
+#define SLOT_HEADER_SIZE 12
+#define ENTRY_SIZE 4
+#define CELL_SIZE 4
+
+#define MAX_SIZE 0xffffffffUL
+
+/* Set in name length of slots no longer in use */
+#define SLOT_DEAD 0x80000000UL
+
+/* FNV-1a, 32-bit */
+#define FNV_OFFSET 0x811c9dc5UL
+#define FNV_PRIME 0x01000193UL
+
+/* First read covers the header and tables of up to 1017 attributes */
+#define PREFIX_SIZE 4096
+
+#define MIN_CAPACITY 16
+#define COMPACT_MIN_FREE 4096
+
+/* Torn streams are v2 streams whose table has to be rebuilt */
+typedef enum { FORMAT_EMPTY, FORMAT_V1, FORMAT_V2, FORMAT_TORN } format_t;
+
+typedef struct {
+  const adstore_io_t *io;
+  uint32_t size;
+  format_t format;
+  /* v2 header */
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t data_end;
+  uint32_t free;
+  /** Offsets of slots sorted by name, room for `capacity` entries */
+  uint32_t *table;
+} store_t;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t name_len;
+  uint32_t value_len;
+  uint32_t value_capacity;
+  bool dead;
+} slot_t;
+
+typedef struct {
+  const unsigned char *name;
+  uint32_t name_len;
+  const unsigned char *value;
+  uint32_t value_len;
+} entry_t;
+
+/*
+ * Encoding
+ */
+
+static uint32_t get32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  p[0] = (unsigned char)(v & 0xff);
+  p[1] = (unsigned char)((v >> 8) & 0xff);
+  p[2] = (unsigned char)((v >> 16) & 0xff);
+  p[3] = (unsigned char)((v >> 24) & 0xff);
+}
+
+static uint32_t data_start(uint32_t capacity) {
+  return HEADER_SIZE + ENTRY_SIZE * capacity;
+}
+
+static uint32_t slot_size(uint32_t name_len, uint32_t value_capacity) {
+  return SLOT_HEADER_SIZE + name_len + value_capacity;
+}
+
+static int compare_names(const void *a, size_t alen, const void *b,
+                         size_t blen) {
+  int cmp = memcmp(a, b, alen < blen ? alen : blen);
+  return cmp != 0 ? cmp : (alen > blen) - (alen < blen);
+}
+
+static int compare_names_of(const void *a, const void *b) {
+  const entry_t *x = a;
+  const entry_t *y = b;
+  return compare_names(x->name, x->name_len, y->name, y->name_len);
+}
+
+/**
+ * Orders entries by name, then entries of the same name read from one buffer
+ * newest (furthest in the stream) first.
+ */
+static int compare_entries(const void *a, const void *b) {
+  const entry_t *x = a;
+  const entry_t *y = b;
+  int cmp = compare_names(x->name, x->name_len, y->name, y->name_len);
+  return cmp != 0 ? cmp : (x->name < y->name) - (x->name > y->name);
+}
+
+/**
+ * Checks header fields and offset table of \a s, so that a header or table
+ * written only partially is noticed.
+ */
+static uint32_t table_check(const store_t *s) {
+  unsigned char buff[4 * 4];
+  uint32_t hash = FNV_OFFSET;
+  uint32_t i;
+  size_t j;
+
+  put32(buff, s->count);
+  put32(buff + 4, s->capacity);
+  put32(buff + 8, s->data_end);
+  put32(buff + 12, s->free);
+  for (j = 0; j < sizeof(buff); j++) {
+    hash = (hash ^ buff[j]) * FNV_PRIME;
+  }
+
+  for (i = 0; i < s->count; i++) {
+    put32(buff, s->table[i]);
+    for (j = 0; j < ENTRY_SIZE; j++) {
+      hash = (hash ^ buff[j]) * FNV_PRIME;
+    }
+  }
+
+  return hash & 0xffffffffUL;
+}
+
+/**
+ * Checks that slot header at \a p, \a avail bytes before end of data, fits
+ * the data.
+ */
+static adstore_result_t parse_slot(const unsigned char *p, uint32_t offset,
+                                   uint32_t avail, slot_t *slot) {
+  slot->offset = offset;
+  slot->name_len = get32(p);
+  slot->value_len = get32(p + 4);
+  slot->value_capacity = get32(p + 8);
+  slot->dead = (slot->name_len & SLOT_DEAD) != 0;
+  slot->name_len &= ~SLOT_DEAD;
+
+  if (slot->name_len > avail ||
+      slot->value_capacity > avail - slot->name_len ||
+      slot->value_len > slot->value_capacity) {
+    return ADSTORE_INVALID;
+  }
+  return ADSTORE_OK;
+}
+
+/*
+ * Opening
+ */
+
+static adstore_result_t open_store(const adstore_io_t *io, store_t *s) {
+  unsigned char prefix[PREFIX_SIZE];
+  unsigned char *raw;
+  uint32_t check;
+  uint32_t len;
+  uint32_t i;
+
+  memset(s, 0, sizeof(*s));
+  s->io = io;
+
+  if (!io->size(io->ctx, &s->size)) {
+    return ADSTORE_IO;
+  }
+
+  if (s->size == 0) {
+    s->format = FORMAT_EMPTY;
+    return ADSTORE_OK;
+  }
+
+  len = s->size < PREFIX_SIZE ? s->size : PREFIX_SIZE;
+  if (!io->read(io->ctx, 0, prefix, len)) {
+    return ADSTORE_IO;
+  }
+
+  /* first cell of v1 stream would be a name over 1 GiB long */
+  if (len < MAGIC_SIZE || memcmp(prefix, MAGIC, MAGIC_SIZE) != 0) {
+    s->format = FORMAT_V1;
+    return ADSTORE_OK;
+  }
+
+  if (len < HEADER_SIZE) {
+    return ADSTORE_INVALID;
+  }
+
+  s->format = FORMAT_V2;
+  s->count = get32(prefix + 8);
+  s->capacity = get32(prefix + 12);
+  s->data_end = get32(prefix + 16);
+  s->free = get32(prefix + 20);
+  check = get32(prefix + 24);
+
+  /* slots can be found only with capacity of the table */
+  if (s->capacity == 0 ||
+      s->capacity > (s->size - HEADER_SIZE) / ENTRY_SIZE) {
+    return ADSTORE_INVALID;
+  }
+
+  if (s->count > s->capacity || s->data_end != s->size ||
+      data_start(s->capacity) > s->data_end ||
+      s->free > s->data_end - data_start(s->capacity)) {
+    s->format = FORMAT_TORN;
+    return ADSTORE_OK;
+  }
+
+  if ((s->table = enif_alloc(s->capacity * ENTRY_SIZE)) == NULL) {
+    return ADSTORE_NOMEM;
+  }
+
+  raw = (unsigned char *)s->table;
+  if (data_start(s->count) <= len) {
+    memcpy(raw, prefix + HEADER_SIZE, s->count * ENTRY_SIZE);
+  } else if (!io->read(io->ctx, HEADER_SIZE, raw, s->count * ENTRY_SIZE)) {
+    return ADSTORE_IO;
+  }
+
+  /* decoded in place, each entry is read whole before it is written */
+  for (i = 0; i < s->count; i++) {
+    s->table[i] = get32(raw + i * ENTRY_SIZE);
+  }
+
+  if (table_check(s) != check) {
+    s->format = FORMAT_TORN;
+  }
+
+  return ADSTORE_OK;
+}
+
+static void close_store(store_t *s) {
+  if (s->table != NULL) {
+    enif_free(s->table);
+  }
+}
+
+/*
+ * Lookups
+ */
+
+/**
+ * Reads header of slot at \a offset followed by up to \a want bytes of its
+ * name into \a buff.
+ */
+static adstore_result_t read_slot(const store_t *s, uint32_t offset,
+                                  size_t want, unsigned char *buff,
+                                  slot_t *slot) {
+  uint32_t avail;
+
+  if (offset < data_start(s->capacity) || offset >= s->data_end ||
+      s->data_end - offset < SLOT_HEADER_SIZE) {
+    return ADSTORE_INVALID;
+  }
+
+  avail = s->data_end - offset - SLOT_HEADER_SIZE;
+  if (want > avail) {
+    want = avail;
+  }
+
+  if (!s->io->read(s->io->ctx, offset, buff, SLOT_HEADER_SIZE + want)) {
+    return ADSTORE_IO;
+  }
+
+  return parse_slot(buff, offset, avail, slot);
+}
+
+/**
+ * Binary search of v2 offset table, one read per probe. Found slot may be
+ * dead, if it was left in the table by an interrupted removal.
+ *
+ * \retval pos Index of the attribute, or where it would be inserted.
+ */
+static adstore_result_t search(const store_t *s, const char *name, size_t len,
+                               uint32_t *pos, slot_t *slot, bool *found) {
+  unsigned char buff[SLOT_HEADER_SIZE + NAME_BUFFER_SIZE];
+  adstore_result_t result;
+  uint32_t lo = 0;
+  uint32_t hi = s->count;
+  uint32_t mid;
+  int cmp;
+
+  /* names come from NIF arguments, which are shorter */
+  if (len >= NAME_BUFFER_SIZE) {
+    return ADSTORE_INVALID;
+  }
+
+  *found = false;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((result = read_slot(s, s->table[mid], len, buff, slot)) !=
+        ADSTORE_OK) {
+      return result;
+    }
+
+    /* bytes past the shorter name are never compared */
+    cmp = compare_names(buff + SLOT_HEADER_SIZE, slot->name_len, name, len);
+    if (cmp == 0) {
+      *pos = mid;
+      *found = true;
+      return ADSTORE_OK;
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  *pos = lo;
+  return ADSTORE_OK;
+}
+
+/**
+ * Reads size of v1 cell at \a offset, which has to fit the stream.
+ */
+static adstore_result_t read_cell(const store_t *s, uint32_t offset,
+                                  uint32_t *size) {
+  unsigned char buff[CELL_SIZE];
+
+  if (s->size - offset < CELL_SIZE) {
+    return ADSTORE_INVALID;
+  }
+  if (!s->io->read(s->io->ctx, offset, buff, CELL_SIZE)) {
+    return ADSTORE_IO;
+  }
+
+  *size = get32(buff);
+  return *size <= s->size - offset - CELL_SIZE ? ADSTORE_OK : ADSTORE_INVALID;
+}
+
+static adstore_result_t find_v1(const store_t *s, const char *name,
+                                size_t len, adstore_value_t *value) {
+  unsigned char buff[NAME_BUFFER_SIZE + 1];
+  adstore_result_t result;
+  uint32_t offset = 0;
+  uint32_t name_size;
+  uint32_t value_size;
+  bool match;
+
+  if (len >= NAME_BUFFER_SIZE) {
+    return ADSTORE_INVALID;
+  }
+
+  while (offset < s->size) {
+    if ((result = read_cell(s, offset, &name_size)) != ADSTORE_OK) {
+      return result;
+    }
+    offset += CELL_SIZE;
+
+    /* names are stored with NUL terminator */
+    match = name_size == len + 1;
+    if (match) {
+      if (!s->io->read(s->io->ctx, offset, buff, name_size)) {
+        return ADSTORE_IO;
+      }
+      match = memcmp(buff, name, len + 1) == 0;
+    }
+    offset += name_size;
+
+    if ((result = read_cell(s, offset, &value_size)) != ADSTORE_OK) {
+      return result;
+    }
+    offset += CELL_SIZE;
+
+    if (match) {
+      value->offset = offset;
+      value->size = value_size;
+      return ADSTORE_OK;
+    }
+    offset += value_size;
+  }
+
+  return ADSTORE_NOATTR;
+}
+
+/*
+ * Whole stream operations
+ */
+
+static adstore_result_t read_all(const store_t *s, unsigned char **buff) {
+  *buff = NULL;
+  if (s->size == 0) {
+    return ADSTORE_OK;
+  }
+
+  if ((*buff = enif_alloc(s->size)) == NULL) {
+    return ADSTORE_NOMEM;
+  }
+
+  if (!s->io->read(s->io->ctx, 0, *buff, s->size)) {
+    enif_free(*buff);
+    *buff = NULL;
+    return ADSTORE_IO;
+  }
+
+  return ADSTORE_OK;
+}
+
+static adstore_result_t collect_v2(const store_t *s, const unsigned char *buff,
+                                   entry_t *entries, uint32_t *count) {
+  adstore_result_t result;
+  slot_t slot;
+  uint32_t offset;
+  uint32_t i;
+
+  *count = 0;
+  for (i = 0; i < s->count; i++) {
+    offset = s->table[i];
+    if (offset < data_start(s->capacity) || offset >= s->data_end ||
+        s->data_end - offset < SLOT_HEADER_SIZE) {
+      return ADSTORE_INVALID;
+    }
+
+    if ((result = parse_slot(buff + offset, offset,
+                             s->data_end - offset - SLOT_HEADER_SIZE,
+                             &slot)) != ADSTORE_OK) {
+      return result;
+    }
+
+    if (slot.dead) {
+      continue;
+    }
+
+    entries[*count].name = buff + offset + SLOT_HEADER_SIZE;
+    entries[*count].name_len = slot.name_len;
+    entries[*count].value = entries[*count].name + slot.name_len;
+    entries[*count].value_len = slot.value_len;
+    (*count)++;
+  }
+
+  return ADSTORE_OK;
+}
+
+/**
+ * Walks slots of torn stream in \a buff up to the first one which does not
+ * fit it, or only counts live slots if \a entries is `NULL`.
+ */
+static adstore_result_t collect_torn(const store_t *s,
+                                     const unsigned char *buff,
+                                     entry_t *entries, uint32_t *count) {
+  slot_t slot;
+  uint32_t offset = data_start(s->capacity);
+
+  *count = 0;
+  while (s->size - offset >= SLOT_HEADER_SIZE &&
+         parse_slot(buff + offset, offset,
+                    s->size - offset - SLOT_HEADER_SIZE,
+                    &slot) == ADSTORE_OK) {
+    /* names are never empty, zeros are room the stream was extended by */
+    if (!slot.dead && slot.name_len > 0) {
+      if (entries != NULL) {
+        entries[*count].name = buff + offset + SLOT_HEADER_SIZE;
+        entries[*count].name_len = slot.name_len;
+        entries[*count].value = entries[*count].name + slot.name_len;
+        entries[*count].value_len = slot.value_len;
+      }
+      (*count)++;
+    }
+    offset += slot_size(slot.name_len, slot.value_capacity);
+  }
+
+  return ADSTORE_OK;
+}
+
+/**
+ * Parses v1 cells of \a buff, or only counts attributes if \a entries is
+ * `NULL`.
+ */
+static adstore_result_t collect_v1(const store_t *s, const unsigned char *buff,
+                                   entry_t *entries, uint32_t *count) {
+  entry_t entry;
+  uint32_t offset = 0;
+  uint32_t size;
+
+  *count = 0;
+  while (offset < s->size) {
+    if (s->size - offset < CELL_SIZE ||
+        (size = get32(buff + offset)) > s->size - offset - CELL_SIZE) {
+      return ADSTORE_INVALID;
+    }
+    offset += CELL_SIZE;
+    entry.name = buff + offset;
+    entry.name_len = size > 0 && buff[offset + size - 1] == '\0' ? size - 1
+                                                                 : size;
+    offset += size;
+
+    if (s->size - offset < CELL_SIZE ||
+        (size = get32(buff + offset)) > s->size - offset - CELL_SIZE) {
+      return ADSTORE_INVALID;
+    }
+    offset += CELL_SIZE;
+    entry.value = buff + offset;
+    entry.value_len = size;
+    offset += size;
+
+    if (entries != NULL) {
+      entries[*count] = entry;
+    }
+    (*count)++;
+  }
+
+  return ADSTORE_OK;
+}
+
+/**
+ * Reads all attributes of the stream into \a buff, listed by \a entries in
+ * order of names, both have to be freed. Of slots of the same name in v1 and
+ * torn streams, the newest one is listed.
+ */
+static adstore_result_t collect(const store_t *s, unsigned char **buff,
+                                entry_t **entries, uint32_t *count) {
+  adstore_result_t result;
+  uint32_t i;
+  uint32_t j;
+
+  *entries = NULL;
+  *count = 0;
+  if ((result = read_all(s, buff)) != ADSTORE_OK) {
+    return result;
+  }
+
+  switch (s->format) {
+  case FORMAT_V1: result = collect_v1(s, *buff, NULL, count); break;
+  case FORMAT_V2: *count = s->count; break;
+  case FORMAT_TORN: result = collect_torn(s, *buff, NULL, count); break;
+  default: break;
+  }
+
+  if (result == ADSTORE_OK && *count > 0 &&
+      (*entries = enif_alloc(*count * sizeof(entry_t))) == NULL) {
+    result = ADSTORE_NOMEM;
+  }
+
+  if (result == ADSTORE_OK && *count > 0) {
+    if (s->format == FORMAT_V2) {
+      result = collect_v2(s, *buff, *entries, count);
+    } else {
+      result = s->format == FORMAT_V1
+                   ? collect_v1(s, *buff, *entries, count)
+                   : collect_torn(s, *buff, *entries, count);
+      qsort(*entries, *count, sizeof(entry_t), compare_entries);
+
+      /* v1 streams could hold a name twice only if written concurrently */
+      for (i = 0, j = 0; i < *count; i++) {
+        if (j == 0 || compare_names((*entries)[j - 1].name,
+                                    (*entries)[j - 1].name_len,
+                                    (*entries)[i].name,
+                                    (*entries)[i].name_len) != 0) {
+          (*entries)[j++] = (*entries)[i];
+        }
+      }
+      *count = j;
+    }
+  }
+
+  if (result != ADSTORE_OK) {
+    if (*entries != NULL) {
+      enif_free(*entries);
+      *entries = NULL;
+    }
+    if (*buff != NULL) {
+      enif_free(*buff);
+      *buff = NULL;
+    }
+  }
+  return result;
+}
+
+static void put_header(const store_t *s, unsigned char *header) {
+  memcpy(header, MAGIC, MAGIC_SIZE);
+  put32(header + 8, s->count);
+  put32(header + 12, s->capacity);
+  put32(header + 16, s->data_end);
+  put32(header + 20, s->free);
+  put32(header + 24, table_check(s));
+}
+
+/**
+ * Replaces the stream with v2 image of \a count sorted \a entries, with
+ * slots sized exactly to values.
+ */
+static adstore_result_t write_image(store_t *s, const entry_t *entries,
+                                    uint32_t count) {
+  unsigned char *image;
+  unsigned char *p;
+  uint32_t *table;
+  uint32_t capacity = MIN_CAPACITY;
+  ErlNifUInt64 total;
+  uint32_t offset;
+  uint32_t i;
+
+  while (capacity < 2 * count) {
+    capacity *= 2;
+  }
+
+  total = data_start(capacity);
+  for (i = 0; i < count; i++) {
+    total += slot_size(entries[i].name_len, entries[i].value_len);
+  }
+  if (total > MAX_SIZE) {
+    return ADSTORE_NOMEM;
+  }
+
+  if ((image = enif_alloc((size_t)total)) == NULL) {
+    return ADSTORE_NOMEM;
+  }
+  if ((table = enif_alloc(capacity * ENTRY_SIZE)) == NULL) {
+    enif_free(image);
+    return ADSTORE_NOMEM;
+  }
+
+  memset(image, 0, data_start(capacity));
+
+  offset = data_start(capacity);
+  for (i = 0; i < count; i++) {
+    table[i] = offset;
+    put32(image + HEADER_SIZE + i * ENTRY_SIZE, offset);
+
+    p = image + offset;
+    put32(p, entries[i].name_len);
+    put32(p + 4, entries[i].value_len);
+    put32(p + 8, entries[i].value_len);
+    memcpy(p + SLOT_HEADER_SIZE, entries[i].name, entries[i].name_len);
+    memcpy(p + SLOT_HEADER_SIZE + entries[i].name_len, entries[i].value,
+           entries[i].value_len);
+    offset += slot_size(entries[i].name_len, entries[i].value_len);
+  }
+
+  close_store(s);
+  s->table = table;
+  s->format = FORMAT_V2;
+  s->count = count;
+  s->capacity = capacity;
+  s->data_end = (uint32_t)total;
+  s->free = 0;
+  put_header(s, image);
+
+  /* store left without table stays torn and is rebuilt again */
+  if (!s->io->write(s->io->ctx, 0, image, (size_t)total) ||
+      !s->io->truncate(s->io->ctx, (uint32_t)total)) {
+    enif_free(image);
+    return ADSTORE_IO;
+  }
+  enif_free(image);
+
+  s->size = (uint32_t)total;
+  return ADSTORE_OK;
+}
+
+/**
+ * Rewrites the stream in v2 format without unused slots, with room in the
+ * table for as many attributes as there are. Migrates v1 streams and rebuilds
+ * tables of torn ones.
+ */
+static adstore_result_t compact(store_t *s) {
+  adstore_result_t result;
+  unsigned char *buff;
+  entry_t *entries;
+  uint32_t count;
+
+  if ((result = collect(s, &buff, &entries, &count)) != ADSTORE_OK) {
+    return result;
+  }
+
+  result = write_image(s, entries, count);
+
+  if (entries != NULL) {
+    enif_free(entries);
+  }
+  if (buff != NULL) {
+    enif_free(buff);
+  }
+  return result;
+}
+
+/*
+ * Updates
+ */
+
+/**
+ * Writes the header, which completes an update.
+ */
+static adstore_result_t write_header(const store_t *s) {
+  unsigned char header[HEADER_SIZE];
+
+  put_header(s, header);
+  return s->io->write(s->io->ctx, 0, header, HEADER_SIZE) ? ADSTORE_OK
+                                                          : ADSTORE_IO;
+}
+
+/**
+ * Writes table entries from \a from up to \a to.
+ */
+static adstore_result_t write_entries(const store_t *s, uint32_t from,
+                                      uint32_t to) {
+  unsigned char buff[PREFIX_SIZE];
+  unsigned char *raw = buff;
+  size_t size = (to - from) * ENTRY_SIZE;
+  bool ok;
+  uint32_t i;
+
+  if (size == 0) {
+    return ADSTORE_OK;
+  }
+
+  if (size > sizeof(buff) && (raw = enif_alloc(size)) == NULL) {
+    return ADSTORE_NOMEM;
+  }
+
+  for (i = from; i < to; i++) {
+    put32(raw + (i - from) * ENTRY_SIZE, s->table[i]);
+  }
+
+  ok = s->io->write(s->io->ctx, HEADER_SIZE + from * ENTRY_SIZE, raw, size);
+
+  if (raw != buff) {
+    enif_free(raw);
+  }
+  return ok ? ADSTORE_OK : ADSTORE_IO;
+}
+
+/**
+ * Marks \a slot dead, so that it is not taken for a live one when the table
+ * is rebuilt.
+ */
+static adstore_result_t kill_slot(const store_t *s, const slot_t *slot) {
+  unsigned char buff[CELL_SIZE];
+
+  put32(buff, slot->name_len | SLOT_DEAD);
+  return s->io->write(s->io->ctx, slot->offset, buff, CELL_SIZE)
+             ? ADSTORE_OK
+             : ADSTORE_IO;
+}
+
+/**
+ * Writes slot of \a capacity bytes with \a name and \a value at the end of
+ * data.
+ */
+static adstore_result_t append_slot(store_t *s, const char *name, size_t len,
+                                    const void *value, size_t size,
+                                    uint32_t capacity) {
+  unsigned char *buff;
+  uint32_t end;
+  bool ok;
+
+  if ((ErlNifUInt64)s->data_end + slot_size((uint32_t)len, capacity) >
+      MAX_SIZE) {
+    return ADSTORE_NOMEM;
+  }
+  end = s->data_end + slot_size((uint32_t)len, capacity);
+
+  if ((buff = enif_alloc(SLOT_HEADER_SIZE + len + size)) == NULL) {
+    return ADSTORE_NOMEM;
+  }
+
+  put32(buff, (uint32_t)len);
+  put32(buff + 4, (uint32_t)size);
+  put32(buff + 8, capacity);
+  memcpy(buff + SLOT_HEADER_SIZE, name, len);
+  memcpy(buff + SLOT_HEADER_SIZE + len, value, size);
+
+  /* truncation extends the stream over room left for the value to grow */
+  ok = s->io->write(s->io->ctx, s->data_end, buff,
+                    SLOT_HEADER_SIZE + len + size) &&
+       (end == s->data_end + SLOT_HEADER_SIZE + len + size ||
+        s->io->truncate(s->io->ctx, end));
+  enif_free(buff);
+
+  if (!ok) {
+    return ADSTORE_IO;
+  }
+
+  s->data_end = end;
+  s->size = end;
+  return ADSTORE_OK;
+}
+
+static adstore_result_t update_slot(store_t *s, uint32_t pos,
+                                    const slot_t *slot, const char *name,
+                                    size_t len, const void *value,
+                                    size_t size) {
+  unsigned char buff[CELL_SIZE];
+  adstore_result_t result;
+  uint32_t offset = slot->offset;
+
+  if (size <= slot->value_capacity) {
+    put32(buff, (uint32_t)size);
+    if ((size > 0 &&
+         !s->io->write(s->io->ctx, offset + SLOT_HEADER_SIZE + slot->name_len,
+                       value, size)) ||
+        !s->io->write(s->io->ctx, offset + 4, buff, CELL_SIZE)) {
+      return ADSTORE_IO;
+    }
+    return ADSTORE_OK;
+  }
+
+  /* values which have grown once are likely to grow again */
+  if (size > MAX_SIZE - size / 4) {
+    return ADSTORE_NOMEM;
+  }
+
+  offset = s->data_end;
+  if ((result = append_slot(s, name, len, value, size,
+                            (uint32_t)(size + size / 4))) != ADSTORE_OK) {
+    return result;
+  }
+
+  s->table[pos] = offset;
+  s->free += slot_size(slot->name_len, slot->value_capacity);
+
+  /* the old slot is older than the new one, so it is marked last */
+  if ((result = write_entries(s, pos, pos + 1)) != ADSTORE_OK ||
+      (result = write_header(s)) != ADSTORE_OK) {
+    return result;
+  }
+  return kill_slot(s, slot);
+}
+
+static adstore_result_t insert_slot(store_t *s, uint32_t pos, const char *name,
+                                    size_t len, const void *value,
+                                    size_t size) {
+  adstore_result_t result;
+  uint32_t offset;
+
+  /* compaction keeps order of names, so the position stays valid */
+  if (s->count == s->capacity && (result = compact(s)) != ADSTORE_OK) {
+    return result;
+  }
+
+  if (size > MAX_SIZE) {
+    return ADSTORE_NOMEM;
+  }
+
+  offset = s->data_end;
+  if ((result = append_slot(s, name, len, value, size, (uint32_t)size)) !=
+      ADSTORE_OK) {
+    return result;
+  }
+
+  memmove(s->table + pos + 1, s->table + pos,
+          (s->count - pos) * sizeof(uint32_t));
+  s->table[pos] = offset;
+  s->count++;
+
+  if ((result = write_entries(s, pos, s->count)) != ADSTORE_OK) {
+    return result;
+  }
+  return write_header(s);
+}
+
+static adstore_result_t remove_slot(store_t *s, uint32_t pos,
+                                    const slot_t *slot) {
+  adstore_result_t result;
+  uint32_t size = slot_size(slot->name_len, slot->value_capacity);
+
+  /* stream without attributes is left empty, as if it was never written */
+  if (s->count == 1) {
+    if (!s->io->truncate(s->io->ctx, 0)) {
+      return ADSTORE_IO;
+    }
+    s->format = FORMAT_EMPTY;
+    s->size = 0;
+    return ADSTORE_OK;
+  }
+
+  /* marked first, so that the table cannot be rebuilt with it */
+  if ((result = kill_slot(s, slot)) != ADSTORE_OK) {
+    return result;
+  }
+
+  memmove(s->table + pos, s->table + pos + 1,
+          (s->count - pos - 1) * sizeof(uint32_t));
+  s->count--;
+
+  if (slot->offset + size == s->data_end) {
+    s->data_end = slot->offset;
+    if (!s->io->truncate(s->io->ctx, s->data_end)) {
+      return ADSTORE_IO;
+    }
+    s->size = s->data_end;
+  } else {
+    s->free += size;
+  }
+
+  if ((result = write_entries(s, pos, s->count)) != ADSTORE_OK) {
+    return result;
+  }
+  return write_header(s);
+}
+
+static adstore_result_t maybe_compact(store_t *s) {
+  if (s->format == FORMAT_V2 && s->free >= COMPACT_MIN_FREE &&
+      s->free >= (s->data_end - data_start(s->capacity)) / 2) {
+    return compact(s);
+  }
+  return ADSTORE_OK;
+}
+
+/**
+ * Looks up attribute \a name of torn stream, reading it whole. The table is
+ * rebuilt by the next update.
+ */
+static adstore_result_t find_torn(const store_t *s, const char *name,
+                                  size_t len, adstore_value_t *value) {
+  adstore_result_t result;
+  unsigned char *buff;
+  entry_t *entries;
+  entry_t key;
+  entry_t *entry = NULL;
+  uint32_t count;
+
+  if ((result = collect(s, &buff, &entries, &count)) != ADSTORE_OK) {
+    return result;
+  }
+
+  key.name = (const unsigned char *)name;
+  key.name_len = (uint32_t)len;
+  if (count > 0) {
+    entry = bsearch(&key, entries, count, sizeof(entry_t), compare_names_of);
+  }
+
+  result = ADSTORE_NOATTR;
+  if (entry != NULL) {
+    value->offset = (uint32_t)(entry->value - buff);
+    value->size = entry->value_len;
+    result = ADSTORE_OK;
+  }
+
+  if (entries != NULL) {
+    enif_free(entries);
+  }
+  if (buff != NULL) {
+    enif_free(buff);
+  }
+  return result;
+}
+
+/*
+ * Public interface
+ */
+
+adstore_result_t adstore_find(const adstore_io_t *io, const char *name,
+                              adstore_value_t *value) {
+  adstore_result_t result;
+  store_t s;
+  slot_t slot;
+  uint32_t pos;
+  bool found;
+
+  if ((result = open_store(io, &s)) == ADSTORE_OK) {
+    switch (s.format) {
+    case FORMAT_EMPTY: result = ADSTORE_NOATTR; break;
+    case FORMAT_V1: result = find_v1(&s, name, strlen(name), value); break;
+    case FORMAT_TORN: result = find_torn(&s, name, strlen(name), value); break;
+    case FORMAT_V2:
+      result = search(&s, name, strlen(name), &pos, &slot, &found);
+      if (result == ADSTORE_OK && (!found || slot.dead)) {
+        result = ADSTORE_NOATTR;
+      } else if (result == ADSTORE_OK) {
+        value->offset = slot.offset + SLOT_HEADER_SIZE + slot.name_len;
+        value->size = slot.value_len;
+      }
+      break;
+    }
+  }
+
+  close_store(&s);
+  return result;
+}
+
+adstore_result_t adstore_read(const adstore_io_t *io,
+                              const adstore_value_t *value, void *buff) {
+  if (value->size > 0 &&
+      !io->read(io->ctx, value->offset, buff, value->size)) {
+    return ADSTORE_IO;
+  }
+  return ADSTORE_OK;
+}
+
+adstore_result_t adstore_each(const adstore_io_t *io, adstore_visit_t visit,
+                              void *acc) {
+  adstore_result_t result;
+  unsigned char *buff = NULL;
+  entry_t *entries = NULL;
+  store_t s;
+  uint32_t count = 0;
+  uint32_t i;
+
+  if ((result = open_store(io, &s)) == ADSTORE_OK) {
+    result = collect(&s, &buff, &entries, &count);
+  }
+
+  for (i = 0; result == ADSTORE_OK && i < count; i++) {
+    result = visit(acc, (const char *)entries[i].name, entries[i].name_len,
+                   entries[i].value, entries[i].value_len);
+  }
+
+  if (entries != NULL) {
+    enif_free(entries);
+  }
+  if (buff != NULL) {
+    enif_free(buff);
+  }
+  close_store(&s);
+  return result;
+}
+
+adstore_result_t adstore_set(const adstore_io_t *io, const char *name,
+                             const void *value, size_t size, set_mode_t mode) {
+  adstore_result_t result;
+  store_t s;
+  slot_t slot;
+  uint32_t pos;
+  size_t len = strlen(name);
+  bool found;
+
+  if ((result = open_store(io, &s)) == ADSTORE_OK) {
+    if (s.format == FORMAT_EMPTY && mode == SET_REPLACE) {
+      result = ADSTORE_NOATTR;
+    } else if (s.format != FORMAT_V2) {
+      result = compact(&s);
+    }
+  }
+
+  if (result == ADSTORE_OK) {
+    result = search(&s, name, len, &pos, &slot, &found);
+  }
+
+  /* dead slot left in the table is dropped by rebuilding it */
+  if (result == ADSTORE_OK && found && slot.dead &&
+      (result = compact(&s)) == ADSTORE_OK) {
+    result = search(&s, name, len, &pos, &slot, &found);
+  }
+
+  if (result == ADSTORE_OK) {
+    if (found) {
+      result = mode == SET_CREATE
+                   ? ADSTORE_EXISTS
+                   : update_slot(&s, pos, &slot, name, len, value, size);
+    } else {
+      result = mode == SET_REPLACE
+                   ? ADSTORE_NOATTR
+                   : insert_slot(&s, pos, name, len, value, size);
+    }
+  }
+
+  if (result == ADSTORE_OK) {
+    result = maybe_compact(&s);
+  }
+
+  close_store(&s);
+  return result;
+}
+
+adstore_result_t adstore_remove(const adstore_io_t *io, const char *name) {
+  adstore_result_t result;
+  store_t s;
+  slot_t slot;
+  uint32_t pos;
+  bool found = false;
+
+  if ((result = open_store(io, &s)) == ADSTORE_OK) {
+    if (s.format == FORMAT_EMPTY) {
+      result = ADSTORE_NOATTR;
+    } else if (s.format != FORMAT_V2) {
+      result = compact(&s);
+    }
+  }
+
+  if (result == ADSTORE_OK) {
+    result = search(&s, name, strlen(name), &pos, &slot, &found);
+  }
+
+  if (result == ADSTORE_OK) {
+    result = found && !slot.dead ? remove_slot(&s, pos, &slot)
+                                 : ADSTORE_NOATTR;
+  }
+
+  if (result == ADSTORE_OK) {
+    result = maybe_compact(&s);
+  }
+
+  close_store(&s);
+  return result;
+}
@@ -0,0 +1,93 @@
+#ifndef ELIXIR_XATTR_ADSTORE_H
+#define ELIXIR_XATTR_ADSTORE_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "impl.h"
+
+/*
+ * Attribute store kept in a single stream, the format of `ElixirXattr`
+ * alternate data stream on Windows. The engine does no I/O of its own, it
+ * reaches the stream through callbacks, so it is independent of `HANDLE`
+ * and builds on every platform.
+ */
+
+/**
+ * Outcome of store operations.
+ */
+typedef enum {
+  ADSTORE_OK,
+  /** Attribute does not exist */
+  ADSTORE_NOATTR,
+  /** Attribute exists and `SET_CREATE` was requested */
+  ADSTORE_EXISTS,
+  /** Stream is malformed */
+  ADSTORE_INVALID,
+  ADSTORE_NOMEM,
+  /** I/O callback failed, its platform error is left as it was reported */
+  ADSTORE_IO
+} adstore_result_t;
+
+/**
+ * Positioned I/O on the stream. Reads and writes transfer whole buffers or
+ * fail; the engine never reads past the size it was told.
+ */
+typedef struct {
+  void *ctx;
+  bool (*read)(void *ctx, uint32_t offset, void *buff, size_t size);
+  bool (*write)(void *ctx, uint32_t offset, const void *buff, size_t size);
+  bool (*size)(void *ctx, uint32_t *size);
+  bool (*truncate)(void *ctx, uint32_t size);
+} adstore_io_t;
+
+/**
+ * Location of attribute value within the stream.
+ */
+typedef struct {
+  uint32_t offset;
+  uint32_t size;
+} adstore_value_t;
+
+/**
+ * Called by `adstore_each` for every attribute, with name of \a len bytes
+ * (tagged, not NUL-terminated). Other result than `ADSTORE_OK` stops the
+ * walk and is returned.
+ */
+typedef adstore_result_t (*adstore_visit_t)(void *acc, const char *name,
+                                            size_t len,
+                                            const unsigned char *value,
+                                            size_t size);
+
+/**
+ * Looks up attribute \a name. Takes O(log n) reads in v2 format and a linear
+ * scan in v1 format.
+ */
+adstore_result_t adstore_find(const adstore_io_t *io, const char *name,
+                              adstore_value_t *value);
+
+/**
+ * Reads \a value found by `adstore_find` into \a buff of `value->size` bytes.
+ */
+adstore_result_t adstore_read(const adstore_io_t *io,
+                              const adstore_value_t *value, void *buff);
+
+/**
+ * Reads the whole stream at once and calls \a visit for every attribute,
+ * in order of names in v2 format.
+ */
+adstore_result_t adstore_each(const adstore_io_t *io, adstore_visit_t visit,
+                              void *acc);
+
+/**
+ * Sets attribute \a name to \a size bytes of \a value if \a mode allows it.
+ * Stream in v1 format is migrated to v2 first; empty stream is initialized.
+ */
+adstore_result_t adstore_set(const adstore_io_t *io, const char *name,
+                             const void *value, size_t size, set_mode_t mode);
+
+adstore_result_t adstore_remove(const adstore_io_t *io, const char *name);
+
+#endif
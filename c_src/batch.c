@@ -0,0 +1,670 @@
+#include "batch.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handle.h"
+#include "impl.h"
+#include "sched.h"
+#include "trace.h"
+#include "util.h"
+
+#define PATHS_MAX_ARGC 4
+
+/* Maximum number of items passed to backend at once, and size of buffer for
+ * their names; typical names are short, so the count is usually the limit */
+#define BATCH_CHUNK 256
+#define BATCH_NAMES_SIZE 65536
+
+typedef void (*items_op_t)(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                           const char *const names[],
+                           const ErlNifBinary values[], ERL_NIF_TERM results[]);
+typedef ERL_NIF_TERM (*path_op_t)(ErlNifEnv *env, const char *path,
+                                  const char *name, const ErlNifBinary *value);
+
+/* Names which are too long or contain NUL are not rejected here, they fail
+ * individually instead. */
+static bool is_name(ErlNifEnv *env, ERL_NIF_TERM item) {
+  char name[NAME_BUFFER_SIZE];
+  return get_cstring_arg(env, item, name, sizeof(name)) != ARG_BADARG;
+}
+
+/*
+ * Item operations, called with already converted names (and values)
+ */
+
+static void has_items(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                      const char *const names[],
+                      UNUSED const ErlNifBinary values[],
+                      ERL_NIF_TERM results[]) {
+  fhasxattr_many_impl(env, file, count, names, results);
+}
+
+static void get_items(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                      const char *const names[],
+                      UNUSED const ErlNifBinary values[],
+                      ERL_NIF_TERM results[]) {
+  fgetxattr_many_impl(env, file, count, names, results);
+}
+
+static void set_items(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                      const char *const names[], const ErlNifBinary values[],
+                      ERL_NIF_TERM results[]) {
+  fsetxattr_many_impl(env, file, count, names, values, results);
+}
+
+static void remove_items(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[],
+                         UNUSED const ErlNifBinary values[],
+                         ERL_NIF_TERM results[]) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    results[i] = fremovexattr_impl(env, file, names[i])
+                     ? atom_ok
+                     : make_errno_tuple(env);
+  }
+}
+
+/*
+ * Batch driver
+ */
+
+/**
+ * Items are converted and passed to item operation in chunks, so that
+ * backends can submit them together. Names are packed into `names` buffer.
+ * The chunk lives in per-thread chunk buffer, it is done within single call.
+ */
+typedef struct {
+  char names[BATCH_NAMES_SIZE];
+  const char *name_ptrs[BATCH_CHUNK];
+  ErlNifBinary values[BATCH_CHUNK];
+  ERL_NIF_TERM results[BATCH_CHUNK];
+  /** Error of item which could not be converted */
+  ERL_NIF_TERM errors[BATCH_CHUNK];
+  /** Index of item in `name_ptrs`, or -1 if it could not be converted */
+  int slots[BATCH_CHUNK];
+} batch_chunk_t;
+
+/* compile-time check that the chunk fits into the buffer */
+typedef char batch_chunk_fits[sizeof(batch_chunk_t) <= SCRATCH_CHUNK_SIZE
+                                  ? 1
+                                  : -1];
+
+/**
+ * Converts \a item of the batch into the name (and value) at \a count in
+ * \a chunk, packing the name at \a used. Items are validated here, as they
+ * are converted, so that a long batch is not walked before the first slice;
+ * malformed items fail individually with `{:error, :einval}`.
+ *
+ * \retval true if the item was converted
+ * \retval false if it failed, with its result stored in \a error
+ */
+static bool convert_item(ErlNifEnv *env, batch_chunk_t *chunk, size_t count,
+                         size_t used, ERL_NIF_TERM item, bool pairs,
+                         ERL_NIF_TERM *error) {
+  const ERL_NIF_TERM *tuple;
+  arg_status_t status;
+  int arity;
+
+  if (pairs) {
+    if (!enif_get_tuple(env, item, &arity, &tuple) || arity != 2 ||
+        !enif_inspect_binary(env, tuple[1], &chunk->values[count])) {
+      *error = make_error_tuple(env, atom_einval);
+      return false;
+    }
+    item = tuple[0];
+  }
+
+  status = get_cstring_arg(env, item, chunk->names + used, NAME_BUFFER_SIZE);
+  if (status != ARG_OK) {
+    /* names too long for the buffer are too long for the file system too */
+    *error = make_arg_error(env, status == ARG_BADARG ? ARG_INVALID : status,
+                            atom_erange);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Converts next chunk of \a items and applies \a op on it, prepending results
+ * to \a results in reverse order and adding number of items to \a done.
+ *
+ * \return Rest of items.
+ */
+static ERL_NIF_TERM run_chunk(ErlNifEnv *env, xattr_file_t *file,
+                              batch_chunk_t *chunk, ERL_NIF_TERM items,
+                              bool pairs, items_op_t op, ERL_NIF_TERM *results,
+                              size_t *done) {
+  ERL_NIF_TERM item;
+  size_t used = 0;
+  size_t count = 0;
+  size_t n = 0;
+  size_t i;
+
+  while (n < BATCH_CHUNK && used + NAME_BUFFER_SIZE <= BATCH_NAMES_SIZE &&
+         enif_get_list_cell(env, items, &item, &items)) {
+    if (convert_item(env, chunk, count, used, item, pairs,
+                     &chunk->errors[n])) {
+      chunk->name_ptrs[count] = chunk->names + used;
+      used += strlen(chunk->names + used) + 1;
+      chunk->slots[n] = count++;
+    } else {
+      chunk->slots[n] = -1;
+    }
+    n++;
+  }
+  *done += n;
+
+  op(env, file, count, chunk->name_ptrs, chunk->values, chunk->results);
+
+  for (i = 0; i < n; i++) {
+    item = chunk->slots[i] == -1 ? chunk->errors[i]
+                                 : chunk->results[chunk->slots[i]];
+    *results = enif_make_list_cell(env, item, *results);
+  }
+
+  return items;
+}
+
+/**
+ * Batch in progress. It is kept in a resource, so that the NIF can yield
+ * between chunks and continue with the rest of items; the path is passed
+ * along with them as a term.
+ */
+typedef struct {
+  /** Handle the batch runs on, referenced until the batch is done */
+  xattr_handle_t *handle;
+  /** File opened by path, closed when the batch is done */
+  xattr_file_t *file;
+  items_op_t op;
+  bool pairs;
+  /** Name under which the NIF is rescheduled */
+  const char *fname;
+  /** Name of the operation, used in traces */
+  const char *name;
+  size_t count;
+  bool traced;
+  ErlNifTime trace_start;
+} batch_t;
+
+static ErlNifResourceType *batch_type = NULL;
+
+/**
+ * Releases file and handle of \a batch, unless it is already done.
+ */
+static void end_batch(batch_t *batch) {
+  if (batch->file != NULL) {
+    closexattr_impl(batch->file);
+    batch->file = NULL;
+  }
+
+  if (batch->handle != NULL) {
+    enif_release_resource(batch->handle);
+    batch->handle = NULL;
+  }
+}
+
+static void batch_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  /* the batch has not been done if its process died in the meantime */
+  end_batch(obj);
+}
+
+bool batch_init(ErlNifEnv *env) {
+  batch_type = enif_open_resource_type(env, NULL, "xattr_batch", batch_dtor,
+                                       ERL_NIF_RT_CREATE, NULL);
+  return batch_type != NULL;
+}
+
+/**
+ * Converts \a target path of \a batch into \a buff for traces. Path of
+ * handle is not known here.
+ */
+static const char *trace_path(ErlNifEnv *env, batch_t *batch,
+                              ERL_NIF_TERM target, char *buff) {
+  if (batch->handle == NULL &&
+      get_cstring_arg(env, target, buff, PATH_BUFFER_SIZE) == ARG_OK) {
+    return buff;
+  }
+  return NULL;
+}
+
+static ERL_NIF_TERM resume_batch(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]);
+
+/**
+ * Applies operation of \a batch, held by resource term \a self, on \a items
+ * in chunks, prepending their results to \a results. When the time slice is
+ * over, the NIF is rescheduled with the rest of items; the handle is unlocked
+ * in the meantime. \a target is path or handle the batch was started with.
+ */
+static ERL_NIF_TERM run_chunks(ErlNifEnv *env, batch_t *batch,
+                               ERL_NIF_TERM self, ERL_NIF_TERM target,
+                               ERL_NIF_TERM items, ERL_NIF_TERM results) {
+  char path[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM new_argv[4];
+  xattr_file_t *file = batch->file;
+  batch_chunk_t *chunk;
+  sched_slice_t slice;
+
+  if ((chunk = (batch_chunk_t *)scratch_chunk_get()) == NULL) {
+    end_batch(batch);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  if (batch->handle != NULL && (file = handle_lock(batch->handle)) == NULL) {
+    end_batch(batch);
+    return make_closed_tuple(env);
+  }
+
+  sched_slice_start(&slice);
+  while (enif_is_list(env, items) && !enif_is_empty_list(env, items)) {
+    items = run_chunk(env, file, chunk, items, batch->pairs, batch->op,
+                      &results, &batch->count);
+
+    if (sched_slice_over(env, &slice) && enif_is_list(env, items) &&
+        !enif_is_empty_list(env, items)) {
+      if (batch->handle != NULL) {
+        handle_unlock(batch->handle);
+      }
+
+      new_argv[0] = self;
+      new_argv[1] = target;
+      new_argv[2] = items;
+      new_argv[3] = results;
+      return enif_schedule_nif(env, batch->fname, 0, resume_batch, 4,
+                               new_argv);
+    }
+  }
+
+  if (batch->traced) {
+    TRACE4(batch__return, batch->name, trace_path(env, batch, target, path),
+           batch->count,
+           enif_monotonic_time(ERL_NIF_NSEC) - batch->trace_start);
+  }
+
+  if (batch->handle != NULL) {
+    handle_unlock(batch->handle);
+  }
+
+  end_batch(batch);
+  if (!enif_is_empty_list(env, items)) {
+    /* improper list, detected only after the proper part is done */
+    return enif_make_badarg(env);
+  }
+
+  enif_make_reverse_list(env, results, &results);
+  return make_ok_tuple(env, results);
+}
+
+/** @spec resume_batch(reference, iodata | reference, list, list) ::
+ *          {:ok, list} | {:error, term} */
+static ERL_NIF_TERM resume_batch(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  batch_t *batch;
+
+  if (argc != 4 ||
+      !enif_get_resource(env, argv[0], batch_type, (void **)&batch)) {
+    return enif_make_badarg(env);
+  }
+
+  return run_chunks(env, batch, argv[0], argv[1], argv[2], argv[3]);
+}
+
+/**
+ * Validates arguments `(path_or_handle, items)`, opens the file (or references
+ * the handle) and applies \a op on all items, yielding the scheduler between
+ * chunks. Items are `{name, value}` pairs if \a pairs is set, names otherwise.
+ * \a name of the operation is used in traces, \a fname when the NIF is
+ * rescheduled.
+ */
+static ERL_NIF_TERM run_batch(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[], const char *fname,
+                              const char *name, bool pairs, items_op_t op) {
+  char path[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM result;
+  xattr_handle_t *handle = NULL;
+  batch_t *batch;
+  arg_status_t status = ARG_OK;
+  unsigned count = 0;
+
+  if (argc != 2) {
+    return enif_make_badarg(env);
+  }
+
+  if (!handle_get(env, argv[0], &handle)) {
+    handle = NULL;
+    status = get_cstring_arg(env, argv[0], path, sizeof(path));
+    if (status == ARG_BADARG) {
+      return enif_make_badarg(env);
+    }
+  }
+
+  if (!enif_is_list(env, argv[1])) {
+    return enif_make_badarg(env);
+  }
+
+  if (status != ARG_OK) {
+    return make_arg_error(env, status, atom_enametoolong);
+  }
+
+  if ((batch = enif_alloc_resource(batch_type, sizeof(batch_t))) == NULL) {
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  batch->handle = NULL;
+  batch->file = NULL;
+  if (handle != NULL) {
+    enif_keep_resource(handle);
+    batch->handle = handle;
+  } else if (!openxattr_impl(env, path, &batch->file)) {
+    result = make_errno_tuple(env);
+    enif_release_resource(batch);
+    return result;
+  }
+
+  batch->op = op;
+  batch->pairs = pairs;
+  batch->fname = fname;
+  batch->name = name;
+  batch->count = 0;
+
+  /* the list is walked upfront only to report its length to tracers */
+  if (TRACE_ENABLED(batch__entry)) {
+    enif_get_list_length(env, argv[1], &count);
+    TRACE3(batch__entry, name, handle == NULL ? path : NULL, (size_t)count);
+  }
+  if ((batch->traced = TRACE_ENABLED(batch__return))) {
+    batch->trace_start = enif_monotonic_time(ERL_NIF_NSEC);
+  }
+
+  /* the term keeps the batch alive while the NIF is rescheduled */
+  result = enif_make_resource(env, batch);
+  enif_release_resource(batch);
+
+  return run_chunks(env, batch, result, argv[0], argv[1],
+                    enif_make_list(env, 0));
+}
+
+static ERL_NIF_TERM do_hasxattr_many(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+  return run_batch(env, argc, argv, "hasxattr_many_nif", "has", false,
+                   has_items);
+}
+
+static ERL_NIF_TERM do_getxattr_many(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+  return run_batch(env, argc, argv, "getxattr_many_nif", "get", false,
+                   get_items);
+}
+
+static ERL_NIF_TERM do_setxattr_many(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+  return run_batch(env, argc, argv, "setxattr_many_nif", "set", true,
+                   set_items);
+}
+
+static ERL_NIF_TERM do_removexattr_many(ErlNifEnv *env, int argc,
+                                        const ERL_NIF_TERM argv[]) {
+  return run_batch(env, argc, argv, "removexattr_many_nif", "rm", false,
+                   remove_items);
+}
+
+/*
+ * Multi-path operations, called with already validated arguments
+ */
+
+static ERL_NIF_TERM has_path(ErlNifEnv *env, const char *path,
+                             const char *name,
+                             UNUSED const ErlNifBinary *value) {
+  bool result;
+
+  if (!hasxattr_impl(env, path, name, &result)) {
+    return make_errno_tuple(env);
+  }
+
+  return make_ok_tuple(env, make_bool(env, result));
+}
+
+static ERL_NIF_TERM get_path(ErlNifEnv *env, const char *path,
+                             const char *name,
+                             UNUSED const ErlNifBinary *value) {
+  ERL_NIF_TERM result;
+
+  if (!getxattr_impl(env, path, name, &result)) {
+    return make_errno_tuple(env);
+  }
+
+  return make_ok_tuple(env, result);
+}
+
+static ERL_NIF_TERM set_path(ErlNifEnv *env, const char *path,
+                             const char *name,
+                             const ErlNifBinary *value) {
+  if (!setxattr_impl(env, path, name, *value)) {
+    return make_errno_tuple(env);
+  }
+
+  return atom_ok;
+}
+
+/*
+ * Multi-path driver
+ *
+ * Arguments of driven NIFs are `(paths, name, [value,] acc)`, where `paths` are
+ * paths still to be processed and `acc` is reversed list of results so far.
+ * When the time slice is exhausted, the NIF reschedules itself with the rest of
+ * paths. In adaptive mode, a path on remote or slow mount moves the rest of the
+ * work to a dirty I/O scheduler.
+ */
+
+static ERL_NIF_TERM reschedule_paths(ErlNifEnv *env, const char *fname,
+                                     int flags, nif_fptr_t self, int argc,
+                                     const ERL_NIF_TERM argv[],
+                                     ERL_NIF_TERM paths, ERL_NIF_TERM acc) {
+  ERL_NIF_TERM new_argv[PATHS_MAX_ARGC];
+  int i;
+
+  new_argv[0] = paths;
+  for (i = 1; i < argc - 1; i++) {
+    new_argv[i] = argv[i];
+  }
+  new_argv[argc - 1] = acc;
+
+  return enif_schedule_nif(env, fname, flags, self, argc, new_argv);
+}
+
+static ERL_NIF_TERM run_paths(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[], const char *fname,
+                              nif_fptr_t self, path_op_t op) {
+  char buff[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+  ERL_NIF_TERM name_error = 0;
+  ERL_NIF_TERM paths;
+  ERL_NIF_TERM rest;
+  ERL_NIF_TERM head;
+  ERL_NIF_TERM acc;
+  ERL_NIF_TERM result;
+  ErlNifTime start = 0;
+  ErlNifTime elapsed;
+  ErlNifTime pending = 0;
+  sched_mount_t *mount = NULL;
+  arg_status_t status;
+  bool normal = enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER;
+  bool adaptive = normal && sched_mode() == SCHED_ADAPTIVE;
+  int percent;
+
+  paths = argv[0];
+  acc = argv[argc - 1];
+  if (!get_name_arg(env, argv[1], name, &name_error)) {
+    /* the same error applies to every path */
+    name[0] = '\0';
+  }
+  if (argc == 4) {
+    enif_inspect_binary(env, argv[2], &value);
+  }
+
+  while (enif_get_list_cell(env, paths, &head, &rest)) {
+    if (name[0] == '\0') {
+      result = name_error;
+      pending++;
+    } else if ((status = get_cstring_arg(env, head, buff, sizeof(buff))) !=
+               ARG_OK) {
+      /* paths are validated here rather than upfront, so that a long list is
+       * converted in slices too; terms which are not iodata fail alone */
+      result = make_arg_error(env, status == ARG_BADARG ? ARG_INVALID : status,
+                              atom_enametoolong);
+      pending++;
+    } else {
+      if (normal) {
+        start = enif_monotonic_time(ERL_NIF_USEC);
+      }
+
+      if (adaptive) {
+        mount = sched_lookup(buff, strlen(buff));
+        if (sched_is_slow(mount, start)) {
+          return reschedule_paths(env, fname, ERL_NIF_DIRTY_JOB_IO_BOUND, self,
+                                  argc, argv, paths, acc);
+        }
+      }
+
+      result = op(env, buff, name, argc == 4 ? &value : NULL);
+
+      if (normal) {
+        elapsed = enif_monotonic_time(ERL_NIF_USEC) - start;
+        pending += elapsed;
+        if (adaptive) {
+          sched_record(mount, start, elapsed);
+        }
+      }
+    }
+
+    acc = enif_make_list_cell(env, result, acc);
+    paths = rest;
+
+    /* report consumed time in 1% (10 us) units, yield if slice is over;
+     * paths which fail without a system call count as 1 us */
+    if (pending >= 10) {
+      percent = (int)(pending / 10);
+      pending %= 10;
+      if (enif_consume_timeslice(env, percent > 100 ? 100 : percent)) {
+        return reschedule_paths(env, fname, 0, self, argc, argv, paths, acc);
+      }
+    }
+  }
+
+  if (!enif_is_empty_list(env, paths)) {
+    /* improper list, detected only after the proper part is done */
+    return enif_make_badarg(env);
+  }
+
+  enif_make_reverse_list(env, acc, &acc);
+  return acc;
+}
+
+static ERL_NIF_TERM do_hasxattr_paths(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  return run_paths(env, argc, argv, "hasxattr_paths_nif", do_hasxattr_paths,
+                   has_path);
+}
+
+static ERL_NIF_TERM do_getxattr_paths(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  return run_paths(env, argc, argv, "getxattr_paths_nif", do_getxattr_paths,
+                   get_path);
+}
+
+static ERL_NIF_TERM do_setxattr_paths(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  return run_paths(env, argc, argv, "setxattr_paths_nif", do_setxattr_paths,
+                   set_path);
+}
+
+/**
+ * Validates arguments `(paths, name, [value])` and starts \a fptr with empty
+ * accumulator, on dirty I/O scheduler if configured so. Elements of `paths`
+ * are checked one by one as they are processed.
+ */
+static ERL_NIF_TERM start_paths(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[], const char *fname,
+                                nif_fptr_t fptr) {
+  ERL_NIF_TERM new_argv[PATHS_MAX_ARGC];
+  ErlNifBinary value;
+  int i;
+
+  if (argc + 1 > PATHS_MAX_ARGC || !enif_is_list(env, argv[0])) {
+    return enif_make_badarg(env);
+  }
+
+  if (!is_name(env, argv[1])) {
+    return enif_make_badarg(env);
+  }
+
+  if (argc == 3 && !enif_inspect_binary(env, argv[2], &value)) {
+    return enif_make_badarg(env);
+  }
+
+  for (i = 0; i < argc; i++) {
+    new_argv[i] = argv[i];
+  }
+  new_argv[argc] = enif_make_list(env, 0);
+
+  if (sched_mode() == SCHED_DIRTY) {
+    return enif_schedule_nif(env, fname, ERL_NIF_DIRTY_JOB_IO_BOUND, fptr,
+                             argc + 1, new_argv);
+  }
+
+  return fptr(env, argc + 1, new_argv);
+}
+
+/*
+ * Exported NIFs
+ */
+
+ERL_NIF_TERM hasxattr_many_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "hasxattr_many_nif", do_hasxattr_many, argc, argv);
+}
+
+ERL_NIF_TERM getxattr_many_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "getxattr_many_nif", do_getxattr_many, argc, argv);
+}
+
+ERL_NIF_TERM setxattr_many_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "setxattr_many_nif", do_setxattr_many, argc, argv);
+}
+
+ERL_NIF_TERM removexattr_many_nif(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "removexattr_many_nif", do_removexattr_many, argc,
+                   argv);
+}
+
+ERL_NIF_TERM hasxattr_paths_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  if (argc != 2) {
+    return enif_make_badarg(env);
+  }
+  return start_paths(env, argc, argv, "hasxattr_paths_nif", do_hasxattr_paths);
+}
+
+ERL_NIF_TERM getxattr_paths_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  if (argc != 2) {
+    return enif_make_badarg(env);
+  }
+  return start_paths(env, argc, argv, "getxattr_paths_nif", do_getxattr_paths);
+}
+
+ERL_NIF_TERM setxattr_paths_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  if (argc != 3) {
+    return enif_make_badarg(env);
+  }
+  return start_paths(env, argc, argv, "setxattr_paths_nif", do_setxattr_paths);
+}
@@ -0,0 +1,60 @@
+#ifndef ELIXIR_XATTR_BATCH_H
+#define ELIXIR_XATTR_BATCH_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+/*
+ * Batch NIFs operate on many attributes of single file, which is opened only
+ * once. The file is given either by path or by handle. Results are returned in
+ * order of requested attributes. Attributes are processed in chunks, yielding
+ * the scheduler between them when its time slice is over.
+ */
+
+/**
+ * Registers batch resource type. Called from NIF `load` callback.
+ */
+bool batch_init(ErlNifEnv *env);
+
+/** @spec hasxattr_many_nif(binary | reference, [binary]) ::
+ *          {:ok, [{:ok, boolean} | {:error, term}]} | {:error, term} */
+ERL_NIF_TERM hasxattr_many_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]);
+
+/** @spec getxattr_many_nif(binary | reference, [binary]) ::
+ *          {:ok, [{:ok, binary} | {:error, term}]} | {:error, term} */
+ERL_NIF_TERM getxattr_many_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]);
+
+/** @spec setxattr_many_nif(binary | reference, [{binary, binary}]) ::
+ *          {:ok, [:ok | {:error, term}]} | {:error, term} */
+ERL_NIF_TERM setxattr_many_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]);
+
+/** @spec removexattr_many_nif(binary | reference, [binary]) ::
+ *          {:ok, [:ok | {:error, term}]} | {:error, term} */
+ERL_NIF_TERM removexattr_many_nif(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]);
+
+/*
+ * Multi-path NIFs perform the same operation on many files. Results are
+ * returned in order of paths. Long lists are processed in slices, yielding
+ * the scheduler between them.
+ */
+
+/** @spec hasxattr_paths_nif([binary], binary) ::
+ *          [{:ok, boolean} | {:error, term}] */
+ERL_NIF_TERM hasxattr_paths_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+/** @spec getxattr_paths_nif([binary], binary) ::
+ *          [{:ok, binary} | {:error, term}] */
+ERL_NIF_TERM getxattr_paths_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+/** @spec setxattr_paths_nif([binary], binary, binary) ::
+ *          [:ok | {:error, term}] */
+ERL_NIF_TERM setxattr_paths_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+#endif
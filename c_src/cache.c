@@ -0,0 +1,358 @@
+#include "cache.h"
+
+#include <string.h>
+
+#include "util.h"
+
+/* Number of shards, power of 2. Each shard has its own lock, LRU list and
+ * share of the memory limit. */
+#define CACHE_SHARDS 16
+#define CACHE_MIN_BUCKETS 64
+
+typedef struct cache_entry {
+  /** Next entry in hash chain */
+  struct cache_entry *chain;
+  /** Neighbours in LRU list, most recently used first */
+  struct cache_entry *prev;
+  struct cache_entry *next;
+  unsigned long hash;
+  cache_stamp_t stamp;
+  size_t name_len;
+  size_t value_len;
+  /** NUL-terminated name followed by value */
+  char data[1];
+} cache_entry_t;
+
+typedef struct {
+  ErlNifMutex *lock;
+  cache_entry_t **buckets;
+  size_t nbuckets;
+  /** Sentinel of circular LRU list */
+  cache_entry_t lru;
+  size_t count;
+  size_t bytes;
+  ErlNifUInt64 hits;
+  ErlNifUInt64 misses;
+  ErlNifUInt64 evictions;
+} cache_shard_t;
+
+static cache_shard_t *shards = NULL;
+static size_t shard_max_bytes = 0;
+
+/*
+ * Shard internals, called with shard lock held
+ */
+
+static unsigned long hash_key(const cache_stamp_t *stamp, const char *name,
+                              size_t name_len) {
+  /* FNV-1a */
+  unsigned long hash = 2166136261UL;
+  size_t i;
+
+  for (i = 0; i < name_len; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619UL;
+  }
+
+  hash ^= (unsigned long)(stamp->ino ^ (stamp->ino >> 32));
+  hash *= 16777619UL;
+  hash ^= (unsigned long)(stamp->dev ^ (stamp->dev >> 32));
+  hash *= 16777619UL;
+
+  return hash;
+}
+
+static cache_shard_t *shard_of(unsigned long hash) {
+  /* low bits select the bucket, high bits the shard */
+  return &shards[(hash >> 24) & (CACHE_SHARDS - 1)];
+}
+
+static size_t entry_bytes(const cache_entry_t *entry) {
+  return sizeof(cache_entry_t) + entry->name_len + entry->value_len;
+}
+
+static cache_entry_t **find_slot(cache_shard_t *shard, unsigned long hash,
+                                 const cache_stamp_t *stamp, const char *name,
+                                 size_t name_len) {
+  cache_entry_t **slot = &shard->buckets[hash & (shard->nbuckets - 1)];
+
+  for (; *slot != NULL; slot = &(*slot)->chain) {
+    if ((*slot)->hash == hash && (*slot)->stamp.ino == stamp->ino &&
+        (*slot)->stamp.dev == stamp->dev && (*slot)->name_len == name_len &&
+        memcmp((*slot)->data, name, name_len) == 0) {
+      break;
+    }
+  }
+
+  return slot;
+}
+
+static void lru_unlink(cache_entry_t *entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+}
+
+static void lru_push_front(cache_shard_t *shard, cache_entry_t *entry) {
+  entry->prev = &shard->lru;
+  entry->next = shard->lru.next;
+  shard->lru.next->prev = entry;
+  shard->lru.next = entry;
+}
+
+static void remove_entry(cache_shard_t *shard, cache_entry_t **slot) {
+  cache_entry_t *entry = *slot;
+
+  *slot = entry->chain;
+  lru_unlink(entry);
+  shard->count--;
+  shard->bytes -= entry_bytes(entry);
+  enif_free(entry);
+}
+
+static void evict_lru(cache_shard_t *shard) {
+  cache_entry_t *victim = shard->lru.prev;
+  cache_entry_t **slot;
+
+  slot = find_slot(shard, victim->hash, &victim->stamp, victim->data,
+                   victim->name_len);
+  remove_entry(shard, slot);
+  shard->evictions++;
+}
+
+/**
+ * Doubles bucket array once there are more entries than buckets. Failure to
+ * grow only makes chains longer.
+ */
+static void maybe_grow(cache_shard_t *shard) {
+  cache_entry_t **buckets;
+  cache_entry_t *entry;
+  cache_entry_t *next;
+  size_t nbuckets = shard->nbuckets * 2;
+  size_t i;
+
+  if (shard->count <= shard->nbuckets) {
+    return;
+  }
+
+  if ((buckets = enif_alloc(nbuckets * sizeof(cache_entry_t *))) == NULL) {
+    return;
+  }
+  memset(buckets, 0, nbuckets * sizeof(cache_entry_t *));
+
+  for (i = 0; i < shard->nbuckets; i++) {
+    for (entry = shard->buckets[i]; entry != NULL; entry = next) {
+      next = entry->chain;
+      entry->chain = buckets[entry->hash & (nbuckets - 1)];
+      buckets[entry->hash & (nbuckets - 1)] = entry;
+    }
+  }
+
+  enif_free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+/*
+ * Public interface
+ */
+
+bool cache_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM value;
+  ErlNifUInt64 max_bytes = 0;
+  cache_shard_t *shard;
+  size_t i;
+
+  if (enif_is_map(env, load_info) &&
+      enif_get_map_value(env, load_info,
+                         enif_make_atom(env, "cache_max_bytes"), &value) &&
+      !enif_get_uint64(env, value, &max_bytes)) {
+    return false;
+  }
+
+  if (max_bytes == 0) {
+    return true;
+  }
+
+  if ((shards = enif_alloc(CACHE_SHARDS * sizeof(cache_shard_t))) == NULL) {
+    return false;
+  }
+  memset(shards, 0, CACHE_SHARDS * sizeof(cache_shard_t));
+  shard_max_bytes = max_bytes / CACHE_SHARDS;
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    shard = &shards[i];
+    shard->lru.prev = shard->lru.next = &shard->lru;
+    shard->nbuckets = CACHE_MIN_BUCKETS;
+    shard->buckets = enif_alloc(CACHE_MIN_BUCKETS * sizeof(cache_entry_t *));
+    shard->lock = enif_mutex_create("xattr_cache");
+    if (shard->buckets == NULL || shard->lock == NULL) {
+      cache_destroy();
+      return false;
+    }
+    memset(shard->buckets, 0, CACHE_MIN_BUCKETS * sizeof(cache_entry_t *));
+  }
+
+  return true;
+}
+
+void cache_destroy(void) {
+  cache_entry_t *entry;
+  cache_entry_t *next;
+  size_t i;
+
+  if (shards == NULL) {
+    return;
+  }
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    if (shards[i].buckets != NULL) {
+      for (entry = shards[i].lru.next; entry != &shards[i].lru; entry = next) {
+        next = entry->next;
+        enif_free(entry);
+      }
+      enif_free(shards[i].buckets);
+    }
+    if (shards[i].lock != NULL) {
+      enif_mutex_destroy(shards[i].lock);
+    }
+  }
+
+  enif_free(shards);
+  shards = NULL;
+}
+
+bool cache_enabled(void) { return shards != NULL; }
+
+bool cache_get(ErlNifEnv *env, const cache_stamp_t *stamp, const char *name,
+               ERL_NIF_TERM *value) {
+  size_t name_len = strlen(name);
+  unsigned long hash = hash_key(stamp, name, name_len);
+  cache_shard_t *shard = shard_of(hash);
+  cache_entry_t **slot;
+  cache_entry_t *entry;
+  bool hit = false;
+
+  enif_mutex_lock(shard->lock);
+
+  slot = find_slot(shard, hash, stamp, name, name_len);
+  if ((entry = *slot) != NULL) {
+    if (entry->stamp.ctime_sec == stamp->ctime_sec &&
+        entry->stamp.ctime_nsec == stamp->ctime_nsec) {
+      memcpy(enif_make_new_binary(env, entry->value_len, value),
+             entry->data + name_len + 1, entry->value_len);
+      lru_unlink(entry);
+      lru_push_front(shard, entry);
+      hit = true;
+    } else {
+      /* file has changed since the value was cached */
+      remove_entry(shard, slot);
+    }
+  }
+
+  if (hit) {
+    shard->hits++;
+  } else {
+    shard->misses++;
+  }
+
+  enif_mutex_unlock(shard->lock);
+  return hit;
+}
+
+void cache_put(const cache_stamp_t *stamp, const char *name, const void *value,
+               size_t size) {
+  size_t name_len = strlen(name);
+  unsigned long hash = hash_key(stamp, name, name_len);
+  cache_shard_t *shard = shard_of(hash);
+  cache_entry_t **slot;
+  cache_entry_t *entry;
+
+  if (sizeof(cache_entry_t) + name_len + size > shard_max_bytes) {
+    return;
+  }
+
+  /* copy outside of the lock */
+  if ((entry = enif_alloc(sizeof(cache_entry_t) + name_len + size)) == NULL) {
+    return;
+  }
+  entry->hash = hash;
+  entry->stamp = *stamp;
+  entry->name_len = name_len;
+  entry->value_len = size;
+  memcpy(entry->data, name, name_len + 1);
+  memcpy(entry->data + name_len + 1, value, size);
+
+  enif_mutex_lock(shard->lock);
+
+  slot = find_slot(shard, hash, stamp, name, name_len);
+  if (*slot != NULL) {
+    remove_entry(shard, slot);
+    slot = find_slot(shard, hash, stamp, name, name_len);
+  }
+
+  entry->chain = NULL;
+  *slot = entry;
+  lru_push_front(shard, entry);
+  shard->count++;
+  shard->bytes += entry_bytes(entry);
+
+  while (shard->bytes > shard_max_bytes) {
+    evict_lru(shard);
+  }
+
+  maybe_grow(shard);
+
+  enif_mutex_unlock(shard->lock);
+}
+
+void cache_invalidate(const cache_stamp_t *stamp, const char *name) {
+  size_t name_len = strlen(name);
+  unsigned long hash = hash_key(stamp, name, name_len);
+  cache_shard_t *shard = shard_of(hash);
+  cache_entry_t **slot;
+
+  enif_mutex_lock(shard->lock);
+
+  slot = find_slot(shard, hash, stamp, name, name_len);
+  if (*slot != NULL) {
+    remove_entry(shard, slot);
+  }
+
+  enif_mutex_unlock(shard->lock);
+}
+
+ERL_NIF_TERM cache_stats_nif(ErlNifEnv *env, UNUSED int argc,
+                             UNUSED const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM keys[5];
+  ERL_NIF_TERM values[5];
+  ERL_NIF_TERM map;
+  ERL_NIF_TERM list = enif_make_list(env, 0);
+  cache_shard_t *shard;
+  int i;
+
+  if (shards == NULL) {
+    return list;
+  }
+
+  keys[0] = make_atom(env, "hits");
+  keys[1] = make_atom(env, "misses");
+  keys[2] = make_atom(env, "evictions");
+  keys[3] = make_atom(env, "entries");
+  keys[4] = make_atom(env, "bytes");
+
+  for (i = CACHE_SHARDS - 1; i >= 0; i--) {
+    shard = &shards[i];
+
+    enif_mutex_lock(shard->lock);
+    values[0] = enif_make_uint64(env, shard->hits);
+    values[1] = enif_make_uint64(env, shard->misses);
+    values[2] = enif_make_uint64(env, shard->evictions);
+    values[3] = enif_make_uint64(env, shard->count);
+    values[4] = enif_make_uint64(env, shard->bytes);
+    enif_mutex_unlock(shard->lock);
+
+    enif_make_map_from_arrays(env, keys, values, 5, &map);
+    list = enif_make_list_cell(env, map, list);
+  }
+
+  return list;
+}
@@ -0,0 +1,67 @@
+#ifndef ELIXIR_XATTR_CACHE_H
+#define ELIXIR_XATTR_CACHE_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Identity and change time of a file, as returned by `stat`. The kernel bumps
+ * change time on every attribute change, so cached values are valid as long
+ * as the stamp of the file does not change.
+ */
+typedef struct {
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  long ctime_sec;
+  long ctime_nsec;
+} cache_stamp_t;
+
+/**
+ * Reads `cache_max_bytes` option from NIF \a load_info map and sets up the
+ * cache. The cache is disabled if the option is missing or `0`.
+ *
+ * \return `false` if the option is malformed or memory cannot be allocated.
+ */
+bool cache_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Releases all cached entries.
+ */
+void cache_destroy(void);
+
+/**
+ * Checks whether cache has been enabled in `cache_init`.
+ */
+bool cache_enabled(void);
+
+/**
+ * Looks up value of attribute \a name of file identified by \a stamp. Entry
+ * cached with different change time is dropped.
+ *
+ * \return `true` on hit, `false` on miss.
+ *
+ * \retval value On hit, binary term holding copy of the cached value.
+ */
+bool cache_get(ErlNifEnv *env, const cache_stamp_t *stamp, const char *name,
+               ERL_NIF_TERM *value);
+
+/**
+ * Stores \a size bytes of \a value of attribute \a name of file identified by
+ * \a stamp, evicting least recently used entries if the cache is over its
+ * memory limit.
+ */
+void cache_put(const cache_stamp_t *stamp, const char *name, const void *value,
+               size_t size);
+
+/**
+ * Drops cached value of attribute \a name of file identified by \a stamp
+ * (change time is ignored).
+ */
+void cache_invalidate(const cache_stamp_t *stamp, const char *name);
+
+/** @spec cache_stats_nif() :: [%{atom => non_neg_integer}] */
+ERL_NIF_TERM cache_stats_nif(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]);
+
+#endif
@@ -0,0 +1,395 @@
+#include "codec.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#define METHOD_STORED 0
+#define METHOD_LZ4 1
+
+/*
+ * Compressed payload is a single LZ4 block: a run of sequences, each made of
+ * token (literal length and match length - 4, 4 bits each), literal length
+ * continuation bytes, literals, 16-bit little endian match offset and match
+ * length continuation bytes. The last sequence has literals only. Blocks are
+ * readable by any LZ4 block decoder.
+ */
+
+#define MIN_MATCH 4
+/* Block must end with this many literals, and the last match must start at
+ * least `MF_LIMIT` bytes before its end */
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+#define RUN_MASK 15
+
+/* Match finder table holds 4096 positions, 16 KiB on stack */
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+
+/* Largest ratio of decoded to encoded size LZ4 can achieve, so that headers
+ * of corrupted values cannot request huge allocations */
+#define MAX_RATIO 256
+
+static char **names = NULL;
+static size_t names_count = 0;
+
+/*
+ * Compressor
+ */
+
+static unsigned long read32(const unsigned char *p) {
+  return (unsigned long)p[0] | (unsigned long)p[1] << 8 |
+         (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static unsigned hash32(const unsigned char *p) {
+  return (unsigned)(((read32(p) * 2654435761UL) & 0xffffffffUL) >>
+                    (32 - HASH_LOG));
+}
+
+/**
+ * Number of bytes taken by \a len encoded as 4-bit token field followed by
+ * continuation bytes.
+ */
+static size_t length_size(size_t len) {
+  return len < RUN_MASK ? 0 : (len - RUN_MASK) / 255 + 1;
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255) {
+    *op++ = 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+/**
+ * Writes sequence of \a lit_len literals at \a lit followed by match of
+ * \a match_len bytes at distance \a offset, or literals only if \a offset
+ * is `0`.
+ *
+ * \return Position after the sequence, or `NULL` if it does not fit before
+ *         \a oend.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *lit, size_t lit_len,
+                                   size_t offset, size_t match_len) {
+  unsigned char *token = op;
+  size_t need = 1 + length_size(lit_len) + lit_len;
+
+  if (offset > 0) {
+    match_len -= MIN_MATCH;
+    need += 2 + length_size(match_len);
+  }
+
+  if ((size_t)(oend - op) < need) {
+    return NULL;
+  }
+
+  op++;
+  if (lit_len >= RUN_MASK) {
+    *token = RUN_MASK << 4;
+    op = put_length(op, lit_len - RUN_MASK);
+  } else {
+    *token = (unsigned char)(lit_len << 4);
+  }
+
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+
+  if (offset > 0) {
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+
+    if (match_len >= RUN_MASK) {
+      *token |= RUN_MASK;
+      op = put_length(op, match_len - RUN_MASK);
+    } else {
+      *token |= (unsigned char)match_len;
+    }
+  }
+
+  return op;
+}
+
+/**
+ * Greedy LZ4 compressor with single-entry hash chains. Output is limited to
+ * \a dst_size bytes, so that values which would not shrink are detected
+ * early.
+ *
+ * \return Size of compressed block, or `0` if it does not fit.
+ */
+static size_t compress_block(const unsigned char *src, size_t size,
+                             unsigned char *dst, size_t dst_size) {
+  unsigned table[HASH_SIZE];
+  const unsigned char *end = src + size;
+  const unsigned char *match_end;
+  const unsigned char *anchor = src;
+  const unsigned char *ip = src + 1;
+  const unsigned char *ref;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dst_size;
+  size_t match_len;
+  unsigned h;
+
+  if (size > MF_LIMIT) {
+    match_end = end - LAST_LITERALS;
+    memset(table, 0, sizeof(table));
+
+    while (ip < end - MF_LIMIT) {
+      h = hash32(ip);
+      ref = src + table[h];
+      table[h] = (unsigned)(ip - src);
+
+      if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+        /* skip faster through data which does not compress */
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+
+      for (match_len = MIN_MATCH;
+           ip + match_len < match_end && ip[match_len] == ref[match_len];
+           match_len++) {
+      }
+
+      if ((op = put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+                             match_len)) == NULL) {
+        return 0;
+      }
+
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+
+  if ((op = put_sequence(op, oend, anchor, end - anchor, 0, 0)) == NULL) {
+    return 0;
+  }
+
+  return op - dst;
+}
+
+/*
+ * Decompressor
+ */
+
+/**
+ * Adds continuation bytes at \a *ip to \a len, failing if it grows past
+ * \a limit or input ends.
+ */
+static bool get_length(const unsigned char **ip, const unsigned char *iend,
+                       size_t limit, size_t *len) {
+  unsigned char byte;
+
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+    if (*len > limit) {
+      return false;
+    }
+  } while (byte == 255);
+
+  return true;
+}
+
+static bool decompress_block(const unsigned char *src, size_t size,
+                             unsigned char *dst, size_t dst_size) {
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + size;
+  const unsigned char *match;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dst_size;
+  size_t lit_len;
+  size_t match_len;
+  size_t offset;
+  unsigned char token;
+
+  for (;;) {
+    if (ip >= iend) {
+      return false;
+    }
+    token = *ip++;
+
+    lit_len = token >> 4;
+    if (lit_len == RUN_MASK && !get_length(&ip, iend, dst_size, &lit_len)) {
+      return false;
+    }
+    if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+      return false;
+    }
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    if (ip == iend) {
+      return op == oend;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return false;
+    }
+
+    match_len = token & RUN_MASK;
+    if (match_len == RUN_MASK &&
+        !get_length(&ip, iend, dst_size, &match_len)) {
+      return false;
+    }
+    match_len += MIN_MATCH;
+    if (match_len > (size_t)(oend - op)) {
+      return false;
+    }
+
+    /* matches may overlap their own output, so bytes are copied one by one */
+    for (match = op - offset; match_len > 0; match_len--) {
+      *op++ = *match++;
+    }
+  }
+}
+
+/*
+ * Public interface
+ */
+
+static bool get_option(ErlNifEnv *env, ERL_NIF_TERM map, const char *key,
+                       ERL_NIF_TERM *value) {
+  return enif_is_map(env, map) &&
+         enif_get_map_value(env, map, enif_make_atom(env, key), value);
+}
+
+bool codec_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM head;
+  unsigned len;
+  size_t name_len;
+
+  if (!get_option(env, load_info, "compress_names", &list)) {
+    return true;
+  }
+
+  if (!enif_get_list_length(env, list, &len)) {
+    return false;
+  }
+
+  if (len == 0) {
+    return true;
+  }
+
+  if ((names = enif_alloc(len * sizeof(char *))) == NULL) {
+    return false;
+  }
+
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    if (get_cstring_arg(env, head, name, NAME_BUFFER_SIZE) != ARG_OK) {
+      codec_destroy();
+      return false;
+    }
+
+    name_len = strlen(name) + 1;
+    if ((names[names_count] = enif_alloc(name_len)) == NULL) {
+      codec_destroy();
+      return false;
+    }
+    memcpy(names[names_count], name, name_len);
+    names_count++;
+  }
+
+  return true;
+}
+
+void codec_destroy(void) {
+  size_t i;
+
+  for (i = 0; i < names_count; i++) {
+    enif_free(names[i]);
+  }
+  if (names != NULL) {
+    enif_free(names);
+  }
+  names = NULL;
+  names_count = 0;
+}
+
+bool codec_enabled(const char *name) {
+  size_t i;
+
+  for (i = 0; i < names_count; i++) {
+    if (strcmp(names[i], name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+size_t codec_bound(size_t size) { return CODEC_HEADER_SIZE + size; }
+
+size_t codec_encode(const unsigned char *src, size_t size,
+                    unsigned char *dst) {
+  size_t encoded;
+
+  dst[1] = (unsigned char)(size & 0xff);
+  dst[2] = (unsigned char)((size >> 8) & 0xff);
+  dst[3] = (unsigned char)((size >> 16) & 0xff);
+  dst[4] = (unsigned char)((size >> 24) & 0xff);
+
+  /* compressed block has to be strictly smaller than the value */
+  if (size > 0 &&
+      (encoded = compress_block(src, size, dst + CODEC_HEADER_SIZE,
+                                size - 1)) != 0) {
+    dst[0] = METHOD_LZ4;
+    return CODEC_HEADER_SIZE + encoded;
+  }
+
+  dst[0] = METHOD_STORED;
+  memcpy(dst + CODEC_HEADER_SIZE, src, size);
+  return CODEC_HEADER_SIZE + size;
+}
+
+bool codec_decoded_size(const unsigned char *src, size_t size,
+                        size_t *decoded) {
+  if (size < CODEC_HEADER_SIZE) {
+    return false;
+  }
+
+  *decoded = (size_t)src[1] | (size_t)src[2] << 8 | (size_t)src[3] << 16 |
+             (size_t)src[4] << 24;
+  size -= CODEC_HEADER_SIZE;
+
+  switch (src[0]) {
+  case METHOD_STORED: return *decoded == size;
+  case METHOD_LZ4: return *decoded / MAX_RATIO <= size;
+  default: return false;
+  }
+}
+
+bool codec_decode(const unsigned char *src, size_t size, unsigned char *dst,
+                  size_t dst_size) {
+  size_t decoded;
+
+  if (!codec_decoded_size(src, size, &decoded) || decoded != dst_size) {
+    return false;
+  }
+
+  if (src[0] == METHOD_STORED) {
+    memcpy(dst, src + CODEC_HEADER_SIZE, dst_size);
+    return true;
+  }
+
+  return decompress_block(src + CODEC_HEADER_SIZE, size - CODEC_HEADER_SIZE,
+                          dst, dst_size);
+}
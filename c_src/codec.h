@@ -0,0 +1,63 @@
+#ifndef ELIXIR_XATTR_CODEC_H
+#define ELIXIR_XATTR_CODEC_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Size of header preceding every encoded value: method byte and decoded size
+ * (32-bit, little endian) */
+#define CODEC_HEADER_SIZE 5
+
+/**
+ * Reads `compress_names` option (list of tagged names) from NIF \a load_info
+ * map. Compression is disabled if the option is missing or empty.
+ *
+ * \return `false` if the option is malformed or memory cannot be allocated.
+ */
+bool codec_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Releases list of compressed names.
+ */
+void codec_destroy(void);
+
+/**
+ * Checks whether values of attribute \a name (tagged, not prefixed) are
+ * stored compressed.
+ */
+bool codec_enabled(const char *name);
+
+/**
+ * Returns size of buffer `codec_encode` needs for value of \a size bytes.
+ */
+size_t codec_bound(size_t size);
+
+/**
+ * Compresses \a size bytes of \a src into \a dst of `codec_bound(size)`
+ * bytes. Values which do not shrink are stored as is after the header.
+ * Encoding is deterministic, so equal values always encode to equal bytes.
+ *
+ * \return Size of encoded value.
+ */
+size_t codec_encode(const unsigned char *src, size_t size, unsigned char *dst);
+
+/**
+ * Reads decoded size from header of \a size bytes of encoded \a src.
+ *
+ * \return `false` if the header is malformed.
+ */
+bool codec_decoded_size(const unsigned char *src, size_t size,
+                        size_t *decoded);
+
+/**
+ * Decompresses \a size bytes of \a src into \a dst of \a dst_size bytes, as
+ * returned by `codec_decoded_size`. Malformed input is detected, it never
+ * causes reads or writes out of bounds.
+ *
+ * \return `false` if \a src is malformed.
+ */
+bool codec_decode(const unsigned char *src, size_t size, unsigned char *dst,
+                  size_t dst_size);
+
+#endif
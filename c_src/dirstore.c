@@ -0,0 +1,1435 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "dirstore.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define STORE_NAME ".elixir_xattr_store"
+#define STORE_TMP_NAME ".elixir_xattr_store.tmp"
+
+#define STORE_MAGIC "XATTRDS1"
+#define STORE_MAGIC_SIZE 8
+
+/* Written in native byte order, so that files of other architectures are
+ * rejected */
+#define STORE_MARKER 0x01020304U
+
+/* Stores are mapped whole at this size, so that readers never remap. Writes
+ * which would grow a store past it fail with ENOSPC. */
+#define STORE_MAP_SIZE (64L * 1024 * 1024)
+#define STORE_GROW (64L * 1024)
+#define MIN_BUCKETS 1024
+
+/* Compaction runs once superseded records take this much and half of the
+ * store */
+#define COMPACT_MIN_DEAD (256L * 1024)
+
+/* Values are limited as by most Linux file systems */
+#define MAX_VALUE 65536
+
+#define STORE_SLOTS 64
+#define MOUNT_SLOTS 64
+
+#define RECORD_REMOVED 1U
+
+#define LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/* FNV-1a, 64-bit; constants are built from halves to stay C89 */
+#define FNV_OFFSET (((ErlNifUInt64)0xcbf29ce4UL << 32) | 0x84222325UL)
+#define FNV_PRIME (((ErlNifUInt64)0x100UL << 32) | 0x1b3UL)
+
+/*
+ * Store file: header, two tables of bucket heads (records hashed by file and
+ * name, and by file alone), then append-only log of records. Each record
+ * links to the older record of both of its buckets, so chains are walked
+ * from the newest record and the first match of a name is its current
+ * value. Removals append a record with `RECORD_REMOVED` flag.
+ *
+ * A record is written past the tail, then the tail and bucket heads are
+ * published with release stores, so readers follow chains of the shared
+ * mapping without locks. Writers are serialized by a mutex within the
+ * process and `flock` between processes. Compaction writes live records into
+ * a new file, renames it over the store and marks the old one obsolete, which
+ * makes every process open the new file on its next call.
+ */
+
+typedef struct {
+  char magic[STORE_MAGIC_SIZE];
+  unsigned int marker;
+  unsigned int buckets;
+  /** End of records */
+  ErlNifUInt64 tail;
+  /** Bytes taken by superseded records and removal records */
+  ErlNifUInt64 dead;
+  /** Set once a compacted store has replaced this file */
+  ErlNifUInt64 obsolete;
+} store_header_t;
+
+typedef struct {
+  /** Offset of older record in the same name bucket, or 0 */
+  ErlNifUInt64 next_key;
+  /** Offset of older record in the same file bucket, or 0 */
+  ErlNifUInt64 next_file;
+  ErlNifUInt64 ino;
+  ErlNifUInt64 gen;
+  unsigned int name_len;
+  unsigned int value_len;
+  unsigned int flags;
+  unsigned int reserved;
+  /* followed by name and value, padded to 8 bytes */
+} record_t;
+
+typedef struct {
+  /** Directory path, key in the store table */
+  char *dir;
+  int fd;
+  bool writable;
+  /** Mapping of `STORE_MAP_SIZE` bytes */
+  unsigned char *base;
+  /** Size of the file last seen, only the mapping below it can be read */
+  ErlNifUInt64 size;
+  /** Serializes writers within the process */
+  ErlNifMutex *lock;
+  /** References held by callers and by the store table */
+  int refs;
+} store_t;
+
+typedef struct {
+  ErlNifUInt64 dev;
+  bool supported;
+} mount_t;
+
+typedef enum { CHECK_NONE, CHECK_ABSENT, CHECK_PRESENT, CHECK_EQUAL } check_t;
+
+static bool enabled = false;
+
+/* Directories whose files use the store regardless of their mount */
+static char **forced = NULL;
+static size_t forced_count = 0;
+
+static ErlNifRWLock *stores_lock = NULL;
+static store_t *stores[STORE_SLOTS];
+
+static ErlNifRWLock *mounts_lock = NULL;
+static mount_t mounts[MOUNT_SLOTS];
+static size_t mounts_count = 0;
+
+/*
+ * Layout helpers
+ */
+
+static store_header_t *header_of(const store_t *store) {
+  return (store_header_t *)store->base;
+}
+
+static ErlNifUInt64 *key_heads(const store_t *store) {
+  return (ErlNifUInt64 *)(store->base + sizeof(store_header_t));
+}
+
+static ErlNifUInt64 *file_heads(const store_t *store) {
+  return key_heads(store) + header_of(store)->buckets;
+}
+
+static ErlNifUInt64 data_start(unsigned buckets) {
+  return sizeof(store_header_t) + 2 * (ErlNifUInt64)buckets * 8;
+}
+
+static ErlNifUInt64 record_size(size_t name_len, size_t value_len) {
+  return (sizeof(record_t) + name_len + value_len + 7) & ~(ErlNifUInt64)7;
+}
+
+static const char *record_name(const record_t *rec) {
+  return (const char *)(rec + 1);
+}
+
+static const unsigned char *record_value(const record_t *rec) {
+  return (const unsigned char *)(rec + 1) + rec->name_len;
+}
+
+static ErlNifUInt64 fnv(ErlNifUInt64 hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static ErlNifUInt64 file_hash(const dirstore_file_t *file) {
+  ErlNifUInt64 hash = fnv(FNV_OFFSET, &file->ino, sizeof(file->ino));
+  return fnv(hash, &file->gen, sizeof(file->gen));
+}
+
+static ErlNifUInt64 key_hash(const dirstore_file_t *file, const char *name,
+                             size_t len) {
+  return fnv(file_hash(file), name, len);
+}
+
+/**
+ * Checks that record at \a off lies within published part of the store.
+ * Offsets of older records are always smaller, so corrupted chains cannot
+ * loop.
+ */
+static const record_t *record_at(const store_t *store, ErlNifUInt64 off,
+                                 ErlNifUInt64 newer, ErlNifUInt64 tail) {
+  const record_t *rec;
+
+  if (off < data_start(header_of(store)->buckets) || off >= newer ||
+      off % 8 != 0 || tail - off < sizeof(record_t)) {
+    return NULL;
+  }
+
+  rec = (const record_t *)(store->base + off);
+  if (record_size(rec->name_len, rec->value_len) > tail - off) {
+    return NULL;
+  }
+  return rec;
+}
+
+/**
+ * Reads tail of \a store, checked against size of its file. The tail is
+ * written by any process mapping the store, and reading the mapping past the
+ * end of the file would raise SIGBUS, so an unexpected one is rejected.
+ */
+static bool published_tail(store_t *store, ErlNifUInt64 *tail) {
+  struct stat st;
+  ErlNifUInt64 t = LOAD_ACQUIRE(&header_of(store)->tail);
+
+  /* files only grow, so the size is checked again only when the tail
+   * outgrows what has been seen */
+  if (t > LOAD_ACQUIRE(&store->size)) {
+    if (fstat(store->fd, &st) == -1) {
+      return false;
+    }
+    if (t > (ErlNifUInt64)st.st_size || st.st_size > STORE_MAP_SIZE) {
+      errno = EILSEQ;
+      return false;
+    }
+    STORE_RELEASE(&store->size, (ErlNifUInt64)st.st_size);
+  }
+
+  *tail = t;
+  return true;
+}
+
+static bool same_file(const record_t *rec, const dirstore_file_t *file) {
+  return rec->ino == file->ino && rec->gen == file->gen;
+}
+
+/**
+ * Finds the newest record of attribute \a name of \a file, which may be
+ * a removal record.
+ *
+ * \retval found The record, or `NULL` if there is none.
+ */
+static bool find_record(store_t *store, const dirstore_file_t *file,
+                        const char *name, size_t len,
+                        const record_t **found) {
+  store_header_t *header = header_of(store);
+  const record_t *rec;
+  ErlNifUInt64 bucket = key_hash(file, name, len) & (header->buckets - 1);
+  ErlNifUInt64 off = LOAD_ACQUIRE(&key_heads(store)[bucket]);
+  ErlNifUInt64 tail;
+  ErlNifUInt64 newer;
+
+  if (!published_tail(store, &tail)) {
+    return false;
+  }
+
+  *found = NULL;
+  newer = tail;
+  while (off != 0 && (rec = record_at(store, off, newer, tail)) != NULL) {
+    if (same_file(rec, file) && rec->name_len == len &&
+        memcmp(record_name(rec), name, len) == 0) {
+      *found = rec;
+      break;
+    }
+    newer = off;
+    off = rec->next_key;
+  }
+
+  return true;
+}
+
+static bool is_live(store_t *store, const dirstore_file_t *file,
+                    const record_t *rec, bool *live) {
+  const record_t *cur = NULL;
+
+  if ((rec->flags & RECORD_REMOVED) == 0 &&
+      !find_record(store, file, record_name(rec), rec->name_len, &cur)) {
+    return false;
+  }
+
+  *live = cur == rec;
+  return true;
+}
+
+/*
+ * Opening stores
+ */
+
+/**
+ * Writes directory of \a path to \a dir of `PATH_BUFFER_SIZE` bytes.
+ */
+static bool dir_of(const char *path, char *dir) {
+  size_t len = strlen(path);
+
+  while (len > 1 && path[len - 1] == '/') {
+    len--;
+  }
+  while (len > 0 && path[len - 1] != '/') {
+    len--;
+  }
+  while (len > 1 && path[len - 1] == '/') {
+    len--;
+  }
+
+  if (len == 0) {
+    strcpy(dir, ".");
+    return true;
+  }
+
+  if (len >= PATH_BUFFER_SIZE) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  return true;
+}
+
+static bool store_path(const char *dir, const char *name, char *path) {
+  size_t len = strlen(dir);
+
+  if (len + 1 + strlen(name) >= PATH_BUFFER_SIZE) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  memcpy(path, dir, len);
+  path[len] = '/';
+  strcpy(path + len + 1, name);
+  return true;
+}
+
+/**
+ * Writes empty store with \a buckets into file \a fd.
+ */
+static bool init_file(int fd, unsigned buckets) {
+  store_header_t header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STORE_MAGIC, STORE_MAGIC_SIZE);
+  header.marker = STORE_MARKER;
+  header.buckets = buckets;
+  header.tail = data_start(buckets);
+
+  if (ftruncate(fd, data_start(buckets) + STORE_GROW) == -1 ||
+      pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    return false;
+  }
+
+  return true;
+}
+
+static bool valid_header(const store_header_t *header, off_t size) {
+  return memcmp(header->magic, STORE_MAGIC, STORE_MAGIC_SIZE) == 0 &&
+         header->marker == STORE_MARKER && header->buckets > 0 &&
+         (header->buckets & (header->buckets - 1)) == 0 &&
+         header->tail >= data_start(header->buckets) &&
+         header->tail <= (ErlNifUInt64)size && size <= STORE_MAP_SIZE;
+}
+
+static void close_store(store_t *store) {
+  munmap(store->base, STORE_MAP_SIZE);
+  close(store->fd);
+  enif_mutex_destroy(store->lock);
+  enif_free(store->dir);
+  enif_free(store);
+}
+
+/**
+ * Opens and maps store in \a dir, creating it if \a create is set.
+ *
+ * \return `false` on failure; `ENOENT` means that the store does not exist.
+ */
+static bool open_store(const char *dir, bool create, store_t **store) {
+  char path[PATH_BUFFER_SIZE];
+  struct stat st;
+  store_t *s;
+  bool writable = true;
+  size_t len = strlen(dir) + 1;
+  void *base;
+  int fd;
+
+  if (!store_path(dir, STORE_NAME, path)) {
+    return false;
+  }
+
+  fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+  if (fd == -1 && !create && (errno == EACCES || errno == EROFS)) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    writable = false;
+  }
+  if (fd == -1) {
+    return false;
+  }
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+
+  /* new store is initialized by whichever process locks it first */
+  if (st.st_size < (off_t)sizeof(store_header_t)) {
+    if (!writable || !create) {
+      close(fd);
+      errno = ENOENT;
+      return false;
+    }
+
+    if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1 ||
+        (st.st_size < (off_t)sizeof(store_header_t) &&
+         (!init_file(fd, MIN_BUCKETS) || fstat(fd, &st) == -1))) {
+      close(fd);
+      return false;
+    }
+    flock(fd, LOCK_UN);
+  }
+
+  base = mmap(NULL, STORE_MAP_SIZE, PROT_READ | (writable ? PROT_WRITE : 0),
+              MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  if (!valid_header(base, st.st_size)) {
+    munmap(base, STORE_MAP_SIZE);
+    close(fd);
+    errno = EILSEQ;
+    return false;
+  }
+
+  if ((s = enif_alloc(sizeof(store_t))) == NULL ||
+      (s->dir = enif_alloc(len)) == NULL ||
+      (s->lock = enif_mutex_create("xattr_dirstore")) == NULL) {
+    if (s != NULL && s->dir != NULL) {
+      enif_free(s->dir);
+    }
+    enif_free(s);
+    munmap(base, STORE_MAP_SIZE);
+    close(fd);
+    errno = ERANGE;
+    return false;
+  }
+
+  memcpy(s->dir, dir, len);
+  s->fd = fd;
+  s->writable = writable;
+  s->base = base;
+  s->size = st.st_size;
+  s->refs = 1;
+
+  *store = s;
+  return true;
+}
+
+static void release_store(store_t *store) {
+  if (__atomic_sub_fetch(&store->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close_store(store);
+  }
+}
+
+/**
+ * Finds store of directory of \a file in the table, or opens it. Stores
+ * replaced by compaction are reopened.
+ */
+static bool get_store(const dirstore_file_t *file, bool create,
+                      store_t **store) {
+  char dir[PATH_BUFFER_SIZE];
+  store_t *s;
+  size_t free_slot = STORE_SLOTS;
+  size_t i;
+
+  if (!dir_of(file->path, dir)) {
+    return false;
+  }
+
+  enif_rwlock_rlock(stores_lock);
+  for (i = 0; i < STORE_SLOTS; i++) {
+    s = stores[i];
+    if (s != NULL && strcmp(s->dir, dir) == 0 &&
+        !LOAD_ACQUIRE(&header_of(s)->obsolete) && (s->writable || !create)) {
+      __atomic_add_fetch(&s->refs, 1, __ATOMIC_ACQ_REL);
+      enif_rwlock_runlock(stores_lock);
+      *store = s;
+      return true;
+    }
+  }
+  enif_rwlock_runlock(stores_lock);
+
+  if (!open_store(dir, create, &s)) {
+    return false;
+  }
+
+  /* replaced store is closed by its last user; unused stores are evicted to
+   * make room, if there is none the new one is not cached */
+  enif_rwlock_rwlock(stores_lock);
+  for (i = 0; i < STORE_SLOTS; i++) {
+    if (stores[i] != NULL && strcmp(stores[i]->dir, dir) == 0) {
+      release_store(stores[i]);
+      stores[i] = NULL;
+    }
+    if (stores[i] == NULL) {
+      free_slot = i;
+    }
+  }
+  for (i = 0; i < STORE_SLOTS && free_slot == STORE_SLOTS; i++) {
+    if (__atomic_load_n(&stores[i]->refs, __ATOMIC_ACQUIRE) == 1) {
+      release_store(stores[i]);
+      free_slot = i;
+    }
+  }
+  if (free_slot < STORE_SLOTS) {
+    s->refs++;
+    stores[free_slot] = s;
+  }
+  enif_rwlock_rwunlock(stores_lock);
+
+  *store = s;
+  return true;
+}
+
+/*
+ * Compaction
+ */
+
+static int compare_ino(const void *a, const void *b) {
+  ErlNifUInt64 x = *(const ErlNifUInt64 *)a;
+  ErlNifUInt64 y = *(const ErlNifUInt64 *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Lists sorted inode numbers of entries of \a dir, so that records of removed
+ * files can be dropped.
+ */
+static bool list_inodes(const char *dir, ErlNifUInt64 **inos, size_t *count) {
+  DIR *d;
+  struct dirent *entry;
+  ErlNifUInt64 *grown;
+  size_t capacity = 256;
+
+  if ((d = opendir(dir)) == NULL) {
+    return false;
+  }
+
+  *count = 0;
+  if ((*inos = enif_alloc(capacity * sizeof(ErlNifUInt64))) == NULL) {
+    closedir(d);
+    errno = ERANGE;
+    return false;
+  }
+
+  while ((entry = readdir(d)) != NULL) {
+    if (*count == capacity) {
+      capacity *= 2;
+      if ((grown = enif_realloc(*inos, capacity * sizeof(ErlNifUInt64))) ==
+          NULL) {
+        enif_free(*inos);
+        closedir(d);
+        errno = ERANGE;
+        return false;
+      }
+      *inos = grown;
+    }
+    (*inos)[(*count)++] = entry->d_ino;
+  }
+
+  closedir(d);
+  qsort(*inos, *count, sizeof(ErlNifUInt64), compare_ino);
+  return true;
+}
+
+/**
+ * Copies live records of files still present in the directory into a new
+ * store and renames it over \a store, which is marked obsolete. Called with
+ * writer locks held.
+ */
+static bool compact(store_t *store) {
+  char path[PATH_BUFFER_SIZE];
+  char tmp_path[PATH_BUFFER_SIZE];
+  store_header_t *header = header_of(store);
+  store_header_t *new_header;
+  const record_t *rec;
+  record_t *copy;
+  dirstore_file_t file;
+  ErlNifUInt64 *inos;
+  ErlNifUInt64 *heads;
+  ErlNifUInt64 off;
+  ErlNifUInt64 tail;
+  ErlNifUInt64 size;
+  ErlNifUInt64 live_bytes = 0;
+  ErlNifUInt64 out;
+  ErlNifUInt64 bucket;
+  size_t ninos;
+  size_t live = 0;
+  unsigned buckets = MIN_BUCKETS;
+  unsigned char *base;
+  bool keep;
+  bool ok;
+  int fd;
+
+  if (!published_tail(store, &tail) ||
+      !store_path(store->dir, STORE_NAME, path) ||
+      !store_path(store->dir, STORE_TMP_NAME, tmp_path) ||
+      !list_inodes(store->dir, &inos, &ninos)) {
+    return false;
+  }
+
+  file.path = NULL;
+  file.dev = 0;
+
+  for (off = data_start(header->buckets); off < tail; off += size) {
+    rec = (const record_t *)(store->base + off);
+    size = record_size(rec->name_len, rec->value_len);
+    file.ino = rec->ino;
+    file.gen = rec->gen;
+    if (size > tail - off || !is_live(store, &file, rec, &keep)) {
+      enif_free(inos);
+      errno = EILSEQ;
+      return false;
+    }
+    if (keep &&
+        bsearch(&rec->ino, inos, ninos, sizeof(ErlNifUInt64), compare_ino)) {
+      live++;
+      live_bytes += size;
+    }
+  }
+
+  while (buckets < 2 * live) {
+    buckets *= 2;
+  }
+  size = (data_start(buckets) + live_bytes + STORE_GROW) & ~(STORE_GROW - 1);
+  if (size > (ErlNifUInt64)STORE_MAP_SIZE) {
+    enif_free(inos);
+    errno = ENOSPC;
+    return false;
+  }
+
+  fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    enif_free(inos);
+    return false;
+  }
+
+  if (!init_file(fd, buckets) || ftruncate(fd, size) == -1 ||
+      (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+    enif_free(inos);
+    close(fd);
+    unlink(tmp_path);
+    return false;
+  }
+
+  new_header = (store_header_t *)base;
+  heads = (ErlNifUInt64 *)(base + sizeof(store_header_t));
+  out = data_start(buckets);
+
+  /* records keep their order, so chains stay sorted from newest; they have
+   * been checked above and the writer lock is still held */
+  for (off = data_start(header->buckets); off < tail; off += size) {
+    rec = (const record_t *)(store->base + off);
+    size = record_size(rec->name_len, rec->value_len);
+    file.ino = rec->ino;
+    file.gen = rec->gen;
+    if (!is_live(store, &file, rec, &keep) || !keep ||
+        !bsearch(&rec->ino, inos, ninos, sizeof(ErlNifUInt64), compare_ino)) {
+      continue;
+    }
+
+    copy = (record_t *)(base + out);
+    memcpy(copy, rec, size);
+    bucket = key_hash(&file, record_name(rec), rec->name_len) & (buckets - 1);
+    copy->next_key = heads[bucket];
+    heads[bucket] = out;
+    bucket = file_hash(&file) & (buckets - 1);
+    copy->next_file = heads[buckets + bucket];
+    heads[buckets + bucket] = out;
+    out += size;
+  }
+  new_header->tail = out;
+
+  enif_free(inos);
+  ok = munmap(base, size) == 0 && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+    return false;
+  }
+
+  STORE_RELEASE(&header->obsolete, 1);
+  return true;
+}
+
+/*
+ * Writing
+ */
+
+/**
+ * Makes sure the store file has room for \a size more bytes.
+ */
+static bool reserve(store_t *store, ErlNifUInt64 size) {
+  store_header_t *header = header_of(store);
+  struct stat st;
+  ErlNifUInt64 end = header->tail + size;
+
+  if (fstat(store->fd, &st) == -1) {
+    return false;
+  }
+
+  if (end <= (ErlNifUInt64)st.st_size) {
+    return true;
+  }
+
+  end = (end + STORE_GROW) & ~(STORE_GROW - 1);
+  if (end > (ErlNifUInt64)STORE_MAP_SIZE) {
+    errno = ENOSPC;
+    return false;
+  }
+
+  if (ftruncate(store->fd, end) == -1) {
+    return false;
+  }
+
+  STORE_RELEASE(&store->size, end);
+  return true;
+}
+
+/**
+ * Appends record of attribute \a name of \a file with \a value (removal if
+ * `NULL`) after checking current value as requested by \a check. Called with
+ * writer locks held.
+ *
+ * \return `false` on failure; `ESTALE` means that the store has been compacted
+ *         to make room and the write has to be retried in the new one.
+ *
+ * \retval matched Whether the check passed and the record was written.
+ */
+static bool append(store_t *store, const dirstore_file_t *file,
+                   const char *name, const ErlNifBinary *value, check_t check,
+                   const ErlNifBinary *expected, bool *matched) {
+  store_header_t *header = header_of(store);
+  const record_t *cur;
+  record_t *rec;
+  ErlNifUInt64 off;
+  ErlNifUInt64 size;
+  ErlNifUInt64 kbucket;
+  ErlNifUInt64 fbucket;
+  size_t len = strlen(name);
+  size_t value_len = value != NULL ? value->size : 0;
+  bool present;
+
+  if (!published_tail(store, &off) ||
+      !find_record(store, file, name, len, &cur)) {
+    return false;
+  }
+
+  present = cur != NULL && (cur->flags & RECORD_REMOVED) == 0;
+
+  switch (check) {
+  case CHECK_ABSENT: *matched = !present; break;
+  case CHECK_PRESENT: *matched = present; break;
+  case CHECK_EQUAL:
+    *matched = present && cur->value_len == expected->size &&
+               memcmp(record_value(cur), expected->data, expected->size) == 0;
+    break;
+  default: *matched = true; break;
+  }
+
+  if (!*matched || (value == NULL && !present)) {
+    return true;
+  }
+
+  if (value_len > MAX_VALUE) {
+    errno = E2BIG;
+    return false;
+  }
+
+  size = record_size(len, value_len);
+  if (!reserve(store, size)) {
+    if (errno == ENOSPC && header->dead > 0 && compact(store)) {
+      errno = ESTALE;
+    }
+    return false;
+  }
+
+  kbucket = key_hash(file, name, len) & (header->buckets - 1);
+  fbucket = file_hash(file) & (header->buckets - 1);
+
+  rec = (record_t *)(store->base + off);
+  rec->next_key = key_heads(store)[kbucket];
+  rec->next_file = file_heads(store)[fbucket];
+  rec->ino = file->ino;
+  rec->gen = file->gen;
+  rec->name_len = len;
+  rec->value_len = value_len;
+  rec->flags = value != NULL ? 0 : RECORD_REMOVED;
+  rec->reserved = 0;
+  memcpy((char *)(rec + 1), name, len);
+  if (value_len > 0) {
+    memcpy((unsigned char *)(rec + 1) + len, value->data, value_len);
+  }
+
+  /* tail first, so that readers which see a head see its record as
+   * published */
+  STORE_RELEASE(&header->tail, off + size);
+  STORE_RELEASE(&key_heads(store)[kbucket], off);
+  STORE_RELEASE(&file_heads(store)[fbucket], off);
+
+  if (cur != NULL) {
+    header->dead += record_size(cur->name_len, cur->value_len);
+  }
+  if (value == NULL) {
+    header->dead += size;
+  }
+
+  /* failed compaction leaves the store as it is */
+  if (header->dead >= COMPACT_MIN_DEAD &&
+      2 * header->dead >= off + size - data_start(header->buckets)) {
+    compact(store);
+  }
+
+  errno = 0;
+  return true;
+}
+
+static bool update(const dirstore_file_t *file, const char *name,
+                   const ErlNifBinary *value, check_t check,
+                   const ErlNifBinary *expected, bool *matched) {
+  store_t *store;
+  bool result;
+  int saved_errno;
+  int attempts;
+
+  for (attempts = 0; attempts < 3; attempts++) {
+    if (!get_store(file, true, &store)) {
+      return false;
+    }
+
+    enif_mutex_lock(store->lock);
+    if (flock(store->fd, LOCK_EX) == -1) {
+      saved_errno = errno;
+      enif_mutex_unlock(store->lock);
+      release_store(store);
+      errno = saved_errno;
+      return false;
+    }
+
+    /* another writer may have compacted the store before we got the lock */
+    result = !LOAD_ACQUIRE(&header_of(store)->obsolete);
+    if (result) {
+      result = append(store, file, name, value, check, expected, matched);
+      if (!result && errno != ESTALE) {
+        attempts = 3;
+      }
+    } else {
+      errno = ESTALE;
+    }
+
+    saved_errno = errno;
+    flock(store->fd, LOCK_UN);
+    enif_mutex_unlock(store->lock);
+    release_store(store);
+    errno = saved_errno;
+
+    if (result) {
+      return true;
+    }
+  }
+
+  if (errno == ESTALE) {
+    errno = EAGAIN;
+  }
+  return false;
+}
+
+/*
+ * Public interface
+ */
+
+static bool get_option(ErlNifEnv *env, ERL_NIF_TERM map, const char *key,
+                       ERL_NIF_TERM *value) {
+  return enif_is_map(env, map) &&
+         enif_get_map_value(env, map, enif_make_atom(env, key), value);
+}
+
+static void free_forced(void) {
+  size_t i;
+
+  for (i = 0; i < forced_count; i++) {
+    enif_free(forced[i]);
+  }
+  if (forced != NULL) {
+    enif_free(forced);
+  }
+  forced = NULL;
+  forced_count = 0;
+}
+
+/**
+ * Reads `dir_store_force` option, list of directories whose files use the
+ * store even on mounts supporting attributes (used by tests).
+ */
+static bool init_forced(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  char dir[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM head;
+  unsigned len;
+  size_t dir_len;
+
+  if (!get_option(env, load_info, "dir_store_force", &list)) {
+    return true;
+  }
+
+  if (!enif_get_list_length(env, list, &len)) {
+    return false;
+  }
+
+  if (len == 0) {
+    return true;
+  }
+
+  if ((forced = enif_alloc(len * sizeof(char *))) == NULL) {
+    return false;
+  }
+
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    if (get_cstring_arg(env, head, dir, PATH_BUFFER_SIZE) != ARG_OK) {
+      free_forced();
+      return false;
+    }
+
+    dir_len = strlen(dir) + 1;
+    if ((forced[forced_count] = enif_alloc(dir_len)) == NULL) {
+      free_forced();
+      return false;
+    }
+    memcpy(forced[forced_count], dir, dir_len);
+    forced_count++;
+  }
+
+  return true;
+}
+
+bool dirstore_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM value;
+
+  enabled = false;
+  if (!get_option(env, load_info, "dir_store", &value)) {
+    return true;
+  }
+
+  if (!enif_is_identical(value, atom_true)) {
+    return enif_is_identical(value, atom_false);
+  }
+
+  memset(stores, 0, sizeof(stores));
+  mounts_count = 0;
+
+  if (!init_forced(env, load_info)) {
+    return false;
+  }
+  if ((stores_lock = enif_rwlock_create("xattr_dirstore_table")) == NULL) {
+    free_forced();
+    return false;
+  }
+  if ((mounts_lock = enif_rwlock_create("xattr_dirstore_mounts")) == NULL) {
+    enif_rwlock_destroy(stores_lock);
+    stores_lock = NULL;
+    free_forced();
+    return false;
+  }
+
+  enabled = true;
+  return true;
+}
+
+void dirstore_destroy(void) {
+  size_t i;
+
+  if (!enabled) {
+    return;
+  }
+
+  for (i = 0; i < STORE_SLOTS; i++) {
+    if (stores[i] != NULL) {
+      release_store(stores[i]);
+      stores[i] = NULL;
+    }
+  }
+
+  enif_rwlock_destroy(stores_lock);
+  enif_rwlock_destroy(mounts_lock);
+  stores_lock = NULL;
+  mounts_lock = NULL;
+  free_forced();
+  enabled = false;
+}
+
+bool dirstore_enabled(void) { return enabled; }
+
+bool dirstore_forced(const char *path) {
+  char dir[PATH_BUFFER_SIZE];
+  size_t i;
+
+  if (forced_count == 0 || !dir_of(path, dir)) {
+    return false;
+  }
+
+  for (i = 0; i < forced_count; i++) {
+    if (strcmp(forced[i], dir) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool dirstore_stat(int fd, const char *path, dirstore_file_t *file) {
+  struct stat st;
+#ifdef STATX_BTIME
+  struct statx stx;
+
+  /* birth time tells apart files which reused an inode, on file systems
+   * without it the generation is 0 */
+  if (statx(fd == -1 ? AT_FDCWD : fd, fd == -1 ? path : "",
+            fd == -1 ? 0 : AT_EMPTY_PATH, STATX_INO | STATX_BTIME,
+            &stx) == 0) {
+    file->path = path;
+    file->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    file->ino = stx.stx_ino;
+    file->gen = (stx.stx_mask & STATX_BTIME)
+                    ? (ErlNifUInt64)stx.stx_btime.tv_sec * 1000000000 +
+                          stx.stx_btime.tv_nsec
+                    : 0;
+    return true;
+  }
+
+  if (errno != ENOSYS) {
+    return false;
+  }
+#endif
+
+  if ((fd == -1 ? stat(path, &st) : fstat(fd, &st)) == -1) {
+    return false;
+  }
+
+  file->path = path;
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->gen = 0;
+  return true;
+}
+
+int dirstore_mount(ErlNifUInt64 dev) {
+  int result = -1;
+  size_t i;
+
+  enif_rwlock_rlock(mounts_lock);
+  for (i = 0; i < mounts_count; i++) {
+    if (mounts[i].dev == dev) {
+      result = mounts[i].supported;
+      break;
+    }
+  }
+  enif_rwlock_runlock(mounts_lock);
+
+  return result;
+}
+
+void dirstore_set_mount(ErlNifUInt64 dev, bool supported) {
+  size_t i;
+
+  enif_rwlock_rwlock(mounts_lock);
+  for (i = 0; i < mounts_count && mounts[i].dev != dev; i++) {
+  }
+  /* when the table is full, the oldest mount is probed again */
+  if (i == MOUNT_SLOTS) {
+    memmove(mounts, mounts + 1, (MOUNT_SLOTS - 1) * sizeof(mount_t));
+    i = MOUNT_SLOTS - 1;
+  } else if (i == mounts_count) {
+    mounts_count++;
+  }
+  mounts[i].dev = dev;
+  mounts[i].supported = supported;
+  enif_rwlock_rwunlock(mounts_lock);
+}
+
+/**
+ * Gets store of \a file for reading. Missing store holds no attributes.
+ *
+ * \retval store Store, or `NULL` if it does not exist.
+ */
+static bool read_store(const dirstore_file_t *file, store_t **store) {
+  if (!get_store(file, false, store)) {
+    if (errno != ENOENT) {
+      return false;
+    }
+    errno = 0;
+    *store = NULL;
+  }
+  return true;
+}
+
+/**
+ * Calls \a fun for every live attribute of \a file, newest first.
+ */
+static bool each_attr(store_t *store, const dirstore_file_t *file,
+                      bool (*fun)(ErlNifEnv *, const record_t *, void *),
+                      ErlNifEnv *env, void *acc) {
+  store_header_t *header = header_of(store);
+  const record_t *rec;
+  ErlNifUInt64 bucket = file_hash(file) & (header->buckets - 1);
+  ErlNifUInt64 off = LOAD_ACQUIRE(&file_heads(store)[bucket]);
+  ErlNifUInt64 tail;
+  ErlNifUInt64 newer;
+  bool live;
+
+  if (!published_tail(store, &tail)) {
+    return false;
+  }
+
+  newer = tail;
+  while (off != 0 && (rec = record_at(store, off, newer, tail)) != NULL) {
+    if (same_file(rec, file) &&
+        (!is_live(store, file, rec, &live) || (live && !fun(env, rec, acc)))) {
+      return false;
+    }
+    newer = off;
+    off = rec->next_file;
+  }
+
+  return true;
+}
+
+typedef struct {
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM rest;
+} list_acc_t;
+
+static bool list_one(ErlNifEnv *env, const record_t *rec, void *acc) {
+  list_acc_t *result = acc;
+  ERL_NIF_TERM name;
+  name_type_t type = name_type(record_name(rec), rec->name_len);
+  size_t len = rec->name_len - NAME_TAG_LENGTH;
+
+  switch (type) {
+  case NAME_CHUNK: return true;
+  case NAME_STRING:
+    memcpy(enif_make_new_binary(env, len, &name),
+           record_name(rec) + NAME_TAG_LENGTH, len);
+    result->list = enif_make_list_cell(env, name, result->list);
+    return true;
+  case NAME_ATOM:
+    add_atom_name(env, record_name(rec) + NAME_TAG_LENGTH, len,
+                  &result->list, &result->rest);
+    return true;
+  default: errno = EILSEQ; return false;
+  }
+}
+
+bool dirstore_list(ErlNifEnv *env, const dirstore_file_t *file,
+                   ERL_NIF_TERM *list, ERL_NIF_TERM *rest) {
+  list_acc_t acc;
+  store_t *store;
+  bool result = true;
+
+  if (!read_store(file, &store)) {
+    return false;
+  }
+
+  acc.list = enif_make_list(env, 0);
+  acc.rest = enif_make_list(env, 0);
+  if (store != NULL) {
+    result = each_attr(store, file, list_one, env, &acc);
+    release_store(store);
+  }
+
+  if (result) {
+    *list = acc.list;
+    *rest = acc.rest;
+  }
+  return result;
+}
+
+typedef struct {
+  ERL_NIF_TERM map;
+  ERL_NIF_TERM rest;
+} getall_acc_t;
+
+static bool getall_one(ErlNifEnv *env, const record_t *rec, void *acc) {
+  getall_acc_t *result = acc;
+  ERL_NIF_TERM name;
+  ERL_NIF_TERM key;
+  ERL_NIF_TERM value;
+  name_type_t type = name_type(record_name(rec), rec->name_len);
+  size_t len = rec->name_len - NAME_TAG_LENGTH;
+
+  switch (type) {
+  case NAME_CHUNK: return true;
+  case NAME_STRING:
+  case NAME_ATOM: break;
+  default: errno = EILSEQ; return false;
+  }
+
+  memcpy(enif_make_new_binary(env, len, &name),
+         record_name(rec) + NAME_TAG_LENGTH, len);
+  memcpy(enif_make_new_binary(env, rec->value_len, &value), record_value(rec),
+         rec->value_len);
+
+  key = name;
+  if (type == NAME_ATOM &&
+      !make_name_atom(env, record_name(rec) + NAME_TAG_LENGTH, len, &key)) {
+    result->rest = enif_make_list_cell(env, enif_make_tuple2(env, name, value),
+                                       result->rest);
+    return true;
+  }
+
+  enif_make_map_put(env, result->map, key, value, &result->map);
+  return true;
+}
+
+bool dirstore_getall(ErlNifEnv *env, const dirstore_file_t *file,
+                     ERL_NIF_TERM *map, ERL_NIF_TERM *rest) {
+  getall_acc_t acc;
+  store_t *store;
+  bool result = true;
+
+  if (!read_store(file, &store)) {
+    return false;
+  }
+
+  acc.map = enif_make_new_map(env);
+  acc.rest = enif_make_list(env, 0);
+  if (store != NULL) {
+    result = each_attr(store, file, getall_one, env, &acc);
+    release_store(store);
+  }
+
+  *map = acc.map;
+  *rest = acc.rest;
+  return result;
+}
+
+typedef struct {
+  dirstore_visit_t visit;
+  void *acc;
+} each_acc_t;
+
+static bool each_one(UNUSED ErlNifEnv *env, const record_t *rec, void *acc) {
+  each_acc_t *each = acc;
+  return each->visit(each->acc, record_name(rec), rec->name_len,
+                     record_value(rec), rec->value_len);
+}
+
+bool dirstore_each(const dirstore_file_t *file, dirstore_visit_t visit,
+                   void *acc) {
+  each_acc_t each;
+  store_t *store;
+  bool result = true;
+
+  if (!read_store(file, &store)) {
+    return false;
+  }
+
+  if (store != NULL) {
+    each.visit = visit;
+    each.acc = acc;
+    result = each_attr(store, file, each_one, NULL, &each);
+    release_store(store);
+  }
+
+  return result;
+}
+
+bool dirstore_has(const dirstore_file_t *file, const char *name,
+                  bool *result) {
+  const record_t *rec;
+  store_t *store;
+  bool found = true;
+  int saved_errno;
+
+  if (!read_store(file, &store)) {
+    return false;
+  }
+
+  *result = false;
+  if (store != NULL) {
+    found = find_record(store, file, name, strlen(name), &rec);
+    *result = found && rec != NULL && (rec->flags & RECORD_REMOVED) == 0;
+    saved_errno = errno;
+    release_store(store);
+    errno = saved_errno;
+  }
+  return found;
+}
+
+bool dirstore_get(ErlNifEnv *env, const dirstore_file_t *file,
+                  const char *name, ERL_NIF_TERM *value) {
+  const record_t *rec = NULL;
+  store_t *store;
+  int saved_errno;
+
+  if (!read_store(file, &store)) {
+    return false;
+  }
+
+  if (store != NULL) {
+    if (!find_record(store, file, name, strlen(name), &rec)) {
+      saved_errno = errno;
+      release_store(store);
+      errno = saved_errno;
+      return false;
+    }
+    if (rec != NULL && (rec->flags & RECORD_REMOVED) == 0) {
+      memcpy(enif_make_new_binary(env, rec->value_len, value),
+             record_value(rec), rec->value_len);
+    } else {
+      rec = NULL;
+    }
+    release_store(store);
+  }
+
+  if (rec == NULL) {
+    errno = ENODATA;
+    return false;
+  }
+  return true;
+}
+
+bool dirstore_set(const dirstore_file_t *file, const char *name,
+                  const ErlNifBinary *value, set_mode_t mode) {
+  check_t check = CHECK_NONE;
+  bool matched;
+
+  if (value == NULL || mode == SET_REPLACE) {
+    check = CHECK_PRESENT;
+  } else if (mode == SET_CREATE) {
+    check = CHECK_ABSENT;
+  }
+
+  if (!update(file, name, value, check, NULL, &matched)) {
+    return false;
+  }
+
+  if (!matched) {
+    errno = check == CHECK_ABSENT ? EEXIST : ENODATA;
+    return false;
+  }
+  return true;
+}
+
+bool dirstore_cas(const dirstore_file_t *file, const char *name,
+                  const ErlNifBinary *expected, const ErlNifBinary *value,
+                  bool *swapped) {
+  check_t check = expected != NULL ? CHECK_EQUAL : CHECK_ABSENT;
+
+  return update(file, name, value, check, expected, swapped);
+}
+
+#else
+
+/*
+ * Directory stores rely on Linux file system semantics, elsewhere the store is
+ * never enabled
+ */
+
+#include <errno.h>
+
+bool dirstore_init(UNUSED ErlNifEnv *env, UNUSED ERL_NIF_TERM load_info) {
+  return true;
+}
+
+void dirstore_destroy(void) {}
+
+bool dirstore_enabled(void) { return false; }
+
+bool dirstore_forced(UNUSED const char *path) { return false; }
+
+bool dirstore_stat(UNUSED int fd, UNUSED const char *path,
+                   UNUSED dirstore_file_t *file) {
+  errno = ENOTSUP;
+  return false;
+}
+
+int dirstore_mount(UNUSED ErlNifUInt64 dev) { return 1; }
+
+void dirstore_set_mount(UNUSED ErlNifUInt64 dev, UNUSED bool supported) {}
+
+bool dirstore_list(UNUSED ErlNifEnv *env, UNUSED const dirstore_file_t *file,
+                   UNUSED ERL_NIF_TERM *list, UNUSED ERL_NIF_TERM *rest) {
+  errno = ENOTSUP;
+  return false;
+}
+
+bool dirstore_has(UNUSED const dirstore_file_t *file, UNUSED const char *name,
+                  UNUSED bool *result) {
+  errno = ENOTSUP;
+  return false;
+}
+
+bool dirstore_get(UNUSED ErlNifEnv *env, UNUSED const dirstore_file_t *file,
+                  UNUSED const char *name, UNUSED ERL_NIF_TERM *value) {
+  errno = ENOTSUP;
+  return false;
+}
+
+bool dirstore_getall(UNUSED ErlNifEnv *env, UNUSED const dirstore_file_t *file,
+                     UNUSED ERL_NIF_TERM *map, UNUSED ERL_NIF_TERM *rest) {
+  errno = ENOTSUP;
+  return false;
+}
+
+bool dirstore_set(UNUSED const dirstore_file_t *file, UNUSED const char *name,
+                  UNUSED const ErlNifBinary *value, UNUSED set_mode_t mode) {
+  errno = ENOTSUP;
+  return false;
+}
+
+bool dirstore_cas(UNUSED const dirstore_file_t *file, UNUSED const char *name,
+                  UNUSED const ErlNifBinary *expected,
+                  UNUSED const ErlNifBinary *value, UNUSED bool *swapped) {
+  errno = ENOTSUP;
+  return false;
+}
+
+bool dirstore_each(UNUSED const dirstore_file_t *file,
+                   UNUSED dirstore_visit_t visit, UNUSED void *acc) {
+  errno = ENOTSUP;
+  return false;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef ELIXIR_XATTR_DIRSTORE_H
+#define ELIXIR_XATTR_DIRSTORE_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+#include "impl.h"
+
+/**
+ * Identity of a file whose attributes are kept in the store of its
+ * directory. Generation tells apart files which reused the same inode.
+ */
+typedef struct {
+  /** Path of the file, its directory holds the store */
+  const char *path;
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  ErlNifUInt64 gen;
+} dirstore_file_t;
+
+/**
+ * Reads `dir_store` (boolean) and `dir_store_force` (list of directories)
+ * options from NIF \a load_info map. The store is disabled if the first one
+ * is missing.
+ *
+ * \return `false` if an option is malformed or locks cannot be created.
+ */
+bool dirstore_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Unmaps all stores. Called from NIF `unload` callback.
+ */
+void dirstore_destroy(void);
+
+/**
+ * Checks whether the store has been enabled in `dirstore_init`.
+ */
+bool dirstore_enabled(void);
+
+/**
+ * Checks whether directory of \a path, as given, has been listed in
+ * `dir_store_force` option, so that its files use the store on any mount.
+ */
+bool dirstore_forced(const char *path);
+
+/**
+ * Fills \a file with identity of file at \a path, opened as \a fd (or `-1`
+ * to access it by path). \a path has to outlive \a file.
+ */
+bool dirstore_stat(int fd, const char *path, dirstore_file_t *file);
+
+/**
+ * Looks up whether mount \a dev is known to support user attributes.
+ *
+ * \return `1` if it does, `0` if it does not, `-1` if it has not been probed.
+ */
+int dirstore_mount(ErlNifUInt64 dev);
+
+/**
+ * Records result of probing mount \a dev for user attributes.
+ */
+void dirstore_set_mount(ErlNifUInt64 dev, bool supported);
+
+/*
+ * Attribute operations, with semantics of their `*xattr_impl` counterparts.
+ * Names are tagged and not prefixed.
+ */
+
+bool dirstore_list(ErlNifEnv *env, const dirstore_file_t *file,
+                   ERL_NIF_TERM *list, ERL_NIF_TERM *rest);
+
+bool dirstore_has(const dirstore_file_t *file, const char *name,
+                  bool *result);
+
+bool dirstore_get(ErlNifEnv *env, const dirstore_file_t *file,
+                  const char *name, ERL_NIF_TERM *value);
+
+bool dirstore_getall(ErlNifEnv *env, const dirstore_file_t *file,
+                     ERL_NIF_TERM *map, ERL_NIF_TERM *rest);
+
+/**
+ * Sets attribute \a name to \a value, or removes it if \a value is `NULL`.
+ */
+bool dirstore_set(const dirstore_file_t *file, const char *name,
+                  const ErlNifBinary *value, set_mode_t mode);
+
+bool dirstore_cas(const dirstore_file_t *file, const char *name,
+                  const ErlNifBinary *expected, const ErlNifBinary *value,
+                  bool *swapped);
+
+/**
+ * Called by `dirstore_each` for every attribute, with tagged name of \a len
+ * bytes (not NUL-terminated). Returning `false` stops the walk.
+ */
+typedef bool (*dirstore_visit_t)(void *acc, const char *name, size_t len,
+                                 const unsigned char *value, size_t size);
+
+/**
+ * Calls \a visit for every attribute of \a file, chunks of large values
+ * included, newest first.
+ */
+bool dirstore_each(const dirstore_file_t *file, dirstore_visit_t visit,
+                   void *acc);
+
+#endif
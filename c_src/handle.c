@@ -0,0 +1,573 @@
+#include "handle.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "listing.h"
+#include "util.h"
+
+struct xattr_handle {
+  /** Held for reading by operations, for writing by close */
+  ErlNifRWLock *lock;
+  /** Wrapped file, `NULL` once the handle is closed */
+  xattr_file_t *file;
+  sched_mount_t *mount;
+};
+
+static ErlNifResourceType *handle_type = NULL;
+
+/*
+ * Closer thread
+ *
+ * Files of garbage collected handles are closed by a thread of their own, as
+ * destructors run on whichever scheduler collects the handle and close(2) may
+ * block (e.g. flushing to a remote server). The lock and condition are
+ * destroyed only while no handle exists, as handles may outlive the library
+ * they were opened by.
+ */
+
+typedef struct closing {
+  struct closing *next;
+  xattr_file_t *file;
+} closing_t;
+
+static ErlNifMutex *closer_lock = NULL;
+static ErlNifCond *closer_cond = NULL;
+static ErlNifTid closer_tid;
+static bool closer_running = false;
+static bool closer_stopping = false;
+static closing_t *closing = NULL;
+static size_t live_handles = 0;
+
+static void close_files(closing_t *node) {
+  closing_t *next;
+
+  for (; node != NULL; node = next) {
+    next = node->next;
+    closexattr_impl(node->file);
+    enif_free(node);
+  }
+}
+
+static void *closer_main(UNUSED void *arg) {
+  closing_t *node;
+
+  enif_mutex_lock(closer_lock);
+  for (;;) {
+    while (closing == NULL && !closer_stopping) {
+      enif_cond_wait(closer_cond, closer_lock);
+    }
+
+    /* files queued before stop are still closed */
+    if ((node = closing) == NULL) {
+      break;
+    }
+    closing = NULL;
+
+    enif_mutex_unlock(closer_lock);
+    close_files(node);
+    enif_mutex_lock(closer_lock);
+  }
+  enif_mutex_unlock(closer_lock);
+
+  return NULL;
+}
+
+static void handle_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  xattr_handle_t *handle = obj;
+  xattr_file_t *file = handle->file;
+  closing_t *node;
+
+  if (handle->lock != NULL) {
+    enif_rwlock_destroy(handle->lock);
+  }
+
+  enif_mutex_lock(closer_lock);
+  if (file != NULL && closer_running &&
+      (node = enif_alloc(sizeof(closing_t))) != NULL) {
+    node->file = file;
+    node->next = closing;
+    closing = node;
+    enif_cond_signal(closer_cond);
+    file = NULL;
+  }
+  live_handles--;
+  enif_mutex_unlock(closer_lock);
+
+  /* the closer has been stopped with the library, or memory is short */
+  if (file != NULL) {
+    closexattr_impl(file);
+  }
+}
+
+bool handle_init(ErlNifEnv *env) {
+  handle_type = enif_open_resource_type(env, NULL, "xattr_handle", handle_dtor,
+                                        ERL_NIF_RT_CREATE, NULL);
+  if (handle_type == NULL) {
+    return false;
+  }
+
+  if (closer_lock == NULL) {
+    closer_lock = enif_mutex_create("xattr_closer");
+  }
+  if (closer_cond == NULL) {
+    closer_cond = enif_cond_create("xattr_closer");
+  }
+  if (closer_lock == NULL || closer_cond == NULL) {
+    handle_destroy();
+    return false;
+  }
+
+  closer_stopping = false;
+  if (enif_thread_create("xattr_closer", &closer_tid, closer_main, NULL,
+                         NULL) != 0) {
+    handle_destroy();
+    return false;
+  }
+  closer_running = true;
+
+  return true;
+}
+
+void handle_destroy(void) {
+  bool in_use = false;
+
+  if (closer_lock != NULL && closer_cond != NULL) {
+    enif_mutex_lock(closer_lock);
+    if (closer_running) {
+      closer_stopping = true;
+      closer_running = false;
+      enif_cond_signal(closer_cond);
+      enif_mutex_unlock(closer_lock);
+
+      /* the thread must not outlive the library code it runs */
+      enif_thread_join(closer_tid, NULL);
+      enif_mutex_lock(closer_lock);
+    }
+    in_use = live_handles > 0;
+    enif_mutex_unlock(closer_lock);
+  }
+
+  /* destructors of remaining handles still take the lock */
+  if (in_use) {
+    return;
+  }
+
+  if (closer_cond != NULL) {
+    enif_cond_destroy(closer_cond);
+    closer_cond = NULL;
+  }
+  if (closer_lock != NULL) {
+    enif_mutex_destroy(closer_lock);
+    closer_lock = NULL;
+  }
+}
+
+bool handle_get(ErlNifEnv *env, ERL_NIF_TERM term, xattr_handle_t **handle) {
+  return enif_get_resource(env, term, handle_type, (void **)handle);
+}
+
+xattr_file_t *handle_lock(xattr_handle_t *handle) {
+  enif_rwlock_rlock(handle->lock);
+
+  if (handle->file == NULL) {
+    enif_rwlock_runlock(handle->lock);
+    return NULL;
+  }
+
+  return handle->file;
+}
+
+void handle_unlock(xattr_handle_t *handle) {
+  enif_rwlock_runlock(handle->lock);
+}
+
+sched_mount_t *handle_mount(xattr_handle_t *handle) { return handle->mount; }
+
+ERL_NIF_TERM make_closed_tuple(ErlNifEnv *env) {
+  return make_error_tuple(env, atom_closed);
+}
+
+/*
+ * NIF bodies
+ */
+
+static ERL_NIF_TERM do_open(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM result;
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+
+  if (argc != 1) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_path_arg(env, argv[0], path, &result)) {
+    return result;
+  }
+
+  if (!openxattr_impl(env, path, &file)) {
+    return make_errno_tuple(env);
+  }
+
+  handle = enif_alloc_resource(handle_type, sizeof(xattr_handle_t));
+  if (handle == NULL) {
+    closexattr_impl(file);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  enif_mutex_lock(closer_lock);
+  live_handles++;
+  enif_mutex_unlock(closer_lock);
+
+  handle->file = file;
+  handle->mount = sched_lookup(path, strlen(path));
+  handle->lock = enif_rwlock_create("xattr_handle");
+  if (handle->lock == NULL) {
+    /* destructor closes the file */
+    enif_release_resource(handle);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  result = enif_make_resource(env, handle);
+  enif_release_resource(handle);
+
+  return make_ok_tuple(env, result);
+}
+
+static ERL_NIF_TERM do_flistxattr(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  xattr_listing_t listing;
+  ERL_NIF_TERM error;
+
+  if (argc != 1 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!flisting_begin_impl(env, file, &listing)) {
+    error = make_errno_tuple(env);
+    handle_unlock(handle);
+    return error;
+  }
+
+  handle_unlock(handle);
+
+  /* names are decoded without the file, the handle can be closed meanwhile */
+  return listing_run(env, "flistxattr_nif", &listing);
+}
+
+static ERL_NIF_TERM do_fgetallxattr(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  ERL_NIF_TERM map;
+  ERL_NIF_TERM rest;
+  ERL_NIF_TERM result;
+
+  if (argc != 1 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fgetallxattr_impl(env, file, &map, &rest)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = make_ok_rest_tuple(env, map, rest);
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_fhasxattr(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM result;
+  bool has;
+
+  if (argc != 2 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[1], name, &result)) {
+    return result;
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fhasxattr_impl(env, file, name, &has)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = make_ok_tuple(env, make_bool(env, has));
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_fgetxattr(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM value;
+  ERL_NIF_TERM result;
+
+  if (argc != 2 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[1], name, &result)) {
+    return result;
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fgetxattr_impl(env, file, name, &value)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = make_ok_tuple(env, value);
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_fsetxattr(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+  ERL_NIF_TERM result;
+
+  if (argc != 3 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[1], name, &result)) {
+    return result;
+  }
+
+  if (!enif_inspect_binary(env, argv[2], &value)) {
+    return enif_make_badarg(env);
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fsetxattr_impl(env, file, name, value)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = atom_ok;
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_fsetxattr_mode(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+  ERL_NIF_TERM result;
+  set_mode_t mode;
+
+  if (argc != 4 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[1], name, &result)) {
+    return result;
+  }
+
+  if (!enif_inspect_binary(env, argv[2], &value) ||
+      !get_set_mode_arg(env, argv[3], &mode)) {
+    return enif_make_badarg(env);
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fsetxattr_mode_impl(env, file, name, value, mode)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = atom_ok;
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_fcasxattr(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary expected;
+  ErlNifBinary value;
+  ERL_NIF_TERM result;
+  bool absent;
+  bool swapped;
+
+  if (argc != 4 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[1], name, &result)) {
+    return result;
+  }
+
+  absent = enif_is_identical(argv[2], atom_nil);
+  if ((!absent && !enif_inspect_binary(env, argv[2], &expected)) ||
+      !enif_inspect_binary(env, argv[3], &value)) {
+    return enif_make_badarg(env);
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fcasxattr_impl(env, file, name, absent ? NULL : &expected, value,
+                      &swapped)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = make_ok_tuple(env, make_bool(env, swapped));
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_fremovexattr(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM result;
+
+  if (argc != 2 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[1], name, &result)) {
+    return result;
+  }
+
+  if ((file = handle_lock(handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  if (!fremovexattr_impl(env, file, name)) {
+    result = make_errno_tuple(env);
+  } else {
+    result = atom_ok;
+  }
+
+  handle_unlock(handle);
+  return result;
+}
+
+static ERL_NIF_TERM do_close(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]) {
+  xattr_handle_t *handle;
+  xattr_file_t *file;
+
+  if (argc != 1 || !handle_get(env, argv[0], &handle)) {
+    return enif_make_badarg(env);
+  }
+
+  if (enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER) {
+    /* operations in progress may take long, wait for them on dirty scheduler
+     * instead */
+    if (enif_rwlock_tryrwlock(handle->lock) != 0) {
+      return enif_schedule_nif(env, "close_nif", ERL_NIF_DIRTY_JOB_IO_BOUND,
+                               do_close, argc, argv);
+    }
+  } else {
+    /* waits for operations in progress */
+    enif_rwlock_rwlock(handle->lock);
+  }
+
+  file = handle->file;
+  handle->file = NULL;
+  enif_rwlock_rwunlock(handle->lock);
+
+  if (file != NULL) {
+    closexattr_impl(file);
+  }
+
+  return atom_ok;
+}
+
+/*
+ * Exported NIFs
+ */
+
+ERL_NIF_TERM open_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "open_nif", do_open, argc, argv);
+}
+
+ERL_NIF_TERM close_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "close_nif", do_close, argc, argv);
+}
+
+ERL_NIF_TERM flistxattr_nif(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "flistxattr_nif", do_flistxattr, argc, argv);
+}
+
+ERL_NIF_TERM fgetallxattr_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fgetallxattr_nif", do_fgetallxattr, argc, argv);
+}
+
+ERL_NIF_TERM fhasxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fhasxattr_nif", do_fhasxattr, argc, argv);
+}
+
+ERL_NIF_TERM fgetxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fgetxattr_nif", do_fgetxattr, argc, argv);
+}
+
+ERL_NIF_TERM fsetxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fsetxattr_nif", do_fsetxattr, argc, argv);
+}
+
+ERL_NIF_TERM fsetxattr_mode_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fsetxattr_mode_nif", do_fsetxattr_mode, argc, argv);
+}
+
+ERL_NIF_TERM fcasxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fcasxattr_nif", do_fcasxattr, argc, argv);
+}
+
+ERL_NIF_TERM fremovexattr_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "fremovexattr_nif", do_fremovexattr, argc, argv);
+}
@@ -0,0 +1,102 @@
+#ifndef ELIXIR_XATTR_HANDLE_H
+#define ELIXIR_XATTR_HANDLE_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+#include "impl.h"
+#include "sched.h"
+
+/**
+ * Resource wrapping file opened for extended attribute access. The file is
+ * closed either explicitly, or by resource destructor when the handle is
+ * garbage collected.
+ */
+typedef struct xattr_handle xattr_handle_t;
+
+/**
+ * Registers handle resource type and starts the thread which closes files of
+ * garbage collected handles. Called from NIF `load` callback.
+ */
+bool handle_init(ErlNifEnv *env);
+
+/**
+ * Stops the closer thread, after it has closed files queued so far. Files of
+ * handles collected later are closed by their destructors.
+ */
+void handle_destroy(void);
+
+/**
+ * Gets handle resource from \a term.
+ *
+ * \return `false` if \a term is not a handle.
+ */
+bool handle_get(ErlNifEnv *env, ERL_NIF_TERM term, xattr_handle_t **handle);
+
+/**
+ * Locks \a handle for use, so that it cannot be closed in the meantime.
+ *
+ * \return File wrapped by handle, or `NULL` if handle has been closed
+ *         (handle is not locked then).
+ */
+xattr_file_t *handle_lock(xattr_handle_t *handle);
+
+/**
+ * Unlocks handle previously locked with `handle_lock`.
+ */
+void handle_unlock(xattr_handle_t *handle);
+
+/**
+ * Returns mount which file wrapped by \a handle lives on.
+ */
+sched_mount_t *handle_mount(xattr_handle_t *handle);
+
+/**
+ * Constructs `{:error, :closed}` tuple.
+ */
+ERL_NIF_TERM make_closed_tuple(ErlNifEnv *env);
+
+/** @spec open_nif(binary) :: {:ok, reference} | {:error, term} */
+ERL_NIF_TERM open_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/** @spec close_nif(reference) :: :ok */
+ERL_NIF_TERM close_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/** @spec flistxattr_nif(reference) ::
+ *          {:ok, list} | {:ok, list, list(binary)} | {:error, term} */
+ERL_NIF_TERM flistxattr_nif(ErlNifEnv *env, int argc,
+                            const ERL_NIF_TERM argv[]);
+
+/** @spec fgetallxattr_nif(reference) ::
+ *          {:ok, map} | {:ok, map, list({binary, binary})} | {:error, term} */
+ERL_NIF_TERM fgetallxattr_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]);
+
+/** @spec fhasxattr_nif(reference, binary) ::
+ *          {:ok, boolean} | {:error, term} */
+ERL_NIF_TERM fhasxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]);
+
+/** @spec fgetxattr_nif(reference, binary) :: {:ok, binary} | {:error, term} */
+ERL_NIF_TERM fgetxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]);
+
+/** @spec fsetxattr_nif(reference, binary, binary) :: :ok | {:error, term} */
+ERL_NIF_TERM fsetxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]);
+
+/** @spec fsetxattr_mode_nif(reference, binary, binary, :create | :replace) ::
+ *          :ok | {:error, term} */
+ERL_NIF_TERM fsetxattr_mode_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+/** @spec fcasxattr_nif(reference, binary, binary | nil, binary) ::
+ *          {:ok, boolean} | {:error, term} */
+ERL_NIF_TERM fcasxattr_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]);
+
+/** @spec fremovexattr_nif(reference, binary) :: :ok | {:error, term} */
+ERL_NIF_TERM fremovexattr_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]);
+
+#endif
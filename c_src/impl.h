@@ -11,15 +11,21 @@
  * Retrieves the list of extended attribute names associated with the given
  * \a path in the filesystem.
  *
- * The retrieved list is placed in \a list, an Erlang list of attribute names.
+ * The retrieved list is placed in \a list, an Erlang list of decoded
+ * attribute names: binaries for string names and atoms for atom names.
  *
  * \return On success, `true` is returned. On failure, `false` is returned and
- *         `errno` is set appropriately.
+ *         `errno` is set appropriately; a name with malformed type tag fails
+ *         with `EILSEQ`.
  *
  * \retval list On success, list of attribute names is returned.
  *              On failure, this value is left untouched.
+ * \retval rest On success, list of binary atom names whose atoms could not be
+ *              made natively (see `make_name_atom`), usually empty. On
+ *              failure, this value is left untouched.
  */
-bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list);
+bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list,
+                    ERL_NIF_TERM *rest);
 
 /**
  * Checks whether there is extended attribute associated with given \a path in
@@ -38,17 +44,17 @@ bool hasxattr_impl(ErlNifEnv *env, const char *path, const char *name,
 /**
  * Retrieves the value of the extended attribute identified by \a name and
  * associated with the given \a path in the filesystem. The attribute value is
- * placed in the binary pointed to by \a bin.
+ * placed in the binary term pointed to by \a value.
  *
  * \return On success, `true` is returned. On failure, `false` is returned and
  *         `errno` is set appropriately.
  *
- * \retval bin On success, attribute value is written to binary pointed by
- *             this argument, which is reallocated if needed.
- *             On failure, this value is not guaranteed to be left untouched.
+ * \retval value On success, binary term holding attribute value, sized
+ *               exactly to the value. On failure, this value is left
+ *               untouched.
  */
 bool getxattr_impl(ErlNifEnv *env, const char *path, const char *name,
-                   ErlNifBinary *bin);
+                   ERL_NIF_TERM *value);
 
 /**
  * Sets the \a value of the extended attribute identified by \a name and
@@ -60,6 +66,53 @@ bool getxattr_impl(ErlNifEnv *env, const char *path, const char *name,
 bool setxattr_impl(ErlNifEnv *env, const char *path, const char *name,
                    const ErlNifBinary value);
 
+/**
+ * Condition under which `setxattr_mode_impl` writes the value, mapped to flags
+ * of setxattr(2).
+ */
+typedef enum {
+  /** Create the attribute or replace its value */
+  SET_ANY,
+  /** Fail with `EEXIST` if the attribute already exists (`XATTR_CREATE`) */
+  SET_CREATE,
+  /** Fail with `ENODATA` if the attribute does not exist (`XATTR_REPLACE`) */
+  SET_REPLACE
+} set_mode_t;
+
+/**
+ * Sets the \a value of the extended attribute identified by \a name, like
+ * `setxattr_impl`, but only if the condition given by \a mode holds. The check
+ * and the write are done atomically by the filesystem.
+ *
+ * \return On success, `true` is returned. On failure, `false` is returned and
+ *         `errno` is set appropriately.
+ */
+bool setxattr_mode_impl(ErlNifEnv *env, const char *path, const char *name,
+                        const ErlNifBinary value, set_mode_t mode);
+
+/**
+ * Sets the extended attribute identified by \a name to \a value if its
+ * current value equals \a expected, or if it does not exist when \a expected
+ * is `NULL`.
+ *
+ * The read and the write are done under a lock of the inode (see
+ * `inode_lock`), so concurrent calls on the same file are serialized. Other
+ * writers are not excluded, but a concurrent removal or creation of the
+ * attribute is still detected, as the value is written with `SET_REPLACE` or
+ * `SET_CREATE` mode.
+ *
+ * \return On success, `true` is returned. On failure, `false` is returned and
+ *         `errno` is set appropriately. A value which does not match is not a
+ *         failure.
+ *
+ * \retval swapped On success, this value is set to `true` if the value has
+ *                 been written, otherwise `false`. On failure, this value is
+ *                 left untouched.
+ */
+bool casxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   const ErlNifBinary *expected, const ErlNifBinary value,
+                   bool *swapped);
+
 /**
  * Removes the extended attribute identified by \a name and associated with the
  * given \a path in the filesystem.
@@ -69,6 +122,204 @@ bool setxattr_impl(ErlNifEnv *env, const char *path, const char *name,
  */
 bool removexattr_impl(ErlNifEnv *env, const char *path, const char *name);
 
+/**
+ * Retrieves names and values of all extended attributes associated with the
+ * given \a path in the filesystem, opening it only once.
+ *
+ * \return On success, `true` is returned. On failure, `false` is returned and
+ *         `errno` is set appropriately.
+ *
+ * \retval map On success, map of decoded attribute names to their values.
+ *             On failure, this value is left untouched.
+ * \retval rest On success, list of `{name, value}` tuples of atom-named
+ *              attributes whose atoms could not be made natively (see
+ *              `make_name_atom`), usually empty. On failure, this value is
+ *              left untouched.
+ */
+bool getallxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *map,
+                      ERL_NIF_TERM *rest);
+
+/*
+ * File handle interface
+ *
+ * Functions below operate on a file opened once with `openxattr_impl`, so that
+ * batch operations resolve the path only once. Semantics of each function are
+ * the same as of its path-based counterpart above.
+ */
+
+/**
+ * Opaque handle to a file opened for extended attribute access. Its layout is
+ * private to the backend.
+ */
+typedef struct xattr_file xattr_file_t;
+
+/**
+ * Opens file at \a path for extended attribute access.
+ *
+ * \return On success, `true` is returned. On failure, `false` is returned and
+ *         `errno` is set appropriately.
+ *
+ * \retval file On success, newly allocated handle which has to be released
+ *              with `closexattr_impl`. On failure, this value is left
+ *              untouched.
+ */
+bool openxattr_impl(ErlNifEnv *env, const char *path, xattr_file_t **file);
+
+/**
+ * Wraps file descriptor \a fd, already opened by the caller, for extended
+ * attribute access; the descriptor is closed by `closexattr_impl`. With \a fd
+ * of `-1`, attributes are accessed by \a path. Unix only, on Windows it fails
+ * with `ERROR_NOT_SUPPORTED`.
+ *
+ * \return On success, `true` is returned. On failure, `false` is returned and
+ *         `errno` is set appropriately; \a fd is left open then.
+ *
+ * \retval file On success, newly allocated handle which has to be released
+ *              with `closexattr_impl`. On failure, this value is left
+ *              untouched.
+ */
+bool fdopenxattr_impl(ErlNifEnv *env, int fd, const char *path,
+                      xattr_file_t **file);
+
+/**
+ * Closes \a file and releases its memory.
+ */
+void closexattr_impl(xattr_file_t *file);
+
+bool flistxattr_impl(ErlNifEnv *env, xattr_file_t *file, ERL_NIF_TERM *list,
+                     ERL_NIF_TERM *rest);
+
+bool fhasxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    bool *result);
+
+bool fgetxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    ERL_NIF_TERM *value);
+
+bool fgetallxattr_impl(ErlNifEnv *env, xattr_file_t *file, ERL_NIF_TERM *map,
+                       ERL_NIF_TERM *rest);
+
+bool fsetxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    const ErlNifBinary value);
+
+bool fsetxattr_mode_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                         const ErlNifBinary value, set_mode_t mode);
+
+bool fcasxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    const ErlNifBinary *expected, const ErlNifBinary value,
+                    bool *swapped);
+
+bool fremovexattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name);
+
+/*
+ * Stepwise listing
+ *
+ * Functions below split `listxattr_impl` into reading of names, done at once,
+ * and building of the list, done in steps, so that callers can yield the
+ * scheduler between them. Backends which build the whole list when reading
+ * leave no steps to do.
+ */
+
+/**
+ * Listing of attribute names in progress. Terms are valid only in the
+ * environment they have been made in; a caller which continues the listing in
+ * another call has to pass them along and restore them.
+ */
+typedef struct {
+  /** Names in backend format, decoded up to `offset` */
+  const char *names;
+  size_t size;
+  size_t offset;
+  /** Memory owned by the listing, `data` is `NULL` if there is none */
+  ErlNifBinary owned;
+  /** Offset of next string name in `strings` */
+  size_t strings_offset;
+  /** Decoded names and binary atom names, as returned by `listxattr_impl` */
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM rest;
+  /** Binary holding all string names, which are made its sub-binaries */
+  ERL_NIF_TERM strings;
+} xattr_listing_t;
+
+/**
+ * Reads names of attributes of \a file into \a listing, checking that all of
+ * them are well-formed. Semantics of errors are the same as of
+ * `listxattr_impl`. On success, \a listing has to be released with
+ * `listing_end_impl`.
+ */
+bool flisting_begin_impl(ErlNifEnv *env, xattr_file_t *file,
+                         xattr_listing_t *listing);
+
+bool listing_begin_impl(ErlNifEnv *env, const char *path,
+                        xattr_listing_t *listing);
+
+/**
+ * Decodes at most \a max next names of \a listing into its terms.
+ *
+ * \return `true` if all names have been decoded.
+ */
+bool listing_step_impl(ErlNifEnv *env, xattr_listing_t *listing, size_t max);
+
+/**
+ * Moves names of \a listing out of buffers owned by calling thread, so that
+ * it can be continued on another thread.
+ *
+ * \return `false` with `errno` set to `ERANGE` if memory cannot be allocated.
+ */
+bool listing_detach_impl(xattr_listing_t *listing);
+
+/**
+ * Releases memory of \a listing; it can be called more than once.
+ */
+void listing_end_impl(xattr_listing_t *listing);
+
+/*
+ * Batched operations
+ *
+ * Functions below apply the same operation to \a count attributes of \a file,
+ * so that backends able to submit many operations at once can do so. Result of
+ * each operation is stored in \a results as returned by NIFs: `{:ok, boolean}`,
+ * `{:ok, binary}` or `:ok` on success and error tuple on failure.
+ */
+
+void fhasxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], ERL_NIF_TERM results[]);
+
+void fgetxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], ERL_NIF_TERM results[]);
+
+void fsetxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], const ErlNifBinary values[],
+                         ERL_NIF_TERM results[]);
+
+/*
+ * Copying
+ */
+
+/**
+ * Flags of `copyxattr_impl`.
+ */
+typedef enum {
+  /** Remove attributes of destination which source does not have, and write
+   * only values which differ */
+  COPY_SYNC = 1,
+  /** Create or truncate destination and copy contents of source, a regular
+   * file, to it first; implies `COPY_SYNC` */
+  COPY_DATA = 2
+} copy_flag_t;
+
+/**
+ * Copies all extended attributes, chunks of large values included, of file at
+ * \a src to file at \a dst, opening each of them only once. Values are copied
+ * decoded and written as configured for \a dst, so compression settings of
+ * the source do not carry over. \a flags is a combination of `copy_flag_t`.
+ *
+ * \return On success, `true` is returned. On failure, `false` is returned and
+ *         `errno` is set appropriately; attributes written before the failure
+ *         are left in place.
+ */
+bool copyxattr_impl(ErlNifEnv *env, const char *src, const char *dst,
+                    int flags);
+
 /**
  * Constructs Erlang tuple representing system error.
  */
@@ -0,0 +1,411 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "impl_uring.h"
+
+#include <string.h>
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+/* Extended attribute opcodes (Linux 5.19), older headers do not know them */
+#define URING_OP_FSETXATTR 41
+#define URING_OP_SETXATTR 42
+#define URING_OP_FGETXATTR 43
+#define URING_OP_GETXATTR 44
+
+#define DEFAULT_DEPTH 64
+#define MAX_DEPTH 1024
+
+#define LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/**
+ * Submission queue entry, laid out as `struct io_uring_sqe` with fields used
+ * by extended attribute operations, which older headers lack.
+ */
+typedef struct {
+  __u8 opcode;
+  __u8 flags;
+  __u16 ioprio;
+  __s32 fd;
+  /** Value buffer */
+  __u64 off;
+  /** Attribute name */
+  __u64 addr;
+  /** Value size */
+  __u32 len;
+  /** `XATTR_CREATE` / `XATTR_REPLACE` */
+  __u32 xattr_flags;
+  __u64 user_data;
+  __u16 buf_index;
+  __u16 personality;
+  __s32 splice_fd_in;
+  /** Path, for operations not on file descriptor */
+  __u64 addr3;
+  __u64 pad;
+} uring_sqe_t;
+
+typedef struct uring {
+  struct uring *next;
+  int fd;
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  uring_sqe_t *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  uring_op_t ops[1];
+} uring_t;
+
+static size_t depth = 0;
+
+/* Rings are owned by threads via TSD, and linked together so that they can be
+ * released on unload. Threads on which ring setup failed hold `unavailable`,
+ * so that it is not retried on every call. */
+static ErlNifTSDKey ring_key;
+static ErlNifMutex *ring_lock = NULL;
+static uring_t *ring_list = NULL;
+static uring_t unavailable;
+
+/*
+ * Rings
+ */
+
+static bool probe(void) {
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  size_t size = sizeof(struct io_uring_probe) +
+                (URING_OP_GETXATTR + 1) * sizeof(struct io_uring_probe_op);
+  bool result = false;
+  int fd;
+  int op;
+
+  memset(&params, 0, sizeof(params));
+  if ((fd = syscall(__NR_io_uring_setup, 1, &params)) == -1) {
+    return false;
+  }
+
+  if ((probe = enif_alloc(size)) != NULL) {
+    memset(probe, 0, size);
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                URING_OP_GETXATTR + 1) == 0 &&
+        probe->last_op >= URING_OP_GETXATTR) {
+      result = true;
+      for (op = URING_OP_FSETXATTR; op <= URING_OP_GETXATTR; op++) {
+        result = result && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+      }
+    }
+    enif_free(probe);
+  }
+
+  close(fd);
+  return result;
+}
+
+static void free_ring(uring_t *ring) {
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_size);
+  }
+  if (ring->sq_ptr != NULL) {
+    munmap(ring->sq_ptr, ring->sq_size);
+  }
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+  enif_free(ring);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static uring_t *new_ring(void) {
+  struct io_uring_params params;
+  uring_t *ring;
+  char *sq;
+  char *cq;
+
+  if ((ring = enif_alloc(sizeof(uring_t) +
+                         (depth - 1) * sizeof(uring_op_t))) == NULL) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(uring_t));
+
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = syscall(__NR_io_uring_setup, depth, &params)) == -1) {
+    free_ring(ring);
+    return NULL;
+  }
+
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) {
+      ring->sq_size = ring->cq_size;
+    }
+    ring->cq_size = ring->sq_size;
+  }
+
+  if ((ring->sq_ptr = map_ring(ring->fd, ring->sq_size, IORING_OFF_SQ_RING)) ==
+      NULL) {
+    free_ring(ring);
+    return NULL;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+  } else if ((ring->cq_ptr = map_ring(ring->fd, ring->cq_size,
+                                      IORING_OFF_CQ_RING)) == NULL) {
+    free_ring(ring);
+    return NULL;
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(uring_sqe_t);
+  if ((ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES)) ==
+      NULL) {
+    free_ring(ring);
+    return NULL;
+  }
+
+  sq = ring->sq_ptr;
+  cq = ring->cq_ptr;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return ring;
+}
+
+/**
+ * Drops ring of calling thread, replacing it with \a replacement, e.g. after
+ * a failure which may have left requests in flight. Closing the ring cancels
+ * them.
+ */
+static void drop_ring(uring_t *ring, uring_t *replacement) {
+  uring_t **ptr;
+
+  enif_mutex_lock(ring_lock);
+  for (ptr = &ring_list; *ptr != ring; ptr = &(*ptr)->next) {
+  }
+  *ptr = ring->next;
+  enif_mutex_unlock(ring_lock);
+
+  free_ring(ring);
+  enif_tsd_set(ring_key, replacement);
+}
+
+/*
+ * Public interface
+ */
+
+bool uring_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM value;
+  ErlNifUInt64 number = DEFAULT_DEPTH;
+  char enabled[8] = "true";
+
+  depth = 0;
+
+  if (enif_is_map(env, load_info)) {
+    if (enif_get_map_value(env, load_info, enif_make_atom(env, "uring"),
+                           &value) &&
+        !enif_get_atom(env, value, enabled, sizeof(enabled), ERL_NIF_LATIN1)) {
+      return false;
+    }
+
+    if (enif_get_map_value(env, load_info, enif_make_atom(env, "uring_depth"),
+                           &value) &&
+        (!enif_get_uint64(env, value, &number) || number == 0 ||
+         number > MAX_DEPTH)) {
+      return false;
+    }
+  }
+
+  if (strcmp(enabled, "true") != 0 || !probe()) {
+    return true;
+  }
+
+  if (enif_tsd_key_create("xattr_uring", &ring_key) != 0) {
+    return false;
+  }
+
+  if ((ring_lock = enif_mutex_create("xattr_uring")) == NULL) {
+    enif_tsd_key_destroy(ring_key);
+    return false;
+  }
+
+  depth = number;
+  return true;
+}
+
+void uring_destroy(void) {
+  uring_t *next;
+
+  if (depth == 0) {
+    return;
+  }
+
+  while (ring_list != NULL) {
+    next = ring_list->next;
+    free_ring(ring_list);
+    ring_list = next;
+  }
+
+  enif_mutex_destroy(ring_lock);
+  ring_lock = NULL;
+  enif_tsd_key_destroy(ring_key);
+  depth = 0;
+}
+
+void uring_release(void) {
+  uring_t *ring;
+
+  if (depth == 0 || (ring = enif_tsd_get(ring_key)) == NULL) {
+    return;
+  }
+
+  if (ring == &unavailable) {
+    enif_tsd_set(ring_key, NULL);
+  } else {
+    drop_ring(ring, NULL);
+  }
+}
+
+size_t uring_depth(void) { return depth; }
+
+uring_op_t *uring_ops(void) {
+  uring_t *ring;
+
+  if (depth == 0) {
+    return NULL;
+  }
+
+  if ((ring = enif_tsd_get(ring_key)) == NULL) {
+    if ((ring = new_ring()) == NULL) {
+      enif_tsd_set(ring_key, &unavailable);
+      return NULL;
+    }
+
+    enif_mutex_lock(ring_lock);
+    ring->next = ring_list;
+    ring_list = ring;
+    enif_mutex_unlock(ring_lock);
+
+    enif_tsd_set(ring_key, ring);
+  }
+
+  return ring == &unavailable ? NULL : ring->ops;
+}
+
+bool uring_run(uring_kind_t kind, int fd, const char *path, size_t count) {
+  uring_t *ring = enif_tsd_get(ring_key);
+  struct io_uring_cqe *cqe;
+  uring_sqe_t *sqe;
+  unsigned tail = *ring->sq_tail;
+  unsigned head;
+  unsigned index;
+  size_t submitted = 0;
+  size_t completed = 0;
+  size_t i;
+  long ret;
+
+  for (i = 0; i < count; i++) {
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(uring_sqe_t));
+
+    if (fd == -1) {
+      sqe->opcode = kind == URING_GET ? URING_OP_GETXATTR : URING_OP_SETXATTR;
+      sqe->addr3 = (unsigned long)path;
+    } else {
+      sqe->opcode = kind == URING_GET ? URING_OP_FGETXATTR : URING_OP_FSETXATTR;
+      sqe->fd = fd;
+    }
+    sqe->addr = (unsigned long)ring->ops[i].name;
+    sqe->off = (unsigned long)ring->ops[i].value;
+    sqe->len = ring->ops[i].size;
+    sqe->user_data = i;
+
+    ring->sq_array[index] = index;
+    tail++;
+  }
+  STORE_RELEASE(ring->sq_tail, tail);
+
+  while (completed < count) {
+    ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+                  count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      drop_ring(ring, &unavailable);
+      return false;
+    }
+    submitted += ret;
+
+    head = *ring->cq_head;
+    while (head != LOAD_ACQUIRE(ring->cq_tail)) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      ring->ops[cqe->user_data].result = cqe->res;
+      head++;
+      completed++;
+    }
+    STORE_RELEASE(ring->cq_head, head);
+  }
+
+  return true;
+}
+
+#else
+
+bool uring_init(UNUSED ErlNifEnv *env, UNUSED ERL_NIF_TERM load_info) {
+  return true;
+}
+
+void uring_destroy(void) {}
+
+void uring_release(void) {}
+
+size_t uring_depth(void) { return 0; }
+
+uring_op_t *uring_ops(void) { return NULL; }
+
+bool uring_run(UNUSED uring_kind_t kind, UNUSED int fd,
+               UNUSED const char *path, UNUSED size_t count) {
+  return false;
+}
+
+#endif
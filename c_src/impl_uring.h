@@ -0,0 +1,74 @@
+#ifndef ELIXIR_XATTR_IMPL_URING_H
+#define ELIXIR_XATTR_IMPL_URING_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+/* Size of full attribute names in operations, leaving room for namespace */
+#define URING_NAME_SIZE (NAME_BUFFER_SIZE + 64)
+
+typedef enum { URING_GET, URING_SET } uring_kind_t;
+
+/**
+ * Single extended attribute operation submitted through io_uring.
+ */
+typedef struct {
+  /** Full NUL-terminated attribute name, including namespace */
+  char name[URING_NAME_SIZE];
+  /** Buffer for read value, or value to be written */
+  void *value;
+  size_t size;
+  /** Syscall result: value size, `0`, or negated `errno` */
+  long result;
+} uring_op_t;
+
+/**
+ * Reads `uring` (boolean) and `uring_depth` options from NIF \a load_info
+ * map and probes whether the kernel supports extended attribute operations
+ * in io_uring (Linux 5.19+). If it does not, io_uring is silently disabled.
+ *
+ * \return `false` if options are malformed.
+ */
+bool uring_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Releases rings of all threads.
+ */
+void uring_destroy(void);
+
+/**
+ * Releases ring of calling thread, if it has one. Called by threads which
+ * exit before the library is unloaded.
+ */
+void uring_release(void);
+
+/**
+ * Returns maximum number of operations submitted at once, or `0` if io_uring
+ * is disabled.
+ */
+size_t uring_depth(void);
+
+/**
+ * Returns array of `uring_depth()` operations owned by calling thread,
+ * setting up its ring on first use.
+ *
+ * \return Operations, or `NULL` if io_uring is disabled or the ring could not
+ *         be set up.
+ */
+uring_op_t *uring_ops(void);
+
+/**
+ * Submits first \a count operations from `uring_ops()` array of \a kind on
+ * file descriptor \a fd, or on \a path if \a fd is `-1`, and waits until all
+ * of them complete. Values read by `URING_GET` operations with `0` size are
+ * not stored, only their size is returned.
+ *
+ * \return `false` if the operations could not be submitted; their results
+ *         are undefined then and the caller should fall back to syscalls.
+ */
+bool uring_run(uring_kind_t kind, int fd, const char *path, size_t count);
+
+#endif
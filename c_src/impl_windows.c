@@ -1,5 +1,6 @@
 #include "impl.h"
 
+#include "adstore.h"
 #include "util.h"
 #include <stdint.h>
 #include <string.h>
@@ -141,205 +142,157 @@ static int get_data_stream(const char *filepath, bool ro, bool create,
 }
 
 /*
- * Xattr file parser
+ * Attribute store I/O
+ *
+ * Stream format is implemented by the portable engine in `adstore.c`, which
+ * reaches the stream through these callbacks.
  */
 
-typedef enum { XEVT_ERROR, XEVT_EOF, XEVT_NAME, XEVT_VALUE } xevt_type_t;
-
-typedef struct {
-  xevt_type_t type;
-  size_t size;
-  void *data;
-} xevt_t;
-
-typedef struct {
-  HANDLE h;
-  ErlNifBinary buffer;
-  bool on_value;
-  bool skip_values;
-} xparser_t;
+static bool stream_read(void *ctx, uint32_t offset, void *buff, size_t size) {
+  DWORD nb_read = 0;
+  OVERLAPPED ov;
 
-static bool xparser_init(xparser_t *p, HANDLE file_handle, bool skip_values) {
-  p->h = file_handle;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = offset;
 
-  if (!enif_alloc_binary(512, &p->buffer)) {
-    SetLastError(ERR_ENIF_ALLOC);
+  if (!ReadFile((HANDLE)ctx, buff, (DWORD)size, &nb_read, &ov)) {
     return false;
   }
 
-  p->on_value = false;
-  p->skip_values = skip_values;
+  // stream has been truncated by someone else
+  if (nb_read != size) {
+    SetLastError(ERR_INVALID_FORMAT);
+    return false;
+  }
 
   return true;
 }
 
-static void xparser_release(xparser_t *p) { enif_release_binary(&p->buffer); }
+static bool stream_write(void *ctx, uint32_t offset, const void *buff,
+                         size_t size) {
+  DWORD nb_written = 0;
+  OVERLAPPED ov;
 
-static bool xparser_next(xparser_t *p, xevt_t *evt) {
-  DWORD fptr;
-  DWORD last_error;
-  DWORD nb_read = 0;
-  uint32_t block_size = 0;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset = offset;
 
-  memset(evt, 0, sizeof(*evt));
+  return WriteFile((HANDLE)ctx, buff, (DWORD)size, &nb_written, &ov) &&
+         nb_written == size;
+}
 
-  // read block size
-  if (!ReadFile(p->h, &block_size, sizeof(uint32_t), &nb_read, NULL)) {
-    evt->type = XEVT_ERROR;
-    return false;
-  }
+static bool stream_size(void *ctx, uint32_t *size) {
+  LARGE_INTEGER li;
 
-  // check whether we haven't reached EOF
-  if (nb_read == 0) {
-    evt->type = XEVT_EOF;
+  if (!GetFileSizeEx((HANDLE)ctx, &li)) {
     return false;
   }
 
-  // check we have read whole uint32
-  if (nb_read != sizeof(uint32_t)) {
-    evt->type = XEVT_ERROR;
+  if (li.QuadPart > UINT32_MAX) {
     SetLastError(ERR_INVALID_FORMAT);
     return false;
   }
 
-  if (p->skip_values && p->on_value) {
-    // skip value
-
-    fptr = SetFilePointer(p->h, (LONG)block_size, NULL, FILE_CURRENT);
-    last_error = GetLastError();
-
-    if (fptr == INVALID_SET_FILE_POINTER) {
-      evt->type = XEVT_ERROR;
-      SetLastError(last_error);
-      return false;
-    }
-
-    p->on_value = !p->on_value;
-    // and retry, we are now parsing name
-    return xparser_next(p, evt);
-  } else {
-    // read name/value and store it in buffer
-
-    // ensure our buffer is large enough
-    if (block_size + 1 > p->buffer.size) {
-      if (!enif_realloc_binary(&p->buffer, block_size + 1)) {
-        evt->type = XEVT_ERROR;
-        SetLastError(ERR_ENIF_ALLOC);
-        return false;
-      }
-    }
+  *size = (uint32_t)li.QuadPart;
+  return true;
+}
 
-    // we allow empty blocks
-    if (block_size > 0) {
-      // read block
-      if (!ReadFile(p->h, p->buffer.data, block_size, &nb_read, NULL)) {
-        evt->type = XEVT_ERROR;
-        return false;
-      }
-
-      // check whether we have read whole block
-      if (nb_read != block_size) {
-        evt->type = XEVT_ERROR;
-        SetLastError(ERR_INVALID_FORMAT);
-        return false;
-      }
-    }
+static bool stream_truncate(void *ctx, uint32_t size) {
+  LARGE_INTEGER li;
 
-    evt->type = (p->on_value ? XEVT_VALUE : XEVT_NAME);
-    evt->size = block_size;
-    evt->data = (void *)p->buffer.data;
+  li.QuadPart = size;
+  return SetFilePointerEx((HANDLE)ctx, li, NULL, FILE_BEGIN) &&
+         SetEndOfFile((HANDLE)ctx);
+}
 
-    p->on_value = !p->on_value;
-    return true;
-  }
+static void stream_io(HANDLE ds, adstore_io_t *io) {
+  io->ctx = ds;
+  io->read = stream_read;
+  io->write = stream_write;
+  io->size = stream_size;
+  io->truncate = stream_truncate;
 }
 
-/*
- * Xattr write functions
+/**
+ * Closes \a ds, preserving the error reported by the store.
  */
+static bool close_stream(HANDLE ds, adstore_result_t result) {
+  DWORD last_error = GetLastError();
 
-bool write_block(HANDLE file_handle, const void *data, uint32_t size) {
-  bool r;
-  DWORD nb_written;
+  CloseHandle(ds);
 
-  r = WriteFile(file_handle, &size, sizeof(size), &nb_written, NULL);
-  if (!r) {
-    return false;
+  switch (result) {
+  case ADSTORE_OK: return true;
+  case ADSTORE_NOATTR: SetLastError(ERR_NOATTR); break;
+  case ADSTORE_EXISTS: SetLastError(ERROR_FILE_EXISTS); break;
+  case ADSTORE_INVALID: SetLastError(ERR_INVALID_FORMAT); break;
+  case ADSTORE_NOMEM: SetLastError(ERR_ENIF_ALLOC); break;
+  default: SetLastError(last_error); break;
   }
 
-  /* FIXME: what if we haven't written everything? */
-
-  r = WriteFile(file_handle, data, size, &nb_written, NULL);
-  return r;
-}
-
-bool write_binary(HANDLE file_handle, const ErlNifBinary bin) {
-  return write_block(file_handle, bin.data, (uint32_t)bin.size);
-}
-
-bool write_cstring(HANDLE file_handle, const char *str) {
-  return write_block(file_handle, str, (strlen(str) + 1) * sizeof(char));
+  return false;
 }
 
 /*
  * Implementation functions
  */
 
-bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list) {
-  DWORD last_error;
+typedef struct {
+  ErlNifEnv *env;
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM rest;
+} list_acc_t;
+
+static adstore_result_t list_visit(void *acc, const char *name, size_t len,
+                                   const unsigned char *value, size_t size) {
+  list_acc_t *a = acc;
   ERL_NIF_TERM entry;
+
+  switch (name_type(name, len)) {
+  case NAME_CHUNK: return ADSTORE_OK;
+  case NAME_STRING:
+    len -= NAME_TAG_LENGTH;
+    memcpy(enif_make_new_binary(a->env, len, &entry), name + NAME_TAG_LENGTH,
+           len);
+    a->list = enif_make_list_cell(a->env, entry, a->list);
+    return ADSTORE_OK;
+  case NAME_ATOM:
+    add_atom_name(a->env, name + NAME_TAG_LENGTH, len - NAME_TAG_LENGTH,
+                  &a->list, &a->rest);
+    return ADSTORE_OK;
+  default:
+    // compressed values are never written on Windows
+    return ADSTORE_INVALID;
+  }
+}
+
+bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list,
+                    ERL_NIF_TERM *rest) {
+  adstore_io_t io;
+  list_acc_t acc;
   HANDLE ds;
   int result;
-  xevt_t evt;
-  xparser_t parser;
 
   result = get_data_stream(path,
                            true,  // read-only
                            false, // do not create if not exists
                            &ds);
   if (result == 0) {
-    // Xattr stream exists
+    acc.env = env;
+    acc.list = enif_make_list(env, 0);
+    acc.rest = enif_make_list(env, 0);
 
-    if (!xparser_init(&parser, ds, true)) {
-      last_error = GetLastError();
-      CloseHandle(ds);
-      SetLastError(last_error);
+    stream_io(ds, &io);
+    if (!close_stream(ds, adstore_each(&io, list_visit, &acc))) {
       return false;
     }
 
-    *list = enif_make_list(env, 0);
-
-    while (xparser_next(&parser, &evt)) {
-      if (evt.type == XEVT_NAME) {
-        entry = make_elixir_string(env, (char *)evt.data);
-        *list = enif_make_list_cell(env, entry, *list);
-      } else {
-        fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-      }
-    }
-
-    last_error = GetLastError();
-
-    if (evt.type == XEVT_EOF) {
-      xparser_release(&parser);
-      CloseHandle(ds);
-      return true;
-    } else {
-      xparser_release(&parser);
-      CloseHandle(ds);
-
-      if (evt.type != XEVT_ERROR) {
-        fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-        SetLastError(ERR_INVALID_FORMAT);
-      } else {
-        SetLastError(last_error);
-      }
-
-      return false;
-    }
+    *list = acc.list;
+    *rest = acc.rest;
+    return true;
   } else if (result == -1) {
     // Return empty list if there is no xattr stream
     *list = enif_make_list(env, 0);
+    *rest = enif_make_list(env, 0);
     return true;
   } else {
     // Error
@@ -349,62 +302,126 @@ bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list) {
 
 bool hasxattr_impl(ErlNifEnv *env, const char *path, const char *name,
                    bool *returnValue) {
-  DWORD last_error;
+  adstore_io_t io;
+  adstore_result_t found;
+  adstore_value_t value;
   HANDLE ds;
   int result;
-  xevt_t evt;
-  xparser_t parser;
 
   result = get_data_stream(path,
                            true,  // read-only
                            false, // do not create if not exists
                            &ds);
   if (result == 0) {
-    // Xattr stream exists
+    stream_io(ds, &io);
+    found = adstore_find(&io, name, &value);
+    *returnValue = found == ADSTORE_OK;
+    return close_stream(ds, found == ADSTORE_NOATTR ? ADSTORE_OK : found);
+  } else if (result == -1) {
+    // Return false if there is no xattr stream
+    *returnValue = false;
+    return true;
+  } else {
+    // Error
+    return false;
+  }
+}
 
-    if (!xparser_init(&parser, ds, true)) {
-      last_error = GetLastError();
-      CloseHandle(ds);
-      SetLastError(last_error);
-      return false;
-    }
+bool getxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   ERL_NIF_TERM *value) {
+  adstore_io_t io;
+  adstore_result_t found;
+  adstore_value_t location;
+  HANDLE ds;
+  int result;
 
-    while (xparser_next(&parser, &evt)) {
-      if (evt.type == XEVT_NAME) {
-        if (strcmp(name, (char *)evt.data) == 0) {
-          xparser_release(&parser);
-          CloseHandle(ds);
-          *returnValue = true;
-          return true;
-        }
-      } else {
-        fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-      }
+  result = get_data_stream(path,
+                           true,  // read-only
+                           false, // do not create if not exists
+                           &ds);
+  if (result == 0) {
+    stream_io(ds, &io);
+    found = adstore_find(&io, name, &location);
+    if (found == ADSTORE_OK) {
+      // read straight into the binary returned to Erlang
+      found = adstore_read(
+          &io, &location, enif_make_new_binary(env, location.size, value));
     }
+    return close_stream(ds, found);
+  } else if (result == -1) {
+    // Return false if there is no xattr stream
+    SetLastError(ERR_NOATTR);
+    return false;
+  } else {
+    // Error
+    return false;
+  }
+}
 
-    last_error = GetLastError();
+typedef struct {
+  ErlNifEnv *env;
+  ERL_NIF_TERM map;
+  ERL_NIF_TERM rest;
+} getall_acc_t;
+
+static adstore_result_t getall_visit(void *acc, const char *name, size_t len,
+                                     const unsigned char *data, size_t size) {
+  getall_acc_t *a = acc;
+  ERL_NIF_TERM key;
+  ERL_NIF_TERM value;
+  name_type_t type = name_type(name, len);
+
+  if (type == NAME_CHUNK) {
+    return ADSTORE_OK;
+  } else if (type != NAME_STRING && type != NAME_ATOM) {
+    return ADSTORE_INVALID;
+  }
 
-    if (evt.type == XEVT_EOF) {
-      xparser_release(&parser);
-      CloseHandle(ds);
-      *returnValue = false;
-      return true;
-    } else {
-      xparser_release(&parser);
-      CloseHandle(ds);
+  len -= NAME_TAG_LENGTH;
+  name += NAME_TAG_LENGTH;
+  memcpy(enif_make_new_binary(a->env, size, &value), data, size);
+
+  if (type == NAME_STRING) {
+    memcpy(enif_make_new_binary(a->env, len, &key), name, len);
+  } else if (!make_name_atom(a->env, name, len, &key)) {
+    memcpy(enif_make_new_binary(a->env, len, &key), name, len);
+    a->rest = enif_make_list_cell(a->env, enif_make_tuple2(a->env, key, value),
+                                  a->rest);
+    return ADSTORE_OK;
+  }
+
+  enif_make_map_put(a->env, a->map, key, value, &a->map);
+  return ADSTORE_OK;
+}
 
-      if (evt.type != XEVT_ERROR) {
-        fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-        SetLastError(ERR_INVALID_FORMAT);
-      } else {
-        SetLastError(last_error);
-      }
+bool getallxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *map,
+                      ERL_NIF_TERM *rest) {
+  adstore_io_t io;
+  getall_acc_t acc;
+  HANDLE ds;
+  int result;
 
+  result = get_data_stream(path,
+                           true,  // read-only
+                           false, // do not create if not exists
+                           &ds);
+  if (result == 0) {
+    acc.env = env;
+    acc.map = enif_make_new_map(env);
+    acc.rest = enif_make_list(env, 0);
+
+    stream_io(ds, &io);
+    if (!close_stream(ds, adstore_each(&io, getall_visit, &acc))) {
       return false;
     }
+
+    *map = acc.map;
+    *rest = acc.rest;
+    return true;
   } else if (result == -1) {
-    // Return false if there is no xattr stream
-    *returnValue = false;
+    // No xattr stream means no attributes
+    *map = enif_make_new_map(env);
+    *rest = enif_make_list(env, 0);
     return true;
   } else {
     // Error
@@ -412,75 +429,90 @@ bool hasxattr_impl(ErlNifEnv *env, const char *path, const char *name,
   }
 }
 
-bool getxattr_impl(ErlNifEnv *env, const char *path, const char *name,
-                   ErlNifBinary *bin) {
-  bool found = false;
-  DWORD last_error;
+bool setxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   const ErlNifBinary value) {
+  return setxattr_mode_impl(env, path, name, value, SET_ANY);
+}
+
+bool setxattr_mode_impl(ErlNifEnv *env, const char *path, const char *name,
+                        const ErlNifBinary value, set_mode_t mode) {
+  adstore_io_t io;
   HANDLE ds;
   int result;
-  xevt_t evt;
-  xparser_t parser;
 
   result = get_data_stream(path,
-                           true,  // read-only
-                           false, // do not create if not exists
+                           false, // read & write
+                           true,  // create if not exists
                            &ds);
   if (result == 0) {
-    // Xattr stream exists
+    // Streams in v1 format are migrated on first write
+    stream_io(ds, &io);
+    return close_stream(ds,
+                        adstore_set(&io, name, value.data, value.size, mode));
+  } else {
+    // Error
+    return false;
+  }
+}
 
-    if (!xparser_init(&parser, ds, false)) {
-      last_error = GetLastError();
-      CloseHandle(ds);
-      SetLastError(last_error);
-      return false;
-    }
+bool casxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   const ErlNifBinary *expected, const ErlNifBinary value,
+                   bool *swapped) {
+  ERL_NIF_TERM current;
+  ErlNifBinary bin;
+  ErlNifMutex *lock;
+  ErlNifUInt64 hash = 0;
+  DWORD last_error = 0;
+  bool result = true;
+  const char *c;
+
+  // Streams have no inode numbers, so the lock is picked by path
+  for (c = path; *c != '\0'; c++) {
+    hash = hash * 31 + (unsigned char)*c;
+  }
 
-    while (xparser_next(&parser, &evt)) {
-      if (evt.type == XEVT_NAME) {
-        if (strcmp(name, (char *)evt.data) == 0) {
-          found = true;
-        }
-      } else if (evt.type == XEVT_VALUE) {
-        if (found) {
-          if (!enif_alloc_binary(evt.size, bin)) {
-            xparser_release(&parser);
-            CloseHandle(ds);
-            SetLastError(ERR_ENIF_ALLOC);
-            return false;
-          }
-
-          memcpy(bin->data, evt.data, evt.size);
-
-          xparser_release(&parser);
-          CloseHandle(ds);
-          return true;
-        }
-        // otherwise continue searching...
-      } else {
-        fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-      }
+  lock = inode_lock(0, hash);
+  enif_mutex_lock(lock);
+
+  if (expected != NULL) {
+    if (!getxattr_impl(env, path, name, &current)) {
+      last_error = GetLastError();
+      result = last_error == ERR_NOATTR;
+      *swapped = false;
+    } else {
+      enif_inspect_binary(env, current, &bin);
+      *swapped = bin.size == expected->size &&
+                 memcmp(bin.data, expected->data, bin.size) == 0;
     }
+  } else {
+    *swapped = true;
+  }
 
+  if (result && *swapped &&
+      !setxattr_mode_impl(env, path, name, value,
+                          expected != NULL ? SET_REPLACE : SET_CREATE)) {
     last_error = GetLastError();
+    result = last_error == ERR_NOATTR || last_error == ERROR_FILE_EXISTS;
+    *swapped = false;
+  }
 
-    if (evt.type == XEVT_EOF) {
-      xparser_release(&parser);
-      CloseHandle(ds);
-      SetLastError(ERR_NOATTR);
-      return false;
-    } else {
-      xparser_release(&parser);
-      CloseHandle(ds);
+  enif_mutex_unlock(lock);
+  SetLastError(result ? 0 : last_error);
+  return result;
+}
 
-      if (evt.type != XEVT_ERROR) {
-        fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-        SetLastError(ERR_INVALID_FORMAT);
-      } else {
-        SetLastError(last_error);
-      }
+bool removexattr_impl(ErlNifEnv *env, const char *path, const char *name) {
+  adstore_io_t io;
+  HANDLE ds;
+  int result;
 
-      return false;
-    }
+  result = get_data_stream(path,
+                           false, // read & write
+                           false, // do not create if not exists
+                           &ds);
+  if (result == 0) {
+    stream_io(ds, &io);
+    return close_stream(ds, adstore_remove(&io, name));
   } else if (result == -1) {
     // Return false if there is no xattr stream
     SetLastError(ERR_NOATTR);
@@ -491,244 +523,341 @@ bool getxattr_impl(ErlNifEnv *env, const char *path, const char *name,
   }
 }
 
-/**
- * Move attribute to the end of xattr file and place file pointer on beginning
- * of this attribute.
+/*
+ * File handle interface
  *
- * Returns false and sets last error to ERR_NOATTR if attribute wasn't found,
- * the pointer is then set to the EOF.
+ * Attribute stream is reopened on every operation, so handles only remember
+ * the path.
  */
-static bool move_attr_to_end(HANDLE ds, const char *name) {
-  bool found = false;
-  bool result;
-  DWORD last_error;
-  DWORD nb_read = 0;
-  DWORD nb_written = 0;
-  DWORD readptr;
-  DWORD writeptr;
-  DWORD window_width;
-  ErlNifBinary found_value;
-  void *buffer;
-  xevt_t evt;
-  xparser_t parser;
-
-  if (!xparser_init(&parser, ds, false)) {
+
+struct xattr_file {
+  char *path;
+};
+
+bool openxattr_impl(ErlNifEnv *env, const char *path, xattr_file_t **file) {
+  xattr_file_t *f;
+  LPWSTR wpath;
+  size_t len = strlen(path) + 1;
+
+  if (!utf8_to_ws(path, &wpath)) {
+    SetLastError(ERR_ENIF_ALLOC);
     return false;
   }
 
-  // skip all attributes until we find `name`
-  while (!found && xparser_next(&parser, &evt)) {
-    if (evt.type == XEVT_NAME) {
-      if (strcmp(name, (char *)evt.data) == 0) {
-        // we found our attribute
-
-        // read & save its value
-        result = xparser_next(&parser, &evt);
-        if (result && evt.type == XEVT_VALUE) {
-          if (!enif_alloc_binary(evt.size, &found_value)) {
-            xparser_release(&parser);
-            SetLastError(ERR_ENIF_ALLOC);
-            return false;
-          }
-
-          memcpy(evt.data, found_value.data, evt.size);
-        } else if (!result && evt.type == XEVT_EOF) {
-          xparser_release(&parser);
-          SetLastError(ERR_INVALID_FORMAT);
-          return false;
-        } else {
-          last_error = GetLastError();
-          xparser_release(&parser);
-          SetLastError(last_error);
-          return false;
-        }
-
-        found = true;
-      }
-    } else if (evt.type == XEVT_VALUE) {
-      // skip value
-    } else {
-      fprintf(stderr, "ElixirXattr: unexpected event %d\n", evt.type);
-    }
+  if (!file_exists(wpath)) {
+    enif_free(wpath);
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return false;
   }
 
-  if (!found) {
-    // previous loop has iterated over whole file or errored
-    if (evt.type == XEVT_EOF) {
-      xparser_release(&parser);
-      SetLastError(ERR_NOATTR);
-      return false;
-    } else {
-      last_error = GetLastError();
-      xparser_release(&parser);
-      SetLastError(last_error);
-      return false;
-    }
+  enif_free(wpath);
+
+  if ((f = enif_alloc(sizeof(xattr_file_t) + len)) == NULL) {
+    SetLastError(ERR_ENIF_ALLOC);
+    return false;
   }
 
-  // Release parser as we won't need it anymore
-  xparser_release(&parser);
+  f->path = (char *)(f + 1);
+  memcpy(f->path, path, len);
+
+  *file = f;
+  return true;
+}
+
+bool fdopenxattr_impl(ErlNifEnv *env, int fd, const char *path,
+                      xattr_file_t **file) {
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return false;
+}
 
-  // now compute window width = size of attribute representation
-  // and shift rest data in bursts of 4kb
-  window_width = sizeof(uint32_t) + (strlen(name) + 1) * sizeof(char) +
-                 sizeof(uint32_t) + found_value.size;
+void closexattr_impl(xattr_file_t *file) { enif_free(file); }
 
-  buffer = enif_alloc(4096);
-  if (buffer == NULL) {
-    enif_release_binary(&found_value);
-    SetLastError(ERR_ENIF_ALLOC);
+bool flistxattr_impl(ErlNifEnv *env, xattr_file_t *file, ERL_NIF_TERM *list,
+                     ERL_NIF_TERM *rest) {
+  return listxattr_impl(env, file->path, list, rest);
+}
+
+// Names are decoded while the stream is read, so listings have no steps.
+
+bool listing_begin_impl(ErlNifEnv *env, const char *path,
+                        xattr_listing_t *listing) {
+  listing->names = "";
+  listing->size = 0;
+  listing->offset = 0;
+  listing->owned.data = NULL;
+  listing->strings_offset = 0;
+  if (!listxattr_impl(env, path, &listing->list, &listing->rest)) {
     return false;
   }
+  listing->strings = listing->list;
+  return true;
+}
 
-  readptr = SetFilePointer(ds, 0, NULL, FILE_CURRENT);
+bool flisting_begin_impl(ErlNifEnv *env, xattr_file_t *file,
+                         xattr_listing_t *listing) {
+  return listing_begin_impl(env, file->path, listing);
+}
 
-  do {
-    readptr = SetFilePointer(ds, readptr, NULL, FILE_BEGIN);
-    if (readptr == INVALID_SET_FILE_POINTER) {
-      last_error = GetLastError();
-      enif_release_binary(&found_value);
-      enif_free(buffer);
-      SetLastError(last_error);
-      return false;
-    }
+bool listing_step_impl(ErlNifEnv *env, xattr_listing_t *listing, size_t max) {
+  return true;
+}
 
-    if (!ReadFile(ds, buffer, 4096, &nb_read, NULL)) {
-      last_error = GetLastError();
-      enif_release_binary(&found_value);
-      enif_free(buffer);
-      SetLastError(last_error);
-      return false;
-    }
+bool listing_detach_impl(xattr_listing_t *listing) { return true; }
 
-    readptr = SetFilePointer(ds, 0, NULL, FILE_CURRENT);
+void listing_end_impl(xattr_listing_t *listing) {}
 
-    writeptr = SetFilePointer(ds, -window_width - nb_read, NULL, FILE_CURRENT);
-    if (writeptr == INVALID_SET_FILE_POINTER) {
-      last_error = GetLastError();
-      enif_release_binary(&found_value);
-      enif_free(buffer);
-      SetLastError(last_error);
-      return false;
-    }
+bool fhasxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    bool *result) {
+  return hasxattr_impl(env, file->path, name, result);
+}
 
-    if (!WriteFile(ds, buffer, nb_read, &nb_written, NULL)) {
-      last_error = GetLastError();
-      enif_release_binary(&found_value);
-      enif_free(buffer);
-      SetLastError(last_error);
-      return false;
-    }
+bool fgetxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    ERL_NIF_TERM *value) {
+  return getxattr_impl(env, file->path, name, value);
+}
 
-    /* FIXME: what if we haven't written everything? */
-  } while (nb_read > 0);
+bool fgetallxattr_impl(ErlNifEnv *env, xattr_file_t *file, ERL_NIF_TERM *map,
+                       ERL_NIF_TERM *rest) {
+  return getallxattr_impl(env, file->path, map, rest);
+}
 
-  enif_free(buffer);
+bool fsetxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    const ErlNifBinary value) {
+  return setxattr_impl(env, file->path, name, value);
+}
 
-  // now write our attribute at the end of file
-  if (!write_cstring(ds, name)) {
-    last_error = GetLastError();
-    enif_release_binary(&found_value);
-    SetLastError(last_error);
-    return false;
+bool fsetxattr_mode_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                         const ErlNifBinary value, set_mode_t mode) {
+  return setxattr_mode_impl(env, file->path, name, value, mode);
+}
+
+bool fcasxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    const ErlNifBinary *expected, const ErlNifBinary value,
+                    bool *swapped) {
+  return casxattr_impl(env, file->path, name, expected, value, swapped);
+}
+
+bool fremovexattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name) {
+  return removexattr_impl(env, file->path, name);
+}
+
+/*
+ * Batched operations, done one by one as streams have no batch interface
+ */
+
+void fhasxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], ERL_NIF_TERM results[]) {
+  bool has;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    results[i] = fhasxattr_impl(env, file, names[i], &has)
+                     ? make_ok_tuple(env, make_bool(env, has))
+                     : make_errno_tuple(env);
   }
+}
 
-  if (!write_binary(ds, found_value)) {
-    last_error = GetLastError();
-    enif_release_binary(&found_value);
-    SetLastError(last_error);
-    return false;
+void fgetxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], ERL_NIF_TERM results[]) {
+  ERL_NIF_TERM value;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    results[i] = fgetxattr_impl(env, file, names[i], &value)
+                     ? make_ok_tuple(env, value)
+                     : make_errno_tuple(env);
+  }
+}
+
+void fsetxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], const ErlNifBinary values[],
+                         ERL_NIF_TERM results[]) {
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    results[i] = fsetxattr_impl(env, file, names[i], values[i])
+                     ? atom_ok
+                     : make_errno_tuple(env);
   }
+}
+
+/*
+ * Copying
+ */
 
-  // and move file pointer just before it
-  writeptr = SetFilePointer(ds, -window_width, NULL, FILE_CURRENT);
+typedef struct {
+  // Stream of the source, `NULL` if it has none
+  const adstore_io_t *src;
+  const adstore_io_t *dst;
+  bool sync;
+} copy_acc_t;
+
+static bool terminate_name(const char *name, size_t len, char *buff) {
+  if (len >= NAME_BUFFER_SIZE) {
+    return false;
+  }
 
-  enif_release_binary(&found_value);
+  memcpy(buff, name, len);
+  buff[len] = '\0';
   return true;
 }
 
-bool setxattr_impl(ErlNifEnv *env, const char *path, const char *name,
-                   const ErlNifBinary value) {
-  DWORD last_error;
-  HANDLE ds;
-  int result;
+/**
+ * Checks whether attribute \a name of \a io has \a size bytes of \a data.
+ */
+static adstore_result_t has_value(const adstore_io_t *io, const char *name,
+                                  const unsigned char *data, size_t size,
+                                  bool *equal) {
+  adstore_value_t location;
+  adstore_result_t result;
+  unsigned char *buff;
+
+  *equal = false;
+  result = adstore_find(io, name, &location);
+  if (result == ADSTORE_NOATTR) {
+    return ADSTORE_OK;
+  } else if (result != ADSTORE_OK || location.size != size) {
+    return result;
+  }
 
-  result = get_data_stream(path,
-                           false, // read & write
-                           true,  // create if not exists
-                           &ds);
-  if (result == 0) {
-    // Xattr stream exists
+  if ((buff = enif_alloc(size + 1)) == NULL) {
+    return ADSTORE_NOMEM;
+  }
 
-    // Move attribute to end of file so we can easily overwrite it.
-    if (!move_attr_to_end(ds, name)) {
-      last_error = GetLastError();
-      if (last_error != ERR_NOATTR) {
-        CloseHandle(ds);
-        SetLastError(last_error);
-        return false;
-      }
-    }
+  if ((result = adstore_read(io, &location, buff)) == ADSTORE_OK) {
+    *equal = memcmp(buff, data, size) == 0;
+  }
 
-    // Write name
-    if (!write_cstring(ds, name)) {
-      last_error = GetLastError();
-      CloseHandle(ds);
-      SetLastError(last_error);
-      return false;
-    }
+  enif_free(buff);
+  return result;
+}
 
-    // Write new value
-    if (!write_binary(ds, value)) {
-      last_error = GetLastError();
-      CloseHandle(ds);
-      SetLastError(last_error);
-      return false;
-    }
+static adstore_result_t copy_visit(void *acc, const char *name, size_t len,
+                                   const unsigned char *value, size_t size) {
+  copy_acc_t *a = acc;
+  adstore_result_t result;
+  char buff[NAME_BUFFER_SIZE];
+  bool equal = false;
 
-    // Truncate file if new value was shorter then existing one
-    SetEndOfFile(ds);
+  if (!terminate_name(name, len, buff)) {
+    return ADSTORE_INVALID;
+  }
 
-    CloseHandle(ds);
-    return true;
-  } else {
-    // Error
-    return false;
+  if (a->sync &&
+      (result = has_value(a->dst, buff, value, size, &equal)) != ADSTORE_OK) {
+    return result;
   }
+
+  return equal ? ADSTORE_OK : adstore_set(a->dst, buff, value, size, SET_ANY);
 }
 
-bool removexattr_impl(ErlNifEnv *env, const char *path, const char *name) {
+static adstore_result_t prune_visit(void *acc, const char *name, size_t len,
+                                    const unsigned char *value, size_t size) {
+  copy_acc_t *a = acc;
+  adstore_value_t location;
+  adstore_result_t result;
+  char buff[NAME_BUFFER_SIZE];
+
+  if (!terminate_name(name, len, buff)) {
+    return ADSTORE_INVALID;
+  }
+
+  // the walk goes over a copy of the stream, so removals do not disturb it
+  if (a->src != NULL &&
+      (result = adstore_find(a->src, buff, &location)) != ADSTORE_NOATTR) {
+    return result;
+  }
+
+  return adstore_remove(a->dst, buff);
+}
+
+// Copies contents of the file, attribute stream included
+static bool copy_file(const char *src, const char *dst) {
   DWORD last_error;
-  HANDLE ds;
-  int result;
+  LPWSTR wsrc;
+  LPWSTR wdst;
+  BOOL result;
 
-  result = get_data_stream(path,
-                           false, // read & write
-                           false, // do not create if not exists
-                           &ds);
-  if (result == 0) {
-    // Xattr stream exists
+  if (!utf8_to_ws(src, &wsrc)) {
+    SetLastError(ERR_ENIF_ALLOC);
+    return false;
+  }
 
-    // Move attribute to end of file and truncate file just before this attr.
-    if (!move_attr_to_end(ds, name)) {
-      last_error = GetLastError();
-      CloseHandle(ds);
-      SetLastError(last_error);
-      return false;
-    }
+  if (!utf8_to_ws(dst, &wdst)) {
+    enif_free(wsrc);
+    SetLastError(ERR_ENIF_ALLOC);
+    return false;
+  }
 
-    SetEndOfFile(ds);
+  result = CopyFileW(wsrc, wdst, FALSE);
+  last_error = GetLastError();
 
-    CloseHandle(ds);
-    return true;
-  } else if (result == -1) {
-    // Return false if there is no xattr stream
-    SetLastError(ERR_NOATTR);
+  enif_free(wsrc);
+  enif_free(wdst);
+
+  SetLastError(last_error);
+  return result;
+}
+
+bool copyxattr_impl(ErlNifEnv *env, const char *src, const char *dst,
+                    int flags) {
+  adstore_io_t src_io;
+  adstore_io_t dst_io;
+  adstore_result_t result = ADSTORE_OK;
+  copy_acc_t acc;
+  HANDLE src_ds;
+  HANDLE dst_ds;
+  DWORD last_error;
+  int src_result;
+  int dst_result;
+
+  // CopyFileW carries the stream over, the pass below only drops attributes
+  // of a destination stream it left in place
+  if ((flags & COPY_DATA) && !copy_file(src, dst)) {
     return false;
-  } else {
-    // Error
+  }
+
+  src_result = get_data_stream(src,
+                               true,  // read-only
+                               false, // do not create if not exists
+                               &src_ds);
+  if (src_result > 0) {
     return false;
   }
+
+  // Destination stream is created only if there is something to copy
+  dst_result = get_data_stream(dst,
+                               false, // read & write
+                               src_result == 0, &dst_ds);
+  if (dst_result != 0) {
+    if (src_result == 0) {
+      return close_stream(src_ds, ADSTORE_IO);
+    }
+    return dst_result == -1;
+  }
+
+  stream_io(dst_ds, &dst_io);
+  acc.src = NULL;
+  acc.dst = &dst_io;
+  acc.sync = (flags & (COPY_SYNC | COPY_DATA)) != 0;
+
+  if (src_result == 0) {
+    stream_io(src_ds, &src_io);
+    acc.src = &src_io;
+    result = adstore_each(&src_io, copy_visit, &acc);
+  }
+
+  if (result == ADSTORE_OK && acc.sync) {
+    result = adstore_each(&dst_io, prune_visit, &acc);
+  }
+
+  if (src_result == 0) {
+    last_error = GetLastError();
+    CloseHandle(src_ds);
+    SetLastError(last_error);
+  }
+
+  return close_stream(dst_ds, result);
 }
 
 static ERL_NIF_TERM fmt_win_error(ErlNifEnv *env, DWORD last_error) {
@@ -737,14 +866,14 @@ static ERL_NIF_TERM fmt_win_error(ErlNifEnv *env, DWORD last_error) {
   LPWSTR wbuff;
 
   if ((wbuff = enif_alloc(128)) == NULL) {
-    return make_atom(env, "badalloc");
+    return atom_badalloc;
   }
 
   StringCchPrintfW(wbuff, 128, L"Windows Error 0x%X", last_error);
 
   if (!ws_to_utf8(wbuff, &buff)) {
     enif_free(wbuff);
-    return make_atom(env, "badalloc");
+    return atom_badalloc;
   }
 
   result = enif_make_string(env, buff, ERL_NIF_LATIN1);
@@ -757,10 +886,11 @@ static ERL_NIF_TERM fmt_win_error(ErlNifEnv *env, DWORD last_error) {
 ERL_NIF_TERM make_errno_term(ErlNifEnv *env) {
   DWORD last_error = GetLastError();
   switch (last_error) {
-  case ERR_ENIF_ALLOC: return make_atom(env, "badalloc");
-  case ERR_INVALID_FORMAT: return make_atom(env, "invalfmt");
-  case ERR_NOATTR: return make_atom(env, "enoattr");
-  case ERROR_FILE_NOT_FOUND: return make_atom(env, "enoent");
+  case ERR_ENIF_ALLOC: return atom_badalloc;
+  case ERR_INVALID_FORMAT: return atom_invalfmt;
+  case ERR_NOATTR: return atom_enoattr;
+  case ERROR_FILE_NOT_FOUND: return atom_enoent;
+  case ERROR_FILE_EXISTS: return atom_eexist;
   default: return fmt_win_error(env, last_error);
   }
 }
@@ -1,189 +1,2392 @@
+#define _GNU_SOURCE
+
 #include "impl.h"
 
+#include "cache.h"
+#include "codec.h"
+#include "dirstore.h"
+#include "impl_uring.h"
+#include "index.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
 #include <sys/xattr.h>
+#include <unistd.h>
 
 #define NSUSER_PREFIX ("user.ElixirXattr.")
 #define NSUSER_LENGTH (sizeof(NSUSER_PREFIX) / sizeof(char) - 1)
 
+/* Type tag prepended to tagged names of compressed values */
+#define COMPRESSED_TAG ("z$")
+
+#define REAL_NAME_SIZE (NSUSER_LENGTH + NAME_TAG_LENGTH + NAME_BUFFER_SIZE)
+
+/* Values of files changed more recently than this are not cached, because
+ * another change within file system timestamp granularity would go unnoticed */
+#define CACHE_RACY_NS 20000000L
+
+/* Maximum number of bytes copied by single copy_file_range(2) call */
+#define COPY_RANGE_SIZE (1 << 30)
+
 #define TO_BOOL(result) ((result == 0) ? true : false)
 
+struct xattr_file {
+  /** File descriptor, or -1 if attributes are accessed by path */
+  int fd;
+  /** Path the file was opened at, as given by the caller */
+  const char *path;
+  /** Path attributes are accessed by if `fd` is -1; either `path`, or
+   *  `/proc/self/fd` link of `path_fd` */
+  const char *sys_path;
+  /** `O_PATH` descriptor of file which cannot be opened for reading, or -1 */
+  int path_fd;
+  char proc_path[32];
+  /** Canonical path for the index, resolved when the file is opened, or
+   *  `NULL` if files accessed by path resolve it on every change */
+  char *real_path;
+};
+
+static void path_file(xattr_file_t *file, const char *path) {
+  file->fd = -1;
+  file->path = path;
+  file->sys_path = path;
+  file->path_fd = -1;
+  file->real_path = NULL;
+}
+
+static int index_fd(xattr_file_t *file) {
+  return file->fd == -1 ? file->path_fd : file->fd;
+}
+
+static ssize_t file_listxattr(xattr_file_t *file, char *list, size_t size) {
+  ssize_t result = file->fd == -1 ? listxattr(file->sys_path, list, size)
+                                  : flistxattr(file->fd, list, size);
+
+  stats_syscall(list != NULL && result > 0 ? result : 0, 0);
+  return result;
+}
+
+static ssize_t file_getxattr(xattr_file_t *file, const char *name, void *value,
+                             size_t size) {
+  ssize_t result = file->fd == -1 ? getxattr(file->sys_path, name, value, size)
+                                  : fgetxattr(file->fd, name, value, size);
+
+  stats_syscall(value != NULL && result > 0 ? result : 0, 0);
+  return result;
+}
+
+static int file_setxattr(xattr_file_t *file, const char *name,
+                         const void *value, size_t size, int flags) {
+  int result = file->fd == -1
+                   ? setxattr(file->sys_path, name, value, size, flags)
+                   : fsetxattr(file->fd, name, value, size, flags);
+
+  stats_syscall(0, result == 0 ? size : 0);
+  return result;
+}
+
+static int file_removexattr(xattr_file_t *file, const char *name) {
+  int result = file->fd == -1 ? removexattr(file->sys_path, name)
+                              : fremovexattr(file->fd, name);
+
+  stats_syscall(0, 0);
+  return result;
+}
+
+/*
+ * Cache
+ */
+
+static bool file_stamp(xattr_file_t *file, cache_stamp_t *stamp) {
+  struct stat st;
+
+  stats_syscall(0, 0);
+  if (file->fd == -1) {
+    if (fstatat(AT_FDCWD, file->sys_path, &st, 0) == -1) {
+      return false;
+    }
+  } else if (fstat(file->fd, &st) == -1) {
+    return false;
+  }
+
+  stamp->dev = st.st_dev;
+  stamp->ino = st.st_ino;
+#ifdef __APPLE__
+  stamp->ctime_sec = st.st_ctimespec.tv_sec;
+  stamp->ctime_nsec = st.st_ctimespec.tv_nsec;
+#else
+  stamp->ctime_sec = st.st_ctim.tv_sec;
+  stamp->ctime_nsec = st.st_ctim.tv_nsec;
+#endif
+  return true;
+}
+
+static void cache_store(const cache_stamp_t *stamp, const char *name,
+                        const void *value, size_t size) {
+  struct timespec now;
+  long age_sec;
+
+  if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+    return;
+  }
+
+  age_sec = now.tv_sec - stamp->ctime_sec;
+  if (age_sec < 1 &&
+      age_sec * 1000000000L + now.tv_nsec - stamp->ctime_nsec <
+          CACHE_RACY_NS) {
+    return;
+  }
+
+  cache_put(stamp, name, value, size);
+}
+
+/**
+ * Drops cached value of attribute \a name of \a file after it was set to
+ * \a value, or removed if \a value is `NULL`, and updates the index. Change
+ * time would invalidate cached value anyway, this only frees memory early.
+ */
+static void note_change(xattr_file_t *file, const char *name,
+                        const ErlNifBinary *value) {
+  cache_stamp_t stamp;
+  char *real = file->real_path;
+  bool indexed = index_wants(name);
+  int saved_errno = errno;
+
+  if ((cache_enabled() || indexed) && file_stamp(file, &stamp)) {
+    if (cache_enabled()) {
+      cache_invalidate(&stamp, name);
+    }
+    if (indexed &&
+        (real != NULL || (real = index_resolve(index_fd(file), file->path)))) {
+      index_update(stamp.dev, stamp.ino, real, name, value);
+      if (real != file->real_path) {
+        enif_free(real);
+      }
+    }
+  }
+
+  errno = saved_errno;
+}
+
+/*
+ * Directory store
+ */
+
+/**
+ * Checks whether attributes of \a file are kept in the store of its directory,
+ * which happens when the store is enabled and the mount does not support user
+ * attributes. Mounts are probed on first access. If the file cannot be
+ * examined, the attribute call itself is left to report the error.
+ *
+ * \retval key Identity of the file in the store, if `true` is returned.
+ */
+static bool in_store(xattr_file_t *file, dirstore_file_t *key) {
+  int saved_errno = errno;
+  int supported;
+
+  if (!dirstore_enabled()) {
+    return false;
+  }
+
+  if (!dirstore_stat(file->fd, file->path, key)) {
+    errno = saved_errno;
+    return false;
+  }
+
+  if (dirstore_forced(file->path)) {
+    errno = saved_errno;
+    return true;
+  }
+
+  if ((supported = dirstore_mount(key->dev)) == -1) {
+    if (file_getxattr(file, NSUSER_PREFIX, NULL, 0) != -1 ||
+        errno == ENODATA || errno == ERANGE) {
+      supported = 1;
+    } else if (errno == ENOTSUP) {
+      supported = 0;
+    }
+    if (supported != -1) {
+      dirstore_set_mount(key->dev, supported);
+    }
+  }
+
+  errno = saved_errno;
+  return supported == 0;
+}
+
+/*
+ * Implementation functions
+ */
+
 static bool is_user_namespace(const char *name, size_t len) {
   return len > NSUSER_LENGTH &&
          strncmp(NSUSER_PREFIX, name, NSUSER_LENGTH) == 0;
 }
 
-static char *prepend_user_prefix(const char *name) {
-  char *buff;
-  size_t buff_size = sizeof(NSUSER_PREFIX) + (strlen(name) + 1) * sizeof(char);
+/**
+ * Writes \a name prefixed with user namespace to \a buff of
+ * `REAL_NAME_SIZE` bytes.
+ */
+static bool prepend_user_prefix(const char *name, char *buff) {
+  size_t len = strlen(name);
 
-  if ((buff = enif_alloc(buff_size)) == NULL) {
+  if (len >= NAME_BUFFER_SIZE) {
     errno = ERANGE;
-    return NULL;
+    return false;
   }
 
-  sprintf(buff, "%s%s", NSUSER_PREFIX, name);
-  return buff;
+  memcpy(buff, NSUSER_PREFIX, NSUSER_LENGTH);
+  memcpy(buff + NSUSER_LENGTH, name, len + 1);
+  return true;
 }
 
-bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list) {
-  const char *buff_ptr;
-  ERL_NIF_TERM entry;
-  ErlNifBinary buff;
-  size_t namelen;
-  ssize_t bsize;
+/**
+ * Writes name under which compressed value of attribute \a name is stored,
+ * prefixed with user namespace and `z$` tag, to \a buff of `REAL_NAME_SIZE`
+ * bytes.
+ */
+static bool prepend_compressed_prefix(const char *name, char *buff) {
+  size_t len = strlen(name);
 
-  if ((bsize = listxattr(path, NULL, 0)) == -1) {
+  if (len >= NAME_BUFFER_SIZE) {
+    errno = ERANGE;
     return false;
   }
 
-  if (!enif_alloc_binary(bsize, &buff)) {
-    errno = ERANGE;
-    return false;
+  memcpy(buff, NSUSER_PREFIX, NSUSER_LENGTH);
+  memcpy(buff + NSUSER_LENGTH, COMPRESSED_TAG, NAME_TAG_LENGTH);
+  memcpy(buff + NSUSER_LENGTH + NAME_TAG_LENGTH, name, len + 1);
+  return true;
+}
+
+/**
+ * Classifies listed attribute \a name of \a len bytes, stripped of namespace
+ * prefix, looking through `z$` tag of compressed values.
+ *
+ * \retval tags Length of type tags preceding untagged name.
+ */
+static name_type_t listed_name_type(const char *name, size_t len,
+                                    size_t *tags) {
+  name_type_t type = name_type(name, len);
+
+  *tags = NAME_TAG_LENGTH;
+  if (type == NAME_COMPRESSED) {
+    *tags += NAME_TAG_LENGTH;
+    type = name_type(name + NAME_TAG_LENGTH, len - NAME_TAG_LENGTH);
+    if (type != NAME_STRING && type != NAME_ATOM) {
+      type = NAME_INVALID;
+    }
   }
 
-  while ((bsize = listxattr(path, (char *)buff.data, buff.size)) == -1) {
-    if (errno == ERANGE) {
-      bsize = buff.size * 2;
-      if (!enif_realloc_binary(&buff, bsize)) {
-        errno = ERANGE;
-        return false;
-      }
-      /* continue with bigger buffer */
-    } else {
+  return type;
+}
+
+/**
+ * Reads list of attribute names of \a file. The list is placed in scratch
+ * buffer if it fits there, otherwise in newly allocated binary \a bin, which
+ * has to be released with `release_names`.
+ *
+ * \retval names On success, pointer to the list.
+ * \retval bsize On success, size of the list.
+ */
+static bool read_names(xattr_file_t *file, ErlNifBinary *bin,
+                       const char **names, ssize_t *bsize) {
+  unsigned char *scratch;
+
+  bin->data = NULL;
+
+  /* Scratch buffer can hold any list Linux returns, so in the common case a
+   * single syscall is made and no buffer is allocated. */
+  if ((scratch = scratch_get()) != NULL) {
+    *bsize = file_listxattr(file, (char *)scratch, SCRATCH_SIZE);
+    if (*bsize != -1) {
+      *names = (char *)scratch;
+      return true;
+    }
+    if (errno != ERANGE) {
+      return false;
+    }
+    stats_retry();
+  }
+
+  for (;;) {
+    if ((*bsize = file_listxattr(file, NULL, 0)) == -1) {
+      return false;
+    }
+
+    if (*bsize == 0) {
+      *names = "";
+      return true;
+    }
+
+    if (!enif_alloc_binary(*bsize, bin)) {
+      bin->data = NULL;
+      errno = ERANGE;
+      return false;
+    }
+
+    *bsize = file_listxattr(file, (char *)bin->data, bin->size);
+    if (*bsize != -1) {
+      *names = (char *)bin->data;
+      return true;
+    }
+
+    enif_release_binary(bin);
+    bin->data = NULL;
+    if (errno != ERANGE) {
+      return false;
+    }
+    /* list grew in the meantime, probe size again */
+    stats_retry();
+  }
+}
+
+static void release_names(ErlNifBinary *bin) {
+  if (bin->data != NULL) {
+    enif_release_binary(bin);
+  }
+}
+
+/**
+ * Checks names of \a listing filled by `listxattr` and copies string names,
+ * stripped of prefix and type tag, into `strings` binary, so that the whole
+ * list takes one allocation and steps only make its sub-binaries.
+ *
+ * \return `false` with `errno` set to `EILSEQ` if a name is malformed.
+ *
+ * \retval count Number of names to be listed.
+ */
+static bool check_names(ErlNifEnv *env, xattr_listing_t *listing,
+                        size_t *count) {
+  const char *end = listing->names + listing->size;
+  const char *ptr;
+  unsigned char *data;
+  name_type_t type;
+  size_t namelen;
+  size_t tags;
+  size_t total = 0;
+
+  *count = 0;
+  for (ptr = listing->names; ptr < end; ptr += namelen + 1) {
+    namelen = strlen(ptr);
+    if (!is_user_namespace(ptr, namelen)) {
+      continue;
+    }
+
+    type = listed_name_type(ptr + NSUSER_LENGTH, namelen - NSUSER_LENGTH,
+                            &tags);
+    if (type == NAME_INVALID) {
+      errno = EILSEQ;
       return false;
+    } else if (type == NAME_STRING) {
+      total += namelen - NSUSER_LENGTH - tags;
+      (*count)++;
+    } else if (type == NAME_ATOM) {
+      (*count)++;
     }
   }
 
-  *list = enif_make_list(env, 0);
-  buff_ptr = (char *)buff.data;
+  data = enif_make_new_binary(env, total, &listing->strings);
 
-  while (bsize != 0) {
-    namelen = strlen(buff_ptr);
-    if (is_user_namespace(buff_ptr, namelen)) {
-      entry = make_elixir_string(env, buff_ptr + NSUSER_LENGTH);
-      *list = enif_make_list_cell(env, entry, *list);
+  for (ptr = listing->names; ptr < end; ptr += namelen + 1) {
+    namelen = strlen(ptr);
+    if (is_user_namespace(ptr, namelen) &&
+        listed_name_type(ptr + NSUSER_LENGTH, namelen - NSUSER_LENGTH,
+                         &tags) == NAME_STRING) {
+      memcpy(data, ptr + NSUSER_LENGTH + tags, namelen - NSUSER_LENGTH - tags);
+      data += namelen - NSUSER_LENGTH - tags;
     }
-    buff_ptr += namelen + 1;
-    bsize -= namelen + 1;
   }
 
   return true;
 }
 
-bool hasxattr_impl(UNUSED ErlNifEnv *env, const char *path, const char *name,
-                   bool *result) {
-  char *real_name;
-  ssize_t r;
+/**
+ * Reads names of \a file into \a listing. Names of files in directory store
+ * are decoded at once.
+ *
+ * \retval count Number of names left for steps.
+ */
+static bool begin_listing(ErlNifEnv *env, xattr_file_t *file,
+                          xattr_listing_t *listing, size_t *count) {
+  dirstore_file_t store_key;
+  ErlNifBinary bin;
+  const char *names;
+  ssize_t bsize;
+
+  listing->names = "";
+  listing->size = 0;
+  listing->offset = 0;
+  listing->owned.data = NULL;
+  listing->strings_offset = 0;
+  listing->list = enif_make_list(env, 0);
+  listing->rest = enif_make_list(env, 0);
+  listing->strings = listing->list;
+  *count = 0;
+
+  if (in_store(file, &store_key)) {
+    return dirstore_list(env, &store_key, &listing->list, &listing->rest);
+  }
+
+  if (!read_names(file, &bin, &names, &bsize)) {
+    return false;
+  }
+
+  listing->names = names;
+  listing->size = bsize;
+  listing->owned = bin;
+
+  if (!check_names(env, listing, count)) {
+    listing_end_impl(listing);
+    return false;
+  }
+
+  return true;
+}
+
+bool listing_step_impl(ErlNifEnv *env, xattr_listing_t *listing, size_t max) {
+  const char *ptr;
+  name_type_t type;
+  size_t namelen;
+  size_t tags;
+
+  while (max > 0 && listing->offset < listing->size) {
+    ptr = listing->names + listing->offset;
+    namelen = strlen(ptr);
+    listing->offset += namelen + 1;
+    if (!is_user_namespace(ptr, namelen)) {
+      continue;
+    }
+
+    type = listed_name_type(ptr + NSUSER_LENGTH, namelen - NSUSER_LENGTH,
+                            &tags);
+    ptr += NSUSER_LENGTH + tags;
+    namelen -= NSUSER_LENGTH + tags;
+    if (type == NAME_STRING) {
+      listing->list = enif_make_list_cell(
+          env,
+          enif_make_sub_binary(env, listing->strings, listing->strings_offset,
+                               namelen),
+          listing->list);
+      listing->strings_offset += namelen;
+    } else if (type == NAME_ATOM) {
+      add_atom_name(env, ptr, namelen, &listing->list, &listing->rest);
+    }
+    max--;
+  }
+
+  return listing->offset >= listing->size;
+}
+
+bool listing_detach_impl(xattr_listing_t *listing) {
+  ErlNifBinary bin;
+
+  if (listing->owned.data != NULL || listing->offset >= listing->size) {
+    return true;
+  }
 
-  if ((real_name = prepend_user_prefix(name)) == NULL) {
+  /* names are in scratch buffer, copy only those not decoded yet */
+  if (!enif_alloc_binary(listing->size - listing->offset, &bin)) {
+    errno = ERANGE;
     return false;
   }
 
-  if ((r = getxattr(path, real_name, NULL, 0)) == -1) {
+  memcpy(bin.data, listing->names + listing->offset, bin.size);
+  listing->names = (const char *)bin.data;
+  listing->size = bin.size;
+  listing->offset = 0;
+  listing->owned = bin;
+  return true;
+}
+
+void listing_end_impl(xattr_listing_t *listing) {
+  release_names(&listing->owned);
+  listing->owned.data = NULL;
+}
+
+static bool has_real_name(xattr_file_t *file, const char *real_name,
+                          bool *result) {
+  ssize_t r;
+
+  if ((r = file_getxattr(file, real_name, NULL, 0)) == -1) {
     if (errno == ENODATA) {
       errno = 0;
       *result = false;
-      enif_free(real_name);
       return true;
     } else {
-      enif_free(real_name);
       return false;
     }
   } else {
     *result = true;
-    enif_free(real_name);
     return true;
   }
 }
 
-bool getxattr_impl(UNUSED ErlNifEnv *env, const char *path, const char *name,
-                   ErlNifBinary *bin) {
-  char *real_name;
-  ssize_t new_size;
-  ssize_t result;
+static bool has_file(xattr_file_t *file, const char *name, bool *result) {
+  char real_name[REAL_NAME_SIZE];
+  dirstore_file_t store_key;
 
-  if ((real_name = prepend_user_prefix(name)) == NULL) {
-    return false;
+  if (in_store(file, &store_key)) {
+    return dirstore_has(&store_key, name, result);
+  }
+
+  /* values written before the name was configured are stored uncompressed */
+  if (codec_enabled(name)) {
+    if (!prepend_compressed_prefix(name, real_name) ||
+        !has_real_name(file, real_name, result)) {
+      return false;
+    }
+    if (*result) {
+      return true;
+    }
   }
 
-  if ((new_size = getxattr(path, real_name, NULL, 0)) == -1) {
-    enif_free(real_name);
+  if (!prepend_user_prefix(name, real_name)) {
     return false;
   }
 
-  if (!enif_alloc_binary(new_size, bin)) {
+  return has_real_name(file, real_name, result);
+}
+
+/**
+ * Reads value of attribute \a real_name into newly allocated binary \a bin
+ * of exact size, probing the size first.
+ */
+static bool read_value(xattr_file_t *file, const char *real_name,
+                       ErlNifBinary *bin) {
+  ssize_t size;
+
+  for (;;) {
+    if ((size = file_getxattr(file, real_name, NULL, 0)) == -1) {
+      return false;
+    }
+
+    if (!enif_alloc_binary(size, bin)) {
+      errno = ERANGE;
+      return false;
+    }
+
+    /* size 0 would only probe again */
+    if (size == 0 ||
+        (size = file_getxattr(file, real_name, bin->data, bin->size)) != -1) {
+      break;
+    }
+
+    enif_release_binary(bin);
+    if (errno != ERANGE) {
+      return false;
+    }
+    /* value grew in the meantime, probe size again */
+    stats_retry();
+  }
+
+  /* value may have shrunk in the meantime */
+  if ((size_t)size < bin->size && !enif_realloc_binary(bin, size)) {
+    enif_release_binary(bin);
     errno = ERANGE;
-    enif_free(real_name);
     return false;
   }
 
-  while ((result = getxattr(path, real_name, bin->data, bin->size)) == -1) {
-    if (errno == ERANGE) {
-      new_size = bin->size * 2;
-      if (!enif_realloc_binary(bin, new_size)) {
-        errno = ERANGE;
-        enif_free(real_name);
-        return false;
+  return true;
+}
+
+/**
+ * Reads compressed value of attribute \a name and decompresses it into new
+ * binary \a value, which is cached if \a stamp is not `NULL`.
+ */
+static bool read_compressed(ErlNifEnv *env, xattr_file_t *file,
+                            const char *name, const cache_stamp_t *stamp,
+                            ERL_NIF_TERM *value) {
+  char real_name[REAL_NAME_SIZE];
+  unsigned char *raw;
+  unsigned char *data = NULL;
+  ErlNifBinary bin;
+  ssize_t size = -1;
+  size_t decoded;
+  bool result;
+
+  if (!prepend_compressed_prefix(name, real_name)) {
+    return false;
+  }
+
+  bin.data = NULL;
+  if ((raw = scratch_get()) != NULL) {
+    size = file_getxattr(file, real_name, raw, SCRATCH_SIZE);
+    if (size == -1 && errno != ERANGE) {
+      return false;
+    }
+  }
+
+  if (size == -1) {
+    stats_retry();
+    if (!read_value(file, real_name, &bin)) {
+      return false;
+    }
+    raw = bin.data;
+    size = bin.size;
+  }
+
+  result = codec_decoded_size(raw, size, &decoded);
+  if (result) {
+    data = enif_make_new_binary(env, decoded, value);
+    result = codec_decode(raw, size, data, decoded);
+  }
+
+  if (result && stamp != NULL) {
+    cache_store(stamp, name, data, decoded);
+  }
+
+  if (bin.data != NULL) {
+    enif_release_binary(&bin);
+  }
+  if (!result) {
+    errno = EILSEQ;
+  }
+  return result;
+}
+
+static bool get_file(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                     ERL_NIF_TERM *value) {
+  unsigned char *scratch;
+  char real_name[REAL_NAME_SIZE];
+  ErlNifBinary bin;
+  ssize_t size;
+  cache_stamp_t stamp;
+  dirstore_file_t store_key;
+  bool cached;
+
+  /* store changes do not touch change time, so they bypass the cache */
+  if (in_store(file, &store_key)) {
+    return dirstore_get(env, &store_key, name, value);
+  }
+
+  if (!prepend_user_prefix(name, real_name)) {
+    return false;
+  }
+
+  /* A hit costs one stat instead of getxattr. If stat fails, getxattr will
+   * report the error. */
+  cached = cache_enabled() && file_stamp(file, &stamp);
+  if (cached && cache_get(env, &stamp, name, value)) {
+    return true;
+  }
+
+  /* values written before the name was configured are stored uncompressed */
+  if (codec_enabled(name)) {
+    if (read_compressed(env, file, name, cached ? &stamp : NULL, value)) {
+      return true;
+    }
+    if (errno != ENODATA) {
+      return false;
+    }
+    errno = 0;
+  }
+
+  /* Read speculatively into scratch buffer, which can hold any value Linux
+   * returns, and copy it into binary of exact size (heap binary for small
+   * values). This avoids separate size probe in the common case. */
+  if ((scratch = scratch_get()) != NULL) {
+    size = file_getxattr(file, real_name, scratch, SCRATCH_SIZE);
+    if (size != -1) {
+      memcpy(enif_make_new_binary(env, size, value), scratch, size);
+      if (cached) {
+        cache_store(&stamp, name, scratch, size);
       }
-      /* continue with bigger buffer */
-    } else {
-      enif_free(real_name);
+      return true;
+    }
+    if (errno != ERANGE) {
       return false;
     }
+    stats_retry();
+  }
+
+  if (!read_value(file, real_name, &bin)) {
+    return false;
+  }
+
+  if (cached) {
+    cache_store(&stamp, name, bin.data, bin.size);
   }
 
-  enif_free(real_name);
+  *value = enif_make_binary(env, &bin);
   return true;
 }
 
-bool setxattr_impl(UNUSED ErlNifEnv *env, const char *path, const char *name,
-                   const ErlNifBinary value) {
-  char *real_name;
-  int result;
+typedef struct {
+  /** Listed name, `NULL` for attributes of directory store */
+  const char *name;
+  name_type_t type;
+  /** Length of type tags, longer for compressed values */
+  size_t tags;
+  size_t key_offset;
+  size_t key_size;
+  size_t value_offset;
+  size_t value_size;
+} getall_entry_t;
+
+/**
+ * Makes sure \a bin has at least \a size bytes, growing it geometrically.
+ */
+static bool reserve_binary(ErlNifBinary *bin, size_t size) {
+  size_t capacity = bin->size;
+
+  if (size <= capacity) {
+    return true;
+  }
+
+  while (capacity < size) {
+    capacity *= 2;
+  }
 
-  if ((real_name = prepend_user_prefix(name)) == NULL) {
+  if (!enif_realloc_binary(bin, capacity)) {
+    errno = ERANGE;
     return false;
   }
 
-  result = setxattr(path, real_name, value.data, value.size, 0);
+  return true;
+}
 
-  enif_free(real_name);
-  return TO_BOOL(result);
+/**
+ * Decompresses value of \a entry, read into \a buff, right after it. Space
+ * taken by compressed value is not reclaimed.
+ */
+static bool decode_entry(getall_entry_t *entry, ErlNifBinary *buff,
+                         size_t *offset) {
+  size_t decoded;
+
+  if (!codec_decoded_size(buff->data + entry->value_offset, entry->value_size,
+                          &decoded)) {
+    errno = EILSEQ;
+    return false;
+  }
+
+  if (!reserve_binary(buff, *offset + decoded + 1)) {
+    return false;
+  }
+
+  if (!codec_decode(buff->data + entry->value_offset, entry->value_size,
+                    buff->data + *offset, decoded)) {
+    errno = EILSEQ;
+    return false;
+  }
+
+  entry->value_offset = *offset;
+  entry->value_size = decoded;
+  *offset += decoded;
+  return true;
 }
 
-bool removexattr_impl(UNUSED ErlNifEnv *env, const char *path,
-                      const char *name) {
-  char *real_name;
-  int result;
+/**
+ * Reads tagged name and value of \a entry into \a buff at \a offset. The type
+ * tag is kept right before the key, so that the name can be written back.
+ *
+ * \return `false` on failure. If attribute was removed after listing,
+ *         `true` is returned and \a entry is left with `NAME_INVALID` type.
+ */
+static bool read_entry(xattr_file_t *file, getall_entry_t *entry,
+                       ErlNifBinary *buff, size_t *offset) {
+  ssize_t size;
 
-  if ((real_name = prepend_user_prefix(name)) == NULL) {
+  if (!reserve_binary(buff,
+                      *offset + NAME_TAG_LENGTH + entry->key_size + 1)) {
     return false;
   }
 
-  result = removexattr(path, real_name);
+  memcpy(buff->data + *offset,
+         entry->name + NSUSER_LENGTH + entry->tags - NAME_TAG_LENGTH,
+         NAME_TAG_LENGTH + entry->key_size);
+  entry->key_offset = *offset + NAME_TAG_LENGTH;
+  entry->value_offset = entry->key_offset + entry->key_size;
 
-  enif_free(real_name);
-  return TO_BOOL(result);
+  /* buffer always has some room left, so that empty value is not confused
+   * with size probe */
+  while ((size = file_getxattr(file, entry->name,
+                               buff->data + entry->value_offset,
+                               buff->size - entry->value_offset)) == -1) {
+    if (errno == ERANGE) {
+      size = file_getxattr(file, entry->name, NULL, 0);
+    }
+
+    if (size == -1) {
+      if (errno == ENODATA) {
+        errno = 0;
+        entry->type = NAME_INVALID;
+        return true;
+      }
+      return false;
+    }
+
+    if (!reserve_binary(buff, entry->value_offset + size + 1)) {
+      return false;
+    }
+  }
+
+  entry->value_size = size;
+  *offset = entry->value_offset + size;
+  return entry->tags == NAME_TAG_LENGTH || decode_entry(entry, buff, offset);
+}
+
+/**
+ * Names and decoded values of all attributes of a file, read into single
+ * buffer.
+ */
+typedef struct {
+  getall_entry_t *entries;
+  size_t count;
+  size_t capacity;
+  /** Whether chunks of large values are included */
+  bool chunks;
+  ErlNifBinary buff;
+  size_t offset;
+} attr_set_t;
+
+static bool alloc_set(attr_set_t *set, size_t capacity, bool chunks) {
+  /* one extra slot keeps allocation non-empty */
+  set->entries = enif_alloc((capacity + 1) * sizeof(getall_entry_t));
+  if (set->entries == NULL || !enif_alloc_binary(256, &set->buff)) {
+    enif_free(set->entries);
+    errno = ERANGE;
+    return false;
+  }
+
+  set->count = 0;
+  set->capacity = capacity + 1;
+  set->chunks = chunks;
+  set->offset = 0;
+  return true;
+}
+
+static void release_set(attr_set_t *set) {
+  enif_free(set->entries);
+  enif_release_binary(&set->buff);
+}
+
+/**
+ * Appends attribute of directory store to \a acc, an `attr_set_t`.
+ */
+static bool add_stored(void *acc, const char *name, size_t len,
+                       const unsigned char *value, size_t size) {
+  attr_set_t *set = acc;
+  getall_entry_t *entry;
+  getall_entry_t *entries;
+  name_type_t type = name_type(name, len);
+
+  switch (type) {
+  case NAME_CHUNK:
+    if (!set->chunks) {
+      return true;
+    }
+    break;
+  case NAME_STRING:
+  case NAME_ATOM: break;
+  default: errno = EILSEQ; return false;
+  }
+
+  if (set->count == set->capacity) {
+    entries = enif_realloc(set->entries,
+                           2 * set->capacity * sizeof(getall_entry_t));
+    if (entries == NULL) {
+      errno = ERANGE;
+      return false;
+    }
+    set->entries = entries;
+    set->capacity *= 2;
+  }
+
+  if (!reserve_binary(&set->buff, set->offset + len + size)) {
+    return false;
+  }
+
+  entry = &set->entries[set->count++];
+  entry->name = NULL;
+  entry->type = type;
+  entry->tags = NAME_TAG_LENGTH;
+  entry->key_offset = set->offset + NAME_TAG_LENGTH;
+  entry->key_size = len - NAME_TAG_LENGTH;
+  entry->value_offset = set->offset + len;
+  entry->value_size = size;
+
+  memcpy(set->buff.data + set->offset, name, len);
+  memcpy(set->buff.data + entry->value_offset, value, size);
+  set->offset += len + size;
+  return true;
+}
+
+/**
+ * Drops duplicates of \a set left by a value stored both compressed and
+ * uncompressed (after a crash between the write and removal of the other
+ * copy, or once a name is dropped from `compress_names`), keeping the copy
+ * `get_file` would read. Names of \a set still point to the listing.
+ */
+static void dedupe_set(attr_set_t *set) {
+  getall_entry_t *entries = set->entries;
+  const char *tagged;
+  size_t i;
+  size_t j;
+  size_t kept = 0;
+
+  for (i = 0; i < set->count; i++) {
+    if (entries[i].tags == NAME_TAG_LENGTH) {
+      continue;
+    }
+
+    tagged = entries[i].name + NSUSER_LENGTH + NAME_TAG_LENGTH;
+    for (j = 0; j < set->count; j++) {
+      if (entries[j].tags == NAME_TAG_LENGTH &&
+          entries[j].type == entries[i].type &&
+          entries[j].key_size == entries[i].key_size &&
+          memcmp(entries[j].name + NSUSER_LENGTH, tagged,
+                 NAME_TAG_LENGTH + entries[i].key_size) == 0) {
+        entries[codec_enabled(tagged) ? j : i].type = NAME_INVALID;
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i < set->count; i++) {
+    if (entries[i].type != NAME_INVALID) {
+      entries[kept++] = entries[i];
+    }
+  }
+  set->count = kept;
+}
+
+/**
+ * Reads all attributes of \a file into \a set, skipping chunks of large
+ * values unless \a chunks is set. On success, \a set has to be released with
+ * `release_set`.
+ */
+static bool read_set(xattr_file_t *file, bool chunks, attr_set_t *set) {
+  ErlNifBinary list_bin;
+  getall_entry_t *entry;
+  const char *names;
+  const char *ptr;
+  ssize_t bsize;
+  size_t namelen;
+  size_t tags;
+  size_t count = 0;
+  bool compressed = false;
+  dirstore_file_t store_key;
+
+  if (in_store(file, &store_key)) {
+    if (!alloc_set(set, 16, chunks)) {
+      return false;
+    }
+    if (!dirstore_each(&store_key, add_stored, set)) {
+      release_set(set);
+      return false;
+    }
+    return true;
+  }
+
+  if (!read_names(file, &list_bin, &names, &bsize)) {
+    return false;
+  }
+
+  for (ptr = names; ptr < names + bsize; ptr += namelen + 1) {
+    namelen = strlen(ptr);
+    if (is_user_namespace(ptr, namelen)) {
+      switch (listed_name_type(ptr + NSUSER_LENGTH, namelen - NSUSER_LENGTH,
+                               &tags)) {
+      case NAME_INVALID:
+        release_names(&list_bin);
+        errno = EILSEQ;
+        return false;
+      case NAME_CHUNK:
+        if (chunks) {
+          count++;
+        }
+        break;
+      default: count++; break;
+      }
+    }
+  }
+
+  if (!alloc_set(set, count, chunks)) {
+    release_names(&list_bin);
+    return false;
+  }
+
+  /* all names and values are read into single buffer */
+  for (ptr = names; ptr < names + bsize; ptr += namelen + 1) {
+    namelen = strlen(ptr);
+    if (!is_user_namespace(ptr, namelen)) {
+      continue;
+    }
+
+    entry = &set->entries[set->count];
+    entry->name = ptr;
+    entry->type = listed_name_type(ptr + NSUSER_LENGTH,
+                                   namelen - NSUSER_LENGTH, &entry->tags);
+    if (entry->type == NAME_CHUNK && !chunks) {
+      continue;
+    }
+    entry->key_size = namelen - NSUSER_LENGTH - entry->tags;
+
+    if (!read_entry(file, entry, &set->buff, &set->offset)) {
+      release_set(set);
+      release_names(&list_bin);
+      return false;
+    }
+
+    if (entry->type != NAME_INVALID) {
+      compressed = compressed || entry->tags != NAME_TAG_LENGTH;
+      set->count++;
+    }
+  }
+
+  if (compressed) {
+    dedupe_set(set);
+  }
+
+  release_names(&list_bin);
+  return true;
+}
+
+bool fgetallxattr_impl(ErlNifEnv *env, xattr_file_t *file, ERL_NIF_TERM *map,
+                       ERL_NIF_TERM *rest) {
+  attr_set_t set;
+  ERL_NIF_TERM buff_term;
+  ERL_NIF_TERM *keys;
+  ERL_NIF_TERM *values;
+  ERL_NIF_TERM key;
+  ERL_NIF_TERM value;
+  getall_entry_t *entries;
+  size_t count = 0;
+  size_t i;
+  dirstore_file_t store_key;
+
+  if (in_store(file, &store_key)) {
+    return dirstore_getall(env, &store_key, map, rest);
+  }
+
+  if (!read_set(file, false, &set)) {
+    return false;
+  }
+
+  keys = enif_alloc((set.count + 1) * sizeof(ERL_NIF_TERM));
+  values = enif_alloc((set.count + 1) * sizeof(ERL_NIF_TERM));
+  if (keys == NULL || values == NULL) {
+    enif_free(keys);
+    enif_free(values);
+    release_set(&set);
+    errno = ERANGE;
+    return false;
+  }
+
+  if (set.offset < set.buff.size &&
+      !enif_realloc_binary(&set.buff, set.offset)) {
+    enif_free(keys);
+    enif_free(values);
+    release_set(&set);
+    errno = ERANGE;
+    return false;
+  }
+  buff_term = enif_make_binary(env, &set.buff);
+  entries = set.entries;
+
+  *rest = enif_make_list(env, 0);
+
+  for (i = 0; i < set.count; i++) {
+    key = enif_make_sub_binary(env, buff_term, entries[i].key_offset,
+                               entries[i].key_size);
+    value = enif_make_sub_binary(env, buff_term, entries[i].value_offset,
+                                 entries[i].value_size);
+
+    if (entries[i].type == NAME_ATOM &&
+        !make_name_atom(env, (char *)set.buff.data + entries[i].key_offset,
+                        entries[i].key_size, &keys[count])) {
+      *rest = enif_make_list_cell(env, enif_make_tuple2(env, key, value),
+                                  *rest);
+      continue;
+    }
+
+    if (entries[i].type == NAME_STRING) {
+      keys[count] = key;
+    }
+    values[count] = value;
+    count++;
+  }
+
+  enif_free(entries);
+
+  /* duplicate keys are dropped by `read_set`, fail rather than crash */
+  if (!enif_make_map_from_arrays(env, keys, values, count, map)) {
+    enif_free(keys);
+    enif_free(values);
+    errno = EILSEQ;
+    return false;
+  }
+
+  enif_free(keys);
+  enif_free(values);
+  return true;
+}
+
+static int set_mode_flags(set_mode_t mode) {
+  switch (mode) {
+  case SET_CREATE: return XATTR_CREATE;
+  case SET_REPLACE: return XATTR_REPLACE;
+  default: return 0;
+  }
+}
+
+bool fsetxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    const ErlNifBinary value) {
+  return fsetxattr_mode_impl(env, file, name, value, SET_ANY);
+}
+
+/**
+ * Compresses \a value into \a scratch if it is not `NULL` and large enough,
+ * otherwise into newly allocated buffer. \a encoded has to be released with
+ * `release_encoded`.
+ */
+static bool encode_value(const ErlNifBinary *value, unsigned char *scratch,
+                         ErlNifBinary *encoded) {
+  size_t bound = codec_bound(value->size);
+
+  if (scratch != NULL && bound <= SCRATCH_SIZE) {
+    encoded->data = scratch;
+  } else if ((encoded->data = enif_alloc(bound)) == NULL) {
+    errno = ERANGE;
+    return false;
+  }
+
+  encoded->size = codec_encode(value->data, value->size, encoded->data);
+  return true;
+}
+
+static void release_encoded(ErlNifBinary *encoded,
+                            const unsigned char *scratch) {
+  if (encoded->data != scratch) {
+    enif_free(encoded->data);
+  }
+}
+
+static bool has_real_name(xattr_file_t *file, const char *real_name,
+                          bool *result);
+
+/**
+ * Writes \a encoded value to compressed attribute \a real_name in \a mode,
+ * which also takes uncompressed value \a legacy_name into account. Called
+ * with inode lock held for modes other than `SET_ANY`.
+ */
+static int set_compressed(xattr_file_t *file, const char *real_name,
+                          const char *legacy_name,
+                          const ErlNifBinary *encoded, set_mode_t mode) {
+  bool legacy;
+
+  if (mode == SET_CREATE) {
+    if (!has_real_name(file, legacy_name, &legacy)) {
+      return -1;
+    }
+    if (legacy) {
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  if (file_setxattr(file, real_name, encoded->data, encoded->size,
+                    set_mode_flags(mode)) == 0) {
+    return 0;
+  }
+
+  if (mode != SET_REPLACE || errno != ENODATA) {
+    return -1;
+  }
+
+  /* only the uncompressed value exists, it is replaced as well */
+  if (!has_real_name(file, legacy_name, &legacy)) {
+    return -1;
+  }
+  if (!legacy) {
+    errno = ENODATA;
+    return -1;
+  }
+
+  return file_setxattr(file, real_name, encoded->data, encoded->size,
+                       XATTR_CREATE);
+}
+
+/**
+ * Stores \a value of attribute \a name compressed, then removes its
+ * uncompressed value written before the name was configured, if any.
+ * Conditional writes check existence of both, under inode lock.
+ */
+static bool write_compressed(xattr_file_t *file, const char *name,
+                             const ErlNifBinary *value, set_mode_t mode) {
+  char real_name[REAL_NAME_SIZE];
+  char legacy_name[REAL_NAME_SIZE];
+  unsigned char *scratch = scratch_get();
+  ErlNifBinary encoded;
+  cache_stamp_t stamp;
+  ErlNifMutex *lock = NULL;
+  int saved_errno;
+  int result;
+
+  if (!prepend_compressed_prefix(name, real_name) ||
+      !prepend_user_prefix(name, legacy_name)) {
+    return false;
+  }
+
+  if (mode != SET_ANY) {
+    if (!file_stamp(file, &stamp)) {
+      return false;
+    }
+    lock = inode_lock(stamp.dev, stamp.ino);
+  }
+
+  if (!encode_value(value, scratch, &encoded)) {
+    return false;
+  }
+
+  if (lock != NULL) {
+    enif_mutex_lock(lock);
+  }
+
+  result = set_compressed(file, real_name, legacy_name, &encoded, mode);
+  if (result == 0) {
+    /* usually fails with ENODATA, which does not change the file */
+    file_removexattr(file, legacy_name);
+  }
+
+  saved_errno = errno;
+  if (lock != NULL) {
+    enif_mutex_unlock(lock);
+  }
+  release_encoded(&encoded, scratch);
+
+  if (result == -1) {
+    errno = saved_errno;
+    return false;
+  }
+
+  errno = 0;
+  note_change(file, name, value);
+  return true;
+}
+
+static bool set_file(xattr_file_t *file, const char *name,
+                     const ErlNifBinary value, set_mode_t mode) {
+  char real_name[REAL_NAME_SIZE];
+  dirstore_file_t store_key;
+  int result;
+
+  /* the store keeps values uncompressed */
+  if (in_store(file, &store_key)) {
+    if (!dirstore_set(&store_key, name, &value, mode)) {
+      return false;
+    }
+    note_change(file, name, &value);
+    return true;
+  }
+
+  if (codec_enabled(name)) {
+    return write_compressed(file, name, &value, mode);
+  }
+
+  if (!prepend_user_prefix(name, real_name)) {
+    return false;
+  }
+
+  result = file_setxattr(file, real_name, value.data, value.size,
+                         set_mode_flags(mode));
+  if (result == 0) {
+    note_change(file, name, &value);
+  }
+
+  return TO_BOOL(result);
+}
+
+/**
+ * Checks whether value of attribute \a real_name equals \a expected. The value
+ * is read into buffer one byte longer than \a expected, so that longer values
+ * fail with `ERANGE` instead of being read whole.
+ */
+static bool value_equals(xattr_file_t *file, const char *real_name,
+                         const ErlNifBinary *expected, bool *equal) {
+  unsigned char *buff;
+  bool allocated = false;
+  ssize_t size;
+
+  if (expected->size >= SCRATCH_SIZE || (buff = scratch_get()) == NULL) {
+    if ((buff = enif_alloc(expected->size + 1)) == NULL) {
+      errno = ERANGE;
+      return false;
+    }
+    allocated = true;
+  }
+
+  size = file_getxattr(file, real_name, buff, expected->size + 1);
+  if (size != -1) {
+    *equal = (size_t)size == expected->size &&
+             memcmp(buff, expected->data, expected->size) == 0;
+  } else if (errno == ERANGE) {
+    errno = 0;
+    *equal = false;
+    size = 0;
+  }
+
+  if (allocated) {
+    enif_free(buff);
+  }
+  return size != -1;
+}
+
+/**
+ * Checks whether compressed value of attribute \a real_name decodes to
+ * \a expected. Values are compared decoded, as an equal value may have been
+ * encoded differently (e.g. by another version of the codec). Sizes are
+ * compared first, so only values of the expected size are decoded.
+ */
+static bool compressed_equals(xattr_file_t *file, const char *real_name,
+                              const ErlNifBinary *expected, bool *equal) {
+  unsigned char *raw;
+  unsigned char *data;
+  ErlNifBinary bin;
+  ssize_t size = -1;
+  size_t decoded;
+  bool result;
+
+  bin.data = NULL;
+  if ((raw = scratch_get()) != NULL) {
+    size = file_getxattr(file, real_name, raw, SCRATCH_SIZE);
+    if (size == -1 && errno != ERANGE) {
+      return false;
+    }
+  }
+
+  if (size == -1) {
+    stats_retry();
+    if (!read_value(file, real_name, &bin)) {
+      return false;
+    }
+    raw = bin.data;
+    size = bin.size;
+  }
+
+  result = codec_decoded_size(raw, size, &decoded);
+  *equal = false;
+  if (result && decoded == expected->size) {
+    /* scratch may hold the raw value, decoded one gets buffer of its own */
+    if ((data = enif_alloc(decoded > 0 ? decoded : 1)) == NULL) {
+      if (bin.data != NULL) {
+        enif_release_binary(&bin);
+      }
+      errno = ERANGE;
+      return false;
+    }
+
+    result = codec_decode(raw, size, data, decoded);
+    *equal = result && memcmp(data, expected->data, decoded) == 0;
+    enif_free(data);
+  }
+
+  if (bin.data != NULL) {
+    enif_release_binary(&bin);
+  }
+  if (!result) {
+    errno = EILSEQ;
+  }
+  return result;
+}
+
+/**
+ * Checks whether value of attribute \a real_name equals \a expected, treating
+ * missing attribute as not equal. Value is decoded first if \a compressed.
+ *
+ * \retval found Whether the attribute exists.
+ */
+static bool find_equal(xattr_file_t *file, const char *real_name,
+                       bool compressed, const ErlNifBinary *expected,
+                       bool *found, bool *equal) {
+  *found = true;
+  if (compressed ? compressed_equals(file, real_name, expected, equal)
+                 : value_equals(file, real_name, expected, equal)) {
+    return true;
+  }
+
+  if (errno != ENODATA) {
+    return false;
+  }
+
+  errno = 0;
+  *found = false;
+  *equal = false;
+  return true;
+}
+
+/**
+ * Sets attribute \a real_name to \a stored if its value equals \a expected.
+ * \a stored is in the form it is stored in, \a value is the one reported to
+ * cache and index.
+ *
+ * For compressed attributes, \a legacy_name is the uncompressed value written
+ * before the name was configured, compared with \a expected if the compressed
+ * one does not exist, and removed once replaced. It is `NULL` otherwise.
+ */
+static bool compare_and_set(xattr_file_t *file, const char *name,
+                            const char *real_name, const char *legacy_name,
+                            const ErlNifBinary *expected,
+                            const ErlNifBinary *stored,
+                            const ErlNifBinary *value, bool *swapped) {
+  set_mode_t mode = SET_CREATE;
+  bool legacy = false;
+  bool found = false;
+  bool equal;
+
+  if (expected != NULL) {
+    if (!find_equal(file, real_name, legacy_name != NULL, expected, &found,
+                    &equal)) {
+      return false;
+    }
+
+    if (!found && legacy_name != NULL) {
+      if (!find_equal(file, legacy_name, false, expected, &legacy, &equal)) {
+        return false;
+      }
+      legacy = legacy && equal;
+    }
+
+    if (!equal) {
+      *swapped = false;
+      return true;
+    }
+
+    mode = found ? SET_REPLACE : SET_CREATE;
+  } else if (legacy_name != NULL) {
+    if (!has_real_name(file, legacy_name, &found)) {
+      return false;
+    }
+    if (found) {
+      *swapped = false;
+      return true;
+    }
+  }
+
+  /* the attribute may have been created or removed by a writer which does
+   * not take the inode lock, the filesystem checks it again */
+  if (file_setxattr(file, real_name, stored->data, stored->size,
+                    set_mode_flags(mode)) == -1) {
+    if ((mode == SET_CREATE && errno == EEXIST) ||
+        (mode == SET_REPLACE && errno == ENODATA)) {
+      errno = 0;
+      *swapped = false;
+      return true;
+    }
+    return false;
+  }
+
+  if (legacy) {
+    file_removexattr(file, legacy_name);
+    errno = 0;
+  }
+
+  note_change(file, name, value);
+  *swapped = true;
+  return true;
+}
+
+bool fcasxattr_impl(UNUSED ErlNifEnv *env, xattr_file_t *file,
+                    const char *name, const ErlNifBinary *expected,
+                    const ErlNifBinary value, bool *swapped) {
+  char real_name[REAL_NAME_SIZE];
+  char legacy_name[REAL_NAME_SIZE];
+  cache_stamp_t stamp;
+  ErlNifBinary stored;
+  ErlNifMutex *lock;
+  dirstore_file_t store_key;
+  bool compressed = codec_enabled(name);
+  bool result;
+  int saved_errno;
+
+  if (in_store(file, &store_key)) {
+    if (!dirstore_cas(&store_key, name, expected, &value, swapped)) {
+      return false;
+    }
+    if (*swapped) {
+      note_change(file, name, &value);
+    }
+    return true;
+  }
+
+  if (compressed ? !prepend_compressed_prefix(name, real_name) ||
+                       !prepend_user_prefix(name, legacy_name)
+                 : !prepend_user_prefix(name, real_name)) {
+    return false;
+  }
+
+  if (!file_stamp(file, &stamp)) {
+    return false;
+  }
+
+  /* the new value is encoded outside of the lock, the stored one is decoded
+   * and compared under it (buffer is allocated, as scratch is used for
+   * reading) */
+  stored = value;
+  if (compressed && !encode_value(&value, NULL, &stored)) {
+    return false;
+  }
+
+  lock = inode_lock(stamp.dev, stamp.ino);
+  enif_mutex_lock(lock);
+  result = compare_and_set(file, name, real_name,
+                           compressed ? legacy_name : NULL, expected, &stored,
+                           &value, swapped);
+  saved_errno = errno;
+  enif_mutex_unlock(lock);
+
+  if (compressed) {
+    release_encoded(&stored, NULL);
+  }
+
+  errno = saved_errno;
+  return result;
+}
+
+static bool remove_file(xattr_file_t *file, const char *name) {
+  char real_name[REAL_NAME_SIZE];
+  dirstore_file_t store_key;
+  bool removed = false;
+  int result;
+
+  if (in_store(file, &store_key)) {
+    if (!dirstore_set(&store_key, name, NULL, SET_ANY)) {
+      return false;
+    }
+    note_change(file, name, NULL);
+    return true;
+  }
+
+  /* values written before the name was configured are stored uncompressed */
+  if (codec_enabled(name)) {
+    if (!prepend_compressed_prefix(name, real_name)) {
+      return false;
+    }
+    if (file_removexattr(file, real_name) == 0) {
+      removed = true;
+    } else if (errno != ENODATA) {
+      return false;
+    }
+  }
+
+  if (!prepend_user_prefix(name, real_name)) {
+    return false;
+  }
+
+  result = file_removexattr(file, real_name);
+  if (result == -1 && removed && errno == ENODATA) {
+    errno = 0;
+    result = 0;
+  }
+  if (result == 0) {
+    note_change(file, name, NULL);
+  }
+
+  return TO_BOOL(result);
+}
+
+/*
+ * Statistics and tracing
+ */
+
+/**
+ * Single attribute operation in progress.
+ */
+typedef struct {
+  stats_call_t stats;
+  stats_op_t op;
+  /** Whether a tracer is attached to `op__return` probe */
+  bool traced;
+  ErlNifTime trace_start;
+} op_call_t;
+
+static void begin_op(op_call_t *call, stats_op_t op, xattr_file_t *file,
+                     const char *name) {
+  call->op = op;
+  TRACE3(op__entry, stats_op_name(op), file->path, name);
+  if ((call->traced = TRACE_ENABLED(op__return))) {
+    call->trace_start = enif_monotonic_time(ERL_NIF_NSEC);
+  }
+  stats_begin(&call->stats, op);
+}
+
+/**
+ * Formats device holding \a file as `major:minor` into \a buff, which has to
+ * hold at least 24 characters.
+ */
+static void format_dev(xattr_file_t *file, char *buff) {
+  struct stat st;
+  int result =
+      file->fd == -1 ? stat(file->sys_path, &st) : fstat(file->fd, &st);
+
+  if (result == -1) {
+    strcpy(buff, "?");
+  } else {
+    sprintf(buff, "%u:%u", (unsigned)major(st.st_dev),
+            (unsigned)minor(st.st_dev));
+  }
+}
+
+/**
+ * Returns size of binary \a term or length of list \a term, for tracing.
+ */
+static size_t term_size(ErlNifEnv *env, ERL_NIF_TERM term) {
+  ErlNifBinary bin;
+  unsigned length;
+
+  if (enif_inspect_binary(env, term, &bin)) {
+    return bin.size;
+  }
+
+  return enif_get_list_length(env, term, &length) ? length : 0;
+}
+
+/**
+ * Finishes \a call with \a result; \a size is number of bytes read or
+ * written, computed only if `call->traced` is set.
+ */
+static void end_op(op_call_t *call, xattr_file_t *file, const char *name,
+                   bool result, size_t size) {
+  char dev[24];
+  ErlNifTime duration;
+  int saved_errno = errno;
+
+  stats_end(&call->stats, result);
+
+  if (call->traced) {
+    duration = enif_monotonic_time(ERL_NIF_NSEC) - call->trace_start;
+    format_dev(file, dev);
+    TRACE7(op__return, stats_op_name(call->op), file->path, name,
+           result ? size : 0, result ? 0 : saved_errno, duration, dev);
+    errno = saved_errno;
+  }
+}
+
+bool flisting_begin_impl(ErlNifEnv *env, xattr_file_t *file,
+                         xattr_listing_t *listing) {
+  op_call_t call;
+  size_t count;
+  bool result;
+
+  begin_op(&call, STATS_LS, file, NULL);
+  result = begin_listing(env, file, listing, &count);
+  /* names of directory store are already in the list */
+  end_op(&call, file, NULL, result,
+         call.traced && result ? count + term_size(env, listing->list) : 0);
+  return result;
+}
+
+bool flistxattr_impl(ErlNifEnv *env, xattr_file_t *file, ERL_NIF_TERM *list,
+                     ERL_NIF_TERM *rest) {
+  xattr_listing_t listing;
+
+  if (!flisting_begin_impl(env, file, &listing)) {
+    return false;
+  }
+
+  listing_step_impl(env, &listing, (size_t)-1);
+  listing_end_impl(&listing);
+  *list = listing.list;
+  *rest = listing.rest;
+  return true;
+}
+
+bool fhasxattr_impl(UNUSED ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    bool *result) {
+  op_call_t call;
+  bool ok;
+
+  begin_op(&call, STATS_HAS, file, name);
+  ok = has_file(file, name, result);
+  end_op(&call, file, name, ok, 0);
+  return ok;
+}
+
+bool fgetxattr_impl(ErlNifEnv *env, xattr_file_t *file, const char *name,
+                    ERL_NIF_TERM *value) {
+  op_call_t call;
+  bool result;
+
+  begin_op(&call, STATS_GET, file, name);
+  result = get_file(env, file, name, value);
+  end_op(&call, file, name, result,
+         call.traced && result ? term_size(env, *value) : 0);
+  return result;
+}
+
+bool fsetxattr_mode_impl(UNUSED ErlNifEnv *env, xattr_file_t *file,
+                         const char *name, const ErlNifBinary value,
+                         set_mode_t mode) {
+  op_call_t call;
+  bool result;
+
+  begin_op(&call, STATS_SET, file, name);
+  result = set_file(file, name, value, mode);
+  end_op(&call, file, name, result, value.size);
+  return result;
+}
+
+bool fremovexattr_impl(UNUSED ErlNifEnv *env, xattr_file_t *file,
+                       const char *name) {
+  op_call_t call;
+  bool result;
+
+  begin_op(&call, STATS_RM, file, name);
+  result = remove_file(file, name);
+  end_op(&call, file, name, result, 0);
+  return result;
+}
+
+/*
+ * Batched operations
+ */
+
+typedef enum { MANY_HAS, MANY_GET, MANY_SET } many_kind_t;
+
+static ERL_NIF_TERM run_single(ErlNifEnv *env, xattr_file_t *file,
+                               many_kind_t kind, const char *name,
+                               const ErlNifBinary *value) {
+  ERL_NIF_TERM term;
+  bool has;
+
+  switch (kind) {
+  case MANY_HAS:
+    if (!fhasxattr_impl(env, file, name, &has)) {
+      return make_errno_tuple(env);
+    }
+    return make_ok_tuple(env, make_bool(env, has));
+  case MANY_GET:
+    if (!fgetxattr_impl(env, file, name, &term)) {
+      return make_errno_tuple(env);
+    }
+    return make_ok_tuple(env, term);
+  default:
+    if (!fsetxattr_impl(env, file, name, *value)) {
+      return make_errno_tuple(env);
+    }
+    return atom_ok;
+  }
+}
+
+/**
+ * Submits up to `uring_depth()` first operations through io_uring. Values are
+ * read into equal slots of scratch buffer; larger ones are read again with
+ * `fgetxattr_impl`. Compressed values are transformed in memory, so the batch
+ * ends before the first of them, which is done on its own.
+ *
+ * \return Number of operations done, `0` if io_uring cannot be used.
+ */
+static size_t run_uring(ErlNifEnv *env, xattr_file_t *file, many_kind_t kind,
+                        size_t count, const char *const names[],
+                        const ErlNifBinary values[], ERL_NIF_TERM results[]) {
+  unsigned char *scratch = NULL;
+  uring_op_t *ops;
+  size_t slot;
+  size_t i;
+  long res;
+
+  /* a single operation is cheaper as a plain syscall */
+  if (count < 2 || (ops = uring_ops()) == NULL ||
+      (kind == MANY_GET && (scratch = scratch_get()) == NULL)) {
+    return 0;
+  }
+
+  for (i = 0; i < count && i < uring_depth() && !codec_enabled(names[i]);
+       i++) {
+  }
+  if (i < 2) {
+    results[0] = run_single(env, file, kind, names[0], values);
+    return 1;
+  }
+
+  count = i;
+  slot = SCRATCH_SIZE / count;
+
+  for (i = 0; i < count; i++) {
+    if (!prepend_user_prefix(names[i], ops[i].name)) {
+      return 0;
+    }
+
+    switch (kind) {
+    case MANY_HAS:
+      ops[i].value = NULL;
+      ops[i].size = 0;
+      break;
+    case MANY_GET:
+      ops[i].value = scratch + i * slot;
+      ops[i].size = slot;
+      break;
+    case MANY_SET:
+      ops[i].value = values[i].data;
+      ops[i].size = values[i].size;
+      break;
+    }
+  }
+
+  if (!uring_run(kind == MANY_SET ? URING_SET : URING_GET, file->fd,
+                 file->sys_path, count)) {
+    return 0;
+  }
+
+  /* scratch is reused by fallback reads, so all values are copied first */
+  for (i = 0; i < count; i++) {
+    res = ops[i].result;
+    if (kind == MANY_HAS) {
+      if (res >= 0 || res == -ENODATA) {
+        results[i] = make_ok_tuple(env, make_bool(env, res >= 0));
+        continue;
+      }
+    } else if (res >= 0) {
+      if (kind == MANY_GET) {
+        memcpy(enif_make_new_binary(env, res, &results[i]), ops[i].value, res);
+        results[i] = make_ok_tuple(env, results[i]);
+      } else {
+        note_change(file, names[i], &values[i]);
+        results[i] = atom_ok;
+      }
+      continue;
+    }
+
+    errno = -res;
+    results[i] = make_errno_tuple(env);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (kind == MANY_GET && ops[i].result == -ERANGE) {
+      results[i] = run_single(env, file, kind, names[i], NULL);
+    }
+  }
+
+  return count;
+}
+
+static void run_many(ErlNifEnv *env, xattr_file_t *file, many_kind_t kind,
+                     size_t count, const char *const names[],
+                     const ErlNifBinary values[], ERL_NIF_TERM results[]) {
+  dirstore_file_t store_key;
+  bool stored = in_store(file, &store_key);
+  size_t done;
+  size_t i;
+
+  /* io_uring reaches attributes of the file only, not the store */
+  while (count > 0) {
+    if (stored || (done = run_uring(env, file, kind, count, names, values,
+                                    results)) == 0) {
+      for (i = 0; i < count; i++) {
+        results[i] = run_single(env, file, kind, names[i],
+                                values != NULL ? &values[i] : NULL);
+      }
+      return;
+    }
+
+    count -= done;
+    names += done;
+    results += done;
+    if (values != NULL) {
+      values += done;
+    }
+  }
+}
+
+void fhasxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], ERL_NIF_TERM results[]) {
+  run_many(env, file, MANY_HAS, count, names, NULL, results);
+}
+
+void fgetxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], ERL_NIF_TERM results[]) {
+  run_many(env, file, MANY_GET, count, names, NULL, results);
+}
+
+void fsetxattr_many_impl(ErlNifEnv *env, xattr_file_t *file, size_t count,
+                         const char *const names[], const ErlNifBinary values[],
+                         ERL_NIF_TERM results[]) {
+  run_many(env, file, MANY_SET, count, names, values, results);
+}
+
+/*
+ * Copying
+ */
+
+/**
+ * Attribute being copied, pointing into buffer of its `attr_set_t`.
+ */
+typedef struct {
+  /** Tagged name, not NUL-terminated */
+  const char *name;
+  size_t name_len;
+  const unsigned char *value;
+  size_t value_size;
+} copy_entry_t;
+
+static int compare_entries(const void *a, const void *b) {
+  const copy_entry_t *x = a;
+  const copy_entry_t *y = b;
+  size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  int result = memcmp(x->name, y->name, len);
+
+  if (result != 0) {
+    return result;
+  }
+  return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+/**
+ * Makes array of attributes of \a set, sorted by name if \a sorted is set.
+ * The array has to be released with `enif_free`.
+ */
+static copy_entry_t *copy_entries(const attr_set_t *set, bool sorted) {
+  const getall_entry_t *entry;
+  copy_entry_t *entries;
+  size_t i;
+
+  entries = enif_alloc((set->count + 1) * sizeof(copy_entry_t));
+  if (entries == NULL) {
+    errno = ERANGE;
+    return NULL;
+  }
+
+  for (i = 0; i < set->count; i++) {
+    entry = &set->entries[i];
+    entries[i].name =
+        (const char *)set->buff.data + entry->key_offset - NAME_TAG_LENGTH;
+    entries[i].name_len = NAME_TAG_LENGTH + entry->key_size;
+    entries[i].value = set->buff.data + entry->value_offset;
+    entries[i].value_size = entry->value_size;
+  }
+
+  if (sorted) {
+    qsort(entries, set->count, sizeof(copy_entry_t), compare_entries);
+  }
+  return entries;
+}
+
+/**
+ * Writes attribute \a entry to \a file, or removes it if \a write is not set.
+ */
+static bool apply_entry(ErlNifEnv *env, xattr_file_t *file,
+                        const copy_entry_t *entry, bool write) {
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+
+  if (entry->name_len >= NAME_BUFFER_SIZE) {
+    errno = ERANGE;
+    return false;
+  }
+
+  memcpy(name, entry->name, entry->name_len);
+  name[entry->name_len] = '\0';
+
+  if (!write) {
+    return fremovexattr_impl(env, file, name);
+  }
+
+  memset(&value, 0, sizeof(value));
+  value.data = (unsigned char *)entry->value;
+  value.size = entry->value_size;
+  return fsetxattr_impl(env, file, name, value);
+}
+
+/**
+ * Copies attributes of \a src to \a dst. With \a sync, attributes of \a dst
+ * are read as well and both sets are merged by name: equal values are not
+ * written again and attributes missing in \a src are removed.
+ */
+static bool copy_attrs(ErlNifEnv *env, xattr_file_t *src, xattr_file_t *dst,
+                       bool sync) {
+  attr_set_t from;
+  attr_set_t to;
+  copy_entry_t *a = NULL;
+  copy_entry_t *b = NULL;
+  size_t i = 0;
+  size_t j = 0;
+  int order;
+  bool result = false;
+
+  if (!read_set(src, true, &from)) {
+    return false;
+  }
+
+  if (sync ? !read_set(dst, true, &to) : !alloc_set(&to, 0, true)) {
+    release_set(&from);
+    return false;
+  }
+
+  if ((a = copy_entries(&from, sync)) != NULL &&
+      (b = copy_entries(&to, sync)) != NULL) {
+    result = true;
+  }
+
+  while (result && (i < from.count || j < to.count)) {
+    if (i == from.count) {
+      order = 1;
+    } else if (j == to.count) {
+      order = -1;
+    } else {
+      order = compare_entries(&a[i], &b[j]);
+    }
+
+    if (order > 0) {
+      /* value stored both compressed and uncompressed is listed twice, but
+       * removed at once */
+      if (j == 0 || compare_entries(&b[j - 1], &b[j]) != 0) {
+        result = apply_entry(env, dst, &b[j], false);
+      }
+      j++;
+      continue;
+    }
+
+    if (order < 0 || a[i].value_size != b[j].value_size ||
+        memcmp(a[i].value, b[j].value, a[i].value_size) != 0) {
+      result = apply_entry(env, dst, &a[i], true);
+    }
+    i++;
+    if (order == 0) {
+      j++;
+    }
+  }
+
+  enif_free(a);
+  enif_free(b);
+  release_set(&from);
+  release_set(&to);
+  return result;
+}
+
+/**
+ * Copies contents of regular file \a in to empty file \a out. Extents are
+ * shared if the file system supports it, otherwise data is copied within the
+ * kernel with copy_file_range(2), and through scratch buffer as a last
+ * resort.
+ */
+static bool copy_data(int in, int out) {
+  unsigned char *buff;
+  unsigned char *owned = NULL;
+  ssize_t size;
+  ssize_t written;
+  ssize_t done;
+  bool result = true;
+#ifdef SYS_copy_file_range
+  bool copied = false;
+#endif
+
+#ifdef FICLONE
+  if (ioctl(out, FICLONE, in) == 0) {
+    return true;
+  }
+#endif
+
+#ifdef SYS_copy_file_range
+  for (;;) {
+    size = syscall(SYS_copy_file_range, in, NULL, out, NULL, COPY_RANGE_SIZE,
+                   0);
+    if (size > 0) {
+      copied = true;
+    } else if (size == 0) {
+      return true;
+    } else if (errno != EINTR) {
+      break;
+    }
+  }
+
+  /* unsupported by the kernel or across these file systems */
+  if (copied || (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                 errno != EOPNOTSUPP)) {
+    return false;
+  }
+#endif
+
+  if ((buff = scratch_get()) == NULL &&
+      (buff = owned = enif_alloc(SCRATCH_SIZE)) == NULL) {
+    errno = ERANGE;
+    return false;
+  }
+
+  while (result && (size = read(in, buff, SCRATCH_SIZE)) != 0) {
+    if (size == -1) {
+      result = errno == EINTR;
+      continue;
+    }
+
+    for (done = 0; result && done < size; done += written) {
+      if ((written = write(out, buff + done, size - done)) == -1) {
+        written = 0;
+        result = errno == EINTR;
+      }
+    }
+  }
+
+  if (owned != NULL) {
+    enif_free(owned);
+  }
+  return result;
+}
+
+/**
+ * Copies contents of regular file \a src to \a dst, which is created or
+ * truncated, and opens both of them for extended attribute access.
+ */
+static bool open_data_copy(ErlNifEnv *env, const char *src, const char *dst,
+                           xattr_file_t **from, xattr_file_t **to) {
+  struct stat in_st;
+  struct stat out_st;
+  int in;
+  int out = -1;
+  int saved_errno;
+  bool result = false;
+
+  if ((in = open(src, O_RDONLY | O_NOCTTY | O_CLOEXEC)) == -1) {
+    return false;
+  }
+
+  if (fstat(in, &in_st) == 0) {
+    if (S_ISREG(in_st.st_mode)) {
+      out = open(dst, O_WRONLY | O_CREAT | O_NOCTTY | O_CLOEXEC,
+                 in_st.st_mode & 0777);
+    } else {
+      errno = EINVAL;
+    }
+  }
+
+  /* destination is truncated only after it is known not to be the source */
+  if (out != -1 && fstat(out, &out_st) == 0) {
+    if (out_st.st_dev == in_st.st_dev && out_st.st_ino == in_st.st_ino) {
+      errno = EINVAL;
+    } else {
+      result = ftruncate(out, 0) == 0 && copy_data(in, out);
+    }
+  }
+
+  if (result && fdopenxattr_impl(env, in, src, from)) {
+    if (fdopenxattr_impl(env, out, dst, to)) {
+      return true;
+    }
+    saved_errno = errno;
+    closexattr_impl(*from);
+    close(out);
+    errno = saved_errno;
+    return false;
+  }
+
+  saved_errno = errno;
+  if (out != -1) {
+    close(out);
+  }
+  close(in);
+  errno = saved_errno;
+  return false;
+}
+
+bool copyxattr_impl(ErlNifEnv *env, const char *src, const char *dst,
+                    int flags) {
+  xattr_file_t *from;
+  xattr_file_t *to;
+  bool result;
+  int saved_errno;
+
+  if (flags & COPY_DATA) {
+    if (!open_data_copy(env, src, dst, &from, &to)) {
+      return false;
+    }
+  } else {
+    if (!openxattr_impl(env, src, &from)) {
+      return false;
+    }
+    if (!openxattr_impl(env, dst, &to)) {
+      saved_errno = errno;
+      closexattr_impl(from);
+      errno = saved_errno;
+      return false;
+    }
+  }
+
+  result = copy_attrs(env, from, to, (flags & (COPY_SYNC | COPY_DATA)) != 0);
+
+  saved_errno = errno;
+  closexattr_impl(from);
+  closexattr_impl(to);
+  errno = saved_errno;
+
+  return result;
+}
+
+bool listxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *list,
+                    ERL_NIF_TERM *rest) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return flistxattr_impl(env, &file, list, rest);
+}
+
+bool listing_begin_impl(ErlNifEnv *env, const char *path,
+                        xattr_listing_t *listing) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return flisting_begin_impl(env, &file, listing);
+}
+
+bool hasxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   bool *result) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return fhasxattr_impl(env, &file, name, result);
+}
+
+bool getxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   ERL_NIF_TERM *value) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return fgetxattr_impl(env, &file, name, value);
+}
+
+bool getallxattr_impl(ErlNifEnv *env, const char *path, ERL_NIF_TERM *map,
+                      ERL_NIF_TERM *rest) {
+  xattr_file_t *file;
+  bool result;
+  int saved_errno;
+
+  if (!openxattr_impl(env, path, &file)) {
+    return false;
+  }
+
+  result = fgetallxattr_impl(env, file, map, rest);
+
+  saved_errno = errno;
+  closexattr_impl(file);
+  errno = saved_errno;
+
+  return result;
+}
+
+bool setxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   const ErlNifBinary value) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return fsetxattr_impl(env, &file, name, value);
+}
+
+bool setxattr_mode_impl(ErlNifEnv *env, const char *path, const char *name,
+                        const ErlNifBinary value, set_mode_t mode) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return fsetxattr_mode_impl(env, &file, name, value, mode);
+}
+
+bool casxattr_impl(ErlNifEnv *env, const char *path, const char *name,
+                   const ErlNifBinary *expected, const ErlNifBinary value,
+                   bool *swapped) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return fcasxattr_impl(env, &file, name, expected, value, swapped);
+}
+
+bool removexattr_impl(ErlNifEnv *env, const char *path, const char *name) {
+  xattr_file_t file;
+  path_file(&file, path);
+  return fremovexattr_impl(env, &file, name);
+}
+
+bool openxattr_impl(UNUSED ErlNifEnv *env, const char *path,
+                    xattr_file_t **file) {
+  xattr_file_t *f;
+  size_t len = strlen(path) + 1;
+
+  if ((f = enif_alloc(sizeof(xattr_file_t) + len)) == NULL) {
+    errno = ERANGE;
+    return false;
+  }
+
+  memcpy((char *)(f + 1), path, len);
+  path_file(f, (char *)(f + 1));
+
+  /* O_NONBLOCK keeps FIFOs from blocking, O_NOCTTY keeps terminals away */
+  f->fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+#ifdef __linux__
+  if (f->fd == -1 &&
+      (errno == EACCES || errno == EPERM || errno == ENXIO || errno == ENODEV)) {
+    /* file cannot be opened for reading (e.g. no read permission or it is
+     * a socket), but its attributes still may be accessible; `f*xattr` calls
+     * do not accept `O_PATH` descriptors, so they go through its link, which
+     * keeps following the file if it is renamed */
+    f->path_fd = open(path, O_PATH | O_CLOEXEC);
+    if (f->path_fd != -1) {
+      sprintf(f->proc_path, "/proc/self/fd/%d", f->path_fd);
+      f->sys_path = f->proc_path;
+    }
+  }
+#endif
+  if (f->fd == -1 && f->path_fd == -1) {
+    enif_free(f);
+    return false;
+  }
+
+  /* opened files are resolved once, not on every change */
+  f->real_path = index_resolve(index_fd(f), f->path);
+
+  *file = f;
+  return true;
+}
+
+bool fdopenxattr_impl(UNUSED ErlNifEnv *env, int fd, const char *path,
+                      xattr_file_t **file) {
+  xattr_file_t *f;
+  size_t len = strlen(path) + 1;
+
+  if ((f = enif_alloc(sizeof(xattr_file_t) + len)) == NULL) {
+    errno = ERANGE;
+    return false;
+  }
+
+  memcpy((char *)(f + 1), path, len);
+  path_file(f, (char *)(f + 1));
+  f->fd = fd;
+  f->real_path = index_resolve(fd, f->path);
+
+  *file = f;
+  return true;
+}
+
+void closexattr_impl(xattr_file_t *file) {
+  if (file->fd != -1) {
+    close(file->fd);
+  }
+  if (file->path_fd != -1) {
+    close(file->path_fd);
+  }
+  if (file->real_path != NULL) {
+    enif_free(file->real_path);
+  }
+  enif_free(file);
 }
 
 ERL_NIF_TERM make_errno_term(ErlNifEnv *env) {
   switch (errno) {
-  case E2BIG: return make_atom(env, "e2big");
-  case EAGAIN: return make_atom(env, "eagain");
-  case EDQUOT: return make_atom(env, "edquot");
-  case EFAULT: return make_atom(env, "efault");
-  case ENODATA: return make_atom(env, "enoattr");
-  case ENOENT: return make_atom(env, "enoent");
-  case ENOSPC: return make_atom(env, "enospc");
-  case ENOTSUP: return make_atom(env, "enotsup");
-  case EPERM: return make_atom(env, "eperm");
-  case ERANGE: return make_atom(env, "erange");
+  case E2BIG: return atom_e2big;
+  case EAGAIN: return atom_eagain;
+  case EDQUOT: return atom_edquot;
+  case EEXIST: return atom_eexist;
+  case EFAULT: return atom_efault;
+  case ENODATA: return atom_enoattr;
+  case ENOENT: return atom_enoent;
+  case ENOSPC: return atom_enospc;
+  case ENOTSUP: return atom_enotsup;
+  case EPERM: return atom_eperm;
+  case ERANGE: return atom_erange;
+  case EILSEQ: return atom_invalfmt;
   default: return enif_make_string(env, strerror(errno), ERL_NIF_LATIN1);
   }
 }
@@ -0,0 +1,2068 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "index.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "XATTRIX1"
+#define INDEX_MAGIC_SIZE 8
+
+/* Written in native byte order, so that files of other architectures are
+ * rejected */
+#define INDEX_MARKER 0x01020304U
+
+/* Size of update layer, and of its journal, which triggers compaction */
+#define LAYER_MAX 65536
+#define JOURNAL_MAX (64L * 1024 * 1024)
+
+#define DEFAULT_MAX_VALUE 1024
+#define MIN_BUCKETS 64
+
+/* FNV-1a, 64-bit; constants are built from halves to stay C89 */
+#define FNV_OFFSET (((ErlNifUInt64)0xcbf29ce4UL << 32) | 0x84222325UL)
+#define FNV_PRIME (((ErlNifUInt64)0x100UL << 32) | 0x1b3UL)
+
+/*
+ * On-disk format: header, file records sorted by device and inode, postings
+ * sorted by key hash, key and file, then string area holding index root,
+ * file paths and keys (name immediately followed by value). Offsets are
+ * relative to the string area. Postings with the same key share its bytes.
+ */
+
+typedef struct {
+  char magic[INDEX_MAGIC_SIZE];
+  unsigned int marker;
+  unsigned int root_len;
+  ErlNifUInt64 file_count;
+  ErlNifUInt64 post_count;
+  ErlNifUInt64 strings_size;
+} index_header_t;
+
+typedef struct {
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  ErlNifUInt64 path_off;
+  ErlNifUInt64 path_len;
+} index_file_t;
+
+typedef struct {
+  ErlNifUInt64 hash;
+  ErlNifUInt64 key_off;
+  unsigned int name_len;
+  unsigned int value_len;
+  /** Position of file record */
+  unsigned int file;
+  unsigned int reserved;
+} index_post_t;
+
+/**
+ * Index file mapped into memory, or empty if there is none yet.
+ */
+typedef struct {
+  void *map;
+  size_t size;
+  size_t file_count;
+  size_t post_count;
+  const index_file_t *files;
+  const index_post_t *posts;
+  const char *strings;
+} base_t;
+
+/**
+ * Latest update of a single attribute of a single file.
+ */
+typedef struct {
+  /** Hash of name and value, see `key_hash` */
+  ErlNifUInt64 key_hash;
+  /** Hash of file and name, see `file_hash` */
+  ErlNifUInt64 file_hash;
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  /** Sequence number, telling updates made after build has started */
+  ErlNifUInt64 seq;
+  /** Next entries in key and file hash chains, as index + 1 */
+  size_t key_next;
+  size_t file_next;
+  bool removed;
+  size_t name_len;
+  size_t value_len;
+  size_t path_len;
+  /** Name, value and canonical path of file, not terminated */
+  char *data;
+} entry_t;
+
+/**
+ * Updates made on top of base, one entry per file and attribute. Entries are
+ * chained by file and name, to tell which postings of older layers they
+ * supersede, and by key, for lookups. Removals are not chained by key.
+ */
+typedef struct {
+  entry_t *entries;
+  size_t count;
+  size_t capacity;
+  size_t *key_buckets;
+  size_t *file_buckets;
+  size_t nbuckets;
+} layer_t;
+
+typedef struct {
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  size_t path_off;
+  size_t path_len;
+  /** Next file in hash chain, as index + 1 */
+  size_t next;
+} bfile_t;
+
+typedef struct {
+  ErlNifUInt64 hash;
+  size_t key_off;
+  size_t name_len;
+  size_t value_len;
+  size_t file;
+} bpost_t;
+
+/**
+ * Postings collected in memory, to be sorted and written as a new base.
+ */
+typedef struct {
+  bfile_t *files;
+  size_t file_count;
+  size_t file_capacity;
+  size_t *buckets;
+  size_t nbuckets;
+  bpost_t *posts;
+  size_t post_count;
+  size_t post_capacity;
+  char *strings;
+  size_t strings_size;
+  size_t strings_capacity;
+} builder_t;
+
+/**
+ * Builder resource, filled by `index_builder_add_nif`.
+ */
+typedef struct {
+  ErlNifMutex *lock;
+  /** Sequence number of the last update made before the build started */
+  ErlNifUInt64 seq;
+  builder_t builder;
+  bool committed;
+} build_t;
+
+static bool enabled = false;
+static ErlNifResourceType *build_type = NULL;
+
+static char *root = NULL;
+static size_t root_len = 0;
+static char **names = NULL;
+static size_t names_count = 0;
+static size_t max_value = DEFAULT_MAX_VALUE;
+
+/* Index file, new base being written, journal of live layer and journal of
+ * frozen layer */
+static char *index_path = NULL;
+static char *tmp_path = NULL;
+static char *log_path = NULL;
+static char *old_path = NULL;
+
+/* Guards state below. Base and frozen layer are only replaced with
+ * `compact_lock` held too, so its holder may read them without this lock. */
+static ErlNifRWLock *index_lock = NULL;
+static base_t base;
+static layer_t live;
+/** Layer being merged into base, NULL if none */
+static layer_t *frozen = NULL;
+static ErlNifUInt64 seq = 0;
+static bool compact_requested = false;
+
+/* Guards the journal below, and is taken before `index_lock`. Updates append
+ * to the journal holding only this lock, so that lookups do not wait for the
+ * write; it is held until the update is in the live layer, which keeps both in
+ * the same order. */
+static ErlNifMutex *journal_lock = NULL;
+static int journal_fd = -1;
+static long journal_size = 0;
+
+/* Serializes compactions and commits of builders */
+static ErlNifMutex *compact_lock = NULL;
+
+static ErlNifMutex *wake_lock = NULL;
+static ErlNifCond *wake_cond = NULL;
+static bool wake_pending = false;
+static bool stopping = false;
+static ErlNifTid compactor;
+static bool compactor_started = false;
+
+/*
+ * Hashing
+ */
+
+static ErlNifUInt64 hash_bytes(ErlNifUInt64 hash, const void *data,
+                               size_t len) {
+  const unsigned char *bytes = data;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+
+  return hash;
+}
+
+static ErlNifUInt64 key_hash(const char *name, size_t name_len,
+                             const void *value, size_t value_len) {
+  /* names cannot contain NUL, so it separates them from values */
+  static const char separator = '\0';
+  ErlNifUInt64 hash = hash_bytes(FNV_OFFSET, name, name_len);
+
+  hash = hash_bytes(hash, &separator, 1);
+  return hash_bytes(hash, value, value_len);
+}
+
+static ErlNifUInt64 inode_hash(ErlNifUInt64 dev, ErlNifUInt64 ino) {
+  return hash_bytes(hash_bytes(FNV_OFFSET, &dev, sizeof(dev)), &ino,
+                    sizeof(ino));
+}
+
+static ErlNifUInt64 file_hash(ErlNifUInt64 dev, ErlNifUInt64 ino,
+                              const char *name, size_t name_len) {
+  return hash_bytes(inode_hash(dev, ino), name, name_len);
+}
+
+/**
+ * Grows array \a *items of \a *capacity elements of \a size bytes, so that
+ * it can hold \a count of them.
+ */
+static bool reserve(void **items, size_t *capacity, size_t count,
+                    size_t size) {
+  size_t wanted = *capacity == 0 ? MIN_BUCKETS : *capacity;
+  void *grown;
+
+  while (wanted < count) {
+    if (wanted > ((size_t)-1) / size / 2) {
+      return false;
+    }
+    wanted *= 2;
+  }
+
+  if (wanted == *capacity) {
+    return true;
+  }
+
+  grown = *items == NULL ? enif_alloc(wanted * size)
+                         : enif_realloc(*items, wanted * size);
+  if (grown == NULL) {
+    return false;
+  }
+
+  *items = grown;
+  *capacity = wanted;
+  return true;
+}
+
+static void free_array(void *items) {
+  if (items != NULL) {
+    enif_free(items);
+  }
+}
+
+static size_t *alloc_buckets(size_t nbuckets) {
+  size_t *buckets = enif_alloc(nbuckets * sizeof(size_t));
+
+  if (buckets != NULL) {
+    memset(buckets, 0, nbuckets * sizeof(size_t));
+  }
+  return buckets;
+}
+
+/*
+ * Update layers
+ */
+
+static const char *entry_value(const entry_t *entry) {
+  return entry->data + entry->name_len;
+}
+
+static const char *entry_path(const entry_t *entry) {
+  return entry->data + entry->name_len + entry->value_len;
+}
+
+/**
+ * Fills \a entry, taking ownership of \a data holding name, value and path.
+ */
+static void fill_entry(entry_t *entry, char *data, ErlNifUInt64 dev,
+                       ErlNifUInt64 ino, bool removed, size_t name_len,
+                       size_t value_len, size_t path_len) {
+  memset(entry, 0, sizeof(entry_t));
+  entry->data = data;
+  entry->dev = dev;
+  entry->ino = ino;
+  entry->removed = removed;
+  entry->name_len = name_len;
+  entry->value_len = value_len;
+  entry->path_len = path_len;
+  entry->key_hash = key_hash(data, name_len, data + name_len, value_len);
+  entry->file_hash = file_hash(dev, ino, data, name_len);
+}
+
+static bool layer_init(layer_t *layer) {
+  memset(layer, 0, sizeof(layer_t));
+  layer->nbuckets = MIN_BUCKETS;
+  layer->key_buckets = alloc_buckets(MIN_BUCKETS);
+  layer->file_buckets = alloc_buckets(MIN_BUCKETS);
+
+  if (layer->key_buckets == NULL || layer->file_buckets == NULL) {
+    free_array(layer->key_buckets);
+    free_array(layer->file_buckets);
+    memset(layer, 0, sizeof(layer_t));
+    return false;
+  }
+
+  return true;
+}
+
+static void layer_free(layer_t *layer) {
+  size_t i;
+
+  for (i = 0; i < layer->count; i++) {
+    enif_free(layer->entries[i].data);
+  }
+
+  free_array(layer->entries);
+  free_array(layer->key_buckets);
+  free_array(layer->file_buckets);
+  memset(layer, 0, sizeof(layer_t));
+}
+
+static entry_t *layer_find(const layer_t *layer, ErlNifUInt64 hash,
+                           ErlNifUInt64 dev, ErlNifUInt64 ino,
+                           const char *name, size_t name_len) {
+  entry_t *entry;
+  size_t i;
+
+  for (i = layer->file_buckets[hash & (layer->nbuckets - 1)]; i != 0;
+       i = entry->file_next) {
+    entry = &layer->entries[i - 1];
+    if (entry->file_hash == hash && entry->dev == dev && entry->ino == ino &&
+        entry->name_len == name_len &&
+        memcmp(entry->data, name, name_len) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static void link_entry(layer_t *layer, size_t i, bool by_file) {
+  entry_t *entry = &layer->entries[i];
+  size_t mask = layer->nbuckets - 1;
+
+  if (by_file) {
+    entry->file_next = layer->file_buckets[entry->file_hash & mask];
+    layer->file_buckets[entry->file_hash & mask] = i + 1;
+  }
+
+  entry->key_next = 0;
+  if (!entry->removed) {
+    entry->key_next = layer->key_buckets[entry->key_hash & mask];
+    layer->key_buckets[entry->key_hash & mask] = i + 1;
+  }
+}
+
+static void unlink_key(layer_t *layer, size_t i) {
+  entry_t *entry = &layer->entries[i];
+  size_t *link;
+
+  if (entry->removed) {
+    return;
+  }
+
+  link = &layer->key_buckets[entry->key_hash & (layer->nbuckets - 1)];
+  while (*link != i + 1) {
+    link = &layer->entries[*link - 1].key_next;
+  }
+  *link = entry->key_next;
+}
+
+/**
+ * Doubles bucket arrays once there are more entries than buckets. Failure to
+ * grow only makes chains longer.
+ */
+static void maybe_grow(layer_t *layer) {
+  size_t nbuckets = layer->nbuckets * 2;
+  size_t *key_buckets;
+  size_t *file_buckets;
+  size_t i;
+
+  if (layer->count <= layer->nbuckets) {
+    return;
+  }
+
+  key_buckets = alloc_buckets(nbuckets);
+  file_buckets = alloc_buckets(nbuckets);
+  if (key_buckets == NULL || file_buckets == NULL) {
+    free_array(key_buckets);
+    free_array(file_buckets);
+    return;
+  }
+
+  enif_free(layer->key_buckets);
+  enif_free(layer->file_buckets);
+  layer->key_buckets = key_buckets;
+  layer->file_buckets = file_buckets;
+  layer->nbuckets = nbuckets;
+
+  for (i = 0; i < layer->count; i++) {
+    link_entry(layer, i, true);
+  }
+}
+
+/**
+ * Stores \a update in \a layer, replacing entry of the same file and name.
+ * The layer takes ownership of entry data, unless `false` is returned.
+ */
+static bool layer_put(layer_t *layer, const entry_t *update) {
+  entry_t *entry;
+  size_t file_next;
+  size_t i;
+
+  entry = layer_find(layer, update->file_hash, update->dev, update->ino,
+                     update->data, update->name_len);
+  if (entry != NULL) {
+    i = entry - layer->entries;
+    unlink_key(layer, i);
+    enif_free(entry->data);
+    file_next = entry->file_next;
+    *entry = *update;
+    entry->file_next = file_next;
+    link_entry(layer, i, false);
+    return true;
+  }
+
+  if (!reserve((void **)&layer->entries, &layer->capacity, layer->count + 1,
+               sizeof(entry_t))) {
+    return false;
+  }
+
+  i = layer->count++;
+  layer->entries[i] = *update;
+  link_entry(layer, i, true);
+  maybe_grow(layer);
+  return true;
+}
+
+/**
+ * Moves entries of \a src made after update \a after into \a dst.
+ */
+static void keep_updates(layer_t *dst, layer_t *src, ErlNifUInt64 after) {
+  entry_t *entry;
+  size_t i;
+
+  for (i = 0; i < src->count; i++) {
+    entry = &src->entries[i];
+    if (entry->seq <= after) {
+      continue;
+    }
+    if (!layer_put(dst, entry)) {
+      enif_free(entry->data);
+    }
+    entry->data = NULL;
+  }
+}
+
+/**
+ * Checks whether attribute \a name of file \a dev / \a ino has been updated
+ * in any of \a count layers.
+ */
+static bool overridden(layer_t *const layers[], size_t count,
+                       ErlNifUInt64 dev, ErlNifUInt64 ino, const char *name,
+                       size_t name_len) {
+  ErlNifUInt64 hash = file_hash(dev, ino, name, name_len);
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (layers[i] != NULL &&
+        layer_find(layers[i], hash, dev, ino, name, name_len) != NULL) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Base
+ */
+
+static void base_close(base_t *run) {
+  if (run->map != NULL) {
+    munmap(run->map, run->size);
+  }
+  memset(run, 0, sizeof(base_t));
+}
+
+/**
+ * Validates header and all offsets of mapped index, so that lookups do not
+ * have to.
+ */
+static bool base_check(base_t *run) {
+  const index_header_t *header = run->map;
+  size_t body = run->size - sizeof(index_header_t);
+  const index_post_t *post;
+  const index_file_t *file;
+  size_t i;
+
+  if (memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0 ||
+      header->marker != INDEX_MARKER ||
+      header->file_count > body / sizeof(index_file_t)) {
+    return false;
+  }
+  body -= header->file_count * sizeof(index_file_t);
+
+  if (header->post_count > body / sizeof(index_post_t)) {
+    return false;
+  }
+  body -= header->post_count * sizeof(index_post_t);
+
+  if (header->strings_size != body || header->root_len != root_len ||
+      root_len > body) {
+    return false;
+  }
+
+  run->file_count = header->file_count;
+  run->post_count = header->post_count;
+  run->files = (const index_file_t *)(header + 1);
+  run->posts = (const index_post_t *)(run->files + run->file_count);
+  run->strings = (const char *)(run->posts + run->post_count);
+
+  if (memcmp(run->strings, root, root_len) != 0) {
+    return false;
+  }
+
+  for (i = 0; i < run->file_count; i++) {
+    file = &run->files[i];
+    if (file->path_off > body || file->path_len > body - file->path_off) {
+      return false;
+    }
+  }
+
+  for (i = 0; i < run->post_count; i++) {
+    post = &run->posts[i];
+    if (post->key_off > body ||
+        (ErlNifUInt64)post->name_len + post->value_len >
+            body - post->key_off ||
+        post->file >= run->file_count) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Maps index file at \a path. On failure \a run is left empty.
+ */
+static bool base_open(base_t *run, const char *path) {
+  struct stat st;
+  void *map;
+  int fd;
+
+  memset(run, 0, sizeof(base_t));
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+    return false;
+  }
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+
+  if (st.st_size < (off_t)sizeof(index_header_t)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  run->map = map;
+  run->size = st.st_size;
+  if (!base_check(run)) {
+    base_close(run);
+    errno = EINVAL;
+    return false;
+  }
+
+  return true;
+}
+
+static bool post_matches(const index_post_t *post, ErlNifUInt64 hash,
+                         const char *name, size_t name_len, const void *value,
+                         size_t value_len) {
+  const char *key = base.strings + post->key_off;
+
+  return post->hash == hash && post->name_len == name_len &&
+         post->value_len == value_len && memcmp(key, name, name_len) == 0 &&
+         memcmp(key + name_len, value, value_len) == 0;
+}
+
+/**
+ * Finds position of the first posting of base with key hash \a hash or
+ * greater.
+ */
+static size_t lower_bound(ErlNifUInt64 hash) {
+  size_t low = 0;
+  size_t high = base.post_count;
+  size_t mid;
+
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (base.posts[mid].hash < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+/*
+ * Builder
+ */
+
+static bool builder_init(builder_t *builder) {
+  memset(builder, 0, sizeof(builder_t));
+  builder->nbuckets = MIN_BUCKETS;
+  return (builder->buckets = alloc_buckets(MIN_BUCKETS)) != NULL;
+}
+
+static void builder_free(builder_t *builder) {
+  free_array(builder->files);
+  free_array(builder->buckets);
+  free_array(builder->posts);
+  free_array(builder->strings);
+  memset(builder, 0, sizeof(builder_t));
+}
+
+static bool append_bytes(builder_t *builder, const void *data, size_t len) {
+  if (!reserve((void **)&builder->strings, &builder->strings_capacity,
+               builder->strings_size + len, 1)) {
+    return false;
+  }
+
+  memcpy(builder->strings + builder->strings_size, data, len);
+  builder->strings_size += len;
+  return true;
+}
+
+static void rehash_files(builder_t *builder) {
+  size_t nbuckets = builder->nbuckets * 2;
+  size_t *buckets;
+  bfile_t *file;
+  size_t slot;
+  size_t i;
+
+  if (builder->file_count <= builder->nbuckets ||
+      (buckets = alloc_buckets(nbuckets)) == NULL) {
+    return;
+  }
+
+  for (i = 0; i < builder->file_count; i++) {
+    file = &builder->files[i];
+    slot = inode_hash(file->dev, file->ino) & (nbuckets - 1);
+    file->next = buckets[slot];
+    buckets[slot] = i + 1;
+  }
+
+  enif_free(builder->buckets);
+  builder->buckets = buckets;
+  builder->nbuckets = nbuckets;
+}
+
+/**
+ * Finds file \a dev / \a ino in \a builder, adding it with \a path if it is
+ * not there yet.
+ */
+static bool builder_file(builder_t *builder, ErlNifUInt64 dev,
+                         ErlNifUInt64 ino, const char *path, size_t path_len,
+                         size_t *index) {
+  size_t slot = inode_hash(dev, ino) & (builder->nbuckets - 1);
+  bfile_t *file;
+  size_t i;
+
+  for (i = builder->buckets[slot]; i != 0; i = file->next) {
+    file = &builder->files[i - 1];
+    if (file->dev == dev && file->ino == ino) {
+      *index = i - 1;
+      return true;
+    }
+  }
+
+  if (!reserve((void **)&builder->files, &builder->file_capacity,
+               builder->file_count + 1, sizeof(bfile_t))) {
+    return false;
+  }
+
+  file = &builder->files[builder->file_count];
+  file->dev = dev;
+  file->ino = ino;
+  file->path_off = builder->strings_size;
+  file->path_len = path_len;
+  if (!append_bytes(builder, path, path_len)) {
+    return false;
+  }
+
+  file->next = builder->buckets[slot];
+  builder->buckets[slot] = builder->file_count + 1;
+  *index = builder->file_count++;
+  rehash_files(builder);
+  return true;
+}
+
+static bool builder_add(builder_t *builder, ErlNifUInt64 dev, ErlNifUInt64 ino,
+                        const char *path, size_t path_len, const char *name,
+                        size_t name_len, const void *value, size_t value_len) {
+  bpost_t *post;
+  size_t file;
+  size_t key_off;
+
+  if (!builder_file(builder, dev, ino, path, path_len, &file) ||
+      !reserve((void **)&builder->posts, &builder->post_capacity,
+               builder->post_count + 1, sizeof(bpost_t))) {
+    return false;
+  }
+
+  key_off = builder->strings_size;
+  if (!append_bytes(builder, name, name_len) ||
+      !append_bytes(builder, value, value_len)) {
+    return false;
+  }
+
+  post = &builder->posts[builder->post_count++];
+  post->hash = key_hash(name, name_len, value, value_len);
+  post->key_off = key_off;
+  post->name_len = name_len;
+  post->value_len = value_len;
+  post->file = file;
+  return true;
+}
+
+/**
+ * Adds postings of \a count layers (newest first) and of base which are not
+ * superseded by newer layers to \a builder. Newest known path of each file is
+ * kept.
+ */
+static bool materialize(builder_t *builder, layer_t *const layers[],
+                        size_t count) {
+  const index_post_t *post;
+  const index_file_t *file;
+  const entry_t *entry;
+  const char *key;
+  size_t i;
+  size_t j;
+
+  for (i = 0; i < count; i++) {
+    for (j = 0; layers[i] != NULL && j < layers[i]->count; j++) {
+      entry = &layers[i]->entries[j];
+      if (entry->removed || overridden(layers, i, entry->dev, entry->ino,
+                                       entry->data, entry->name_len)) {
+        continue;
+      }
+      if (!builder_add(builder, entry->dev, entry->ino, entry_path(entry),
+                       entry->path_len, entry->data, entry->name_len,
+                       entry_value(entry), entry->value_len)) {
+        return false;
+      }
+    }
+  }
+
+  for (i = 0; i < base.post_count; i++) {
+    post = &base.posts[i];
+    file = &base.files[post->file];
+    key = base.strings + post->key_off;
+    if (overridden(layers, count, file->dev, file->ino, key, post->name_len)) {
+      continue;
+    }
+    if (!builder_add(builder, file->dev, file->ino,
+                     base.strings + file->path_off, file->path_len, key,
+                     post->name_len, key + post->name_len, post->value_len)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+typedef struct {
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  size_t file;
+} sorted_file_t;
+
+typedef struct {
+  ErlNifUInt64 hash;
+  const char *key;
+  size_t name_len;
+  size_t value_len;
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  /** Position of file in sorted file table */
+  size_t file;
+} sorted_post_t;
+
+static int compare_files(const void *a, const void *b) {
+  const sorted_file_t *left = a;
+  const sorted_file_t *right = b;
+
+  if (left->dev != right->dev) {
+    return left->dev < right->dev ? -1 : 1;
+  }
+  if (left->ino != right->ino) {
+    return left->ino < right->ino ? -1 : 1;
+  }
+  return 0;
+}
+
+static int compare_keys(const sorted_post_t *left,
+                        const sorted_post_t *right) {
+  if (left->hash != right->hash) {
+    return left->hash < right->hash ? -1 : 1;
+  }
+  if (left->name_len != right->name_len) {
+    return left->name_len < right->name_len ? -1 : 1;
+  }
+  if (left->value_len != right->value_len) {
+    return left->value_len < right->value_len ? -1 : 1;
+  }
+  return memcmp(left->key, right->key, left->name_len + left->value_len);
+}
+
+static int compare_posts(const void *a, const void *b) {
+  const sorted_post_t *left = a;
+  const sorted_post_t *right = b;
+  int result = compare_keys(left, right);
+
+  if (result != 0) {
+    return result;
+  }
+  if (left->dev != right->dev) {
+    return left->dev < right->dev ? -1 : 1;
+  }
+  if (left->ino != right->ino) {
+    return left->ino < right->ino ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * Sorts files and postings of \a builder in on-disk order, dropping duplicate
+ * postings. Returned arrays have to be freed by the caller.
+ */
+static bool builder_sort(const builder_t *builder, sorted_file_t **files,
+                         sorted_post_t **posts, size_t *post_count) {
+  const bfile_t *file;
+  const bpost_t *post;
+  size_t *ranks;
+  size_t count = 0;
+  size_t i;
+
+  *files = enif_alloc((builder->file_count + 1) * sizeof(sorted_file_t));
+  *posts = enif_alloc((builder->post_count + 1) * sizeof(sorted_post_t));
+  ranks = enif_alloc((builder->file_count + 1) * sizeof(size_t));
+  if (*files == NULL || *posts == NULL || ranks == NULL) {
+    free_array(*files);
+    free_array(*posts);
+    free_array(ranks);
+    return false;
+  }
+
+  for (i = 0; i < builder->file_count; i++) {
+    (*files)[i].dev = builder->files[i].dev;
+    (*files)[i].ino = builder->files[i].ino;
+    (*files)[i].file = i;
+  }
+  qsort(*files, builder->file_count, sizeof(sorted_file_t), compare_files);
+
+  for (i = 0; i < builder->file_count; i++) {
+    ranks[(*files)[i].file] = i;
+  }
+
+  for (i = 0; i < builder->post_count; i++) {
+    post = &builder->posts[i];
+    file = &builder->files[post->file];
+    (*posts)[i].hash = post->hash;
+    (*posts)[i].key = builder->strings + post->key_off;
+    (*posts)[i].name_len = post->name_len;
+    (*posts)[i].value_len = post->value_len;
+    (*posts)[i].dev = file->dev;
+    (*posts)[i].ino = file->ino;
+    (*posts)[i].file = ranks[post->file];
+  }
+  qsort(*posts, builder->post_count, sizeof(sorted_post_t), compare_posts);
+
+  for (i = 0; i < builder->post_count; i++) {
+    if (count == 0 || compare_posts(&(*posts)[count - 1], &(*posts)[i]) != 0) {
+      (*posts)[count++] = (*posts)[i];
+    }
+  }
+
+  *post_count = count;
+  enif_free(ranks);
+  return true;
+}
+
+static bool new_key(const sorted_post_t *posts, size_t i) {
+  return i == 0 || compare_keys(&posts[i - 1], &posts[i]) != 0;
+}
+
+/**
+ * Writes content of \a builder as index file at \a path and syncs it.
+ */
+static bool builder_write(const builder_t *builder, const char *path) {
+  sorted_file_t *files;
+  sorted_post_t *posts;
+  const bfile_t *file;
+  index_header_t header;
+  index_file_t record;
+  index_post_t post;
+  ErlNifUInt64 offset;
+  size_t post_count;
+  size_t i;
+  FILE *out;
+  bool ok;
+  int saved_errno;
+
+  if (builder->file_count > UINT_MAX) {
+    errno = EOVERFLOW;
+    return false;
+  }
+
+  if (!builder_sort(builder, &files, &posts, &post_count)) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  if ((out = fopen(path, "wb")) == NULL) {
+    enif_free(files);
+    enif_free(posts);
+    return false;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+  header.marker = INDEX_MARKER;
+  header.root_len = root_len;
+  header.file_count = builder->file_count;
+  header.post_count = post_count;
+  header.strings_size = root_len;
+  for (i = 0; i < builder->file_count; i++) {
+    header.strings_size += builder->files[i].path_len;
+  }
+  for (i = 0; i < post_count; i++) {
+    if (new_key(posts, i)) {
+      header.strings_size += posts[i].name_len + posts[i].value_len;
+    }
+  }
+  fwrite(&header, sizeof(header), 1, out);
+
+  offset = root_len;
+  for (i = 0; i < builder->file_count; i++) {
+    file = &builder->files[files[i].file];
+    record.dev = file->dev;
+    record.ino = file->ino;
+    record.path_off = offset;
+    record.path_len = file->path_len;
+    offset += file->path_len;
+    fwrite(&record, sizeof(record), 1, out);
+  }
+
+  memset(&post, 0, sizeof(post));
+  for (i = 0; i < post_count; i++) {
+    if (new_key(posts, i)) {
+      post.key_off = offset;
+      offset += posts[i].name_len + posts[i].value_len;
+    }
+    post.hash = posts[i].hash;
+    post.name_len = posts[i].name_len;
+    post.value_len = posts[i].value_len;
+    post.file = posts[i].file;
+    fwrite(&post, sizeof(post), 1, out);
+  }
+
+  fwrite(root, 1, root_len, out);
+  for (i = 0; i < builder->file_count; i++) {
+    file = &builder->files[files[i].file];
+    fwrite(builder->strings + file->path_off, 1, file->path_len, out);
+  }
+  for (i = 0; i < post_count; i++) {
+    if (new_key(posts, i)) {
+      fwrite(posts[i].key, 1, posts[i].name_len + posts[i].value_len, out);
+    }
+  }
+
+  enif_free(files);
+  enif_free(posts);
+
+  ok = !ferror(out) && fflush(out) == 0 && fsync(fileno(out)) == 0;
+  saved_errno = ok ? 0 : errno;
+  if (fclose(out) != 0 && ok) {
+    ok = false;
+    saved_errno = errno;
+  }
+
+  if (!ok) {
+    unlink(path);
+    errno = saved_errno;
+  }
+  return ok;
+}
+
+/**
+ * Counts postings of \a next missing in \a prev as \a added, and the other
+ * way round as \a removed.
+ */
+static bool diff(const builder_t *prev, const builder_t *next,
+                 ErlNifUInt64 *added, ErlNifUInt64 *removed) {
+  sorted_file_t *files[2];
+  sorted_post_t *posts[2];
+  size_t count[2];
+  size_t i = 0;
+  size_t j = 0;
+  int result;
+
+  if (!builder_sort(prev, &files[0], &posts[0], &count[0])) {
+    return false;
+  }
+  if (!builder_sort(next, &files[1], &posts[1], &count[1])) {
+    enif_free(files[0]);
+    enif_free(posts[0]);
+    return false;
+  }
+
+  while (i < count[0] && j < count[1]) {
+    result = compare_posts(&posts[0][i], &posts[1][j]);
+    if (result <= 0) {
+      i++;
+    }
+    if (result >= 0) {
+      j++;
+    }
+    if (result < 0) {
+      (*removed)++;
+    } else if (result > 0) {
+      (*added)++;
+    }
+  }
+  *removed += count[0] - i;
+  *added += count[1] - j;
+
+  for (i = 0; i < 2; i++) {
+    enif_free(files[i]);
+    enif_free(posts[i]);
+  }
+  return true;
+}
+
+/*
+ * Journal
+ */
+
+/*
+ * Each record is followed by its name, value and path. Records are checked
+ * with a hash of both, as a crash may leave a zero-filled or garbage tail.
+ */
+
+typedef struct {
+  /** Hash of record, with this field zeroed, and of its data */
+  ErlNifUInt64 check;
+  ErlNifUInt64 dev;
+  ErlNifUInt64 ino;
+  unsigned int removed;
+  unsigned int name_len;
+  unsigned int value_len;
+  unsigned int path_len;
+} journal_record_t;
+
+static ErlNifUInt64 journal_check(const journal_record_t *record,
+                                  const char *data, size_t len) {
+  journal_record_t copy = *record;
+
+  copy.check = 0;
+  return hash_bytes(hash_bytes(FNV_OFFSET, &copy, sizeof(copy)), data, len);
+}
+
+static bool journal_write(int fd, const entry_t *entry, long *size) {
+  journal_record_t record;
+  size_t data_len = entry->name_len + entry->value_len + entry->path_len;
+  size_t len = sizeof(record) + data_len;
+  ssize_t written;
+  char *buff;
+
+  memset(&record, 0, sizeof(record));
+  record.dev = entry->dev;
+  record.ino = entry->ino;
+  record.removed = entry->removed;
+  record.name_len = entry->name_len;
+  record.value_len = entry->value_len;
+  record.path_len = entry->path_len;
+  record.check = journal_check(&record, entry->data, data_len);
+
+  /* single write, so that concurrent crash leaves at most one torn record */
+  if ((buff = enif_alloc(len)) == NULL) {
+    return false;
+  }
+  memcpy(buff, &record, sizeof(record));
+  memcpy(buff + sizeof(record), entry->data, data_len);
+  written = write(fd, buff, len);
+  enif_free(buff);
+
+  if (written != (ssize_t)len) {
+    return false;
+  }
+
+  *size += len;
+  return true;
+}
+
+static void journal_open(void) {
+  journal_fd =
+      open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  journal_size = 0;
+
+  if (journal_fd != -1 &&
+      (journal_size = lseek(journal_fd, 0, SEEK_END)) == -1) {
+    close(journal_fd);
+    journal_fd = -1;
+    journal_size = 0;
+  }
+}
+
+static void journal_close(void) {
+  if (journal_fd != -1) {
+    close(journal_fd);
+    journal_fd = -1;
+  }
+}
+
+/**
+ * Appends \a entry to journal of live layer. Called with `journal_lock` held.
+ */
+static void journal_append(const entry_t *entry) {
+  if (journal_fd == -1) {
+    journal_open();
+  }
+
+  if (journal_fd != -1 && !journal_write(journal_fd, entry, &journal_size) &&
+      ftruncate(journal_fd, journal_size) == -1) {
+    /* replay stops at torn record, later ones would be lost anyway */
+    journal_close();
+  }
+}
+
+/**
+ * Replays journal at \a path into live layer, up to the first torn or
+ * corrupted record.
+ *
+ * \return `false` if there is no journal.
+ */
+static bool journal_replay(const char *path) {
+  journal_record_t record;
+  entry_t entry;
+  size_t len;
+  char *data;
+  FILE *in;
+
+  if ((in = fopen(path, "rb")) == NULL) {
+    return false;
+  }
+
+  while (fread(&record, sizeof(record), 1, in) == 1) {
+    if (record.name_len >= NAME_BUFFER_SIZE ||
+        record.value_len > SCRATCH_SIZE || record.path_len >= PATH_MAX) {
+      break;
+    }
+
+    len = record.name_len + record.value_len + record.path_len;
+    if ((data = enif_alloc(len + 1)) == NULL) {
+      break;
+    }
+    if (fread(data, 1, len, in) != len ||
+        journal_check(&record, data, len) != record.check) {
+      enif_free(data);
+      break;
+    }
+
+    fill_entry(&entry, data, record.dev, record.ino, record.removed != 0,
+               record.name_len, record.value_len, record.path_len);
+    entry.seq = ++seq;
+    if (!layer_put(&live, &entry)) {
+      enif_free(data);
+      break;
+    }
+  }
+
+  fclose(in);
+  return true;
+}
+
+/**
+ * Replaces journals with a single one holding entries of live layer. Called
+ * with `journal_lock` and `index_lock` held for writing, or before the index
+ * is enabled.
+ */
+static void journal_rewrite(void) {
+  long size = 0;
+  size_t i;
+  int fd;
+
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return;
+  }
+
+  for (i = 0; i < live.count; i++) {
+    if (!journal_write(fd, &live.entries[i], &size)) {
+      close(fd);
+      unlink(tmp_path);
+      return;
+    }
+  }
+
+  if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp_path, log_path) == -1) {
+    unlink(tmp_path);
+    return;
+  }
+
+  journal_close();
+  journal_open();
+  unlink(old_path);
+}
+
+/*
+ * Compaction
+ */
+
+static bool layer_full(void) {
+  return live.count >= LAYER_MAX || journal_size >= JOURNAL_MAX;
+}
+
+/**
+ * Sets live layer and its journal aside for compaction. Called with
+ * `compact_lock`, `journal_lock` and `index_lock` held.
+ */
+static bool freeze(void) {
+  layer_t *layer;
+
+  if ((layer = enif_alloc(sizeof(layer_t))) == NULL) {
+    return false;
+  }
+
+  *layer = live;
+  if (!layer_init(&live)) {
+    live = *layer;
+    enif_free(layer);
+    return false;
+  }
+
+  /* if rename fails, journal keeps frozen entries before the live ones,
+   * which is still replayed correctly */
+  journal_close();
+  rename(log_path, old_path);
+  journal_open();
+
+  frozen = layer;
+  return true;
+}
+
+/**
+ * Maps new base written to `tmp_path` into \a next. Called with
+ * `compact_lock` held.
+ */
+static bool install(base_t *next) {
+  if (rename(tmp_path, index_path) == -1) {
+    unlink(tmp_path);
+    return false;
+  }
+  return base_open(next, index_path);
+}
+
+static void drop_frozen(void) {
+  if (frozen != NULL) {
+    layer_free(frozen);
+    enif_free(frozen);
+    frozen = NULL;
+  }
+}
+
+/**
+ * Merges frozen layer into a new base, freezing live layer first unless a
+ * previous compaction has failed.
+ */
+static void compact(void) {
+  layer_t *layers[1];
+  builder_t builder;
+  base_t next;
+  bool ok;
+
+  enif_mutex_lock(compact_lock);
+
+  enif_mutex_lock(journal_lock);
+  enif_rwlock_rwlock(index_lock);
+  ok = frozen != NULL || (layer_full() && freeze());
+  enif_rwlock_rwunlock(index_lock);
+  enif_mutex_unlock(journal_lock);
+
+  if (ok) {
+    layers[0] = frozen;
+    ok = builder_init(&builder) && materialize(&builder, layers, 1) &&
+         builder_write(&builder, tmp_path) && install(&next);
+    builder_free(&builder);
+  }
+
+  enif_rwlock_rwlock(index_lock);
+  if (ok) {
+    base_close(&base);
+    base = next;
+    drop_frozen();
+    unlink(old_path);
+  }
+  /* on failure, compaction is retried by the next update */
+  compact_requested = false;
+  enif_rwlock_rwunlock(index_lock);
+
+  enif_mutex_unlock(compact_lock);
+}
+
+static void *compact_loop(UNUSED void *arg) {
+  for (;;) {
+    enif_mutex_lock(wake_lock);
+    while (!wake_pending && !stopping) {
+      enif_cond_wait(wake_cond, wake_lock);
+    }
+    if (stopping) {
+      enif_mutex_unlock(wake_lock);
+      return NULL;
+    }
+    wake_pending = false;
+    enif_mutex_unlock(wake_lock);
+
+    compact();
+  }
+}
+
+/*
+ * Helpers
+ */
+
+static bool is_indexed(const char *name) {
+  size_t i;
+
+  if (names_count == 0) {
+    /* chunks of large values are not values on their own */
+    return name_type(name, strlen(name)) != NAME_CHUNK;
+  }
+
+  for (i = 0; i < names_count; i++) {
+    if (strcmp(names[i], name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool under_root(const char *path, size_t len) {
+  return root_len == 1 ||
+         (len >= root_len && memcmp(path, root, root_len) == 0 &&
+          (path[root_len] == '/' || path[root_len] == '\0'));
+}
+
+/**
+ * Finds canonical path of file open as \a fd, or at \a path, into \a real
+ * buffer of `PATH_MAX` bytes.
+ */
+static bool resolve_path(int fd, const char *path, char *real) {
+#ifdef __linux__
+  char link[32];
+  ssize_t len;
+
+  if (fd != -1) {
+    sprintf(link, "/proc/self/fd/%d", fd);
+    len = readlink(link, real, PATH_MAX - 1);
+    if (len > 0 && real[0] == '/') {
+      real[len] = '\0';
+      return true;
+    }
+  }
+#else
+  (void)fd;
+#endif
+
+  return realpath(path, real) != NULL;
+}
+
+static ERL_NIF_TERM make_path(ErlNifEnv *env, const char *path, size_t len) {
+  ERL_NIF_TERM term;
+
+  memcpy(enif_make_new_binary(env, len, &term), path, len);
+  return term;
+}
+
+static char *copy_string(const char *string, const char *suffix) {
+  size_t len = strlen(string);
+  char *copy = enif_alloc(len + strlen(suffix) + 1);
+
+  if (copy != NULL) {
+    memcpy(copy, string, len);
+    strcpy(copy + len, suffix);
+  }
+  return copy;
+}
+
+/*
+ * Builder resource
+ */
+
+static void build_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  build_t *build = obj;
+
+  builder_free(&build->builder);
+  if (build->lock != NULL) {
+    enif_mutex_destroy(build->lock);
+  }
+}
+
+/**
+ * Adds `{path, [{name, value}]}` \a term to \a builder.
+ *
+ * \retval error On failure, term to be returned from NIF.
+ */
+static bool add_scanned(ErlNifEnv *env, builder_t *builder, ERL_NIF_TERM term,
+                        ERL_NIF_TERM *error) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  const ERL_NIF_TERM *items;
+  ERL_NIF_TERM attrs;
+  ERL_NIF_TERM attr;
+  ErlNifBinary value;
+  struct stat st;
+  int arity;
+
+  if (!enif_get_tuple(env, term, &arity, &items) || arity != 2 ||
+      !enif_is_list(env, items[1])) {
+    *error = enif_make_badarg(env);
+    return false;
+  }
+
+  if (!get_path_arg(env, items[0], path, error)) {
+    return false;
+  }
+
+  /* files removed since they were scanned are skipped */
+  if (lstat(path, &st) == -1) {
+    return true;
+  }
+
+  attrs = items[1];
+  while (enif_get_list_cell(env, attrs, &attr, &attrs)) {
+    if (!enif_get_tuple(env, attr, &arity, &items) || arity != 2 ||
+        !enif_inspect_binary(env, items[1], &value)) {
+      *error = enif_make_badarg(env);
+      return false;
+    }
+
+    if (!get_name_arg(env, items[0], name, error)) {
+      return false;
+    }
+
+    if (!is_indexed(name) || value.size > max_value) {
+      continue;
+    }
+
+    if (!builder_add(builder, st.st_dev, st.st_ino, path, strlen(path), name,
+                     strlen(name), value.data, value.size)) {
+      *error = make_error_tuple(env, atom_badalloc);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Replaces base with content of \a build, keeping updates made since the
+ * build started. With \a reconcile, counts postings which differ from those
+ * in the index. Called with `compact_lock` held.
+ */
+static bool commit(build_t *build, bool reconcile, ErlNifUInt64 *added,
+                   ErlNifUInt64 *removed) {
+  layer_t *layers[2];
+  builder_t view;
+  layer_t kept;
+  base_t next;
+  bool ok;
+
+  if (reconcile) {
+    if (!builder_init(&view)) {
+      errno = ENOMEM;
+      return false;
+    }
+
+    enif_rwlock_rlock(index_lock);
+    layers[0] = &live;
+    layers[1] = frozen;
+    ok = materialize(&view, layers, 2);
+    enif_rwlock_runlock(index_lock);
+
+    ok = ok && diff(&view, &build->builder, added, removed);
+    builder_free(&view);
+    if (!ok) {
+      errno = ENOMEM;
+      return false;
+    }
+  }
+
+  if (!layer_init(&kept)) {
+    errno = ENOMEM;
+    return false;
+  }
+
+  if (!builder_write(&build->builder, tmp_path) || !install(&next)) {
+    layer_free(&kept);
+    return false;
+  }
+
+  enif_mutex_lock(journal_lock);
+  enif_rwlock_rwlock(index_lock);
+  base_close(&base);
+  base = next;
+  if (frozen != NULL) {
+    keep_updates(&kept, frozen, build->seq);
+    drop_frozen();
+  }
+  keep_updates(&kept, &live, build->seq);
+  layer_free(&live);
+  live = kept;
+  journal_rewrite();
+  enif_rwlock_rwunlock(index_lock);
+  enif_mutex_unlock(journal_lock);
+
+  return true;
+}
+
+/*
+ * Public interface
+ */
+
+static bool get_option(ErlNifEnv *env, ERL_NIF_TERM map, const char *key,
+                       ERL_NIF_TERM *value) {
+  return enif_get_map_value(env, map, enif_make_atom(env, key), value);
+}
+
+static bool init_names(ErlNifEnv *env, ERL_NIF_TERM list) {
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM head;
+  unsigned len;
+
+  if (!enif_get_list_length(env, list, &len)) {
+    return false;
+  }
+
+  if (len == 0) {
+    return true;
+  }
+
+  if ((names = enif_alloc(len * sizeof(char *))) == NULL) {
+    return false;
+  }
+
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    if (get_cstring_arg(env, head, name, NAME_BUFFER_SIZE) != ARG_OK ||
+        (names[names_count] = copy_string(name, "")) == NULL) {
+      return false;
+    }
+    names_count++;
+  }
+
+  return true;
+}
+
+static bool init_paths(ErlNifEnv *env, ERL_NIF_TERM index, ERL_NIF_TERM dir) {
+  char path[PATH_BUFFER_SIZE];
+  char real[PATH_MAX];
+  char cwd[PATH_BUFFER_SIZE];
+
+  if (get_cstring_arg(env, dir, path, PATH_BUFFER_SIZE) != ARG_OK ||
+      realpath(path, real) == NULL || (root = copy_string(real, "")) == NULL) {
+    return false;
+  }
+  root_len = strlen(root);
+
+  if (get_cstring_arg(env, index, path, PATH_BUFFER_SIZE) != ARG_OK) {
+    return false;
+  }
+
+  /* relative path would break if working directory changed */
+  if (path[0] != '/') {
+    if (getcwd(cwd, sizeof(cwd)) == NULL ||
+        strlen(cwd) + strlen(path) + 2 > sizeof(cwd)) {
+      return false;
+    }
+    strcat(cwd, "/");
+    strcat(cwd, path);
+    strcpy(path, cwd);
+  }
+
+  index_path = copy_string(path, "");
+  tmp_path = copy_string(path, ".tmp");
+  log_path = copy_string(path, ".log");
+  old_path = copy_string(path, ".old");
+  return index_path != NULL && tmp_path != NULL && log_path != NULL &&
+         old_path != NULL;
+}
+
+bool index_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM index;
+  ERL_NIF_TERM dir;
+  ERL_NIF_TERM term;
+  ErlNifUInt64 limit;
+
+  build_type = enif_open_resource_type(env, NULL, "xattr_index_builder",
+                                       build_dtor, ERL_NIF_RT_CREATE, NULL);
+  if (build_type == NULL) {
+    return false;
+  }
+
+  if (!enif_is_map(env, load_info) ||
+      !get_option(env, load_info, "index", &index)) {
+    return true;
+  }
+
+  if (!get_option(env, load_info, "index_root", &dir) ||
+      !init_paths(env, index, dir)) {
+    index_destroy();
+    return false;
+  }
+
+  if (get_option(env, load_info, "index_names", &term) &&
+      !init_names(env, term)) {
+    index_destroy();
+    return false;
+  }
+
+  if (get_option(env, load_info, "index_max_value", &term)) {
+    if (!enif_get_uint64(env, term, &limit) || limit > SCRATCH_SIZE) {
+      index_destroy();
+      return false;
+    }
+    max_value = limit;
+  }
+
+  index_lock = enif_rwlock_create("xattr_index");
+  journal_lock = enif_mutex_create("xattr_index_journal");
+  compact_lock = enif_mutex_create("xattr_index_compact");
+  wake_lock = enif_mutex_create("xattr_index_wake");
+  wake_cond = enif_cond_create("xattr_index_wake");
+  if (index_lock == NULL || journal_lock == NULL || compact_lock == NULL ||
+      wake_lock == NULL || wake_cond == NULL || !layer_init(&live)) {
+    index_destroy();
+    return false;
+  }
+
+  /* missing or foreign index starts empty and is replaced by compaction */
+  base_open(&base, index_path);
+
+  /* journal of interrupted compaction goes first, then both are merged */
+  if (journal_replay(old_path)) {
+    journal_replay(log_path);
+    journal_rewrite();
+  } else {
+    journal_replay(log_path);
+  }
+  if (journal_fd == -1) {
+    journal_open();
+  }
+
+  if (enif_thread_create("xattr_index", &compactor, compact_loop, NULL,
+                         NULL) != 0) {
+    index_destroy();
+    return false;
+  }
+  compactor_started = true;
+
+  enabled = true;
+  return true;
+}
+
+void index_destroy(void) {
+  size_t i;
+
+  if (compactor_started) {
+    enif_mutex_lock(wake_lock);
+    stopping = true;
+    enif_cond_signal(wake_cond);
+    enif_mutex_unlock(wake_lock);
+    enif_thread_join(compactor, NULL);
+    compactor_started = false;
+  }
+
+  enabled = false;
+  journal_close();
+  base_close(&base);
+  layer_free(&live);
+  drop_frozen();
+
+  for (i = 0; i < names_count; i++) {
+    enif_free(names[i]);
+  }
+  if (names != NULL) {
+    enif_free(names);
+  }
+  names = NULL;
+  names_count = 0;
+  max_value = DEFAULT_MAX_VALUE;
+
+  if (root != NULL) {
+    enif_free(root);
+  }
+  if (index_path != NULL) {
+    enif_free(index_path);
+  }
+  if (tmp_path != NULL) {
+    enif_free(tmp_path);
+  }
+  if (log_path != NULL) {
+    enif_free(log_path);
+  }
+  if (old_path != NULL) {
+    enif_free(old_path);
+  }
+  root = index_path = tmp_path = log_path = old_path = NULL;
+  root_len = 0;
+
+  if (wake_cond != NULL) {
+    enif_cond_destroy(wake_cond);
+  }
+  if (wake_lock != NULL) {
+    enif_mutex_destroy(wake_lock);
+  }
+  if (compact_lock != NULL) {
+    enif_mutex_destroy(compact_lock);
+  }
+  if (journal_lock != NULL) {
+    enif_mutex_destroy(journal_lock);
+  }
+  if (index_lock != NULL) {
+    enif_rwlock_destroy(index_lock);
+  }
+  wake_cond = NULL;
+  wake_lock = compact_lock = journal_lock = NULL;
+  index_lock = NULL;
+
+  seq = 0;
+  stopping = wake_pending = compact_requested = false;
+}
+
+bool index_enabled(void) { return enabled; }
+
+bool index_wants(const char *name) { return enabled && is_indexed(name); }
+
+char *index_resolve(int fd, const char *path) {
+  char real[PATH_MAX];
+  char *copy = NULL;
+  int saved_errno = errno;
+
+  if (enabled && resolve_path(fd, path, real)) {
+    copy = copy_string(real, "");
+  }
+
+  errno = saved_errno;
+  return copy;
+}
+
+void index_update(ErlNifUInt64 dev, ErlNifUInt64 ino, const char *real,
+                  const char *name, const ErlNifBinary *value) {
+  size_t name_len = strlen(name);
+  size_t real_len = strlen(real);
+  size_t value_len;
+  bool removed;
+  bool wake = false;
+  entry_t entry;
+  char *data;
+  int saved_errno = errno;
+
+  if (!enabled || !is_indexed(name) || !under_root(real, real_len)) {
+    errno = saved_errno;
+    return;
+  }
+
+  /* values too large to be indexed drop the previous ones, and so do
+   * headers of values split into chunks, which are large by definition */
+  removed = value == NULL || value->size > max_value ||
+            is_chunk_header(value->data, value->size);
+  value_len = removed ? 0 : value->size;
+
+  if ((data = enif_alloc(name_len + value_len + real_len + 1)) == NULL) {
+    errno = saved_errno;
+    return;
+  }
+  memcpy(data, name, name_len);
+  if (!removed) {
+    memcpy(data + name_len, value->data, value_len);
+  }
+  memcpy(data + name_len + value_len, real, real_len);
+  fill_entry(&entry, data, dev, ino, removed, name_len, value_len, real_len);
+
+  enif_mutex_lock(journal_lock);
+  journal_append(&entry);
+
+  enif_rwlock_rwlock(index_lock);
+  entry.seq = ++seq;
+  if (!layer_put(&live, &entry)) {
+    enif_free(data);
+  }
+  if (layer_full() && !compact_requested) {
+    compact_requested = wake = true;
+  }
+  enif_rwlock_rwunlock(index_lock);
+  enif_mutex_unlock(journal_lock);
+
+  if (wake) {
+    enif_mutex_lock(wake_lock);
+    wake_pending = true;
+    enif_cond_signal(wake_cond);
+    enif_mutex_unlock(wake_lock);
+  }
+
+  errno = saved_errno;
+}
+
+ERL_NIF_TERM index_lookup_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  char name[NAME_BUFFER_SIZE];
+  const index_post_t *post;
+  const index_file_t *file;
+  const entry_t *entry;
+  layer_t *layers[2];
+  ErlNifBinary value;
+  ErlNifUInt64 hash;
+  ERL_NIF_TERM error;
+  ERL_NIF_TERM list;
+  size_t name_len;
+  size_t i;
+  size_t j;
+
+  if (argc != 2 || !enif_inspect_iolist_as_binary(env, argv[1], &value)) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_name_arg(env, argv[0], name, &error)) {
+    return error;
+  }
+
+  if (!enabled) {
+    return make_error_tuple(env, atom_enotsup);
+  }
+
+  name_len = strlen(name);
+  hash = key_hash(name, name_len, value.data, value.size);
+  list = enif_make_list(env, 0);
+
+  enif_rwlock_rlock(index_lock);
+  layers[0] = &live;
+  layers[1] = frozen;
+
+  for (i = 0; i < 2 && layers[i] != NULL; i++) {
+    for (j = layers[i]->key_buckets[hash & (layers[i]->nbuckets - 1)]; j != 0;
+         j = entry->key_next) {
+      entry = &layers[i]->entries[j - 1];
+      if (entry->key_hash == hash && entry->name_len == name_len &&
+          entry->value_len == value.size &&
+          memcmp(entry->data, name, name_len) == 0 &&
+          memcmp(entry_value(entry), value.data, value.size) == 0 &&
+          !overridden(layers, i, entry->dev, entry->ino, name, name_len)) {
+        list = enif_make_list_cell(
+            env, make_path(env, entry_path(entry), entry->path_len), list);
+      }
+    }
+  }
+
+  for (i = lower_bound(hash); i < base.post_count && base.posts[i].hash == hash;
+       i++) {
+    post = &base.posts[i];
+    file = &base.files[post->file];
+    if (post_matches(post, hash, name, name_len, value.data, value.size) &&
+        !overridden(layers, 2, file->dev, file->ino, name, name_len)) {
+      list = enif_make_list_cell(
+          env, make_path(env, base.strings + file->path_off, file->path_len),
+          list);
+    }
+  }
+
+  enif_rwlock_runlock(index_lock);
+
+  return make_ok_tuple(env, list);
+}
+
+ERL_NIF_TERM index_builder_nif(ErlNifEnv *env, UNUSED int argc,
+                               UNUSED const ERL_NIF_TERM argv[]) {
+  build_t *build;
+  ERL_NIF_TERM term;
+
+  if (!enabled) {
+    return make_error_tuple(env, atom_enotsup);
+  }
+
+  if ((build = enif_alloc_resource(build_type, sizeof(build_t))) == NULL) {
+    return make_error_tuple(env, atom_badalloc);
+  }
+  memset(build, 0, sizeof(build_t));
+
+  build->lock = enif_mutex_create("xattr_index_build");
+  if (build->lock == NULL || !builder_init(&build->builder)) {
+    enif_release_resource(build);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  enif_rwlock_rlock(index_lock);
+  build->seq = seq;
+  enif_rwlock_runlock(index_lock);
+
+  term = enif_make_resource(env, build);
+  enif_release_resource(build);
+
+  return enif_make_tuple3(env, atom_ok, term, make_path(env, root, root_len));
+}
+
+ERL_NIF_TERM index_builder_add_nif(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  ERL_NIF_TERM result = atom_ok;
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM head;
+  build_t *build;
+
+  if (argc != 2 ||
+      !enif_get_resource(env, argv[0], build_type, (void **)&build) ||
+      !enif_is_list(env, argv[1])) {
+    return enif_make_badarg(env);
+  }
+
+  enif_mutex_lock(build->lock);
+
+  if (build->committed) {
+    result = enif_make_badarg(env);
+  }
+
+  list = argv[1];
+  while (!build->committed && enif_get_list_cell(env, list, &head, &list)) {
+    if (!add_scanned(env, &build->builder, head, &result)) {
+      break;
+    }
+  }
+
+  enif_mutex_unlock(build->lock);
+
+  return result;
+}
+
+ERL_NIF_TERM index_commit_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]) {
+  ErlNifUInt64 added = 0;
+  ErlNifUInt64 removed = 0;
+  build_t *build;
+  bool ok;
+
+  if (argc != 2 ||
+      !enif_get_resource(env, argv[0], build_type, (void **)&build) ||
+      !enif_is_atom(env, argv[1])) {
+    return enif_make_badarg(env);
+  }
+
+  enif_mutex_lock(build->lock);
+
+  if (build->committed) {
+    enif_mutex_unlock(build->lock);
+    return enif_make_badarg(env);
+  }
+
+  enif_mutex_lock(compact_lock);
+  ok = commit(build, enif_is_identical(argv[1], atom_true), &added, &removed);
+  enif_mutex_unlock(compact_lock);
+
+  if (ok) {
+    build->committed = true;
+    builder_free(&build->builder);
+  }
+
+  enif_mutex_unlock(build->lock);
+
+  if (!ok) {
+    return make_errno_tuple(env);
+  }
+
+  return enif_make_tuple3(env, atom_ok, enif_make_uint64(env, added),
+                          enif_make_uint64(env, removed));
+}
+
+#else
+
+/*
+ * Alternate data streams cannot be watched for changes made by other
+ * processes and there is no cheap canonical path, Windows has no index
+ */
+
+bool index_init(UNUSED ErlNifEnv *env, UNUSED ERL_NIF_TERM load_info) {
+  return true;
+}
+
+void index_destroy(void) {}
+
+bool index_enabled(void) { return false; }
+
+void index_update(UNUSED ErlNifUInt64 dev, UNUSED ErlNifUInt64 ino,
+                  UNUSED int fd, UNUSED const char *path,
+                  UNUSED const char *name, UNUSED const ErlNifBinary *value) {}
+
+ERL_NIF_TERM index_lookup_nif(ErlNifEnv *env, UNUSED int argc,
+                              UNUSED const ERL_NIF_TERM argv[]) {
+  return make_error_tuple(env, atom_enotsup);
+}
+
+ERL_NIF_TERM index_builder_nif(ErlNifEnv *env, UNUSED int argc,
+                               UNUSED const ERL_NIF_TERM argv[]) {
+  return make_error_tuple(env, atom_enotsup);
+}
+
+ERL_NIF_TERM index_builder_add_nif(ErlNifEnv *env, UNUSED int argc,
+                                   UNUSED const ERL_NIF_TERM argv[]) {
+  return make_error_tuple(env, atom_enotsup);
+}
+
+ERL_NIF_TERM index_commit_nif(ErlNifEnv *env, UNUSED int argc,
+                              UNUSED const ERL_NIF_TERM argv[]) {
+  return make_error_tuple(env, atom_enotsup);
+}
+
+#endif
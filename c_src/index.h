@@ -0,0 +1,87 @@
+#ifndef ELIXIR_XATTR_INDEX_H
+#define ELIXIR_XATTR_INDEX_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+/**
+ * Reads `index`, `index_root`, `index_names` and `index_max_value` options
+ * from NIF \a load_info map, opens the index file and replays its journal.
+ * The index is disabled if `index` option is missing. Index builder resource
+ * type is registered either way.
+ *
+ * \return `false` if options are malformed, index root does not exist or
+ *         memory cannot be allocated.
+ */
+bool index_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Stops compaction thread and unmaps the index. Updates not compacted yet are
+ * kept in the journal. Called from NIF `unload` callback.
+ */
+void index_destroy(void);
+
+/**
+ * Checks whether index has been enabled in `index_init`.
+ */
+bool index_enabled(void);
+
+/**
+ * Checks whether changes of attribute \a name (tagged, not prefixed) are
+ * recorded in the index.
+ */
+bool index_wants(const char *name);
+
+/**
+ * Finds canonical path of file open as descriptor \a fd, or at \a path if
+ * \a fd is `-1`. Files opened for more calls resolve it once and pass it to
+ * every `index_update`. `errno` is kept.
+ *
+ * \return Newly allocated path to be released with `enif_free`, or `NULL` if
+ *         the index is disabled or the path cannot be resolved.
+ */
+char *index_resolve(int fd, const char *path);
+
+/**
+ * Records that attribute \a name (tagged, not prefixed) of file \a dev /
+ * \a ino at canonical path \a real has been set to \a value, or removed if
+ * \a value is `NULL`. Files outside of index root and names which are not
+ * indexed are ignored.
+ *
+ * Failures only cause drift between the index and file system, which is
+ * repaired by reconciliation, so they are not reported and `errno` is kept.
+ */
+void index_update(ErlNifUInt64 dev, ErlNifUInt64 ino, const char *real,
+                  const char *name, const ErlNifBinary *value);
+
+/*
+ * The index is a sorted run of (name, value, file) postings in a file mapped
+ * into memory, with an in-memory layer of updates made since it was written
+ * on top. Updates are appended to a journal next to the index file and
+ * merged into a new run by a background thread once the layer grows large.
+ *
+ * Bulk build and reconciliation feed entries of `Xattr.scan/2` into a builder
+ * resource, which replaces the run once committed. Updates made after the
+ * builder has been created survive the commit.
+ */
+
+/** @spec index_lookup_nif(iodata, iodata) ::
+ *          {:ok, [binary]} | {:error, term} */
+ERL_NIF_TERM index_lookup_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]);
+
+/** @spec index_builder_nif() :: {:ok, reference, binary} | {:error, term} */
+ERL_NIF_TERM index_builder_nif(ErlNifEnv *env, int argc,
+                               const ERL_NIF_TERM argv[]);
+
+/** @spec index_builder_add_nif(reference, [{iodata, [{iodata, binary}]}]) ::
+ *          :ok | {:error, term} */
+ERL_NIF_TERM index_builder_add_nif(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]);
+
+/** @spec index_commit_nif(reference, boolean) ::
+ *          {:ok, non_neg_integer, non_neg_integer} | {:error, term} */
+ERL_NIF_TERM index_commit_nif(ErlNifEnv *env, int argc,
+                              const ERL_NIF_TERM argv[]);
+
+#endif
@@ -0,0 +1,123 @@
+#include "listing.h"
+
+#include "sched.h"
+#include "util.h"
+
+/* Number of names decoded between checks of the time slice */
+#define LISTING_STEP 128
+
+typedef struct {
+  xattr_listing_t listing;
+  /** Name under which the NIF is rescheduled */
+  const char *name;
+} listing_state_t;
+
+static ErlNifResourceType *listing_type = NULL;
+
+static void listing_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  listing_state_t *state = obj;
+
+  /* the listing has not been finished if its process died in the meantime */
+  listing_end_impl(&state->listing);
+}
+
+bool listing_init(ErlNifEnv *env) {
+  listing_type = enif_open_resource_type(
+      env, NULL, "xattr_listing", listing_dtor, ERL_NIF_RT_CREATE, NULL);
+  return listing_type != NULL;
+}
+
+/**
+ * Runs steps of \a listing until all names are decoded or the time slice is
+ * over.
+ *
+ * \return `true` if all names have been decoded.
+ */
+static bool run_steps(ErlNifEnv *env, xattr_listing_t *listing) {
+  sched_slice_t slice;
+  bool done;
+
+  sched_slice_start(&slice);
+  while (!(done = listing_step_impl(env, listing, LISTING_STEP))) {
+    if (sched_slice_over(env, &slice)) {
+      return false;
+    }
+  }
+
+  /* report time of the last steps */
+  sched_slice_over(env, &slice);
+  return done;
+}
+
+static ERL_NIF_TERM finish(ErlNifEnv *env, xattr_listing_t *listing) {
+  listing_end_impl(listing);
+  return make_ok_rest_tuple(env, listing->list, listing->rest);
+}
+
+static ERL_NIF_TERM resume_listing(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]);
+
+/**
+ * Reschedules listing \a state, held by resource term \a self.
+ */
+static ERL_NIF_TERM reschedule(ErlNifEnv *env, listing_state_t *state,
+                               ERL_NIF_TERM self) {
+  ERL_NIF_TERM argv[4];
+
+  argv[0] = self;
+  argv[1] = state->listing.list;
+  argv[2] = state->listing.rest;
+  argv[3] = state->listing.strings;
+
+  return enif_schedule_nif(env, state->name, 0, resume_listing, 4, argv);
+}
+
+/** @spec resume_listing(reference, list, list(binary), binary) ::
+ *          {:ok, list} | {:ok, list, list(binary)} */
+static ERL_NIF_TERM resume_listing(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  listing_state_t *state;
+
+  if (argc != 4 ||
+      !enif_get_resource(env, argv[0], listing_type, (void **)&state)) {
+    return enif_make_badarg(env);
+  }
+
+  state->listing.list = argv[1];
+  state->listing.rest = argv[2];
+  state->listing.strings = argv[3];
+
+  if (!run_steps(env, &state->listing)) {
+    return reschedule(env, state, argv[0]);
+  }
+
+  return finish(env, &state->listing);
+}
+
+ERL_NIF_TERM listing_run(ErlNifEnv *env, const char *name,
+                         xattr_listing_t *listing) {
+  listing_state_t *state;
+  ERL_NIF_TERM self;
+
+  if (run_steps(env, listing)) {
+    return finish(env, listing);
+  }
+
+  if (!listing_detach_impl(listing)) {
+    listing_end_impl(listing);
+    return make_errno_tuple(env);
+  }
+
+  state = enif_alloc_resource(listing_type, sizeof(listing_state_t));
+  if (state == NULL) {
+    listing_end_impl(listing);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  state->listing = *listing;
+  state->name = name;
+  self = enif_make_resource(env, state);
+  enif_release_resource(state);
+
+  return reschedule(env, state, self);
+}
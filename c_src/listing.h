@@ -0,0 +1,31 @@
+#ifndef ELIXIR_XATTR_LISTING_H
+#define ELIXIR_XATTR_LISTING_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+#include "impl.h"
+
+/*
+ * Listing NIFs decode names in steps and yield the normal scheduler when its
+ * time slice is over, so that files with thousands of attributes do not hold
+ * it for long. The listing is then moved into a resource and continued by the
+ * rescheduled NIF, which gets terms built so far in its arguments.
+ */
+
+/**
+ * Registers listing resource type. Called from NIF `load` callback.
+ */
+bool listing_init(ErlNifEnv *env);
+
+/**
+ * Decodes names of \a listing, begun with `listing_begin_impl` or
+ * `flisting_begin_impl`, and releases it.
+ *
+ * \return Result of listing NIF named \a name, `{:ok, list}` or
+ *         `{:ok, list, rest}`, or the NIF rescheduled to finish the listing.
+ */
+ERL_NIF_TERM listing_run(ErlNifEnv *env, const char *name,
+                         xattr_listing_t *listing);
+
+#endif
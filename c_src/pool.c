@@ -0,0 +1,498 @@
+#include "pool.h"
+
+#include <string.h>
+
+#include "handle.h"
+#include "impl.h"
+#include "util.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_QUEUE_SIZE 65536
+#define MAX_THREADS 256
+
+/*
+ * Submission queue is a bounded multi-producer, multi-consumer ring of
+ * cells, each with a sequence number telling whether it is free for the
+ * producer or filled for the consumer at given position (D. Vyukov). Without
+ * GCC atomics it falls back to a mutex.
+ */
+#ifdef __GNUC__
+#define LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define CAS_RELAXED(ptr, expected, desired)                                    \
+  __atomic_compare_exchange_n((ptr), (expected), (desired), true,              \
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+typedef enum { POOL_HAS, POOL_GET, POOL_SET, POOL_REMOVE } pool_op_t;
+
+typedef struct {
+  pool_op_t op;
+  ErlNifPid pid;
+  /** Holds reference and value; message is built and sent from it */
+  ErlNifEnv *env;
+  ERL_NIF_TERM ref;
+  ErlNifBinary value;
+  /** Kept handle, or `NULL` if the job works on path */
+  xattr_handle_t *handle;
+  /** NUL-terminated name, followed by NUL-terminated path */
+  char data[1];
+} pool_job_t;
+
+typedef struct {
+  size_t seq;
+  pool_job_t *job;
+} pool_cell_t;
+
+static pool_cell_t *cells = NULL;
+static size_t mask = 0;
+static size_t head = 0;
+static size_t tail = 0;
+
+/** Guards sleeping only; queue operations do not take it */
+static ErlNifMutex *lock = NULL;
+static ErlNifCond *cond = NULL;
+static int sleepers = 0;
+static bool stopping = false;
+#ifndef __GNUC__
+static ErlNifMutex *queue_lock = NULL;
+#endif
+
+static ErlNifTid *threads = NULL;
+static size_t threads_count = 0;
+
+/*
+ * Queue
+ */
+
+#ifdef __GNUC__
+
+static bool enqueue(pool_job_t *job) {
+  size_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  pool_cell_t *cell;
+  long diff;
+
+  for (;;) {
+    cell = &cells[pos & mask];
+    diff = (long)(LOAD_ACQUIRE(&cell->seq) - pos);
+    if (diff == 0) {
+      if (CAS_RELAXED(&tail, &pos, pos + 1)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* full */
+      return false;
+    } else {
+      pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->job = job;
+  STORE_RELEASE(&cell->seq, pos + 1);
+  return true;
+}
+
+static pool_job_t *dequeue(void) {
+  size_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  pool_cell_t *cell;
+  pool_job_t *job;
+  long diff;
+
+  for (;;) {
+    cell = &cells[pos & mask];
+    diff = (long)(LOAD_ACQUIRE(&cell->seq) - (pos + 1));
+    if (diff == 0) {
+      if (CAS_RELAXED(&head, &pos, pos + 1)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* empty */
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+
+  job = cell->job;
+  STORE_RELEASE(&cell->seq, pos + mask + 1);
+  return job;
+}
+
+#else
+
+static bool enqueue(pool_job_t *job) {
+  pool_cell_t *cell;
+  bool result = false;
+
+  enif_mutex_lock(queue_lock);
+  cell = &cells[tail & mask];
+  if (cell->seq == tail) {
+    cell->job = job;
+    cell->seq = ++tail;
+    result = true;
+  }
+  enif_mutex_unlock(queue_lock);
+
+  return result;
+}
+
+static pool_job_t *dequeue(void) {
+  pool_cell_t *cell;
+  pool_job_t *job = NULL;
+
+  enif_mutex_lock(queue_lock);
+  cell = &cells[head & mask];
+  if (cell->seq == head + 1) {
+    job = cell->job;
+    cell->seq = head + mask + 1;
+    head++;
+  }
+  enif_mutex_unlock(queue_lock);
+
+  return job;
+}
+
+#endif
+
+/**
+ * Wakes up a sleeping worker, if there is any. Workers count themselves as
+ * sleeping before they check the queue for the last time, so either they
+ * see the job just queued, or the producer sees them.
+ */
+static void wake_worker(void) {
+#ifdef __GNUC__
+  FENCE();
+  if (__atomic_load_n(&sleepers, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+#endif
+
+  enif_mutex_lock(lock);
+  enif_cond_signal(cond);
+  enif_mutex_unlock(lock);
+}
+
+/*
+ * Jobs
+ */
+
+static void free_job(pool_job_t *job) {
+  if (job->handle != NULL) {
+    enif_release_resource(job->handle);
+  }
+  enif_free_env(job->env);
+  enif_free(job);
+}
+
+static ERL_NIF_TERM run_job(pool_job_t *job) {
+  ErlNifEnv *env = job->env;
+  const char *name = job->data;
+  const char *path = job->data + strlen(name) + 1;
+  xattr_file_t *file = NULL;
+  ERL_NIF_TERM value;
+  ERL_NIF_TERM result;
+  bool has;
+  bool ok = false;
+
+  if (job->handle != NULL && (file = handle_lock(job->handle)) == NULL) {
+    return make_closed_tuple(env);
+  }
+
+  switch (job->op) {
+  case POOL_HAS:
+    ok = file != NULL ? fhasxattr_impl(env, file, name, &has)
+                      : hasxattr_impl(env, path, name, &has);
+    value = make_bool(env, has);
+    break;
+  case POOL_GET:
+    ok = file != NULL ? fgetxattr_impl(env, file, name, &value)
+                      : getxattr_impl(env, path, name, &value);
+    break;
+  case POOL_SET:
+    ok = file != NULL ? fsetxattr_impl(env, file, name, job->value)
+                      : setxattr_impl(env, path, name, job->value);
+    value = atom_ok;
+    break;
+  case POOL_REMOVE:
+    ok = file != NULL ? fremovexattr_impl(env, file, name)
+                      : removexattr_impl(env, path, name);
+    value = atom_ok;
+    break;
+  }
+
+  if (!ok) {
+    result = make_errno_tuple(env);
+  } else if (job->op == POOL_HAS || job->op == POOL_GET) {
+    result = make_ok_tuple(env, value);
+  } else {
+    result = value;
+  }
+
+  if (file != NULL) {
+    handle_unlock(job->handle);
+  }
+
+  return result;
+}
+
+static void *worker_loop(UNUSED void *arg) {
+  pool_job_t *job;
+  ERL_NIF_TERM result;
+
+  for (;;) {
+    if ((job = dequeue()) == NULL) {
+      enif_mutex_lock(lock);
+#ifdef __GNUC__
+      __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+#endif
+      while (!stopping && (job = dequeue()) == NULL) {
+        enif_cond_wait(cond, lock);
+      }
+#ifdef __GNUC__
+      __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+#endif
+      enif_mutex_unlock(lock);
+
+      if (job == NULL) {
+        break;
+      }
+    }
+
+    result = run_job(job);
+    enif_send(NULL, &job->pid, job->env,
+              enif_make_tuple3(job->env, atom_xattr_result, job->ref, result));
+    free_job(job);
+  }
+
+  return NULL;
+}
+
+/*
+ * Public interface
+ */
+
+static bool get_option(ErlNifEnv *env, ERL_NIF_TERM map, const char *key,
+                       ErlNifUInt64 *value) {
+  ERL_NIF_TERM term;
+
+  if (!enif_is_map(env, map) ||
+      !enif_get_map_value(env, map, enif_make_atom(env, key), &term)) {
+    return true;
+  }
+  return enif_get_uint64(env, term, value);
+}
+
+bool pool_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ErlNifUInt64 count = DEFAULT_THREADS;
+  ErlNifUInt64 queue_size = DEFAULT_QUEUE_SIZE;
+  size_t size = 1;
+  size_t i;
+
+  if (!get_option(env, load_info, "async_threads", &count) ||
+      !get_option(env, load_info, "async_queue_size", &queue_size) ||
+      count > MAX_THREADS || queue_size == 0) {
+    return false;
+  }
+
+  if (count == 0) {
+    return true;
+  }
+
+  /* ring size has to be a power of 2 */
+  while (size < queue_size) {
+    size *= 2;
+  }
+
+  cells = enif_alloc(size * sizeof(pool_cell_t));
+  threads = enif_alloc(count * sizeof(ErlNifTid));
+  lock = enif_mutex_create("xattr_pool");
+  cond = enif_cond_create("xattr_pool");
+#ifndef __GNUC__
+  queue_lock = enif_mutex_create("xattr_pool_queue");
+  if (queue_lock == NULL) {
+    pool_destroy();
+    return false;
+  }
+#endif
+  if (cells == NULL || threads == NULL || lock == NULL || cond == NULL) {
+    pool_destroy();
+    return false;
+  }
+
+  for (i = 0; i < size; i++) {
+    cells[i].seq = i;
+  }
+  mask = size - 1;
+  head = tail = 0;
+  stopping = false;
+
+  for (threads_count = 0; threads_count < count; threads_count++) {
+    if (enif_thread_create("xattr_worker", &threads[threads_count],
+                           worker_loop, NULL, NULL) != 0) {
+      pool_destroy();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void pool_destroy(void) {
+  pool_job_t *job;
+  size_t i;
+
+  if (threads_count > 0) {
+    enif_mutex_lock(lock);
+    stopping = true;
+    enif_cond_broadcast(cond);
+    enif_mutex_unlock(lock);
+
+    for (i = 0; i < threads_count; i++) {
+      enif_thread_join(threads[i], NULL);
+    }
+    threads_count = 0;
+
+    while ((job = dequeue()) != NULL) {
+      free_job(job);
+    }
+  }
+
+  if (cond != NULL) {
+    enif_cond_destroy(cond);
+    cond = NULL;
+  }
+  if (lock != NULL) {
+    enif_mutex_destroy(lock);
+    lock = NULL;
+  }
+#ifndef __GNUC__
+  if (queue_lock != NULL) {
+    enif_mutex_destroy(queue_lock);
+    queue_lock = NULL;
+  }
+#endif
+  enif_free(threads);
+  threads = NULL;
+  enif_free(cells);
+  cells = NULL;
+}
+
+/*
+ * NIFs
+ */
+
+/**
+ * Queues \a op on target `argv[0]` and attribute name `argv[1]`. `argv[2]`
+ * is the value for `POOL_SET`, last argument is the pid to reply to.
+ */
+static ERL_NIF_TERM submit(ErlNifEnv *env, pool_op_t op, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  xattr_handle_t *handle = NULL;
+  pool_job_t *job;
+  ErlNifPid pid;
+  ERL_NIF_TERM ref;
+  ERL_NIF_TERM result;
+  arg_status_t status;
+  size_t name_len;
+  size_t path_len;
+
+  if (argc != (op == POOL_SET ? 4 : 3) ||
+      !enif_get_local_pid(env, argv[argc - 1], &pid) ||
+      (op == POOL_SET && !enif_is_binary(env, argv[2]))) {
+    return enif_make_badarg(env);
+  }
+
+  path[0] = '\0';
+  if (!handle_get(env, argv[0], &handle) &&
+      (status = get_cstring_arg(env, argv[0], path, PATH_BUFFER_SIZE)) !=
+          ARG_OK) {
+    result = make_arg_error(env, status, atom_enametoolong);
+    if (status == ARG_BADARG) {
+      return result;
+    }
+    goto reply;
+  }
+
+  if ((status = get_cstring_arg(env, argv[1], name, NAME_BUFFER_SIZE)) !=
+      ARG_OK) {
+    result = make_arg_error(env, status, atom_erange);
+    if (status == ARG_BADARG) {
+      return result;
+    }
+    goto reply;
+  }
+
+  if (cells == NULL) {
+    result = make_error_tuple(env, atom_enotsup);
+    goto reply;
+  }
+
+  name_len = strlen(name);
+  path_len = strlen(path);
+  if ((job = enif_alloc(sizeof(pool_job_t) + name_len + path_len + 1)) ==
+      NULL) {
+    result = make_error_tuple(env, atom_badalloc);
+    goto reply;
+  }
+
+  if ((job->env = enif_alloc_env()) == NULL) {
+    enif_free(job);
+    result = make_error_tuple(env, atom_badalloc);
+    goto reply;
+  }
+
+  ref = enif_make_ref(env);
+  job->op = op;
+  job->pid = pid;
+  job->ref = enif_make_copy(job->env, ref);
+  job->handle = handle;
+  memcpy(job->data, name, name_len + 1);
+  memcpy(job->data + name_len + 1, path, path_len + 1);
+  if (op == POOL_SET) {
+    /* refc binaries are shared, not copied */
+    enif_inspect_binary(job->env, enif_make_copy(job->env, argv[2]),
+                        &job->value);
+  }
+  if (handle != NULL) {
+    enif_keep_resource(handle);
+  }
+
+  if (!enqueue(job)) {
+    free_job(job);
+    result = make_error_tuple(env, atom_eagain);
+    goto reply_ref;
+  }
+
+  wake_worker();
+  return ref;
+
+reply:
+  ref = enif_make_ref(env);
+reply_ref:
+  enif_send(env, &pid, NULL,
+            enif_make_tuple3(env, atom_xattr_result, ref, result));
+  return ref;
+}
+
+ERL_NIF_TERM async_hasxattr_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  return submit(env, POOL_HAS, argc, argv);
+}
+
+ERL_NIF_TERM async_getxattr_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  return submit(env, POOL_GET, argc, argv);
+}
+
+ERL_NIF_TERM async_setxattr_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  return submit(env, POOL_SET, argc, argv);
+}
+
+ERL_NIF_TERM async_removexattr_nif(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  return submit(env, POOL_REMOVE, argc, argv);
+}
@@ -0,0 +1,44 @@
+#ifndef ELIXIR_XATTR_POOL_H
+#define ELIXIR_XATTR_POOL_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+/**
+ * Reads `async_threads` and `async_queue_size` options from NIF \a load_info
+ * map and starts worker threads. Zero threads disable asynchronous calls.
+ *
+ * \return `false` if options are malformed or threads cannot be started.
+ */
+bool pool_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Stops worker threads and drops jobs which have not been run yet.
+ */
+void pool_destroy(void);
+
+/*
+ * Asynchronous NIFs queue the operation and return a reference right away.
+ * Result is sent to `pid` as `{:xattr_result, reference, result}`, where
+ * `result` is what the synchronous NIF would return. Errors found before the
+ * operation is queued (bad path or name, full queue) are sent the same way.
+ */
+
+/** @spec async_hasxattr_nif(iodata | reference, iodata, pid) :: reference */
+ERL_NIF_TERM async_hasxattr_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+/** @spec async_getxattr_nif(iodata | reference, iodata, pid) :: reference */
+ERL_NIF_TERM async_getxattr_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+/** @spec async_setxattr_nif(iodata | reference, iodata, binary, pid) ::
+ *          reference */
+ERL_NIF_TERM async_setxattr_nif(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+/** @spec async_removexattr_nif(iodata | reference, iodata, pid) :: reference */
+ERL_NIF_TERM async_removexattr_nif(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]);
+
+#endif
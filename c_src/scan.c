@@ -0,0 +1,1201 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "scan.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "impl.h"
+#include "impl_uring.h"
+#include "trace.h"
+
+/* Size of getdents64 buffer of each thread */
+#define DIRENT_BUFFER_SIZE 32768
+#define MAX_THREADS 64
+#define SEEN_SHARDS 16
+#define MIN_SEEN 64
+#define MIN_DEQUE 16
+
+/**
+ * Directory entry returned by getdents64, which older C libraries do not
+ * declare.
+ */
+typedef struct {
+  __u64 d_ino;
+  __s64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+} dirent64_t;
+
+/**
+ * Directory waiting to be walked.
+ */
+typedef struct {
+  char *path;
+  /** Already opened descriptor, or -1 */
+  int fd;
+} scan_dir_t;
+
+/**
+ * Directories queued by a thread. The owner pushes and pops at the bottom, so
+ * that it walks the tree depth first, other threads steal from the top, which
+ * holds directories closest to the root and so the largest subtrees.
+ */
+typedef struct {
+  ErlNifMutex *lock;
+  scan_dir_t *items;
+  size_t head;
+  size_t count;
+  size_t capacity;
+} deque_t;
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} inode_t;
+
+/**
+ * Open addressing set of visited inodes, zero inode marks empty slot.
+ */
+typedef struct {
+  ErlNifMutex *lock;
+  inode_t *inodes;
+  size_t count;
+  size_t capacity;
+} seen_shard_t;
+
+typedef struct scan scan_t;
+
+/**
+ * Thread which has finished, waiting to be joined.
+ */
+typedef struct exited {
+  struct exited *next;
+  ErlNifTid tid;
+} exited_t;
+
+typedef struct {
+  scan_t *scan;
+  size_t index;
+  ErlNifTid tid;
+  /** Allocated up front, handed over to exited threads list on exit */
+  exited_t *exited;
+  deque_t deque;
+  /** Environment of chunk being filled */
+  ErlNifEnv *msg_env;
+  ERL_NIF_TERM entries;
+  size_t nentries;
+  /** Filter keys copied to `msg_env`, valid if `has_keys` is set */
+  ERL_NIF_TERM *keys;
+  bool has_keys;
+  ERL_NIF_TERM *results;
+  char path[PATH_BUFFER_SIZE];
+  char dirents[DIRENT_BUFFER_SIZE];
+} worker_t;
+
+struct scan {
+  /** Links of running scans list, valid if `linked` is set */
+  scan_t *prev;
+  scan_t *next;
+  bool linked;
+  ErlNifPid pid;
+  /** Holds message tag and filter keys */
+  ErlNifEnv *env;
+  ERL_NIF_TERM ref;
+  /** Tagged names to be read, all attributes are read if there are none */
+  size_t nnames;
+  const char **names;
+  ERL_NIF_TERM *keys;
+  char *names_buf;
+  size_t chunk_size;
+  /** Guards counters below */
+  ErlNifMutex *lock;
+  ErlNifCond *work_cond;
+  ErlNifCond *credit_cond;
+  /** Directories queued or being walked */
+  size_t pending;
+  /** Directories queued */
+  size_t queued;
+  size_t idle;
+  /** Chunks which can be sent before acknowledgements arrive */
+  size_t credits;
+  size_t chunks;
+  /** Threads which have not finished yet */
+  size_t running;
+  bool cancelled;
+  seen_shard_t seen[SEEN_SHARDS];
+  size_t nworkers;
+  worker_t *workers;
+};
+
+/**
+ * Handle of scan returned to the caller. Each running thread keeps the scan
+ * itself, so that dropping the handle only cancels the scan and never waits
+ * for threads.
+ */
+typedef struct {
+  scan_t *scan;
+} scan_handle_t;
+
+static ErlNifResourceType *scan_type = NULL;
+static ErlNifResourceType *scan_handle_type = NULL;
+
+/* Running scans, so that their threads can be stopped on unload, and threads
+ * which have finished, joined by the next scan or on unload. The lock is
+ * destroyed only while no scan resource exists, as scans may outlive the
+ * library they were started by. */
+static ErlNifMutex *scans_lock = NULL;
+static ErlNifCond *exited_cond = NULL;
+static scan_t *scans = NULL;
+static exited_t *exited = NULL;
+static size_t live_threads = 0;
+static size_t live_scans = 0;
+
+/*
+ * Visited inodes
+ */
+
+/**
+ * Marks inode as visited.
+ *
+ * \return `false` if it has been visited already.
+ */
+static bool mark_seen(scan_t *scan, dev_t dev, ino_t ino) {
+  unsigned long hash = (unsigned long)ino * 2654435761UL ^ (unsigned long)dev;
+  seen_shard_t *shard = &scan->seen[hash % SEEN_SHARDS];
+  inode_t *inodes;
+  size_t capacity;
+  size_t slot;
+  size_t i;
+  bool fresh = true;
+
+  hash /= SEEN_SHARDS;
+  enif_mutex_lock(shard->lock);
+
+  if ((shard->count + 1) * 2 > shard->capacity) {
+    capacity = shard->capacity == 0 ? MIN_SEEN : shard->capacity * 2;
+    if ((inodes = enif_alloc(capacity * sizeof(inode_t))) != NULL) {
+      memset(inodes, 0, capacity * sizeof(inode_t));
+      for (i = 0; i < shard->capacity; i++) {
+        if (shard->inodes[i].ino != 0) {
+          slot = ((unsigned long)shard->inodes[i].ino * 2654435761UL ^
+                  (unsigned long)shard->inodes[i].dev) /
+                 SEEN_SHARDS;
+          for (slot &= capacity - 1; inodes[slot].ino != 0;
+               slot = (slot + 1) & (capacity - 1)) {
+          }
+          inodes[slot] = shard->inodes[i];
+        }
+      }
+      enif_free(shard->inodes);
+      shard->inodes = inodes;
+      shard->capacity = capacity;
+    }
+  }
+
+  /* if the set could not grow, the inode is simply visited again */
+  if ((shard->count + 1) * 2 <= shard->capacity) {
+    for (slot = hash & (shard->capacity - 1); shard->inodes[slot].ino != 0;
+         slot = (slot + 1) & (shard->capacity - 1)) {
+      if (shard->inodes[slot].ino == ino && shard->inodes[slot].dev == dev) {
+        fresh = false;
+        break;
+      }
+    }
+
+    if (fresh) {
+      shard->inodes[slot].dev = dev;
+      shard->inodes[slot].ino = ino;
+      shard->count++;
+    }
+  }
+
+  enif_mutex_unlock(shard->lock);
+  return fresh;
+}
+
+/*
+ * Work queues
+ */
+
+/**
+ * Makes room for one more directory in \a deque. Only the owner pushes, so
+ * the room stays there until it does.
+ */
+static bool reserve_dir(deque_t *deque) {
+  scan_dir_t *items;
+  size_t capacity;
+  size_t i;
+  bool result = true;
+
+  enif_mutex_lock(deque->lock);
+  if (deque->count == deque->capacity) {
+    capacity = deque->capacity == 0 ? MIN_DEQUE : deque->capacity * 2;
+    if ((items = enif_alloc(capacity * sizeof(scan_dir_t))) != NULL) {
+      for (i = 0; i < deque->count; i++) {
+        items[i] = deque->items[(deque->head + i) % deque->capacity];
+      }
+      enif_free(deque->items);
+      deque->items = items;
+      deque->head = 0;
+      deque->capacity = capacity;
+    } else {
+      result = false;
+    }
+  }
+  enif_mutex_unlock(deque->lock);
+
+  return result;
+}
+
+static bool take_dir(deque_t *deque, bool bottom, scan_dir_t *dir) {
+  bool result = false;
+
+  enif_mutex_lock(deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    if (bottom) {
+      *dir = deque->items[(deque->head + deque->count) % deque->capacity];
+    } else {
+      *dir = deque->items[deque->head];
+      deque->head = (deque->head + 1) % deque->capacity;
+    }
+    result = true;
+  }
+  enif_mutex_unlock(deque->lock);
+
+  return result;
+}
+
+/**
+ * Queues directory at \a path on deque of \a worker. Counters are raised
+ * before the directory becomes visible, so that it cannot be finished before
+ * it is counted.
+ */
+static bool push_dir(worker_t *worker, const char *path, int fd) {
+  scan_t *scan = worker->scan;
+  deque_t *deque = &worker->deque;
+  scan_dir_t dir;
+  size_t len = strlen(path) + 1;
+
+  if ((dir.path = enif_alloc(len)) == NULL) {
+    return false;
+  }
+  memcpy(dir.path, path, len);
+  dir.fd = fd;
+
+  if (!reserve_dir(deque)) {
+    enif_free(dir.path);
+    return false;
+  }
+
+  enif_mutex_lock(scan->lock);
+  scan->pending++;
+  scan->queued++;
+  if (scan->idle > 0) {
+    enif_cond_signal(scan->work_cond);
+  }
+  enif_mutex_unlock(scan->lock);
+
+  enif_mutex_lock(deque->lock);
+  deque->items[(deque->head + deque->count) % deque->capacity] = dir;
+  deque->count++;
+  enif_mutex_unlock(deque->lock);
+
+  return true;
+}
+
+/**
+ * Takes next directory from own deque, or steals one from other threads,
+ * waiting while others may still queue more.
+ *
+ * \return `false` once the whole tree has been walked or the scan has been
+ *         cancelled.
+ */
+static bool next_dir(worker_t *worker, scan_dir_t *dir) {
+  scan_t *scan = worker->scan;
+  bool found;
+  size_t i;
+
+  while (!ATOMIC_LOAD(&scan->cancelled)) {
+    found = take_dir(&worker->deque, true, dir);
+    for (i = 1; !found && i < scan->nworkers; i++) {
+      found = take_dir(
+          &scan->workers[(worker->index + i) % scan->nworkers].deque, false,
+          dir);
+    }
+
+    enif_mutex_lock(scan->lock);
+    if (found) {
+      scan->queued--;
+      enif_mutex_unlock(scan->lock);
+      return true;
+    }
+
+    if (scan->pending == 0) {
+      enif_mutex_unlock(scan->lock);
+      return false;
+    }
+
+    /* queued directory may still be on its way into a deque */
+    if (scan->queued == 0 && !scan->cancelled) {
+      scan->idle++;
+      enif_cond_wait(scan->work_cond, scan->lock);
+      scan->idle--;
+    }
+    enif_mutex_unlock(scan->lock);
+  }
+
+  return false;
+}
+
+static void finish_dir(scan_t *scan) {
+  enif_mutex_lock(scan->lock);
+  if (--scan->pending == 0) {
+    enif_cond_broadcast(scan->work_cond);
+  }
+  enif_mutex_unlock(scan->lock);
+}
+
+/*
+ * Results
+ */
+
+static ERL_NIF_TERM make_path(ErlNifEnv *env, const char *dir, size_t dir_len,
+                              const char *name) {
+  ERL_NIF_TERM term;
+  size_t name_len = strlen(name);
+  unsigned char *data = enif_make_new_binary(env, dir_len + name_len, &term);
+
+  memcpy(data, dir, dir_len);
+  memcpy(data + dir_len, name, name_len);
+  return term;
+}
+
+/**
+ * Sends entries collected by \a worker, waiting for a credit first.
+ */
+static void flush(worker_t *worker) {
+  scan_t *scan = worker->scan;
+  ERL_NIF_TERM msg;
+  bool send;
+
+  if (worker->nentries == 0) {
+    return;
+  }
+
+  enif_mutex_lock(scan->lock);
+  while (scan->credits == 0 && !scan->cancelled) {
+    enif_cond_wait(scan->credit_cond, scan->lock);
+  }
+  if ((send = !scan->cancelled)) {
+    scan->credits--;
+    scan->chunks++;
+  }
+  enif_mutex_unlock(scan->lock);
+
+  if (send) {
+    msg = enif_make_tuple3(worker->msg_env, atom_xattr_scan,
+                           enif_make_copy(worker->msg_env, scan->ref),
+                           worker->entries);
+    if (!enif_send(NULL, &scan->pid, worker->msg_env, msg)) {
+      /* the caller is gone */
+      ATOMIC_STORE(&scan->cancelled, true);
+    }
+  }
+
+  enif_clear_env(worker->msg_env);
+  worker->entries = enif_make_list(worker->msg_env, 0);
+  worker->nentries = 0;
+  worker->has_keys = false;
+}
+
+static void add_entry(worker_t *worker, ERL_NIF_TERM entry) {
+  worker->entries = enif_make_list_cell(worker->msg_env, entry,
+                                        worker->entries);
+  if (++worker->nentries >= worker->scan->chunk_size) {
+    flush(worker);
+  }
+}
+
+static void add_error(worker_t *worker, ERL_NIF_TERM path,
+                      ERL_NIF_TERM reason) {
+  ErlNifEnv *env = worker->msg_env;
+
+  add_entry(worker,
+            enif_make_tuple2(env, path, make_error_tuple(env, reason)));
+}
+
+/**
+ * Reads attributes selected by the scan filter from \a file.
+ *
+ * \retval rest List of `{name, value}` tuples to be merged by the caller.
+ * \retval attrs Map of attributes, or reason of failure.
+ */
+static bool read_attrs(worker_t *worker, xattr_file_t *file,
+                       ERL_NIF_TERM *attrs, ERL_NIF_TERM *rest) {
+  scan_t *scan = worker->scan;
+  ErlNifEnv *env = worker->msg_env;
+  const ERL_NIF_TERM *tuple;
+  int arity;
+  size_t i;
+
+  if (scan->nnames == 0) {
+    if (!fgetallxattr_impl(env, file, attrs, rest)) {
+      *attrs = make_errno_term(env);
+      return false;
+    }
+    return true;
+  }
+
+  if (!worker->has_keys) {
+    for (i = 0; i < scan->nnames; i++) {
+      worker->keys[i] = enif_make_copy(env, scan->keys[i]);
+    }
+    worker->has_keys = true;
+  }
+
+  fgetxattr_many_impl(env, file, scan->nnames, scan->names, worker->results);
+
+  *attrs = enif_make_new_map(env);
+  *rest = enif_make_list(env, 0);
+  for (i = 0; i < scan->nnames; i++) {
+    enif_get_tuple(env, worker->results[i], &arity, &tuple);
+    if (enif_is_identical(tuple[0], atom_ok)) {
+      enif_make_map_put(env, *attrs, worker->keys[i], tuple[1], attrs);
+    } else if (!enif_is_identical(tuple[1], atom_enoattr)) {
+      *attrs = tuple[1];
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Reads attributes of file at \a path, opened as \a fd (or -1 to access it by
+ * path), which is closed afterwards. Files without attributes and files
+ * which vanished or do not support attributes are not reported.
+ */
+static void visit(worker_t *worker, int fd, const char *path) {
+  ErlNifEnv *env = worker->msg_env;
+  xattr_file_t *file;
+  ERL_NIF_TERM attrs;
+  ERL_NIF_TERM rest;
+  ERL_NIF_TERM path_term;
+  ErlNifTime trace_start = 0;
+  unsigned length = 0;
+  size_t size = 0;
+  bool traced;
+  bool ok;
+
+  if (!fdopenxattr_impl(env, fd, path, &file)) {
+    if (fd != -1) {
+      close(fd);
+    }
+    add_error(worker, make_path(env, path, strlen(path), ""), atom_badalloc);
+    return;
+  }
+
+  TRACE1(scan__entry, path);
+  if ((traced = TRACE_ENABLED(scan__return))) {
+    trace_start = enif_monotonic_time(ERL_NIF_NSEC);
+  }
+
+  ok = read_attrs(worker, file, &attrs, &rest);
+  closexattr_impl(file);
+
+  if (traced) {
+    if (ok) {
+      enif_get_map_size(env, attrs, &size);
+      enif_get_list_length(env, rest, &length);
+    }
+    TRACE4(scan__return, path, size + length, ok,
+           enif_monotonic_time(ERL_NIF_NSEC) - trace_start);
+  }
+
+  if (!ok) {
+    if (!enif_is_identical(attrs, atom_enoent) &&
+        !enif_is_identical(attrs, atom_enotsup)) {
+      add_error(worker, make_path(env, path, strlen(path), ""), attrs);
+    }
+    return;
+  }
+
+  if (enif_get_map_size(env, attrs, &size) && size == 0 &&
+      enif_is_empty_list(env, rest)) {
+    return;
+  }
+
+  path_term = make_path(env, path, strlen(path), "");
+  if (enif_is_empty_list(env, rest)) {
+    add_entry(worker, enif_make_tuple2(env, path_term, attrs));
+  } else {
+    add_entry(worker, enif_make_tuple3(env, path_term, attrs, rest));
+  }
+}
+
+/*
+ * Walking
+ */
+
+/**
+ * Visits entry \a name of directory \a dirfd, whose path followed by a slash
+ * takes first \a prefix bytes of `worker->path`. Directories are queued,
+ * symbolic links are skipped; devices, FIFOs and sockets are read by path,
+ * so that they are never opened.
+ */
+static void visit_child(worker_t *worker, int dirfd, size_t prefix,
+                        const char *name, unsigned char type) {
+  ErlNifEnv *env = worker->msg_env;
+  struct stat st;
+  size_t len = strlen(name);
+  bool has_stat = false;
+  int fd = -1;
+
+  if (name[0] == '.' &&
+      (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+    return;
+  }
+
+  if (prefix + len >= PATH_BUFFER_SIZE) {
+    add_error(worker, make_path(env, worker->path, prefix, name),
+              atom_enametoolong);
+    return;
+  }
+  memcpy(worker->path + prefix, name, len + 1);
+
+  if (type == DT_UNKNOWN) {
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+      return;
+    }
+    type = IFTODT(st.st_mode);
+    has_stat = true;
+  }
+
+  switch (type) {
+  case DT_DIR:
+    if (!push_dir(worker, worker->path, -1)) {
+      add_error(worker, make_path(env, worker->path, prefix + len, ""),
+                atom_badalloc);
+    }
+    return;
+  case DT_LNK: return;
+  case DT_REG:
+    fd = openat(dirfd, name,
+                O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1 && errno != EACCES && errno != EPERM) {
+      if (errno != ENOENT && errno != ELOOP) {
+        add_error(worker, make_path(env, worker->path, prefix + len, ""),
+                  make_errno_term(env));
+      }
+      return;
+    }
+    break;
+  default: break;
+  }
+
+  if (!has_stat && fd != -1) {
+    has_stat = fstat(fd, &st) == 0;
+  } else if (!has_stat) {
+    has_stat = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+  }
+
+  if (!has_stat) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+
+  /* hard linked files are visited once */
+  if (st.st_nlink > 1 && !mark_seen(worker->scan, st.st_dev, st.st_ino)) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+
+  visit(worker, fd, worker->path);
+}
+
+static void walk_dir(worker_t *worker, scan_dir_t *dir) {
+  scan_t *scan = worker->scan;
+  ErlNifEnv *env = worker->msg_env;
+  dirent64_t *entry;
+  struct stat st;
+  size_t len = strlen(dir->path);
+  size_t prefix = len;
+  long size = 0;
+  long offset;
+  int fd = dir->fd;
+
+  if (fd == -1 &&
+      (fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) ==
+          -1) {
+    if (errno != ENOENT && errno != ELOOP && errno != ENOTDIR) {
+      add_error(worker, make_path(env, dir->path, len, ""),
+                make_errno_term(env));
+    }
+    return;
+  }
+
+  /* directories reached again through bind mounts are skipped */
+  if (fstat(fd, &st) == 0 && !mark_seen(scan, st.st_dev, st.st_ino)) {
+    close(fd);
+    return;
+  }
+
+  memcpy(worker->path, dir->path, len);
+  if (len == 0 || dir->path[len - 1] != '/') {
+    worker->path[prefix++] = '/';
+  }
+
+  while (!ATOMIC_LOAD(&scan->cancelled) &&
+         (size = syscall(SYS_getdents64, fd, worker->dirents,
+                         sizeof(worker->dirents))) > 0) {
+    for (offset = 0; offset < size && !ATOMIC_LOAD(&scan->cancelled);
+         offset += entry->d_reclen) {
+      entry = (dirent64_t *)(worker->dirents + offset);
+      visit_child(worker, fd, prefix, entry->d_name, entry->d_type);
+    }
+  }
+
+  if (size == -1) {
+    add_error(worker, make_path(env, dir->path, len, ""),
+              make_errno_term(env));
+  }
+
+  visit(worker, fd, dir->path);
+}
+
+static void *scan_loop(void *arg) {
+  worker_t *worker = arg;
+  scan_t *scan = worker->scan;
+  exited_t *node;
+  scan_dir_t dir;
+  ERL_NIF_TERM msg;
+  size_t chunks;
+  bool last;
+
+  while (next_dir(worker, &dir)) {
+    walk_dir(worker, &dir);
+    enif_free(dir.path);
+    finish_dir(scan);
+  }
+
+  flush(worker);
+
+  enif_mutex_lock(scan->lock);
+  last = --scan->running == 0;
+  chunks = scan->chunks;
+  enif_mutex_unlock(scan->lock);
+
+  if (last) {
+    msg = enif_make_tuple3(
+        worker->msg_env, atom_xattr_scan,
+        enif_make_copy(worker->msg_env, scan->ref),
+        enif_make_tuple2(worker->msg_env, atom_done,
+                         enif_make_uint64(worker->msg_env, chunks)));
+    enif_send(NULL, &scan->pid, worker->msg_env, msg);
+    enif_clear_env(worker->msg_env);
+  }
+
+  /* buffers of exited threads would be kept until unload */
+  uring_release();
+  scratch_release();
+
+  node = worker->exited;
+  worker->exited = NULL;
+  node->tid = enif_thread_self();
+
+  /* the worker is freed along with the scan */
+  enif_release_resource(scan);
+
+  enif_mutex_lock(scans_lock);
+  node->next = exited;
+  exited = node;
+  live_threads--;
+  enif_cond_broadcast(exited_cond);
+  enif_mutex_unlock(scans_lock);
+
+  return NULL;
+}
+
+/*
+ * Scan resource
+ */
+
+/**
+ * Cancels \a scan, its threads exit shortly.
+ */
+static void cancel_scan(scan_t *scan) {
+  if (scan->lock == NULL) {
+    return;
+  }
+
+  enif_mutex_lock(scan->lock);
+  scan->cancelled = true;
+  enif_cond_broadcast(scan->work_cond);
+  enif_cond_broadcast(scan->credit_cond);
+  enif_mutex_unlock(scan->lock);
+}
+
+/**
+ * Joins threads which have finished. They have nothing left to do but return,
+ * so this does not block for long.
+ */
+static void reap_threads(void) {
+  exited_t *node;
+  exited_t *next;
+
+  enif_mutex_lock(scans_lock);
+  node = exited;
+  exited = NULL;
+  enif_mutex_unlock(scans_lock);
+
+  for (; node != NULL; node = next) {
+    next = node->next;
+    enif_thread_join(node->tid, NULL);
+    enif_free(node);
+  }
+}
+
+static void free_worker(worker_t *worker) {
+  scan_dir_t dir;
+
+  if (worker->deque.lock != NULL) {
+    while (take_dir(&worker->deque, true, &dir)) {
+      if (dir.fd != -1) {
+        close(dir.fd);
+      }
+      enif_free(dir.path);
+    }
+    enif_mutex_destroy(worker->deque.lock);
+  }
+
+  enif_free(worker->deque.items);
+  enif_free(worker->exited);
+  enif_free(worker->keys);
+  enif_free(worker->results);
+  if (worker->msg_env != NULL) {
+    enif_free_env(worker->msg_env);
+  }
+}
+
+static void scan_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  scan_t *scan = obj;
+  size_t i;
+
+  enif_mutex_lock(scans_lock);
+  if (scan->linked) {
+    if (scan->prev != NULL) {
+      scan->prev->next = scan->next;
+    } else {
+      scans = scan->next;
+    }
+    if (scan->next != NULL) {
+      scan->next->prev = scan->prev;
+    }
+    scan->linked = false;
+  }
+  live_scans--;
+  enif_mutex_unlock(scans_lock);
+
+  if (scan->workers != NULL) {
+    for (i = 0; i < scan->nworkers; i++) {
+      free_worker(&scan->workers[i]);
+    }
+    enif_free(scan->workers);
+  }
+
+  for (i = 0; i < SEEN_SHARDS; i++) {
+    if (scan->seen[i].lock != NULL) {
+      enif_mutex_destroy(scan->seen[i].lock);
+    }
+    enif_free(scan->seen[i].inodes);
+  }
+
+  if (scan->lock != NULL) {
+    enif_mutex_destroy(scan->lock);
+  }
+  if (scan->work_cond != NULL) {
+    enif_cond_destroy(scan->work_cond);
+  }
+  if (scan->credit_cond != NULL) {
+    enif_cond_destroy(scan->credit_cond);
+  }
+
+  enif_free(scan->names);
+  enif_free(scan->keys);
+  enif_free(scan->names_buf);
+  if (scan->env != NULL) {
+    enif_free_env(scan->env);
+  }
+}
+
+static void scan_handle_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  scan_handle_t *handle = obj;
+
+  if (handle->scan != NULL) {
+    cancel_scan(handle->scan);
+    enif_release_resource(handle->scan);
+  }
+}
+
+static bool get_scan(ErlNifEnv *env, ERL_NIF_TERM term, scan_t **scan) {
+  scan_handle_t *handle;
+
+  if (!enif_get_resource(env, term, scan_handle_type, (void **)&handle)) {
+    return false;
+  }
+
+  *scan = handle->scan;
+  return true;
+}
+
+bool scan_init(ErlNifEnv *env) {
+  scan_type = enif_open_resource_type(env, NULL, "xattr_scan", scan_dtor,
+                                      ERL_NIF_RT_CREATE, NULL);
+  scan_handle_type =
+      enif_open_resource_type(env, NULL, "xattr_scan_handle", scan_handle_dtor,
+                              ERL_NIF_RT_CREATE, NULL);
+  if (scan_type == NULL || scan_handle_type == NULL) {
+    return false;
+  }
+
+  if (scans_lock == NULL) {
+    scans_lock = enif_mutex_create("xattr_scans");
+  }
+  if (exited_cond == NULL) {
+    exited_cond = enif_cond_create("xattr_scans_exited");
+  }
+  if (scans_lock == NULL || exited_cond == NULL) {
+    scan_destroy();
+    return false;
+  }
+  return true;
+}
+
+void scan_destroy(void) {
+  scan_t *scan;
+  bool in_use = false;
+
+  if (scans_lock != NULL && exited_cond != NULL) {
+    enif_mutex_lock(scans_lock);
+    for (scan = scans; scan != NULL; scan = scan->next) {
+      cancel_scan(scan);
+      scan->linked = false;
+    }
+    scans = NULL;
+
+    /* threads must not outlive the library code they run */
+    while (live_threads > 0) {
+      enif_cond_wait(exited_cond, scans_lock);
+    }
+    in_use = live_scans > 0;
+    enif_mutex_unlock(scans_lock);
+
+    reap_threads();
+  }
+
+  /* destructors of remaining scans still take the lock */
+  if (in_use) {
+    return;
+  }
+
+  if (exited_cond != NULL) {
+    enif_cond_destroy(exited_cond);
+    exited_cond = NULL;
+  }
+  if (scans_lock != NULL) {
+    enif_mutex_destroy(scans_lock);
+    scans_lock = NULL;
+  }
+}
+
+/*
+ * NIFs
+ */
+
+/**
+ * Copies filter \a list of `{tagged_name, key}` tuples into \a scan.
+ *
+ * \retval error On failure, term to be returned from NIF.
+ */
+static bool get_names(ErlNifEnv *env, ERL_NIF_TERM list, scan_t *scan,
+                      ERL_NIF_TERM *error) {
+  char name[NAME_BUFFER_SIZE];
+  const ERL_NIF_TERM *tuple;
+  ERL_NIF_TERM head;
+  unsigned length;
+  size_t used = 0;
+  size_t len;
+  int arity;
+
+  if (!enif_get_list_length(env, list, &length)) {
+    *error = enif_make_badarg(env);
+    return false;
+  }
+
+  /* one extra slot keeps allocations non-empty */
+  scan->names = enif_alloc((length + 1) * sizeof(char *));
+  scan->keys = enif_alloc((length + 1) * sizeof(ERL_NIF_TERM));
+  scan->names_buf = enif_alloc(length * NAME_BUFFER_SIZE + 1);
+  if (scan->names == NULL || scan->keys == NULL || scan->names_buf == NULL) {
+    *error = make_error_tuple(env, atom_badalloc);
+    return false;
+  }
+
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    if (!enif_get_tuple(env, head, &arity, &tuple) || arity != 2) {
+      *error = enif_make_badarg(env);
+      return false;
+    }
+
+    if (!get_name_arg(env, tuple[0], name, error)) {
+      return false;
+    }
+
+    len = strlen(name) + 1;
+    memcpy(scan->names_buf + used, name, len);
+    scan->names[scan->nnames] = scan->names_buf + used;
+    scan->keys[scan->nnames] = enif_make_copy(scan->env, tuple[1]);
+    scan->nnames++;
+    used += len;
+  }
+
+  return true;
+}
+
+static bool init_scan(scan_t *scan, size_t nworkers) {
+  worker_t *worker;
+  size_t i;
+
+  if ((scan->lock = enif_mutex_create("xattr_scan")) == NULL ||
+      (scan->work_cond = enif_cond_create("xattr_scan_work")) == NULL ||
+      (scan->credit_cond = enif_cond_create("xattr_scan_credit")) == NULL) {
+    return false;
+  }
+
+  for (i = 0; i < SEEN_SHARDS; i++) {
+    if ((scan->seen[i].lock = enif_mutex_create("xattr_scan_seen")) == NULL) {
+      return false;
+    }
+  }
+
+  if ((scan->workers = enif_alloc(nworkers * sizeof(worker_t))) == NULL) {
+    return false;
+  }
+  memset(scan->workers, 0, nworkers * sizeof(worker_t));
+  scan->nworkers = nworkers;
+
+  for (i = 0; i < nworkers; i++) {
+    worker = &scan->workers[i];
+    worker->scan = scan;
+    worker->index = i;
+    if ((worker->deque.lock = enif_mutex_create("xattr_scan_deque")) ==
+            NULL ||
+        (worker->exited = enif_alloc(sizeof(exited_t))) == NULL ||
+        (worker->msg_env = enif_alloc_env()) == NULL ||
+        (worker->keys = enif_alloc((scan->nnames + 1) *
+                                   sizeof(ERL_NIF_TERM))) == NULL ||
+        (worker->results = enif_alloc((scan->nnames + 1) *
+                                      sizeof(ERL_NIF_TERM))) == NULL) {
+      return false;
+    }
+    worker->entries = enif_make_list(worker->msg_env, 0);
+  }
+
+  return true;
+}
+
+/*
+ * Root is opened here, so that its errors are returned right away. Scheduled
+ * on dirty I/O scheduler.
+ */
+ERL_NIF_TERM scan_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM result;
+  ERL_NIF_TERM error;
+  scan_handle_t *handle;
+  scan_t *scan;
+  unsigned threads;
+  unsigned chunk_size;
+  unsigned max_chunks;
+  size_t len;
+  size_t i;
+  int fd;
+
+  if (argc != 5 || !enif_get_uint(env, argv[2], &threads) || threads == 0 ||
+      threads > MAX_THREADS || !enif_get_uint(env, argv[3], &chunk_size) ||
+      chunk_size == 0 || !enif_get_uint(env, argv[4], &max_chunks) ||
+      max_chunks == 0) {
+    return enif_make_badarg(env);
+  }
+
+  if (!get_path_arg(env, argv[0], path, &error)) {
+    return error;
+  }
+
+  reap_threads();
+
+  /* children are joined to root with a single slash */
+  for (len = strlen(path); len > 1 && path[len - 1] == '/'; len--) {
+    path[len - 1] = '\0';
+  }
+
+  if ((scan = enif_alloc_resource(scan_type, sizeof(scan_t))) == NULL) {
+    return make_error_tuple(env, atom_badalloc);
+  }
+  memset(scan, 0, sizeof(scan_t));
+
+  enif_mutex_lock(scans_lock);
+  live_scans++;
+  enif_mutex_unlock(scans_lock);
+  enif_self(env, &scan->pid);
+  scan->chunk_size = chunk_size;
+  scan->credits = max_chunks;
+
+  if ((scan->env = enif_alloc_env()) == NULL) {
+    enif_release_resource(scan);
+    return make_error_tuple(env, atom_badalloc);
+  }
+  scan->ref = enif_make_ref(scan->env);
+
+  if (!get_names(env, argv[1], scan, &error)) {
+    enif_release_resource(scan);
+    return error;
+  }
+
+  if (!init_scan(scan, threads)) {
+    enif_release_resource(scan);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    enif_release_resource(scan);
+    return make_errno_tuple(env);
+  }
+
+  if (!push_dir(&scan->workers[0], path, fd)) {
+    close(fd);
+    enif_release_resource(scan);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  if ((handle = enif_alloc_resource(scan_handle_type,
+                                    sizeof(scan_handle_t))) == NULL) {
+    enif_release_resource(scan);
+    return make_error_tuple(env, atom_badalloc);
+  }
+  /* the handle takes over reference of this call */
+  handle->scan = scan;
+
+  enif_mutex_lock(scans_lock);
+  scan->next = scans;
+  if (scans != NULL) {
+    scans->prev = scan;
+  }
+  scans = scan;
+  scan->linked = true;
+  enif_mutex_unlock(scans_lock);
+
+  /* a thread which fails to start keeps `running` above zero, so that
+   * `:done` is never sent; releasing the handle cancels started ones */
+  scan->running = threads;
+  for (i = 0; i < threads; i++) {
+    enif_keep_resource(scan);
+    enif_mutex_lock(scans_lock);
+    live_threads++;
+    enif_mutex_unlock(scans_lock);
+
+    if (enif_thread_create("xattr_scan", &scan->workers[i].tid, scan_loop,
+                           &scan->workers[i], NULL) != 0) {
+      enif_mutex_lock(scans_lock);
+      live_threads--;
+      enif_mutex_unlock(scans_lock);
+      enif_release_resource(scan);
+      enif_release_resource(handle);
+      return make_error_tuple(env, atom_eagain);
+    }
+  }
+
+  result = enif_make_tuple3(env, atom_ok, enif_make_resource(env, handle),
+                            enif_make_copy(env, scan->ref));
+  enif_release_resource(handle);
+  return result;
+}
+
+ERL_NIF_TERM scan_ack_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  scan_t *scan;
+
+  if (argc != 1 || !get_scan(env, argv[0], &scan)) {
+    return enif_make_badarg(env);
+  }
+
+  enif_mutex_lock(scan->lock);
+  scan->credits++;
+  enif_cond_signal(scan->credit_cond);
+  enif_mutex_unlock(scan->lock);
+
+  return atom_ok;
+}
+
+ERL_NIF_TERM scan_cancel_nif(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]) {
+  scan_t *scan;
+
+  if (argc != 1 || !get_scan(env, argv[0], &scan)) {
+    return enif_make_badarg(env);
+  }
+
+  enif_mutex_lock(scan->lock);
+  scan->cancelled = true;
+  enif_cond_broadcast(scan->work_cond);
+  enif_cond_broadcast(scan->credit_cond);
+  enif_mutex_unlock(scan->lock);
+
+  return atom_ok;
+}
+
+#else
+
+/*
+ * Walker relies on getdents64, other platforms cannot scan
+ */
+
+bool scan_init(UNUSED ErlNifEnv *env) { return true; }
+
+void scan_destroy(void) {}
+
+ERL_NIF_TERM scan_nif(ErlNifEnv *env, UNUSED int argc,
+                      UNUSED const ERL_NIF_TERM argv[]) {
+  return make_error_tuple(env, atom_enotsup);
+}
+
+ERL_NIF_TERM scan_ack_nif(UNUSED ErlNifEnv *env, UNUSED int argc,
+                          UNUSED const ERL_NIF_TERM argv[]) {
+  return atom_ok;
+}
+
+ERL_NIF_TERM scan_cancel_nif(UNUSED ErlNifEnv *env, UNUSED int argc,
+                             UNUSED const ERL_NIF_TERM argv[]) {
+  return atom_ok;
+}
+
+#endif
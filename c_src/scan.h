@@ -0,0 +1,40 @@
+#ifndef ELIXIR_XATTR_SCAN_H
+#define ELIXIR_XATTR_SCAN_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+/**
+ * Registers scan resource types. Called from NIF `load` callback.
+ */
+bool scan_init(ErlNifEnv *env);
+
+/**
+ * Cancels all running scans and waits for their threads. Called from NIF
+ * `unload` callback.
+ */
+void scan_destroy(void);
+
+/*
+ * Scans walk directory tree on their own threads and send attributes of
+ * visited files to the caller as `{:xattr_scan, ref, entries}`, where
+ * `entries` is a list of `{path, map}`, `{path, map, rest}` (see
+ * `getallxattr_impl`) or `{path, {:error, reason}}` tuples. At most
+ * `max_chunks` lists are sent ahead of `scan_ack_nif` calls. When all threads
+ * are done, `{:xattr_scan, ref, {:done, chunks}}` is sent, with number of
+ * lists sent in total.
+ */
+
+/** @spec scan_nif(iodata, [{iodata, term}], pos_integer, pos_integer,
+ *                 pos_integer) :: {:ok, reference, reference} |
+ *                                  {:error, term} */
+ERL_NIF_TERM scan_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/** @spec scan_ack_nif(reference) :: :ok */
+ERL_NIF_TERM scan_ack_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/** @spec scan_cancel_nif(reference) :: :ok */
+ERL_NIF_TERM scan_cancel_nif(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]);
+
+#endif
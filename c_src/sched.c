@@ -0,0 +1,453 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "sched.h"
+
+#include "handle.h"
+#include "util.h"
+#include <string.h>
+
+#ifdef __linux__
+#include <mntent.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+#define DEFAULT_LATENCY_BUDGET 1000  /* us */
+#define DEFAULT_SLOW_COOLDOWN 5000   /* ms */
+
+struct sched_mount {
+  char *dir;
+  size_t dirlen;
+  bool remote;
+  /** Monotonic time (us) until which calls on this mount are sent to dirty
+   *  scheduler, because one of them exceeded latency budget. */
+  volatile ErlNifTime slow_until;
+};
+
+static sched_mode_t current_mode = SCHED_ADAPTIVE;
+static ErlNifTime latency_budget = DEFAULT_LATENCY_BUDGET;
+static ErlNifTime slow_cooldown = DEFAULT_SLOW_COOLDOWN * 1000;
+
+/* Mount table is built once at load time and never modified afterwards, except
+ * for `slow_until` hints. Paths which do not match any mount point (and all
+ * paths on platforms without mount table) fall back to `fallback_mount`. */
+static sched_mount_t *mounts = NULL;
+static size_t mounts_count = 0;
+static sched_mount_t fallback_mount = {NULL, 0, false, 0};
+
+/* Mounts indexed by mount point (open addressing, linear probing), so that a
+ * lookup probes prefixes of the path instead of scanning the table */
+static sched_mount_t **mount_index = NULL;
+static size_t mount_index_mask = 0;
+
+/* Working directory and the mount it lives on, read again once `cwd_until`
+ * passes (as getcwd(2) is a system call), so that relative paths are looked
+ * up without it. `cwd_nested` tells whether other mounts lie below it, paths
+ * relative to it may live on those instead. */
+static ErlNifRWLock *cwd_lock = NULL;
+static char cwd[PATH_BUFFER_SIZE];
+static size_t cwd_len = 0;
+static sched_mount_t *cwd_mount = NULL;
+static bool cwd_nested = false;
+static volatile ErlNifTime cwd_until = 0;
+
+/*
+ * Mount table
+ */
+
+#ifdef __linux__
+
+static const char *remote_fstypes[] = {
+    "nfs",  "nfs4",      "cifs", "smb3",  "smbfs", "ncpfs", "afs",
+    "ceph", "glusterfs", "gfs2", "ocfs2", "lustre", "9p",   "coda",
+    "davfs", NULL};
+
+static bool is_remote_fstype(const char *type) {
+  const char **t;
+
+  /* all FUSE file systems go through user space daemon */
+  if (strncmp(type, "fuse", 4) == 0) {
+    return true;
+  }
+
+  for (t = remote_fstypes; *t != NULL; t++) {
+    if (strcmp(type, *t) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool load_mounts(void) {
+  FILE *f;
+  struct mntent *ent;
+  sched_mount_t *grown;
+  size_t capacity = 0;
+
+  if ((f = setmntent("/proc/self/mounts", "r")) == NULL) {
+    /* no mount table, every path will use fallback */
+    return true;
+  }
+
+  while ((ent = getmntent(f)) != NULL) {
+    if (mounts_count == capacity) {
+      capacity = capacity == 0 ? 32 : capacity * 2;
+      grown = enif_realloc(mounts, capacity * sizeof(sched_mount_t));
+      if (grown == NULL) {
+        endmntent(f);
+        return false;
+      }
+      mounts = grown;
+    }
+
+    mounts[mounts_count].dirlen = strlen(ent->mnt_dir);
+    mounts[mounts_count].dir = enif_alloc(mounts[mounts_count].dirlen + 1);
+    if (mounts[mounts_count].dir == NULL) {
+      endmntent(f);
+      return false;
+    }
+    memcpy(mounts[mounts_count].dir, ent->mnt_dir,
+           mounts[mounts_count].dirlen + 1);
+
+    mounts[mounts_count].remote = is_remote_fstype(ent->mnt_type);
+    mounts[mounts_count].slow_until = 0;
+    mounts_count++;
+  }
+
+  endmntent(f);
+  return true;
+}
+
+static size_t hash_dir(const char *dir, size_t len) {
+  size_t hash = 2166136261UL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)dir[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+static bool build_index(void) {
+  sched_mount_t **slot;
+  size_t size = 16;
+  size_t i;
+  size_t j;
+
+  while (size < mounts_count * 2) {
+    size *= 2;
+  }
+
+  if ((mount_index = enif_alloc(size * sizeof(sched_mount_t *))) == NULL) {
+    return false;
+  }
+  memset(mount_index, 0, size * sizeof(sched_mount_t *));
+  mount_index_mask = size - 1;
+
+  for (i = 0; i < mounts_count; i++) {
+    j = hash_dir(mounts[i].dir, mounts[i].dirlen) & mount_index_mask;
+    for (;; j = (j + 1) & mount_index_mask) {
+      slot = &mount_index[j];
+      /* later entries shadow earlier ones mounted at the same point */
+      if (*slot == NULL || ((*slot)->dirlen == mounts[i].dirlen &&
+                            memcmp((*slot)->dir, mounts[i].dir,
+                                   mounts[i].dirlen) == 0)) {
+        *slot = &mounts[i];
+        break;
+      }
+    }
+  }
+
+  return true;
+}
+
+static sched_mount_t *find_mount(const char *dir, size_t len) {
+  sched_mount_t *mount;
+  size_t j = hash_dir(dir, len) & mount_index_mask;
+
+  for (; (mount = mount_index[j]) != NULL; j = (j + 1) & mount_index_mask) {
+    if (mount->dirlen == len && memcmp(mount->dir, dir, len) == 0) {
+      return mount;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Finds mount which absolute \a path lives on, probing its prefixes which end
+ * at component boundary from the longest one.
+ */
+static sched_mount_t *lookup_absolute(const char *path, size_t len) {
+  sched_mount_t *mount;
+
+  while (len > 1) {
+    if ((mount = find_mount(path, len)) != NULL) {
+      return mount;
+    }
+    /* "/mnt/a" must not match "/mnt/ab" */
+    do {
+      len--;
+    } while (len > 1 && path[len] != '/');
+  }
+
+  mount = find_mount("/", 1);
+  return mount != NULL ? mount : &fallback_mount;
+}
+
+static void refresh_cwd(ErlNifTime now) {
+  char buff[PATH_BUFFER_SIZE];
+  bool known = getcwd(buff, sizeof(buff)) != NULL;
+  size_t i;
+
+  enif_rwlock_rwlock(cwd_lock);
+  cwd_mount = NULL;
+  if (known) {
+    cwd_len = strlen(buff);
+    memcpy(cwd, buff, cwd_len + 1);
+    cwd_mount = lookup_absolute(cwd, cwd_len);
+
+    cwd_nested = false;
+    for (i = 0; i < mounts_count && !cwd_nested; i++) {
+      cwd_nested = mounts[i].dirlen > cwd_len &&
+                   memcmp(mounts[i].dir, cwd, cwd_len) == 0 &&
+                   (cwd_len == 1 || mounts[i].dir[cwd_len] == '/');
+    }
+  }
+  ATOMIC_STORE(&cwd_until, now + slow_cooldown);
+  enif_rwlock_rwunlock(cwd_lock);
+}
+
+/**
+ * Finds mount which \a path relative to working directory lives on. The
+ * directory is read again only once the cooldown passes, so a change of it is
+ * noticed late; like `..` and symlinks, latency budget covers that.
+ */
+static sched_mount_t *lookup_relative(const char *path, size_t len) {
+  char full[PATH_BUFFER_SIZE];
+  sched_mount_t *mount = &fallback_mount;
+  ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (ATOMIC_LOAD(&cwd_until) <= now) {
+    refresh_cwd(now);
+  }
+
+  enif_rwlock_rlock(cwd_lock);
+  if (cwd_mount != NULL) {
+    if (!cwd_nested) {
+      mount = cwd_mount;
+    } else if (cwd_len + 1 + len < sizeof(full)) {
+      memcpy(full, cwd, cwd_len);
+      full[cwd_len] = '/';
+      memcpy(full + cwd_len + 1, path, len);
+      mount = lookup_absolute(full, cwd_len + 1 + len);
+    }
+  }
+  enif_rwlock_runlock(cwd_lock);
+
+  return mount;
+}
+
+/**
+ * Finds mount which given path lives on, using longest prefix match. This is
+ * only a heuristic (symlinks and `..` are not resolved), latency budget covers
+ * misclassified paths.
+ */
+static sched_mount_t *lookup_mount(const char *path, size_t len) {
+  if (len == 0 || mounts_count == 0) {
+    return &fallback_mount;
+  }
+
+  return path[0] == '/' ? lookup_absolute(path, len)
+                        : lookup_relative(path, len);
+}
+
+#else
+
+static bool load_mounts(void) { return true; }
+
+static bool build_index(void) { return true; }
+
+static sched_mount_t *lookup_mount(UNUSED const char *path, UNUSED size_t len) {
+  return &fallback_mount;
+}
+
+#endif
+
+/*
+ * Public interface
+ */
+
+static bool get_option(ErlNifEnv *env, ERL_NIF_TERM map, const char *key,
+                       ERL_NIF_TERM *value) {
+  return enif_get_map_value(env, map, enif_make_atom(env, key), value);
+}
+
+bool sched_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM value;
+  ErlNifSInt64 number;
+  char mode_name[16];
+
+  if (enif_is_map(env, load_info)) {
+    if (get_option(env, load_info, "scheduler", &value)) {
+      if (!enif_get_atom(env, value, mode_name, sizeof(mode_name),
+                         ERL_NIF_LATIN1)) {
+        return false;
+      }
+
+      if (strcmp(mode_name, "normal") == 0) {
+        current_mode = SCHED_NORMAL;
+      } else if (strcmp(mode_name, "dirty") == 0) {
+        current_mode = SCHED_DIRTY;
+      } else if (strcmp(mode_name, "adaptive") == 0) {
+        current_mode = SCHED_ADAPTIVE;
+      } else {
+        return false;
+      }
+    }
+
+    if (get_option(env, load_info, "latency_budget", &value)) {
+      if (!enif_get_int64(env, value, &number) || number < 0) {
+        return false;
+      }
+      latency_budget = number;
+    }
+
+    if (get_option(env, load_info, "slow_cooldown", &value)) {
+      if (!enif_get_int64(env, value, &number) || number < 0) {
+        return false;
+      }
+      slow_cooldown = number * 1000;
+    }
+  }
+
+  if (current_mode == SCHED_ADAPTIVE) {
+    if (!load_mounts() || !build_index() ||
+        (cwd_lock = enif_rwlock_create("xattr_sched_cwd")) == NULL) {
+      sched_destroy();
+      return false;
+    }
+    cwd_until = 0;
+  }
+
+  return true;
+}
+
+void sched_destroy(void) {
+  size_t i;
+
+  for (i = 0; i < mounts_count; i++) {
+    enif_free(mounts[i].dir);
+  }
+
+  enif_free(mounts);
+  mounts = NULL;
+  mounts_count = 0;
+
+  if (mount_index != NULL) {
+    enif_free(mount_index);
+    mount_index = NULL;
+  }
+  if (cwd_lock != NULL) {
+    enif_rwlock_destroy(cwd_lock);
+    cwd_lock = NULL;
+  }
+  cwd_mount = NULL;
+}
+
+sched_mode_t sched_mode(void) { return current_mode; }
+
+sched_mount_t *sched_lookup(const char *path, size_t len) {
+  /* ignore NUL terminator(s) passed from Elixir */
+  while (len > 0 && path[len - 1] == '\0') {
+    len--;
+  }
+  return lookup_mount(path, len);
+}
+
+bool sched_is_slow(sched_mount_t *mount, ErlNifTime now) {
+  return mount->remote || ATOMIC_LOAD(&mount->slow_until) > now;
+}
+
+void sched_record(sched_mount_t *mount, ErlNifTime start, ErlNifTime elapsed) {
+  if (elapsed > latency_budget) {
+    ATOMIC_STORE(&mount->slow_until, start + elapsed + slow_cooldown);
+  }
+}
+
+ERL_NIF_TERM sched_run(ErlNifEnv *env, const char *name, nif_fptr_t fptr,
+                       int argc, const ERL_NIF_TERM argv[]) {
+  char buff[PATH_BUFFER_SIZE];
+  ErlNifBinary path;
+  ERL_NIF_TERM result;
+  xattr_handle_t *handle;
+  ErlNifTime start;
+  ErlNifTime elapsed;
+  sched_mount_t *mount;
+  int percent;
+
+  switch (current_mode) {
+  case SCHED_NORMAL: return fptr(env, argc, argv);
+  case SCHED_DIRTY:
+    return enif_schedule_nif(env, name, ERL_NIF_DIRTY_JOB_IO_BOUND, fptr, argc,
+                             argv);
+  case SCHED_ADAPTIVE: break;
+  }
+
+  if (argc >= 1 && enif_inspect_binary(env, argv[0], &path)) {
+    mount = sched_lookup((const char *)path.data, path.size);
+  } else if (argc >= 1 && enif_is_list(env, argv[0]) &&
+             get_cstring_arg(env, argv[0], buff, sizeof(buff)) == ARG_OK) {
+    /* path given as iolist */
+    mount = sched_lookup(buff, strlen(buff));
+  } else if (argc >= 1 && handle_get(env, argv[0], &handle)) {
+    mount = handle_mount(handle);
+  } else {
+    /* let the NIF report bad argument */
+    return fptr(env, argc, argv);
+  }
+
+  start = enif_monotonic_time(ERL_NIF_USEC);
+
+  if (sched_is_slow(mount, start)) {
+    return enif_schedule_nif(env, name, ERL_NIF_DIRTY_JOB_IO_BOUND, fptr, argc,
+                             argv);
+  }
+
+  result = fptr(env, argc, argv);
+
+  elapsed = enif_monotonic_time(ERL_NIF_USEC) - start;
+  sched_record(mount, start, elapsed);
+
+  /* report consumed time, 100% corresponds to 1 ms */
+  percent = (int)(elapsed / 10);
+  if (percent > 0) {
+    enif_consume_timeslice(env, percent > 100 ? 100 : percent);
+  }
+
+  return result;
+}
+
+void sched_slice_start(sched_slice_t *slice) {
+  slice->normal = enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER;
+  slice->reported = slice->normal ? enif_monotonic_time(ERL_NIF_USEC) : 0;
+}
+
+bool sched_slice_over(ErlNifEnv *env, sched_slice_t *slice) {
+  ErlNifTime units;
+
+  if (!slice->normal) {
+    return false;
+  }
+
+  /* report in 1% (10 us) units, the remainder is left for the next call */
+  units = (enif_monotonic_time(ERL_NIF_USEC) - slice->reported) / 10;
+  if (units == 0) {
+    return false;
+  }
+
+  slice->reported += units * 10;
+  return enif_consume_timeslice(env, units > 100 ? 100 : (int)units);
+}
@@ -0,0 +1,104 @@
+#ifndef ELIXIR_XATTR_SCHED_H
+#define ELIXIR_XATTR_SCHED_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Signature of NIF function, as accepted by `enif_schedule_nif`.
+ */
+typedef ERL_NIF_TERM (*nif_fptr_t)(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]);
+
+/**
+ * Decides on which scheduler file system NIFs are run.
+ */
+typedef enum {
+  /** Always run on calling (normal) scheduler. */
+  SCHED_NORMAL,
+  /** Always reschedule to dirty I/O scheduler. */
+  SCHED_DIRTY,
+  /**
+   * Run on normal scheduler, unless the path lives on remote (network, FUSE)
+   * file system or recent calls on its mount exceeded latency budget.
+   */
+  SCHED_ADAPTIVE
+} sched_mode_t;
+
+/**
+ * Mount table entry, used to classify paths.
+ */
+typedef struct sched_mount sched_mount_t;
+
+/**
+ * Reads scheduling options from NIF \a load_info map and builds mount table.
+ *
+ * Recognized keys are `scheduler` (`normal`, `dirty` or `adaptive`),
+ * `latency_budget` (microseconds) and `slow_cooldown` (milliseconds).
+ *
+ * \return `false` if options are malformed or memory cannot be allocated.
+ */
+bool sched_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Releases memory allocated by `sched_init`.
+ */
+void sched_destroy(void);
+
+/**
+ * Returns configured scheduling mode.
+ */
+sched_mode_t sched_mode(void);
+
+/**
+ * Finds mount which \a path (not necessarily NUL-terminated) lives on.
+ */
+sched_mount_t *sched_lookup(const char *path, size_t len);
+
+/**
+ * Checks whether calls on \a mount should be run on dirty scheduler at \a now
+ * (monotonic time in microseconds).
+ */
+bool sched_is_slow(sched_mount_t *mount, ErlNifTime now);
+
+/**
+ * Records that call on \a mount started at \a start took \a elapsed
+ * microseconds on normal scheduler.
+ */
+void sched_record(sched_mount_t *mount, ErlNifTime start, ErlNifTime elapsed);
+
+/**
+ * Runs \a fptr on scheduler chosen according to configured mode.
+ *
+ * First element of \a argv is expected to be file path or handle, it is used
+ * to classify the call. If \a fptr has to be run on dirty scheduler, it is
+ * scheduled via `enif_schedule_nif` under the name \a name.
+ */
+ERL_NIF_TERM sched_run(ErlNifEnv *env, const char *name, nif_fptr_t fptr,
+                       int argc, const ERL_NIF_TERM argv[]);
+
+/**
+ * Time slice of a NIF which splits its work into steps and yields the
+ * scheduler between them, rescheduling itself with `enif_schedule_nif`.
+ */
+typedef struct {
+  /** Whether the NIF runs on normal scheduler, others are never yielded */
+  bool normal;
+  /** Monotonic time (us) up to which consumed time has been reported */
+  ErlNifTime reported;
+} sched_slice_t;
+
+/**
+ * Starts measuring time consumed by steps of the calling NIF.
+ */
+void sched_slice_start(sched_slice_t *slice);
+
+/**
+ * Reports time consumed since the last call with `enif_consume_timeslice`.
+ *
+ * \return `true` if the time slice is exhausted and the NIF should yield.
+ */
+bool sched_slice_over(ErlNifEnv *env, sched_slice_t *slice);
+
+#endif
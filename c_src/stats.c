@@ -0,0 +1,325 @@
+#include "stats.h"
+
+#include "util.h"
+#include <errno.h>
+#include <string.h>
+
+/* Failures are counted for errno values below this one */
+#define STATS_ERRNOS 256
+
+typedef struct {
+  ErlNifUInt64 calls;
+  ErlNifUInt64 errors;
+  ErlNifUInt64 syscalls;
+  ErlNifUInt64 retries;
+  ErlNifUInt64 bytes_read;
+  ErlNifUInt64 bytes_written;
+  ErlNifUInt64 latency[STATS_BUCKETS];
+} op_stats_t;
+
+/* Counters are written only by the owning thread, with plain loads and stores,
+ * and read by `stats_nif` from other threads. Blocks are also linked together
+ * so that they can be summed up and released on unload (threads outlive the
+ * library). */
+struct stats_block {
+  stats_block_t *next;
+  /** Operation of call in progress, `STATS_OPS` between calls */
+  stats_op_t current;
+  op_stats_t ops[STATS_OPS];
+  ErlNifUInt64 errnos[STATS_ERRNOS];
+};
+
+#define STATS_ADD(counter, n)                                                 \
+  ATOMIC_STORE(&(counter), ATOMIC_LOAD(&(counter)) + (n))
+
+static bool enabled = true;
+static ErlNifTSDKey stats_key;
+static ErlNifMutex *stats_lock = NULL;
+static stats_block_t *stats_list = NULL;
+
+static const char *op_names[STATS_OPS] = {"ls", "get", "has", "set", "rm"};
+
+static bool get_option(ErlNifEnv *env, ERL_NIF_TERM map, const char *key,
+                       ERL_NIF_TERM *value) {
+  return enif_is_map(env, map) &&
+         enif_get_map_value(env, map, enif_make_atom(env, key), value);
+}
+
+bool stats_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM value;
+
+  enabled = true;
+  if (get_option(env, load_info, "stats", &value)) {
+    if (enif_is_identical(value, atom_false)) {
+      enabled = false;
+    } else if (!enif_is_identical(value, atom_true)) {
+      return false;
+    }
+  }
+
+  if (enif_tsd_key_create("xattr_stats", &stats_key) != 0) {
+    return false;
+  }
+
+  if ((stats_lock = enif_mutex_create("xattr_stats")) == NULL) {
+    enif_tsd_key_destroy(stats_key);
+    return false;
+  }
+
+  return true;
+}
+
+void stats_destroy(void) {
+  stats_block_t *next;
+
+  while (stats_list != NULL) {
+    next = stats_list->next;
+    enif_free(stats_list);
+    stats_list = next;
+  }
+
+  enif_mutex_destroy(stats_lock);
+  stats_lock = NULL;
+  enif_tsd_key_destroy(stats_key);
+}
+
+/**
+ * Returns counters of calling thread, allocating them on first use.
+ */
+static stats_block_t *own_block(void) {
+  stats_block_t *block = enif_tsd_get(stats_key);
+
+  if (block == NULL) {
+    if ((block = enif_alloc(sizeof(stats_block_t))) == NULL) {
+      return NULL;
+    }
+    memset(block, 0, sizeof(stats_block_t));
+    block->current = STATS_OPS;
+
+    enif_mutex_lock(stats_lock);
+    block->next = stats_list;
+    stats_list = block;
+    enif_mutex_unlock(stats_lock);
+
+    enif_tsd_set(stats_key, block);
+  }
+
+  return block;
+}
+
+/**
+ * Returns counters of call in progress on calling thread, or `NULL`.
+ */
+static op_stats_t *current_op(void) {
+  stats_block_t *block;
+
+  if (!enabled || (block = enif_tsd_get(stats_key)) == NULL ||
+      block->current == STATS_OPS) {
+    return NULL;
+  }
+
+  return &block->ops[block->current];
+}
+
+const char *stats_op_name(stats_op_t op) { return op_names[op]; }
+
+static int bucket_of(ErlNifTime ns) {
+  int bucket = 0;
+  int shift;
+
+  for (shift = 32; shift > 0; shift /= 2) {
+    if (ns >> shift != 0) {
+      ns >>= shift;
+      bucket += shift;
+    }
+  }
+
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+void stats_begin(stats_call_t *call, stats_op_t op) {
+  call->block = enabled ? own_block() : NULL;
+
+  if (call->block != NULL) {
+    call->block->current = op;
+    call->start = enif_monotonic_time(ERL_NIF_NSEC);
+  }
+}
+
+void stats_end(const stats_call_t *call, bool result) {
+  stats_block_t *block = call->block;
+  op_stats_t *op;
+  ErlNifTime elapsed;
+  int saved_errno = errno;
+
+  if (block == NULL) {
+    return;
+  }
+
+  elapsed = enif_monotonic_time(ERL_NIF_NSEC) - call->start;
+  op = &block->ops[block->current];
+  STATS_ADD(op->calls, 1);
+  STATS_ADD(op->latency[bucket_of(elapsed)], 1);
+
+  if (!result) {
+    STATS_ADD(op->errors, 1);
+    if (saved_errno > 0 && saved_errno < STATS_ERRNOS) {
+      STATS_ADD(block->errnos[saved_errno], 1);
+    }
+  }
+
+  block->current = STATS_OPS;
+  errno = saved_errno;
+}
+
+void stats_syscall(size_t read, size_t written) {
+  op_stats_t *op = current_op();
+
+  if (op != NULL) {
+    STATS_ADD(op->syscalls, 1);
+    STATS_ADD(op->bytes_read, read);
+    STATS_ADD(op->bytes_written, written);
+  }
+}
+
+void stats_retry(void) {
+  op_stats_t *op = current_op();
+
+  if (op != NULL) {
+    STATS_ADD(op->retries, 1);
+  }
+}
+
+/*
+ * NIF
+ */
+
+static void sum_op(const op_stats_t *from, op_stats_t *to) {
+  int i;
+
+  to->calls += ATOMIC_LOAD(&from->calls);
+  to->errors += ATOMIC_LOAD(&from->errors);
+  to->syscalls += ATOMIC_LOAD(&from->syscalls);
+  to->retries += ATOMIC_LOAD(&from->retries);
+  to->bytes_read += ATOMIC_LOAD(&from->bytes_read);
+  to->bytes_written += ATOMIC_LOAD(&from->bytes_written);
+
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    to->latency[i] += ATOMIC_LOAD(&from->latency[i]);
+  }
+}
+
+/**
+ * Makes list of `{upper_bound_ns, count}` tuples of non-empty latency buckets,
+ * in ascending order. The last bucket is unbounded.
+ */
+static ERL_NIF_TERM make_histogram(ErlNifEnv *env, const op_stats_t *op) {
+  ERL_NIF_TERM list = enif_make_list(env, 0);
+  ERL_NIF_TERM bound;
+  ERL_NIF_TERM count;
+  int i;
+
+  for (i = STATS_BUCKETS - 1; i >= 0; i--) {
+    if (op->latency[i] == 0) {
+      continue;
+    }
+
+    bound = i == STATS_BUCKETS - 1
+                ? make_atom(env, "infinity")
+                : enif_make_uint64(env, (ErlNifUInt64)1 << (i + 1));
+    count = enif_make_uint64(env, op->latency[i]);
+    list = enif_make_list_cell(env, enif_make_tuple2(env, bound, count), list);
+  }
+
+  return list;
+}
+
+static ERL_NIF_TERM make_op_map(ErlNifEnv *env, const op_stats_t *op) {
+  ERL_NIF_TERM keys[7];
+  ERL_NIF_TERM values[7];
+  ERL_NIF_TERM map;
+
+  keys[0] = make_atom(env, "calls");
+  keys[1] = make_atom(env, "errors");
+  keys[2] = make_atom(env, "syscalls");
+  keys[3] = make_atom(env, "erange_retries");
+  keys[4] = make_atom(env, "bytes_read");
+  keys[5] = make_atom(env, "bytes_written");
+  keys[6] = make_atom(env, "latency");
+
+  values[0] = enif_make_uint64(env, op->calls);
+  values[1] = enif_make_uint64(env, op->errors);
+  values[2] = enif_make_uint64(env, op->syscalls);
+  values[3] = enif_make_uint64(env, op->retries);
+  values[4] = enif_make_uint64(env, op->bytes_read);
+  values[5] = enif_make_uint64(env, op->bytes_written);
+  values[6] = make_histogram(env, op);
+
+  enif_make_map_from_arrays(env, keys, values, 7, &map);
+  return map;
+}
+
+/**
+ * Makes map of failure reasons, as returned by NIFs, to their counts.
+ */
+static ERL_NIF_TERM make_errno_map(ErlNifEnv *env,
+                                   const ErlNifUInt64 *errnos) {
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  ERL_NIF_TERM reason;
+  ERL_NIF_TERM count;
+  ErlNifUInt64 total;
+  int saved_errno = errno;
+  int i;
+
+  for (i = 1; i < STATS_ERRNOS; i++) {
+    if (errnos[i] == 0) {
+      continue;
+    }
+
+    /* several errno values may map to the same reason */
+    errno = i;
+    reason = make_errno_term(env);
+    total = errnos[i];
+    if (enif_get_map_value(env, map, reason, &count)) {
+      enif_get_uint64(env, count, &total);
+      total += errnos[i];
+    }
+    enif_make_map_put(env, map, reason, enif_make_uint64(env, total), &map);
+  }
+
+  errno = saved_errno;
+  return map;
+}
+
+ERL_NIF_TERM stats_nif(ErlNifEnv *env, UNUSED int argc,
+                       UNUSED const ERL_NIF_TERM argv[]) {
+  op_stats_t ops[STATS_OPS];
+  ErlNifUInt64 errnos[STATS_ERRNOS];
+  stats_block_t *block;
+  ERL_NIF_TERM map;
+  int i;
+
+  memset(ops, 0, sizeof(ops));
+  memset(errnos, 0, sizeof(errnos));
+
+  enif_mutex_lock(stats_lock);
+  for (block = stats_list; block != NULL; block = block->next) {
+    for (i = 0; i < STATS_OPS; i++) {
+      sum_op(&block->ops[i], &ops[i]);
+    }
+    for (i = 0; i < STATS_ERRNOS; i++) {
+      errnos[i] += ATOMIC_LOAD(&block->errnos[i]);
+    }
+  }
+  enif_mutex_unlock(stats_lock);
+
+  map = enif_make_new_map(env);
+  for (i = 0; i < STATS_OPS; i++) {
+    enif_make_map_put(env, map, make_atom(env, op_names[i]),
+                      make_op_map(env, &ops[i]), &map);
+  }
+  enif_make_map_put(env, map, make_atom(env, "errors"),
+                    make_errno_map(env, errnos), &map);
+
+  return map;
+}
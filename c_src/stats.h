@@ -0,0 +1,86 @@
+#ifndef ELIXIR_XATTR_STATS_H
+#define ELIXIR_XATTR_STATS_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/*
+ * Counters of attribute operations, kept per thread, so that recording takes
+ * no locks nor atomic read-modify-write instructions and no cache line is
+ * shared between schedulers. `stats_nif` sums them up when asked.
+ */
+
+/**
+ * Operation a call is recorded as.
+ */
+typedef enum {
+  STATS_LS,
+  STATS_GET,
+  STATS_HAS,
+  STATS_SET,
+  STATS_RM,
+  STATS_OPS
+} stats_op_t;
+
+/* Latencies are counted in buckets of powers of two nanoseconds, the last one
+ * collecting everything from 2^(STATS_BUCKETS - 1) ns up */
+#define STATS_BUCKETS 40
+
+typedef struct stats_block stats_block_t;
+
+/**
+ * Call in progress, started by `stats_begin`.
+ */
+typedef struct {
+  /** Counters of calling thread, `NULL` if statistics are disabled */
+  stats_block_t *block;
+  ErlNifTime start;
+} stats_call_t;
+
+/**
+ * Reads `stats` option (`true` or `false`, defaults to `true`) from NIF
+ * \a load_info map.
+ *
+ * \return `false` if the option is malformed or TSD key cannot be created.
+ */
+bool stats_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
+/**
+ * Releases counters of all threads.
+ */
+void stats_destroy(void);
+
+/**
+ * Returns name of \a op, as used in the NIF result.
+ */
+const char *stats_op_name(stats_op_t op);
+
+/**
+ * Starts timing call of \a op made by this thread. Syscalls made until
+ * `stats_end` are recorded as made by it.
+ */
+void stats_begin(stats_call_t *call, stats_op_t op);
+
+/**
+ * Records that \a call has finished with \a result; failures are counted by
+ * `errno`.
+ */
+void stats_end(const stats_call_t *call, bool result);
+
+/**
+ * Records syscall made by current call of this thread, which read or wrote
+ * the given number of bytes.
+ */
+void stats_syscall(size_t read, size_t written);
+
+/**
+ * Records that current call of this thread retries a read because the buffer
+ * turned out to be too small (`ERANGE`).
+ */
+void stats_retry(void);
+
+/** @spec stats_nif() :: %{atom => map} */
+ERL_NIF_TERM stats_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+#endif
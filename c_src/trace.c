@@ -0,0 +1,15 @@
+#include "trace.h"
+
+/* Semaphores of probes declared in trace.h, kept in `.probes` section where
+ * tracers look for them. Built only with `make USDT=1`. */
+
+#define TRACE_DEFINE(probe)                                                   \
+  volatile unsigned short TRACE_SEMAPHORE(probe)                              \
+      __attribute__((section(".probes"))) = 0
+
+TRACE_DEFINE(op__entry);
+TRACE_DEFINE(op__return);
+TRACE_DEFINE(batch__entry);
+TRACE_DEFINE(batch__return);
+TRACE_DEFINE(scan__entry);
+TRACE_DEFINE(scan__return);
@@ -0,0 +1,70 @@
+#ifndef ELIXIR_XATTR_TRACE_H
+#define ELIXIR_XATTR_TRACE_H
+
+/*
+ * USDT probes of `elixir_xattr` provider, compiled in by `make USDT=1` (Linux,
+ * needs `sys/sdt.h` from systemtap SDT headers). A probe site is a single
+ * `nop` until a tracer attaches to it; arguments which cost a syscall or
+ * clock read are guarded by `TRACE_ENABLED`, which checks probe semaphore
+ * incremented by the tracer. Without `USDT=1` all macros expand to no code.
+ *
+ * op__entry(op, path, name)
+ * op__return(op, path, name, size, errno, duration_ns, dev)
+ *   Single attribute operation: `op` is one of "ls", "get", "has", "set"
+ *   and "rm", `name` is tagged name (`NULL` for "ls"), `size` is size of
+ *   value read or written (number of names for "ls", 0 for others or on
+ *   failure), `errno` is 0 on success and `dev` is "major:minor" of device
+ *   holding the file, as in /proc/self/mountinfo.
+ *
+ * batch__entry(op, path, count)
+ * batch__return(op, path, count, duration_ns)
+ *   Batch operation on `count` attributes of a single file, `path` is `NULL`
+ *   for file handles. Attributes read or written without io_uring also fire
+ *   op__entry and op__return.
+ *
+ * scan__entry(path)
+ * scan__return(path, count, ok, duration_ns)
+ *   Reading of `count` attributes of a file visited by directory scan, `ok`
+ *   is 0 if it failed.
+ */
+
+#ifdef XATTR_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(probe) elixir_xattr_##probe##_semaphore
+
+extern volatile unsigned short TRACE_SEMAPHORE(op__entry);
+extern volatile unsigned short TRACE_SEMAPHORE(op__return);
+extern volatile unsigned short TRACE_SEMAPHORE(batch__entry);
+extern volatile unsigned short TRACE_SEMAPHORE(batch__return);
+extern volatile unsigned short TRACE_SEMAPHORE(scan__entry);
+extern volatile unsigned short TRACE_SEMAPHORE(scan__return);
+
+#define TRACE_ENABLED(probe) (TRACE_SEMAPHORE(probe) != 0)
+
+#define TRACE1(probe, a) DTRACE_PROBE1(elixir_xattr, probe, a)
+#define TRACE3(probe, a, b, c) DTRACE_PROBE3(elixir_xattr, probe, a, b, c)
+#define TRACE4(probe, a, b, c, d)                                             \
+  DTRACE_PROBE4(elixir_xattr, probe, a, b, c, d)
+#define TRACE7(probe, a, b, c, d, e, f, g)                                    \
+  DTRACE_PROBE7(elixir_xattr, probe, a, b, c, d, e, f, g)
+
+#else
+
+#define TRACE_ENABLED(probe) 0
+
+/* arguments are not evaluated, but still count as used */
+#define TRACE_USE(a) ((void)sizeof(a))
+
+#define TRACE1(probe, a) TRACE_USE(a)
+#define TRACE3(probe, a, b, c) (TRACE_USE(a), TRACE_USE(b), TRACE_USE(c))
+#define TRACE4(probe, a, b, c, d)                                             \
+  (TRACE3(probe, a, b, c), TRACE_USE(d))
+#define TRACE7(probe, a, b, c, d, e, f, g)                                    \
+  (TRACE4(probe, a, b, c, d), TRACE3(probe, e, f, g))
+
+#endif
+
+#endif
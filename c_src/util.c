@@ -4,6 +4,80 @@
 
 #include "impl.h"
 
+/* Depth limit of nested iolists accepted as arguments */
+#define IOLIST_MAX_DEPTH 16
+
+ERL_NIF_TERM atom_ok;
+ERL_NIF_TERM atom_error;
+ERL_NIF_TERM atom_true;
+ERL_NIF_TERM atom_false;
+ERL_NIF_TERM atom_nil;
+ERL_NIF_TERM atom_atom;
+ERL_NIF_TERM atom_closed;
+ERL_NIF_TERM atom_badalloc;
+ERL_NIF_TERM atom_invalfmt;
+ERL_NIF_TERM atom_xattr_changed;
+ERL_NIF_TERM atom_xattr_result;
+ERL_NIF_TERM atom_xattr_scan;
+ERL_NIF_TERM atom_done;
+ERL_NIF_TERM atom_create;
+ERL_NIF_TERM atom_replace;
+ERL_NIF_TERM atom_e2big;
+ERL_NIF_TERM atom_eagain;
+ERL_NIF_TERM atom_edquot;
+ERL_NIF_TERM atom_eexist;
+ERL_NIF_TERM atom_efault;
+ERL_NIF_TERM atom_einval;
+ERL_NIF_TERM atom_enametoolong;
+ERL_NIF_TERM atom_enoattr;
+ERL_NIF_TERM atom_enoent;
+ERL_NIF_TERM atom_enospc;
+ERL_NIF_TERM atom_enotsup;
+ERL_NIF_TERM atom_eperm;
+ERL_NIF_TERM atom_erange;
+
+static const struct {
+  ERL_NIF_TERM *atom;
+  const char *name;
+} atom_table[] = {
+    {&atom_ok, "ok"},
+    {&atom_error, "error"},
+    {&atom_true, "true"},
+    {&atom_false, "false"},
+    {&atom_nil, "nil"},
+    {&atom_atom, "atom"},
+    {&atom_closed, "closed"},
+    {&atom_badalloc, "badalloc"},
+    {&atom_invalfmt, "invalfmt"},
+    {&atom_xattr_changed, "xattr_changed"},
+    {&atom_xattr_result, "xattr_result"},
+    {&atom_xattr_scan, "xattr_scan"},
+    {&atom_done, "done"},
+    {&atom_create, "create"},
+    {&atom_replace, "replace"},
+    {&atom_e2big, "e2big"},
+    {&atom_eagain, "eagain"},
+    {&atom_edquot, "edquot"},
+    {&atom_eexist, "eexist"},
+    {&atom_efault, "efault"},
+    {&atom_einval, "einval"},
+    {&atom_enametoolong, "enametoolong"},
+    {&atom_enoattr, "enoattr"},
+    {&atom_enoent, "enoent"},
+    {&atom_enospc, "enospc"},
+    {&atom_enotsup, "enotsup"},
+    {&atom_eperm, "eperm"},
+    {&atom_erange, "erange"},
+};
+
+void atoms_init(ErlNifEnv *env) {
+  size_t i;
+
+  for (i = 0; i < sizeof(atom_table) / sizeof(atom_table[0]); i++) {
+    *atom_table[i].atom = make_atom(env, atom_table[i].name);
+  }
+}
+
 ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom_name) {
   ERL_NIF_TERM atom;
   if (enif_make_existing_atom(env, atom_name, &atom, ERL_NIF_LATIN1)) {
@@ -13,19 +87,19 @@ ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom_name) {
 }
 
 ERL_NIF_TERM make_ok_tuple(ErlNifEnv *env, ERL_NIF_TERM value) {
-  return enif_make_tuple2(env, make_atom(env, "ok"), value);
+  return enif_make_tuple2(env, atom_ok, value);
 }
 
 ERL_NIF_TERM make_error_tuple(ErlNifEnv *env, ERL_NIF_TERM reason) {
-  return enif_make_tuple2(env, make_atom(env, "error"), reason);
+  return enif_make_tuple2(env, atom_error, reason);
 }
 
 ERL_NIF_TERM make_errno_tuple(ErlNifEnv *env) {
   return make_error_tuple(env, make_errno_term(env));
 }
 
-ERL_NIF_TERM make_bool(ErlNifEnv *env, bool value) {
-  return make_atom(env, value ? "true" : "false");
+ERL_NIF_TERM make_bool(UNUSED ErlNifEnv *env, bool value) {
+  return value ? atom_true : atom_false;
 }
 
 ERL_NIF_TERM make_elixir_string(ErlNifEnv *env, const char *string) {
@@ -39,3 +113,386 @@ ERL_NIF_TERM make_elixir_string(ErlNifEnv *env, const char *string) {
 
   return result;
 }
+
+/*
+ * Attribute names
+ */
+
+static bool new_atoms = true;
+
+bool names_init(ErlNifEnv *env, ERL_NIF_TERM load_info) {
+  ERL_NIF_TERM value;
+
+  new_atoms = true;
+  if (enif_is_map(env, load_info) &&
+      enif_get_map_value(env, load_info, enif_make_atom(env, "new_atoms"),
+                         &value)) {
+    if (enif_is_identical(value, atom_false)) {
+      new_atoms = false;
+    } else if (!enif_is_identical(value, atom_true)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+name_type_t name_type(const char *name, size_t len) {
+  if (len < NAME_TAG_LENGTH || name[1] != '$') {
+    return NAME_INVALID;
+  }
+
+  switch (name[0]) {
+  case 's': return NAME_STRING;
+  case 'a': return NAME_ATOM;
+  case 'c': return NAME_CHUNK;
+  case 'z': return NAME_COMPRESSED;
+  default: return NAME_INVALID;
+  }
+}
+
+static ErlNifUInt64 read_le(const unsigned char *data, size_t len) {
+  ErlNifUInt64 value = 0;
+
+  while (len-- > 0) {
+    value = (value << 8) | data[len];
+  }
+  return value;
+}
+
+bool is_chunk_header(const unsigned char *data, size_t size) {
+  ErlNifUInt64 count;
+
+  if (size != CHUNK_HEADER_SIZE || memcmp(data, "XATTRCH1", 8) != 0) {
+    return false;
+  }
+
+  /* the same checks as in Elixir, other values are not headers */
+  count = read_le(data + 12, 4);
+  return count > 0 && read_le(data + 16, 8) >= count;
+}
+
+ERL_NIF_TERM make_ok_rest_tuple(ErlNifEnv *env, ERL_NIF_TERM names,
+                                ERL_NIF_TERM rest) {
+  if (enif_is_empty_list(env, rest)) {
+    return make_ok_tuple(env, names);
+  }
+  return enif_make_tuple3(env, atom_ok, names, rest);
+}
+
+bool make_name_atom(ErlNifEnv *env, const char *name, size_t len,
+                    ERL_NIF_TERM *atom) {
+#if ERL_NIF_MAJOR_VERSION > 2 ||                                               \
+    (ERL_NIF_MAJOR_VERSION == 2 && ERL_NIF_MINOR_VERSION >= 17)
+  if (new_atoms) {
+    return enif_make_new_atom_len(env, name, len, atom, ERL_NIF_UTF8);
+  }
+  return enif_make_existing_atom_len(env, name, len, atom, ERL_NIF_UTF8);
+#else
+  size_t i;
+
+  if (len > 255) {
+    return false;
+  }
+
+  for (i = 0; i < len; i++) {
+    if ((unsigned char)name[i] >= 0x80) {
+      return false;
+    }
+  }
+
+  if (new_atoms) {
+    *atom = enif_make_atom_len(env, name, len);
+    return true;
+  }
+  return enif_make_existing_atom_len(env, name, len, atom, ERL_NIF_LATIN1);
+#endif
+}
+
+void add_atom_name(ErlNifEnv *env, const char *name, size_t len,
+                   ERL_NIF_TERM *list, ERL_NIF_TERM *rest) {
+  ERL_NIF_TERM term;
+
+  if (make_name_atom(env, name, len, &term)) {
+    *list = enif_make_list_cell(env, term, *list);
+  } else {
+    memcpy(enif_make_new_binary(env, len, &term), name, len);
+    *rest = enif_make_list_cell(env, term, *rest);
+  }
+}
+
+/**
+ * Appends iodata \a term to \a buff of \a size bytes, \a len of which are
+ * already used.
+ */
+static arg_status_t append_iodata(ErlNifEnv *env, ERL_NIF_TERM term,
+                                  char *buff, size_t size, size_t *len,
+                                  int depth) {
+  ErlNifBinary bin;
+  ERL_NIF_TERM head;
+  arg_status_t status;
+  int byte;
+
+  if (enif_inspect_binary(env, term, &bin)) {
+    if (bin.size > size - *len) {
+      return ARG_TOO_LONG;
+    }
+    memcpy(buff + *len, bin.data, bin.size);
+    *len += bin.size;
+    return ARG_OK;
+  }
+
+  if (depth == 0) {
+    return ARG_BADARG;
+  }
+
+  while (enif_get_list_cell(env, term, &head, &term)) {
+    if (enif_get_int(env, head, &byte)) {
+      if (byte < 0 || byte > 255) {
+        return ARG_BADARG;
+      }
+      if (*len == size) {
+        return ARG_TOO_LONG;
+      }
+      buff[(*len)++] = (char)byte;
+    } else if ((status = append_iodata(env, head, buff, size, len,
+                                       depth - 1)) != ARG_OK) {
+      return status;
+    }
+  }
+
+  if (enif_is_empty_list(env, term)) {
+    return ARG_OK;
+  }
+
+  /* improper list may only end with a binary */
+  if (!enif_is_binary(env, term)) {
+    return ARG_BADARG;
+  }
+  return append_iodata(env, term, buff, size, len, depth - 1);
+}
+
+arg_status_t get_cstring_arg(ErlNifEnv *env, ERL_NIF_TERM term, char *buff,
+                             size_t size) {
+  arg_status_t status;
+  size_t len = 0;
+
+  /* leave room for NUL terminator */
+  status = append_iodata(env, term, buff, size - 1, &len, IOLIST_MAX_DEPTH);
+  if (status != ARG_OK) {
+    return status;
+  }
+
+  if (len > 0 && buff[len - 1] == '\0') {
+    len--;
+  }
+
+  if (len == 0) {
+    return ARG_BADARG;
+  }
+
+  if (memchr(buff, '\0', len) != NULL) {
+    return ARG_INVALID;
+  }
+
+  buff[len] = '\0';
+  return ARG_OK;
+}
+
+ERL_NIF_TERM make_arg_error(ErlNifEnv *env, arg_status_t status,
+                            ERL_NIF_TERM too_long) {
+  switch (status) {
+  case ARG_TOO_LONG: return make_error_tuple(env, too_long);
+  case ARG_INVALID: return make_error_tuple(env, atom_einval);
+  default: return enif_make_badarg(env);
+  }
+}
+
+bool get_path_arg(ErlNifEnv *env, ERL_NIF_TERM term, char *path,
+                  ERL_NIF_TERM *error) {
+  arg_status_t status = get_cstring_arg(env, term, path, PATH_BUFFER_SIZE);
+
+  if (status != ARG_OK) {
+    *error = make_arg_error(env, status, atom_enametoolong);
+    return false;
+  }
+  return true;
+}
+
+bool get_name_arg(ErlNifEnv *env, ERL_NIF_TERM term, char *name,
+                  ERL_NIF_TERM *error) {
+  arg_status_t status = get_cstring_arg(env, term, name, NAME_BUFFER_SIZE);
+
+  /* names too long for the buffer are too long for the file system as well */
+  if (status != ARG_OK) {
+    *error = make_arg_error(env, status, atom_erange);
+    return false;
+  }
+  return true;
+}
+
+bool get_set_mode_arg(UNUSED ErlNifEnv *env, ERL_NIF_TERM term,
+                      set_mode_t *mode) {
+  if (enif_is_identical(term, atom_nil)) {
+    *mode = SET_ANY;
+  } else if (enif_is_identical(term, atom_create)) {
+    *mode = SET_CREATE;
+  } else if (enif_is_identical(term, atom_replace)) {
+    *mode = SET_REPLACE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Scratch buffers
+ */
+
+typedef struct scratch {
+  struct scratch *next;
+  /** Chunk buffer, allocated on first use */
+  unsigned char *chunk;
+  unsigned char data[SCRATCH_SIZE];
+} scratch_t;
+
+/* Buffers are owned by threads via TSD, but are also linked together so that
+ * they can be released on unload (threads outlive the library). */
+static ErlNifTSDKey scratch_key;
+static ErlNifMutex *scratch_lock = NULL;
+static scratch_t *scratch_list = NULL;
+
+bool scratch_init(void) {
+  if (enif_tsd_key_create("xattr_scratch", &scratch_key) != 0) {
+    return false;
+  }
+
+  if ((scratch_lock = enif_mutex_create("xattr_scratch")) == NULL) {
+    enif_tsd_key_destroy(scratch_key);
+    return false;
+  }
+
+  return true;
+}
+
+void scratch_destroy(void) {
+  scratch_t *next;
+
+  while (scratch_list != NULL) {
+    next = scratch_list->next;
+    if (scratch_list->chunk != NULL) {
+      enif_free(scratch_list->chunk);
+    }
+    enif_free(scratch_list);
+    scratch_list = next;
+  }
+
+  enif_mutex_destroy(scratch_lock);
+  scratch_lock = NULL;
+  enif_tsd_key_destroy(scratch_key);
+}
+
+static scratch_t *thread_scratch(void) {
+  scratch_t *scratch = enif_tsd_get(scratch_key);
+
+  if (scratch == NULL) {
+    if ((scratch = enif_alloc(sizeof(scratch_t))) == NULL) {
+      return NULL;
+    }
+    scratch->chunk = NULL;
+
+    enif_mutex_lock(scratch_lock);
+    scratch->next = scratch_list;
+    scratch_list = scratch;
+    enif_mutex_unlock(scratch_lock);
+
+    enif_tsd_set(scratch_key, scratch);
+  }
+
+  return scratch;
+}
+
+unsigned char *scratch_get(void) {
+  scratch_t *scratch = thread_scratch();
+  return scratch != NULL ? scratch->data : NULL;
+}
+
+unsigned char *scratch_chunk_get(void) {
+  scratch_t *scratch = thread_scratch();
+
+  if (scratch == NULL) {
+    return NULL;
+  }
+
+  if (scratch->chunk == NULL) {
+    scratch->chunk = enif_alloc(SCRATCH_CHUNK_SIZE);
+  }
+  return scratch->chunk;
+}
+
+void scratch_release(void) {
+  scratch_t *scratch = enif_tsd_get(scratch_key);
+  scratch_t **ptr;
+
+  if (scratch == NULL) {
+    return;
+  }
+
+  enif_mutex_lock(scratch_lock);
+  for (ptr = &scratch_list; *ptr != scratch; ptr = &(*ptr)->next) {
+  }
+  *ptr = scratch->next;
+  enif_mutex_unlock(scratch_lock);
+
+  if (scratch->chunk != NULL) {
+    enif_free(scratch->chunk);
+  }
+  enif_free(scratch);
+  enif_tsd_set(scratch_key, NULL);
+}
+
+/*
+ * Inode locks
+ */
+
+/* Number of locks, 2^INODE_LOCKS_BITS */
+#define INODE_LOCKS_BITS 6
+#define INODE_LOCKS (1 << INODE_LOCKS_BITS)
+
+/* Fibonacci hashing multiplier, built from halves to stay C89 */
+#define GOLDEN_RATIO (((ErlNifUInt64)0x9e3779b9UL << 32) | 0x7f4a7c15UL)
+
+static ErlNifMutex *inode_locks[INODE_LOCKS];
+
+bool inode_locks_init(void) {
+  size_t i;
+
+  for (i = 0; i < INODE_LOCKS; i++) {
+    if ((inode_locks[i] = enif_mutex_create("xattr_inode")) == NULL) {
+      while (i-- > 0) {
+        enif_mutex_destroy(inode_locks[i]);
+        inode_locks[i] = NULL;
+      }
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void inode_locks_destroy(void) {
+  size_t i;
+
+  for (i = 0; i < INODE_LOCKS; i++) {
+    if (inode_locks[i] != NULL) {
+      enif_mutex_destroy(inode_locks[i]);
+      inode_locks[i] = NULL;
+    }
+  }
+}
+
+ErlNifMutex *inode_lock(ErlNifUInt64 dev, ErlNifUInt64 ino) {
+  /* inode numbers are often sequential, mix them before picking a lock */
+  ErlNifUInt64 hash = (ino ^ (dev << 32 | dev >> 32)) * GOLDEN_RATIO;
+  return inode_locks[hash >> (64 - INODE_LOCKS_BITS)];
+}
@@ -5,12 +5,85 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "impl.h"
+
 #ifdef __GNUC__
 #define UNUSED __attribute__((__unused__))
 #else
 #define UNUSED
 #endif
 
+/* Size of stack buffers holding NUL-terminated paths */
+#define PATH_BUFFER_SIZE 4096
+
+/* Size of stack buffers holding NUL-terminated, tagged attribute names */
+#define NAME_BUFFER_SIZE 1024
+
+/* Size of per-thread scratch buffers, large enough to hold any attribute value
+ * or name list on Linux (XATTR_SIZE_MAX, XATTR_LIST_MAX) */
+#define SCRATCH_SIZE 65536
+
+/* Size of per-thread chunk buffers, holding converted arguments of batch
+ * operations while values are read into scratch buffer */
+#define SCRATCH_CHUNK_SIZE 98304
+
+/* Relaxed atomic access to word-sized values which are only used as hints */
+#ifdef __GNUC__
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#else
+#define ATOMIC_LOAD(ptr) (*(ptr))
+#define ATOMIC_STORE(ptr, val) (*(ptr) = (val))
+#endif
+
+/*
+ * Atoms interned once in NIF `load` callback, so that hot paths do not have to
+ * look them up in atom table
+ */
+
+extern ERL_NIF_TERM atom_ok;
+extern ERL_NIF_TERM atom_error;
+extern ERL_NIF_TERM atom_true;
+extern ERL_NIF_TERM atom_false;
+extern ERL_NIF_TERM atom_nil;
+extern ERL_NIF_TERM atom_atom;
+extern ERL_NIF_TERM atom_closed;
+extern ERL_NIF_TERM atom_badalloc;
+extern ERL_NIF_TERM atom_invalfmt;
+extern ERL_NIF_TERM atom_xattr_changed;
+extern ERL_NIF_TERM atom_xattr_result;
+extern ERL_NIF_TERM atom_xattr_scan;
+extern ERL_NIF_TERM atom_done;
+extern ERL_NIF_TERM atom_create;
+extern ERL_NIF_TERM atom_replace;
+extern ERL_NIF_TERM atom_e2big;
+extern ERL_NIF_TERM atom_eagain;
+extern ERL_NIF_TERM atom_edquot;
+extern ERL_NIF_TERM atom_eexist;
+extern ERL_NIF_TERM atom_efault;
+extern ERL_NIF_TERM atom_einval;
+extern ERL_NIF_TERM atom_enametoolong;
+extern ERL_NIF_TERM atom_enoattr;
+extern ERL_NIF_TERM atom_enoent;
+extern ERL_NIF_TERM atom_enospc;
+extern ERL_NIF_TERM atom_enotsup;
+extern ERL_NIF_TERM atom_eperm;
+extern ERL_NIF_TERM atom_erange;
+
+/**
+ * Interns all atoms above. Called from NIF `load` callback.
+ */
+void atoms_init(ErlNifEnv *env);
+
+/**
+ * Reads `new_atoms` option (`true` or `false`, defaults to `true`) from NIF
+ * \a load_info map. With `false`, atom names of listed attributes are only
+ * looked up in the atom table and never added to it.
+ *
+ * \return `false` if the option is malformed.
+ */
+bool names_init(ErlNifEnv *env, ERL_NIF_TERM load_info);
+
 ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom_name);
 ERL_NIF_TERM make_ok_tuple(ErlNifEnv *env, ERL_NIF_TERM value);
 ERL_NIF_TERM make_error_tuple(ErlNifEnv *env, ERL_NIF_TERM reason);
@@ -18,4 +91,178 @@ ERL_NIF_TERM make_errno_tuple(ErlNifEnv *env);
 ERL_NIF_TERM make_bool(ErlNifEnv *env, bool value);
 ERL_NIF_TERM make_elixir_string(ErlNifEnv *env, const char *string);
 
+/* Length of type tag (`a$`, `s$`, `c$` or `z$`) which every attribute name
+ * starts with */
+#define NAME_TAG_LENGTH 2
+
+/**
+ * Kind of attribute name, as encoded by type tag. Chunks of large values
+ * (`c$` tag) are managed by Elixir code and hidden from listings. Compressed
+ * values are stored under their tagged name prefixed with `z$` tag.
+ */
+typedef enum {
+  NAME_STRING,
+  NAME_ATOM,
+  NAME_CHUNK,
+  NAME_COMPRESSED,
+  NAME_INVALID
+} name_type_t;
+
+/**
+ * Classifies tagged attribute \a name of \a len bytes.
+ */
+name_type_t name_type(const char *name, size_t len);
+
+/* Size of header which values split into chunks are replaced with: magic,
+ * generation, chunk count, total length and CRC-32, little endian */
+#define CHUNK_HEADER_SIZE 28
+
+/**
+ * Checks whether \a size bytes of \a data are a header of value split into
+ * chunks by Elixir code, rather than the value itself.
+ */
+bool is_chunk_header(const unsigned char *data, size_t size);
+
+/**
+ * Builds result of listing and `get_all` NIFs: `{:ok, names}`, or
+ * `{:ok, names, rest}` if there are attributes whose atom names could not be
+ * made natively.
+ */
+ERL_NIF_TERM make_ok_rest_tuple(ErlNifEnv *env, ERL_NIF_TERM names,
+                                ERL_NIF_TERM rest);
+
+/**
+ * Makes atom from UTF-8 encoded \a name of \a len bytes, like
+ * `String.to_atom/1` does, or like `String.to_existing_atom/1` with
+ * `new_atoms` option set to `false`.
+ *
+ * \return `false` if the atom cannot be made natively: the name is too long,
+ *         it is not ASCII and the runtime does not support UTF-8 atoms in NIF
+ *         API, or the atom does not exist and cannot be created.
+ */
+bool make_name_atom(ErlNifEnv *env, const char *name, size_t len,
+                    ERL_NIF_TERM *atom);
+
+/**
+ * Prepends atom made from untagged attribute \a name of \a len bytes to
+ * \a list, or the name as binary to \a rest if the atom cannot be made
+ * natively (see `make_name_atom`).
+ */
+void add_atom_name(ErlNifEnv *env, const char *name, size_t len,
+                   ERL_NIF_TERM *list, ERL_NIF_TERM *rest);
+
+/**
+ * Outcome of converting NIF argument to C string.
+ */
+typedef enum {
+  ARG_OK,
+  /** Not iodata, or empty */
+  ARG_BADARG,
+  /** Does not fit in the buffer */
+  ARG_TOO_LONG,
+  /** Contains embedded NUL character */
+  ARG_INVALID
+} arg_status_t;
+
+/**
+ * Flattens iodata \a term (binary, or possibly improper list of bytes,
+ * binaries and such lists) into \a buff as NUL-terminated string, without
+ * allocating memory. A single trailing NUL already present in \a term is
+ * accepted.
+ */
+arg_status_t get_cstring_arg(ErlNifEnv *env, ERL_NIF_TERM term, char *buff,
+                             size_t size);
+
+/**
+ * Builds result for argument rejected by `get_cstring_arg`: `badarg`
+ * exception, or error tuple with \a too_long reason or `:einval`.
+ */
+ERL_NIF_TERM make_arg_error(ErlNifEnv *env, arg_status_t status,
+                            ERL_NIF_TERM too_long);
+
+/**
+ * Copies path argument \a term into \a path buffer of `PATH_BUFFER_SIZE`
+ * bytes.
+ *
+ * \retval error On failure, term to be returned from NIF.
+ */
+bool get_path_arg(ErlNifEnv *env, ERL_NIF_TERM term, char *path,
+                  ERL_NIF_TERM *error);
+
+/**
+ * Copies tagged attribute name argument \a term into \a name buffer of
+ * `NAME_BUFFER_SIZE` bytes.
+ *
+ * \retval error On failure, term to be returned from NIF.
+ */
+bool get_name_arg(ErlNifEnv *env, ERL_NIF_TERM term, char *name,
+                  ERL_NIF_TERM *error);
+
+/**
+ * Converts set mode argument \a term: `nil`, `:create` or `:replace`.
+ *
+ * \return `false` if \a term is not a valid mode.
+ */
+bool get_set_mode_arg(ErlNifEnv *env, ERL_NIF_TERM term, set_mode_t *mode);
+
+/**
+ * Sets up per-thread scratch buffers. Called from NIF `load` callback.
+ */
+bool scratch_init(void);
+
+/**
+ * Releases all scratch buffers.
+ */
+void scratch_destroy(void);
+
+/**
+ * Returns scratch buffer of `SCRATCH_SIZE` bytes owned by calling thread,
+ * allocating it on first use.
+ *
+ * The buffer is shared by all code running on the thread, so its content must
+ * not be relied on across calls of other functions which may use it.
+ *
+ * \return Scratch buffer, or `NULL` if it could not be allocated.
+ */
+unsigned char *scratch_get(void);
+
+/**
+ * Returns chunk buffer of `SCRATCH_CHUNK_SIZE` bytes owned by calling thread,
+ * allocating it on first use. It is separate from `scratch_get` buffer, which
+ * may be used while the chunk is, and it is shared the same way.
+ *
+ * \return Chunk buffer, or `NULL` if it could not be allocated.
+ */
+unsigned char *scratch_chunk_get(void);
+
+/**
+ * Releases scratch and chunk buffers of calling thread, if it has them. Called by threads
+ * which exit before the library is unloaded.
+ */
+void scratch_release(void);
+
+/*
+ * Inode locks
+ *
+ * Compare-and-set holds one of a fixed set of mutexes, picked by hash of the
+ * inode, so that calls on the same file are serialized, while calls on
+ * different files rarely contend.
+ */
+
+/**
+ * Creates inode locks. Called from NIF `load` callback.
+ */
+bool inode_locks_init(void);
+
+/**
+ * Destroys inode locks.
+ */
+void inode_locks_destroy(void);
+
+/**
+ * Returns lock guarding inode \a ino of device \a dev. Backends which have
+ * no inode numbers pass hash of the path as \a ino.
+ */
+ErlNifMutex *inode_lock(ErlNifUInt64 dev, ErlNifUInt64 ino);
+
 #endif
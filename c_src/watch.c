@@ -0,0 +1,958 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "watch.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "impl.h"
+
+/* Size of inotify read buffer, enough for a few hundred events */
+#define EVENT_BUFFER_SIZE 65536
+#define MIN_BUCKETS 64
+
+typedef struct subscription subscription_t;
+
+/**
+ * Attributes of watched file, or of a child of watched directory. Children
+ * without attributes have no snapshot.
+ */
+typedef struct snapshot {
+  struct snapshot *chain;
+  unsigned long hash;
+  /** Map of attribute names to values in external term format */
+  ErlNifBinary attrs;
+  char name[1];
+} snapshot_t;
+
+typedef struct watch {
+  /** Next watch in hash chain */
+  struct watch *chain;
+  int wd;
+  bool is_dir;
+  /** Subscriptions receiving changes of this watch */
+  subscription_t **subs;
+  size_t nsubs;
+  size_t subs_size;
+  /** Snapshots keyed by child name, empty name stands for watched file */
+  snapshot_t **buckets;
+  size_t nbuckets;
+  size_t count;
+  char path[1];
+} watch_t;
+
+struct subscription {
+  ErlNifPid pid;
+  ErlNifMonitor monitor;
+  /** `false` once unsubscribed, either explicitly or by subscriber exit */
+  bool active;
+  /** Watch descriptors of subscribed paths */
+  int *wds;
+  size_t nwds;
+  /** Next subscription whose subscriber exited, see `subscription_down` */
+  struct subscription *next_down;
+};
+
+static ErlNifResourceType *subscription_type = NULL;
+
+/** Guards all state below; held by watcher thread while handling events */
+static ErlNifMutex *watch_lock = NULL;
+static bool running = false;
+static ErlNifTid thread;
+static int inotify_fd = -1;
+/** Pipe used to wake watcher thread up on unload and subscriber exit */
+static int wake_fds[2] = {-1, -1};
+static volatile bool stopping = false;
+
+/** Guards list of subscriptions to be dropped by watcher thread; never held
+ *  together with watch lock */
+static ErlNifMutex *down_lock = NULL;
+static subscription_t *down_list = NULL;
+
+/** Watches keyed by watch descriptor */
+static watch_t **watches = NULL;
+static size_t nwatch_buckets = 0;
+static size_t nwatches = 0;
+
+/*
+ * Hash tables, called with watch lock held
+ */
+
+static unsigned long hash_name(const char *name) {
+  /* FNV-1a */
+  unsigned long hash = 2166136261UL;
+
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619UL;
+  }
+
+  return hash;
+}
+
+/*
+ * Both tables double their bucket arrays once there are more entries than
+ * buckets. Failure to grow only makes chains longer.
+ */
+
+static void grow_watches(void) {
+  watch_t **buckets;
+  watch_t *watch;
+  watch_t *next;
+  size_t size = nwatch_buckets * 2;
+  size_t i;
+
+  if (nwatches <= nwatch_buckets ||
+      (buckets = enif_alloc(size * sizeof(watch_t *))) == NULL) {
+    return;
+  }
+  memset(buckets, 0, size * sizeof(watch_t *));
+
+  for (i = 0; i < nwatch_buckets; i++) {
+    for (watch = watches[i]; watch != NULL; watch = next) {
+      next = watch->chain;
+      watch->chain = buckets[(unsigned long)watch->wd & (size - 1)];
+      buckets[(unsigned long)watch->wd & (size - 1)] = watch;
+    }
+  }
+
+  enif_free(watches);
+  watches = buckets;
+  nwatch_buckets = size;
+}
+
+static void grow_snapshots(watch_t *watch) {
+  snapshot_t **buckets;
+  snapshot_t *snapshot;
+  snapshot_t *next;
+  size_t size = watch->nbuckets * 2;
+  size_t i;
+
+  if (watch->count <= watch->nbuckets ||
+      (buckets = enif_alloc(size * sizeof(snapshot_t *))) == NULL) {
+    return;
+  }
+  memset(buckets, 0, size * sizeof(snapshot_t *));
+
+  for (i = 0; i < watch->nbuckets; i++) {
+    for (snapshot = watch->buckets[i]; snapshot != NULL; snapshot = next) {
+      next = snapshot->chain;
+      snapshot->chain = buckets[snapshot->hash & (size - 1)];
+      buckets[snapshot->hash & (size - 1)] = snapshot;
+    }
+  }
+
+  enif_free(watch->buckets);
+  watch->buckets = buckets;
+  watch->nbuckets = size;
+}
+
+static watch_t **find_watch(int wd) {
+  watch_t **slot = &watches[(unsigned long)wd & (nwatch_buckets - 1)];
+
+  while (*slot != NULL && (*slot)->wd != wd) {
+    slot = &(*slot)->chain;
+  }
+
+  return slot;
+}
+
+static snapshot_t **find_snapshot(watch_t *watch, unsigned long hash,
+                                  const char *name) {
+  snapshot_t **slot = &watch->buckets[hash & (watch->nbuckets - 1)];
+
+  while (*slot != NULL &&
+         ((*slot)->hash != hash || strcmp((*slot)->name, name) != 0)) {
+    slot = &(*slot)->chain;
+  }
+
+  return slot;
+}
+
+static void free_snapshot(snapshot_t *snapshot) {
+  enif_release_binary(&snapshot->attrs);
+  enif_free(snapshot);
+}
+
+static watch_t *new_watch(int wd, const char *path, bool is_dir) {
+  size_t len = strlen(path);
+  watch_t *watch;
+
+  /* child paths are joined with '/', so drop trailing ones */
+  while (len > 1 && path[len - 1] == '/') {
+    len--;
+  }
+
+  if ((watch = enif_alloc(sizeof(watch_t) + len)) == NULL) {
+    return NULL;
+  }
+
+  memset(watch, 0, sizeof(watch_t));
+  memcpy(watch->path, path, len);
+  watch->path[len] = '\0';
+  watch->wd = wd;
+  watch->is_dir = is_dir;
+  watch->nbuckets = is_dir ? MIN_BUCKETS : 1;
+
+  if ((watch->buckets = enif_alloc(watch->nbuckets * sizeof(snapshot_t *))) ==
+      NULL) {
+    enif_free(watch);
+    return NULL;
+  }
+  memset(watch->buckets, 0, watch->nbuckets * sizeof(snapshot_t *));
+
+  *find_watch(wd) = watch;
+  nwatches++;
+  grow_watches();
+
+  return watch;
+}
+
+/**
+ * Unlinks \a watch from watch table and frees it. Subscriptions still hold
+ * its watch descriptor, which is skipped when they are dropped.
+ */
+static void free_watch(watch_t *watch) {
+  snapshot_t *snapshot;
+  snapshot_t *next;
+  size_t i;
+
+  *find_watch(watch->wd) = watch->chain;
+  nwatches--;
+
+  for (i = 0; i < watch->nbuckets; i++) {
+    for (snapshot = watch->buckets[i]; snapshot != NULL; snapshot = next) {
+      next = snapshot->chain;
+      free_snapshot(snapshot);
+    }
+  }
+
+  enif_free(watch->buckets);
+  enif_free(watch->subs);
+  enif_free(watch);
+}
+
+/*
+ * Snapshots and change notification, called with watch lock held
+ */
+
+static bool child_path(watch_t *watch, const char *name, char *path) {
+  size_t dir_len = strlen(watch->path);
+  size_t name_len = strlen(name);
+
+  if (name_len == 0) {
+    memcpy(path, watch->path, dir_len + 1);
+    return true;
+  }
+
+  if (dir_len + name_len + 2 > PATH_BUFFER_SIZE) {
+    return false;
+  }
+
+  memcpy(path, watch->path, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + 1, name, name_len + 1);
+  return true;
+}
+
+/**
+ * Reads attributes of file at \a path into a map. Removed file has no
+ * attributes.
+ */
+static bool read_attrs(ErlNifEnv *env, const char *path, ERL_NIF_TERM *map) {
+  ERL_NIF_TERM rest;
+  ERL_NIF_TERM head;
+  const ERL_NIF_TERM *pair;
+  int arity;
+
+  if (!getallxattr_impl(env, path, map, &rest)) {
+    if (errno != ENOENT) {
+      return false;
+    }
+    *map = enif_make_new_map(env);
+    return true;
+  }
+
+  /* names which cannot be made atoms natively keep the listing marker */
+  while (enif_get_list_cell(env, rest, &head, &rest)) {
+    enif_get_tuple(env, head, &arity, &pair);
+    enif_make_map_put(env, *map, enif_make_tuple2(env, atom_atom, pair[0]),
+                      pair[1], map);
+  }
+
+  return true;
+}
+
+static bool is_chunked(ErlNifEnv *env, ERL_NIF_TERM value) {
+  ErlNifBinary bin;
+  return enif_inspect_binary(env, value, &bin) &&
+         is_chunk_header(bin.data, bin.size);
+}
+
+/**
+ * Builds map of attributes which differ between \a old_map and \a new_map,
+ * with `nil` values for removed ones. Headers of values split into chunks are
+ * not values, attributes which hold them are left out.
+ *
+ * \return `false` if there are no differences.
+ */
+static bool make_diff(ErlNifEnv *env, ERL_NIF_TERM old_map,
+                      ERL_NIF_TERM new_map, ERL_NIF_TERM *diff) {
+  ErlNifMapIterator iter;
+  ERL_NIF_TERM key;
+  ERL_NIF_TERM value;
+  ERL_NIF_TERM other;
+  bool changed = false;
+
+  *diff = enif_make_new_map(env);
+
+  enif_map_iterator_create(env, new_map, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+  while (enif_map_iterator_get_pair(env, &iter, &key, &value)) {
+    if ((!enif_get_map_value(env, old_map, key, &other) ||
+         enif_compare(value, other) != 0) &&
+        !is_chunked(env, value)) {
+      enif_make_map_put(env, *diff, key, value, diff);
+      changed = true;
+    }
+    enif_map_iterator_next(env, &iter);
+  }
+  enif_map_iterator_destroy(env, &iter);
+
+  enif_map_iterator_create(env, old_map, &iter, ERL_NIF_MAP_ITERATOR_FIRST);
+  while (enif_map_iterator_get_pair(env, &iter, &key, &value)) {
+    if (!enif_get_map_value(env, new_map, key, &other)) {
+      enif_make_map_put(env, *diff, key, atom_nil, diff);
+      changed = true;
+    }
+    enif_map_iterator_next(env, &iter);
+  }
+  enif_map_iterator_destroy(env, &iter);
+
+  return changed;
+}
+
+/**
+ * Replaces snapshot in \a slot with \a map, or removes it if \a map is empty.
+ * On allocation failure the old snapshot is dropped, so that the next change
+ * is reported in full rather than missed. \a name may point into the old
+ * snapshot.
+ */
+static void store_snapshot(ErlNifEnv *env, watch_t *watch, snapshot_t **slot,
+                           unsigned long hash, const char *name,
+                           ERL_NIF_TERM map) {
+  snapshot_t *snapshot = NULL;
+  snapshot_t *old = *slot;
+  size_t size = 0;
+  size_t name_len = strlen(name);
+
+  if (!(enif_get_map_size(env, map, &size) && size == 0) &&
+      (snapshot = enif_alloc(sizeof(snapshot_t) + name_len)) != NULL) {
+    if (enif_term_to_binary(env, map, &snapshot->attrs)) {
+      memcpy(snapshot->name, name, name_len + 1);
+      snapshot->hash = hash;
+    } else {
+      enif_free(snapshot);
+      snapshot = NULL;
+    }
+  }
+
+  if (old != NULL) {
+    *slot = old->chain;
+    watch->count--;
+    free_snapshot(old);
+  }
+
+  if (snapshot == NULL) {
+    return;
+  }
+
+  snapshot->chain = *slot;
+  *slot = snapshot;
+  watch->count++;
+
+  grow_snapshots(watch);
+}
+
+static void notify(ErlNifEnv *env, watch_t *watch, const char *path,
+                   ERL_NIF_TERM diff) {
+  ErlNifEnv *msg_env;
+  ERL_NIF_TERM msg;
+  size_t i;
+
+  if (watch->nsubs == 0 || (msg_env = enif_alloc_env()) == NULL) {
+    return;
+  }
+
+  msg = enif_make_tuple3(env, atom_xattr_changed, make_elixir_string(env, path),
+                         diff);
+
+  for (i = 0; i < watch->nsubs; i++) {
+    enif_send(NULL, &watch->subs[i]->pid, msg_env,
+              enif_make_copy(msg_env, msg));
+    enif_clear_env(msg_env);
+  }
+
+  enif_free_env(msg_env);
+}
+
+/**
+ * Re-reads attributes of child \a name of \a watch (or watched file itself if
+ * \a name is empty) and notifies subscribers if they differ from snapshot.
+ * Files which cannot be read keep their snapshot.
+ */
+static void refresh(ErlNifEnv *env, watch_t *watch, const char *name) {
+  char path[PATH_BUFFER_SIZE];
+  unsigned long hash = hash_name(name);
+  snapshot_t **slot;
+  ERL_NIF_TERM old_map;
+  ERL_NIF_TERM new_map;
+  ERL_NIF_TERM diff;
+
+  enif_clear_env(env);
+
+  if (!child_path(watch, name, path) || !read_attrs(env, path, &new_map)) {
+    return;
+  }
+
+  slot = find_snapshot(watch, hash, name);
+  if (*slot == NULL || !enif_binary_to_term(env, (*slot)->attrs.data,
+                                            (*slot)->attrs.size, &old_map, 0)) {
+    old_map = enif_make_new_map(env);
+  }
+
+  if (make_diff(env, old_map, new_map, &diff)) {
+    store_snapshot(env, watch, slot, hash, name, new_map);
+    notify(env, watch, path, diff);
+  }
+}
+
+/**
+ * Refreshes watched file and, for directories, all their children. Used to
+ * take initial snapshots and to recover from event queue overflow.
+ */
+static void scan(ErlNifEnv *env, watch_t *watch) {
+  snapshot_t *snapshot;
+  snapshot_t *next;
+  struct dirent *entry;
+  DIR *dir;
+  size_t i;
+
+  /* children removed while events were lost */
+  for (i = 0; i < watch->nbuckets; i++) {
+    for (snapshot = watch->buckets[i]; snapshot != NULL; snapshot = next) {
+      next = snapshot->chain;
+      refresh(env, watch, snapshot->name);
+    }
+  }
+
+  refresh(env, watch, "");
+
+  if (!watch->is_dir || (dir = opendir(watch->path)) == NULL) {
+    return;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      refresh(env, watch, entry->d_name);
+    }
+  }
+
+  closedir(dir);
+}
+
+/*
+ * Subscriptions, called with watch lock held
+ */
+
+static bool add_subscriber(watch_t *watch, subscription_t *sub) {
+  subscription_t **subs;
+  size_t size;
+  size_t i;
+
+  for (i = 0; i < watch->nsubs; i++) {
+    if (watch->subs[i] == sub) {
+      /* the same path given twice */
+      return true;
+    }
+  }
+
+  if (watch->nsubs == watch->subs_size) {
+    size = watch->subs_size == 0 ? 1 : watch->subs_size * 2;
+    if ((subs = enif_realloc(watch->subs, size * sizeof(subscription_t *))) ==
+        NULL) {
+      return false;
+    }
+    watch->subs = subs;
+    watch->subs_size = size;
+  }
+
+  watch->subs[watch->nsubs++] = sub;
+  sub->wds[sub->nwds++] = watch->wd;
+  return true;
+}
+
+/**
+ * Removes \a sub from all its watches, removing watches left without
+ * subscribers.
+ */
+static void drop_subscription(subscription_t *sub) {
+  watch_t *watch;
+  size_t i;
+  size_t j;
+
+  for (i = 0; i < sub->nwds; i++) {
+    if ((watch = *find_watch(sub->wds[i])) == NULL) {
+      continue;
+    }
+
+    for (j = 0; j < watch->nsubs; j++) {
+      if (watch->subs[j] == sub) {
+        watch->subs[j] = watch->subs[--watch->nsubs];
+        break;
+      }
+    }
+
+    if (watch->nsubs == 0) {
+      inotify_rm_watch(inotify_fd, watch->wd);
+      free_watch(watch);
+    }
+  }
+
+  sub->nwds = 0;
+  sub->active = false;
+}
+
+static bool add_watch(ErlNifEnv *env, subscription_t *sub, const char *path) {
+  struct stat st;
+  watch_t *watch;
+  int wd;
+
+  if (stat(path, &st) == -1) {
+    return false;
+  }
+
+  if ((wd = inotify_add_watch(inotify_fd, path, IN_ATTRIB)) == -1) {
+    return false;
+  }
+
+  if ((watch = *find_watch(wd)) == NULL) {
+    if ((watch = new_watch(wd, path, S_ISDIR(st.st_mode))) == NULL) {
+      inotify_rm_watch(inotify_fd, wd);
+      errno = ENOMEM;
+      return false;
+    }
+    scan(env, watch);
+  }
+
+  if (!add_subscriber(watch, sub)) {
+    if (watch->nsubs == 0) {
+      inotify_rm_watch(inotify_fd, wd);
+      free_watch(watch);
+    }
+    errno = ENOMEM;
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Watcher thread
+ */
+
+static void handle_events(ErlNifEnv *env, const char *buff, ssize_t len) {
+  const struct inotify_event *event;
+  const struct inotify_event *prev = NULL;
+  watch_t *watch;
+  const char *ptr;
+  size_t i;
+
+  for (ptr = buff; ptr < buff + len;
+       ptr += sizeof(struct inotify_event) + event->len) {
+    event = (const struct inotify_event *)ptr;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      /* events were lost, compare everything with snapshots */
+      for (i = 0; i < nwatch_buckets; i++) {
+        for (watch = watches[i]; watch != NULL; watch = watch->chain) {
+          scan(env, watch);
+        }
+      }
+      prev = NULL;
+      continue;
+    }
+
+    if ((watch = *find_watch(event->wd)) == NULL) {
+      continue;
+    }
+
+    if (event->mask & IN_IGNORED) {
+      /* watched file was removed or its file system unmounted */
+      free_watch(watch);
+      continue;
+    }
+
+    /* a single change often emits a burst of identical events */
+    if (prev != NULL && prev->wd == event->wd &&
+        strcmp(prev->len > 0 ? prev->name : "",
+               event->len > 0 ? event->name : "") == 0) {
+      continue;
+    }
+    prev = event;
+
+    refresh(env, watch, event->len > 0 ? event->name : "");
+  }
+}
+
+/**
+ * Drops subscriptions of exited subscribers queued by `subscription_down`.
+ * Called without watch lock held.
+ */
+static void drop_down_subscriptions(void) {
+  subscription_t *sub;
+  subscription_t *next;
+
+  enif_mutex_lock(down_lock);
+  sub = down_list;
+  down_list = NULL;
+  enif_mutex_unlock(down_lock);
+
+  for (; sub != NULL; sub = next) {
+    next = sub->next_down;
+
+    enif_mutex_lock(watch_lock);
+    if (sub->active) {
+      drop_subscription(sub);
+      /* reference kept by the watch table */
+      enif_release_resource(sub);
+    }
+    enif_mutex_unlock(watch_lock);
+
+    /* reference kept by `subscription_down` */
+    enif_release_resource(sub);
+  }
+}
+
+static void *watch_loop(UNUSED void *arg) {
+  union {
+    struct inotify_event event;
+    char data[EVENT_BUFFER_SIZE];
+  } buff;
+  struct pollfd fds[2];
+  ErlNifEnv *env;
+  ssize_t len;
+
+  if ((env = enif_alloc_env()) == NULL) {
+    return NULL;
+  }
+
+  fds[0].fd = inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = wake_fds[0];
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents != 0) {
+      while (read(wake_fds[0], buff.data, sizeof(buff.data)) > 0) {
+      }
+      if (ATOMIC_LOAD(&stopping)) {
+        break;
+      }
+      drop_down_subscriptions();
+      continue;
+    }
+
+    if ((len = read(inotify_fd, buff.data, sizeof(buff.data))) <= 0) {
+      continue;
+    }
+
+    enif_mutex_lock(watch_lock);
+    handle_events(env, buff.data, len);
+    enif_mutex_unlock(watch_lock);
+  }
+
+  enif_free_env(env);
+  return NULL;
+}
+
+/**
+ * Starts inotify instance and watcher thread, unless already running.
+ */
+static bool start_watcher(void) {
+  if (running) {
+    return true;
+  }
+
+  if ((watches = enif_alloc(MIN_BUCKETS * sizeof(watch_t *))) == NULL) {
+    errno = ENOMEM;
+    return false;
+  }
+  memset(watches, 0, MIN_BUCKETS * sizeof(watch_t *));
+  nwatch_buckets = MIN_BUCKETS;
+
+  if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    goto fail;
+  }
+
+  /* non-blocking, so that waking the thread up never blocks a scheduler */
+  if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+    goto fail;
+  }
+
+  if (enif_thread_create("xattr_watch", &thread, watch_loop, NULL, NULL) != 0) {
+    errno = EAGAIN;
+    goto fail;
+  }
+
+  stopping = false;
+  running = true;
+  return true;
+
+fail:
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  if (wake_fds[0] != -1) {
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    wake_fds[0] = wake_fds[1] = -1;
+  }
+  enif_free(watches);
+  watches = NULL;
+  nwatch_buckets = 0;
+  return false;
+}
+
+/*
+ * Subscription resource
+ */
+
+static void subscription_dtor(UNUSED ErlNifEnv *env, void *obj) {
+  subscription_t *sub = obj;
+  enif_free(sub->wds);
+}
+
+static void subscription_down(UNUSED ErlNifEnv *env, void *obj,
+                              UNUSED ErlNifPid *pid,
+                              UNUSED ErlNifMonitor *monitor) {
+  subscription_t *sub = obj;
+
+  /* Runs on a normal scheduler, while watch lock may be held for long by
+   * a scan, so the drop is left to watcher thread. The subscription is kept
+   * until then, as it may be unsubscribed concurrently. */
+  enif_keep_resource(sub);
+
+  enif_mutex_lock(down_lock);
+  sub->next_down = down_list;
+  down_list = sub;
+  enif_mutex_unlock(down_lock);
+
+  /* a full pipe means the thread is already about to wake up */
+  (void)!write(wake_fds[1], "", 1);
+}
+
+bool watch_init(ErlNifEnv *env) {
+  ErlNifResourceTypeInit init;
+
+  memset(&init, 0, sizeof(init));
+  init.dtor = subscription_dtor;
+  init.down = subscription_down;
+
+  subscription_type = enif_open_resource_type_x(
+      env, "xattr_subscription", &init, ERL_NIF_RT_CREATE, NULL);
+  if (subscription_type == NULL) {
+    return false;
+  }
+
+  watch_lock = enif_mutex_create("xattr_watch");
+  down_lock = enif_mutex_create("xattr_watch_down");
+  if (watch_lock == NULL || down_lock == NULL) {
+    watch_destroy();
+    return false;
+  }
+  return true;
+}
+
+void watch_destroy(void) {
+  subscription_t *sub;
+  size_t i;
+
+  if (running) {
+    ATOMIC_STORE(&stopping, true);
+    if (write(wake_fds[1], "", 1) == 1 || errno == EAGAIN) {
+      enif_thread_join(thread, NULL);
+    }
+    close(inotify_fd);
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+
+    drop_down_subscriptions();
+
+    /* subscriptions are kept alive by the watch table until dropped */
+    while (nwatches > 0) {
+      for (i = 0; watches[i] == NULL; i++) {
+      }
+      sub = watches[i]->subs[0];
+      drop_subscription(sub);
+      enif_release_resource(sub);
+    }
+
+    enif_free(watches);
+    running = false;
+  }
+
+  if (watch_lock != NULL) {
+    enif_mutex_destroy(watch_lock);
+    watch_lock = NULL;
+  }
+
+  if (down_lock != NULL) {
+    enif_mutex_destroy(down_lock);
+    down_lock = NULL;
+  }
+}
+
+/*
+ * NIFs
+ */
+
+/*
+ * Current attributes of watched files, and of all children of watched
+ * directories, are read up front, so that later changes can be reported as
+ * differences. Scheduled on dirty I/O scheduler.
+ */
+ERL_NIF_TERM subscribe_nif(ErlNifEnv *env, int argc,
+                           const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  subscription_t *sub;
+  ErlNifEnv *scan_env;
+  ERL_NIF_TERM list;
+  ERL_NIF_TERM head;
+  ERL_NIF_TERM result;
+  unsigned length;
+  bool ok = true;
+
+  if (argc != 1 || !enif_get_list_length(env, argv[0], &length) ||
+      length == 0) {
+    return enif_make_badarg(env);
+  }
+
+  if ((sub = enif_alloc_resource(subscription_type,
+                                 sizeof(subscription_t))) == NULL) {
+    return make_error_tuple(env, atom_badalloc);
+  }
+  memset(sub, 0, sizeof(subscription_t));
+  enif_self(env, &sub->pid);
+
+  if ((sub->wds = enif_alloc(length * sizeof(int))) == NULL ||
+      (scan_env = enif_alloc_env()) == NULL) {
+    enif_release_resource(sub);
+    return make_error_tuple(env, atom_badalloc);
+  }
+
+  enif_mutex_lock(watch_lock);
+
+  if (!start_watcher()) {
+    result = make_error_tuple(env, make_errno_term(env));
+    ok = false;
+  }
+
+  for (list = argv[0]; ok && enif_get_list_cell(env, list, &head, &list);) {
+    if (!get_path_arg(env, head, path, &result)) {
+      ok = false;
+    } else if (!add_watch(scan_env, sub, path)) {
+      result = make_error_tuple(env, make_errno_term(env));
+      ok = false;
+    }
+  }
+
+  if (ok && enif_monitor_process(env, sub, &sub->pid, &sub->monitor) != 0) {
+    /* subscriber is already gone */
+    result = make_error_tuple(env, atom_einval);
+    ok = false;
+  }
+
+  if (ok) {
+    sub->active = true;
+    /* kept by the watch table, released when unsubscribed */
+    enif_keep_resource(sub);
+    result = make_ok_tuple(env, enif_make_resource(env, sub));
+  } else {
+    drop_subscription(sub);
+  }
+
+  enif_mutex_unlock(watch_lock);
+
+  enif_free_env(scan_env);
+  enif_release_resource(sub);
+  return result;
+}
+
+/*
+ * Watch lock may be held for long by a scan, scheduled on dirty I/O scheduler.
+ */
+ERL_NIF_TERM unsubscribe_nif(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]) {
+  subscription_t *sub;
+  bool active;
+
+  if (argc != 1 ||
+      !enif_get_resource(env, argv[0], subscription_type, (void **)&sub)) {
+    return enif_make_badarg(env);
+  }
+
+  enif_mutex_lock(watch_lock);
+  if ((active = sub->active)) {
+    drop_subscription(sub);
+    enif_demonitor_process(env, sub, &sub->monitor);
+  }
+  enif_mutex_unlock(watch_lock);
+
+  if (active) {
+    enif_release_resource(sub);
+  }
+
+  return atom_ok;
+}
+
+#else
+
+/*
+ * inotify is Linux-only, other platforms cannot subscribe
+ */
+
+bool watch_init(UNUSED ErlNifEnv *env) { return true; }
+
+void watch_destroy(void) {}
+
+ERL_NIF_TERM subscribe_nif(ErlNifEnv *env, UNUSED int argc,
+                           UNUSED const ERL_NIF_TERM argv[]) {
+  return make_error_tuple(env, atom_enotsup);
+}
+
+ERL_NIF_TERM unsubscribe_nif(UNUSED ErlNifEnv *env, UNUSED int argc,
+                             UNUSED const ERL_NIF_TERM argv[]) {
+  return atom_ok;
+}
+
+#endif
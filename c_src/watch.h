@@ -0,0 +1,28 @@
+#ifndef ELIXIR_XATTR_WATCH_H
+#define ELIXIR_XATTR_WATCH_H
+
+#include <erl_nif.h>
+#include <stdbool.h>
+
+/**
+ * Registers subscription resource type. Called from NIF `load` callback.
+ *
+ * The watcher thread and its inotify instance are started lazily, by the first
+ * subscription.
+ */
+bool watch_init(ErlNifEnv *env);
+
+/**
+ * Stops watcher thread, if it has been started, and drops all watches.
+ * Called from NIF `unload` callback.
+ */
+void watch_destroy(void);
+
+/** @spec subscribe_nif(list(iodata)) :: {:ok, reference} | {:error, term} */
+ERL_NIF_TERM subscribe_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+/** @spec unsubscribe_nif(reference) :: :ok */
+ERL_NIF_TERM unsubscribe_nif(ErlNifEnv *env, int argc,
+                             const ERL_NIF_TERM argv[]);
+
+#endif
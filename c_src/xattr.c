@@ -2,231 +2,461 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "batch.h"
+#include "cache.h"
+#include "codec.h"
+#include "dirstore.h"
+#include "handle.h"
 #include "impl.h"
+#include "index.h"
+#include "impl_uring.h"
+#include "listing.h"
+#include "pool.h"
+#include "scan.h"
+#include "sched.h"
+#include "stats.h"
 #include "util.h"
+#include "watch.h"
 
 /*
- * Exported NIFs
+ * NIF bodies, run either inline or on dirty I/O scheduler
  */
 
-/** @spec listxattr_nif(binary) :: {:ok, list(binary)} | {:error, term} */
-static ERL_NIF_TERM listxattr_nif(ErlNifEnv *env, int argc,
-                                  const ERL_NIF_TERM argv[]) {
-  ErlNifBinary path;
-  ERL_NIF_TERM list;
+/** @spec listxattr_nif(iodata) ::
+ *          {:ok, list} | {:ok, list, list(binary)} | {:error, term} */
+static ERL_NIF_TERM do_listxattr(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  xattr_listing_t listing;
+  ERL_NIF_TERM error;
 
   if (argc != 1) {
     return enif_make_badarg(env);
   }
 
-  if (!enif_inspect_binary(env, argv[0], &path)) {
-    return enif_make_badarg(env);
-  }
-
-  if (path.size == 0) {
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], path, &error)) {
+    return error;
   }
 
-  if (!listxattr_impl(env, (char *)path.data, &list)) {
-    enif_release_binary(&path);
+  if (!listing_begin_impl(env, path, &listing)) {
     return make_errno_tuple(env);
   }
 
-  enif_release_binary(&path);
-  return make_ok_tuple(env, list);
+  return listing_run(env, "listxattr_nif", &listing);
 }
 
-/** @spec hasxattr_nif(binary, binary) :: {:ok, boolean} | {:error, term} */
-static ERL_NIF_TERM hasxattr_nif(ErlNifEnv *env, int argc,
-                                 const ERL_NIF_TERM argv[]) {
-  ErlNifBinary path;
-  ErlNifBinary name;
-  bool result;
+/** @spec getallxattr_nif(iodata) ::
+ *          {:ok, map} | {:ok, map, list({binary, binary})} | {:error, term} */
+static ERL_NIF_TERM do_getallxattr(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM map;
+  ERL_NIF_TERM rest;
+  ERL_NIF_TERM error;
 
-  if (argc != 2) {
+  if (argc != 1) {
     return enif_make_badarg(env);
   }
 
-  if (!enif_inspect_binary(env, argv[0], &path)) {
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], path, &error)) {
+    return error;
   }
 
-  if (path.size == 0) {
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!getallxattr_impl(env, path, &map, &rest)) {
+    return make_errno_tuple(env);
   }
 
-  if (!enif_inspect_binary(env, argv[1], &name)) {
-    enif_release_binary(&path);
+  return make_ok_rest_tuple(env, map, rest);
+}
+
+/** @spec hasxattr_nif(iodata, iodata) :: {:ok, boolean} | {:error, term} */
+static ERL_NIF_TERM do_hasxattr(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM error;
+  bool result;
+
+  if (argc != 2) {
     return enif_make_badarg(env);
   }
 
-  if (name.size == 0) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], path, &error) ||
+      !get_name_arg(env, argv[1], name, &error)) {
+    return error;
   }
 
-  if (!hasxattr_impl(env, (char *)path.data, (char *)name.data, &result)) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
+  if (!hasxattr_impl(env, path, name, &result)) {
     return make_errno_tuple(env);
   }
 
-  enif_release_binary(&name);
-  enif_release_binary(&path);
-
   return make_ok_tuple(env, make_bool(env, result));
 }
 
-/** @spec getxattr_nif(binary, binary) :: {:ok, binary} | {:error, term} */
-static ERL_NIF_TERM getxattr_nif(ErlNifEnv *env, int argc,
-                                 const ERL_NIF_TERM argv[]) {
-  ErlNifBinary path;
-  ErlNifBinary name;
-  ErlNifBinary result;
+/** @spec getxattr_nif(iodata, iodata) :: {:ok, binary} | {:error, term} */
+static ERL_NIF_TERM do_getxattr(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM error;
+  ERL_NIF_TERM result;
 
   if (argc != 2) {
     return enif_make_badarg(env);
   }
 
-  if (!enif_inspect_binary(env, argv[0], &path)) {
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], path, &error) ||
+      !get_name_arg(env, argv[1], name, &error)) {
+    return error;
   }
 
-  if (path.size == 0) {
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!getxattr_impl(env, path, name, &result)) {
+    return make_errno_tuple(env);
   }
 
-  if (!enif_inspect_binary(env, argv[1], &name)) {
-    enif_release_binary(&path);
+  return make_ok_tuple(env, result);
+}
+
+/** @spec setxattr_nif(iodata, iodata, binary) :: :ok | {:error, term} */
+static ERL_NIF_TERM do_setxattr(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary value;
+  ERL_NIF_TERM error;
+
+  if (argc != 3) {
     return enif_make_badarg(env);
   }
 
-  if (name.size == 0) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
+  if (!enif_inspect_binary(env, argv[2], &value)) {
     return enif_make_badarg(env);
   }
 
-  if (!getxattr_impl(env, (char *)path.data, (char *)name.data, &result)) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
-    enif_release_binary(&result);
-    return make_errno_tuple(env);
+  if (!get_path_arg(env, argv[0], path, &error) ||
+      !get_name_arg(env, argv[1], name, &error)) {
+    return error;
   }
 
-  enif_release_binary(&name);
-  enif_release_binary(&path);
+  if (!setxattr_impl(env, path, name, value)) {
+    return make_errno_tuple(env);
+  }
 
-  return make_ok_tuple(env, enif_make_binary(env, &result));
+  return atom_ok;
 }
 
-/** @spec setxattr_nif(binary, binary, binary) :: :ok | {:error, term} */
-static ERL_NIF_TERM setxattr_nif(ErlNifEnv *env, int argc,
-                                 const ERL_NIF_TERM argv[]) {
-  ErlNifBinary path;
-  ErlNifBinary name;
+/** @spec setxattr_mode_nif(iodata, iodata, binary, :create | :replace) ::
+ *          :ok | {:error, term} */
+static ERL_NIF_TERM do_setxattr_mode(ErlNifEnv *env, int argc,
+                                     const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
   ErlNifBinary value;
+  ERL_NIF_TERM error;
+  set_mode_t mode;
 
-  if (argc != 3) {
+  if (argc != 4) {
     return enif_make_badarg(env);
   }
 
-  if (!enif_inspect_binary(env, argv[0], &path)) {
+  if (!enif_inspect_binary(env, argv[2], &value) ||
+      !get_set_mode_arg(env, argv[3], &mode)) {
     return enif_make_badarg(env);
   }
 
-  if (path.size == 0) {
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], path, &error) ||
+      !get_name_arg(env, argv[1], name, &error)) {
+    return error;
   }
 
-  if (!enif_inspect_binary(env, argv[1], &name)) {
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!setxattr_mode_impl(env, path, name, value, mode)) {
+    return make_errno_tuple(env);
   }
 
-  if (name.size == 0) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
+  return atom_ok;
+}
+
+/** @spec casxattr_nif(iodata, iodata, binary | nil, binary) ::
+ *          {:ok, boolean} | {:error, term} */
+static ERL_NIF_TERM do_casxattr(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  ErlNifBinary expected;
+  ErlNifBinary value;
+  ERL_NIF_TERM error;
+  bool absent;
+  bool swapped;
+
+  if (argc != 4) {
     return enif_make_badarg(env);
   }
 
-  if (!enif_inspect_binary(env, argv[2], &value)) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
+  absent = enif_is_identical(argv[2], atom_nil);
+  if ((!absent && !enif_inspect_binary(env, argv[2], &expected)) ||
+      !enif_inspect_binary(env, argv[3], &value)) {
     return enif_make_badarg(env);
   }
 
-  if (!setxattr_impl(env, (char *)path.data, (char *)name.data, value)) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
-    enif_release_binary(&value);
-    return make_errno_tuple(env);
+  if (!get_path_arg(env, argv[0], path, &error) ||
+      !get_name_arg(env, argv[1], name, &error)) {
+    return error;
   }
 
-  enif_release_binary(&name);
-  enif_release_binary(&path);
-  enif_release_binary(&value);
+  if (!casxattr_impl(env, path, name, absent ? NULL : &expected, value,
+                     &swapped)) {
+    return make_errno_tuple(env);
+  }
 
-  return make_atom(env, "ok");
+  return make_ok_tuple(env, make_bool(env, swapped));
 }
 
-/** removexattr_nif(binary, binary) :: :ok | {:error, term} */
-static ERL_NIF_TERM removexattr_nif(ErlNifEnv *env, int argc,
-                                    const ERL_NIF_TERM argv[]) {
-  ErlNifBinary path;
-  ErlNifBinary name;
+/** @spec removexattr_nif(iodata, iodata) :: :ok | {:error, term} */
+static ERL_NIF_TERM do_removexattr(ErlNifEnv *env, int argc,
+                                   const ERL_NIF_TERM argv[]) {
+  char path[PATH_BUFFER_SIZE];
+  char name[NAME_BUFFER_SIZE];
+  ERL_NIF_TERM error;
 
   if (argc != 2) {
     return enif_make_badarg(env);
   }
 
-  if (!enif_inspect_binary(env, argv[0], &path)) {
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], path, &error) ||
+      !get_name_arg(env, argv[1], name, &error)) {
+    return error;
   }
 
-  if (path.size == 0) {
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!removexattr_impl(env, path, name)) {
+    return make_errno_tuple(env);
   }
 
-  if (!enif_inspect_binary(env, argv[1], &name)) {
-    enif_release_binary(&path);
+  return atom_ok;
+}
+
+/** @spec copyxattr_nif(iodata, iodata, boolean, boolean) ::
+ *          :ok | {:error, term} */
+static ERL_NIF_TERM copyxattr_nif(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]) {
+  char src[PATH_BUFFER_SIZE];
+  char dst[PATH_BUFFER_SIZE];
+  ERL_NIF_TERM error;
+  int flags = 0;
+
+  if (argc != 4) {
     return enif_make_badarg(env);
   }
 
-  if (name.size == 0) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
-    return enif_make_badarg(env);
+  if (!get_path_arg(env, argv[0], src, &error) ||
+      !get_path_arg(env, argv[1], dst, &error)) {
+    return error;
   }
 
-  if (!removexattr_impl(env, (char *)path.data, (char *)name.data)) {
-    enif_release_binary(&name);
-    enif_release_binary(&path);
+  if (enif_is_identical(argv[2], atom_true)) {
+    flags |= COPY_SYNC;
+  }
+  if (enif_is_identical(argv[3], atom_true)) {
+    flags |= COPY_DATA;
+  }
+
+  if (!copyxattr_impl(env, src, dst, flags)) {
     return make_errno_tuple(env);
   }
 
-  enif_release_binary(&name);
-  enif_release_binary(&path);
+  return atom_ok;
+}
 
-  return make_atom(env, "ok");
+/*
+ * Exported NIFs
+ */
+
+static ERL_NIF_TERM listxattr_nif(ErlNifEnv *env, int argc,
+                                  const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "listxattr_dirty_nif", do_listxattr, argc, argv);
+}
+
+static ERL_NIF_TERM getallxattr_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "getallxattr_dirty_nif", do_getallxattr, argc, argv);
+}
+
+static ERL_NIF_TERM hasxattr_nif(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "hasxattr_dirty_nif", do_hasxattr, argc, argv);
+}
+
+static ERL_NIF_TERM getxattr_nif(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "getxattr_dirty_nif", do_getxattr, argc, argv);
+}
+
+static ERL_NIF_TERM setxattr_nif(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "setxattr_dirty_nif", do_setxattr, argc, argv);
+}
+
+static ERL_NIF_TERM setxattr_mode_nif(ErlNifEnv *env, int argc,
+                                      const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "setxattr_mode_dirty_nif", do_setxattr_mode, argc, argv);
+}
+
+static ERL_NIF_TERM casxattr_nif(ErlNifEnv *env, int argc,
+                                 const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "casxattr_dirty_nif", do_casxattr, argc, argv);
+}
+
+static ERL_NIF_TERM removexattr_nif(ErlNifEnv *env, int argc,
+                                    const ERL_NIF_TERM argv[]) {
+  return sched_run(env, "removexattr_dirty_nif", do_removexattr, argc, argv);
 }
 
 /*
  * NIF setup
  */
 
+static int load(ErlNifEnv *env, UNUSED void **priv_data,
+                ERL_NIF_TERM load_info) {
+  atoms_init(env);
+
+  /* every init cleans up after itself when it fails, modules which have
+   * been set up are torn down in reverse order */
+  if (!names_init(env, load_info) || !handle_init(env)) {
+    return 1;
+  }
+  if (!batch_init(env) || !listing_init(env) || !watch_init(env)) {
+    goto undo_handle;
+  }
+  if (!scan_init(env)) {
+    goto undo_watch;
+  }
+  if (!scratch_init()) {
+    goto undo_scan;
+  }
+  if (!inode_locks_init()) {
+    goto undo_scratch;
+  }
+  if (!sched_init(env, load_info)) {
+    goto undo_inode_locks;
+  }
+  if (!cache_init(env, load_info)) {
+    goto undo_sched;
+  }
+  if (!uring_init(env, load_info)) {
+    goto undo_cache;
+  }
+  if (!pool_init(env, load_info)) {
+    goto undo_uring;
+  }
+  if (!codec_init(env, load_info)) {
+    goto undo_pool;
+  }
+  if (!dirstore_init(env, load_info)) {
+    goto undo_codec;
+  }
+  if (!index_init(env, load_info)) {
+    goto undo_dirstore;
+  }
+  if (!stats_init(env, load_info)) {
+    goto undo_index;
+  }
+
+  return 0;
+
+undo_index:
+  index_destroy();
+undo_dirstore:
+  dirstore_destroy();
+undo_codec:
+  codec_destroy();
+undo_pool:
+  pool_destroy();
+undo_uring:
+  uring_destroy();
+undo_cache:
+  cache_destroy();
+undo_sched:
+  sched_destroy();
+undo_inode_locks:
+  inode_locks_destroy();
+undo_scratch:
+  scratch_destroy();
+undo_scan:
+  scan_destroy();
+undo_watch:
+  watch_destroy();
+undo_handle:
+  handle_destroy();
+  return 1;
+}
+
+static void unload(UNUSED ErlNifEnv *env, UNUSED void *priv_data) {
+  scan_destroy();
+  pool_destroy();
+  index_destroy();
+  dirstore_destroy();
+  codec_destroy();
+  watch_destroy();
+  uring_destroy();
+  cache_destroy();
+  sched_destroy();
+  inode_locks_destroy();
+  scratch_destroy();
+  stats_destroy();
+  handle_destroy();
+}
+
 static ErlNifFunc nif_funcs[] = {
     {"listxattr_nif", 1, listxattr_nif, 0},
+    {"getallxattr_nif", 1, getallxattr_nif, 0},
     {"hasxattr_nif", 2, hasxattr_nif, 0},
     {"getxattr_nif", 2, getxattr_nif, 0},
     {"setxattr_nif", 3, setxattr_nif, 0},
+    {"setxattr_mode_nif", 4, setxattr_mode_nif, 0},
+    {"casxattr_nif", 4, casxattr_nif, 0},
     {"removexattr_nif", 2, removexattr_nif, 0},
+    {"hasxattr_many_nif", 2, hasxattr_many_nif, 0},
+    {"getxattr_many_nif", 2, getxattr_many_nif, 0},
+    {"setxattr_many_nif", 2, setxattr_many_nif, 0},
+    {"removexattr_many_nif", 2, removexattr_many_nif, 0},
+    {"copyxattr_nif", 4, copyxattr_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"hasxattr_paths_nif", 2, hasxattr_paths_nif, 0},
+    {"getxattr_paths_nif", 2, getxattr_paths_nif, 0},
+    {"setxattr_paths_nif", 3, setxattr_paths_nif, 0},
+    {"open_nif", 1, open_nif, 0},
+    {"close_nif", 1, close_nif, 0},
+    {"flistxattr_nif", 1, flistxattr_nif, 0},
+    {"fgetallxattr_nif", 1, fgetallxattr_nif, 0},
+    {"fhasxattr_nif", 2, fhasxattr_nif, 0},
+    {"fgetxattr_nif", 2, fgetxattr_nif, 0},
+    {"fsetxattr_nif", 3, fsetxattr_nif, 0},
+    {"fsetxattr_mode_nif", 4, fsetxattr_mode_nif, 0},
+    {"fcasxattr_nif", 4, fcasxattr_nif, 0},
+    {"fremovexattr_nif", 2, fremovexattr_nif, 0},
+    {"cache_stats_nif", 0, cache_stats_nif, 0},
+    {"stats_nif", 0, stats_nif, 0},
+    {"async_hasxattr_nif", 3, async_hasxattr_nif, 0},
+    {"async_getxattr_nif", 3, async_getxattr_nif, 0},
+    {"async_setxattr_nif", 4, async_setxattr_nif, 0},
+    {"async_removexattr_nif", 3, async_removexattr_nif, 0},
+    {"subscribe_nif", 1, subscribe_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"unsubscribe_nif", 1, unsubscribe_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"scan_nif", 5, scan_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"scan_ack_nif", 1, scan_ack_nif, 0},
+    {"scan_cancel_nif", 1, scan_cancel_nif, 0},
+    {"index_lookup_nif", 2, index_lookup_nif, 0},
+    {"index_builder_nif", 0, index_builder_nif, 0},
+    {"index_builder_add_nif", 2, index_builder_add_nif,
+     ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"index_commit_nif", 2, index_commit_nif, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"listxattr_dirty_nif", 1, do_listxattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"getallxattr_dirty_nif", 1, do_getallxattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"hasxattr_dirty_nif", 2, do_hasxattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"getxattr_dirty_nif", 2, do_getxattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"setxattr_dirty_nif", 3, do_setxattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"setxattr_mode_dirty_nif", 4, do_setxattr_mode,
+     ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"casxattr_dirty_nif", 4, do_casxattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"removexattr_dirty_nif", 2, do_removexattr, ERL_NIF_DIRTY_JOB_IO_BOUND},
 };
 
-ERL_NIF_INIT(Elixir.Xattr.Nif, nif_funcs, NULL, NULL, NULL, NULL)
+ERL_NIF_INIT(Elixir.Xattr.Nif, nif_funcs, load, NULL, NULL, unload)
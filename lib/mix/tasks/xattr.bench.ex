@@ -0,0 +1,290 @@
+defmodule Mix.Tasks.Xattr.Bench do
+  use Mix.Task
+
+  @shortdoc "Measures throughput and latency of xattr operations"
+
+  @moduledoc """
+  Measures throughput and p50/p99/p999 latency of `ls`, `get`, `has`, `set`
+  and `rm` calls.
+
+      mix xattr.bench --output bench.json tmpfs=/dev/shm ext4=/mnt/ext4
+
+  Every case of operation, value size, number of attributes per file and
+  number of concurrent callers is measured in every given directory, labelled
+  with its filesystem. Each caller is a process working on its own file,
+  which makes the given number of calls and times each of them. Without
+  directories, `XATTR_BENCH_DIR` or the system temporary directory is used.
+  `bench/loopback.sh` makes ext4 and xfs images to run on.
+
+  Results are written as JSON, one case per line in a stable order, so that
+  two runs can be compared with `diff` or `jq`. `bench/xattr_bench` measures
+  the same cases calling native code directly, without the VM, and writes
+  results in the same format.
+
+  Cases which cannot be set up, usually because the filesystem limits total
+  size of attributes of a file, are reported with an error.
+
+  ## Options
+
+    * `--calls` - calls per caller and case, defaults to 2000
+    * `--sizes` - comma-separated value sizes in bytes, defaults to
+      `16,256,4096,65536`
+    * `--attrs` - comma-separated attribute counts, defaults to
+      `1,10,100,1000`
+    * `--concurrency` - comma-separated caller counts, defaults to powers of
+      two up to the number of online schedulers
+    * `--output` - JSON output file, defaults to standard output
+  """
+
+  @switches [
+    calls: :integer,
+    sizes: :string,
+    attrs: :string,
+    concurrency: :string,
+    output: :string
+  ]
+  @ops [:ls, :get, :has, :set, :rm]
+
+  def run(args) do
+    {opts, dirs} = OptionParser.parse!(args, strict: @switches)
+    Mix.Task.run("app.start")
+
+    calls = Keyword.get(opts, :calls, 2000)
+    sizes = parse_list(opts[:sizes], [16, 256, 4096, 65536])
+    attrs = parse_list(opts[:attrs], [1, 10, 100, 1000])
+    concurrency = parse_list(opts[:concurrency], default_concurrency())
+
+    dirs =
+      case dirs do
+        [] -> [{"default", System.get_env("XATTR_BENCH_DIR") || System.tmp_dir!()}]
+        dirs -> Enum.map(dirs, &parse_dir/1)
+      end
+
+    results =
+      for {fs, dir} <- dirs,
+          op <- @ops,
+          size <- sizes,
+          count <- attrs,
+          callers <- concurrency do
+        result = measure(dir, op, size, count, callers, calls)
+
+        Mix.shell().info(
+          "#{fs} #{op} #{size} B x #{count}, #{callers} callers: #{summary(result)}"
+        )
+
+        [
+          fs: fs,
+          dir: dir,
+          op: Atom.to_string(op),
+          value_size: size,
+          attrs: count,
+          concurrency: callers
+        ] ++ result
+      end
+
+    json = encode(harness: "mix", calls: calls, results: {:lines, results})
+
+    case opts[:output] do
+      nil -> IO.puts(json)
+      path -> File.write!(path, [json, ?\n])
+    end
+  end
+
+  defp parse_list(nil, default), do: default
+
+  defp parse_list(arg, _default) do
+    arg
+    |> String.split(",")
+    |> Enum.map(fn item ->
+      case Integer.parse(item) do
+        {value, ""} when value > 0 -> value
+        _ -> Mix.raise("Expected comma-separated positive integers, got: #{arg}")
+      end
+    end)
+  end
+
+  defp parse_dir(arg) do
+    case String.split(arg, "=", parts: 2) do
+      [fs, dir] -> {fs, dir}
+      _ -> Mix.raise("Expected directory as label=path, got: #{arg}")
+    end
+  end
+
+  defp default_concurrency do
+    schedulers = System.schedulers_online()
+
+    1
+    |> Stream.iterate(&(&1 * 2))
+    |> Enum.take_while(&(&1 < schedulers))
+    |> Kernel.++([schedulers])
+  end
+
+  defp summary(result) do
+    case result[:error] do
+      nil -> "#{round(result[:ops_per_sec])} ops/s"
+      error -> error
+    end
+  end
+
+  ## Measurement
+
+  defp measure(dir, op, size, count, callers, calls) do
+    value = :binary.copy("v", size)
+    paths = for i <- 1..callers, do: Path.join(dir, "xattr_bench.#{i}")
+
+    try do
+      case Enum.find_value(paths, &populate(&1, count, value)) do
+        nil -> run_callers(paths, op, value, count, calls)
+        reason -> [error: to_string(reason)]
+      end
+    after
+      Enum.each(paths, &File.rm/1)
+    end
+  end
+
+  defp populate(path, count, value) do
+    File.write!(path, "")
+
+    Enum.find_value(1..count, fn n ->
+      case Xattr.set(path, "bench#{n}", value) do
+        :ok -> nil
+        {:error, reason} -> reason
+      end
+    end)
+  end
+
+  defp run_callers(paths, op, value, count, calls) do
+    parent = self()
+
+    pids =
+      for {path, seed} <- Enum.with_index(paths, 1) do
+        spawn_link(fn ->
+          :rand.seed(:exsplus, {seed, seed, seed})
+          send(parent, {:ready, self()})
+
+          receive do
+            :go ->
+              outcome = loop(op, path, value, count, calls, [])
+              send(parent, {:done, self(), outcome})
+          end
+        end)
+      end
+
+    for pid <- pids do
+      receive do
+        {:ready, ^pid} -> :ok
+      end
+    end
+
+    start = System.monotonic_time()
+    Enum.each(pids, &send(&1, :go))
+
+    outcomes =
+      for pid <- pids do
+        receive do
+          {:done, ^pid, outcome} -> outcome
+        end
+      end
+
+    elapsed = System.monotonic_time() - start
+    seconds = elapsed / System.convert_time_unit(1, :second, :native)
+
+    case Enum.find(outcomes, &match?({:error, _}, &1)) do
+      {:error, reason} ->
+        [error: to_string(reason)]
+
+      nil ->
+        sorted = outcomes |> Enum.concat() |> Enum.sort() |> List.to_tuple()
+        total = tuple_size(sorted)
+
+        [
+          calls: total,
+          seconds: seconds,
+          ops_per_sec: total / seconds,
+          p50_us: percentile(sorted, 0.5),
+          p99_us: percentile(sorted, 0.99),
+          p999_us: percentile(sorted, 0.999)
+        ]
+    end
+  end
+
+  defp percentile(sorted, p) do
+    native = elem(sorted, trunc(p * (tuple_size(sorted) - 1)))
+    System.convert_time_unit(native, :native, :nanosecond) / 1000
+  end
+
+  defp loop(_op, _path, _value, _count, 0, latencies), do: latencies
+
+  defp loop(op, path, value, count, calls, latencies) do
+    name = "bench#{:rand.uniform(count)}"
+
+    case prepare(op, path, value) do
+      :ok ->
+        start = System.monotonic_time()
+        result = call(op, path, name, value)
+        latency = System.monotonic_time() - start
+
+        case result do
+          {:error, _} = error -> error
+          _ -> loop(op, path, value, count, calls - 1, [latency | latencies])
+        end
+
+      error ->
+        error
+    end
+  end
+
+  # removed attribute is set again before each timed call
+  defp prepare(:rm, path, value), do: Xattr.set(path, "bench_rm", value)
+  defp prepare(_op, _path, _value), do: :ok
+
+  defp call(:ls, path, _name, _value), do: Xattr.ls(path)
+  defp call(:get, path, name, _value), do: Xattr.get(path, name)
+  defp call(:has, path, name, _value), do: Xattr.has(path, name)
+  defp call(:set, path, name, value), do: Xattr.set(path, name, value)
+  defp call(:rm, path, _name, _value), do: Xattr.rm(path, "bench_rm")
+
+  ## JSON
+
+  defp encode(fields) do
+    pairs =
+      Enum.map(fields, fn
+        {key, {:lines, items}} ->
+          lines = Enum.map(items, &["    ", encode_object(&1)])
+          items = Enum.intersperse(lines, ",\n")
+          ["  ", encode_value(key), ": [\n", items, "\n  ]"]
+
+        {key, value} ->
+          ["  ", encode_value(key), ": ", encode_value(value)]
+      end)
+
+    IO.iodata_to_binary(["{\n", Enum.intersperse(pairs, ",\n"), "\n}"])
+  end
+
+  defp encode_object(fields) do
+    pairs =
+      Enum.map(fields, fn {key, value} ->
+        [encode_value(key), ": ", encode_value(value)]
+      end)
+
+    ["{", Enum.intersperse(pairs, ", "), "}"]
+  end
+
+  defp encode_value(value) when is_atom(value), do: encode_value(Atom.to_string(value))
+  defp encode_value(value) when is_integer(value), do: Integer.to_string(value)
+  defp encode_value(value) when is_float(value), do: :erlang.float_to_binary(value, decimals: 3)
+
+  defp encode_value(value) when is_binary(value) do
+    escaped =
+      for <<char <- value>>, into: "" do
+        case char do
+          ?" -> "\\\""
+          ?\\ -> "\\\\"
+          char when char < 0x20 -> "\\u00" <> Base.encode16(<<char>>)
+          char -> <<char>>
+        end
+      end
+
+    [?", escaped, ?"]
+  end
+end
@@ -7,31 +7,315 @@ defmodule Xattr.Nif do
 
   def init do
     path = Path.join(:code.priv_dir(unquote(app)), "elixir_xattr")
-    :erlang.load_nif(String.to_charlist(path), 0)
+    :erlang.load_nif(String.to_charlist(path), load_info())
   end
 
-  @spec listxattr_nif(binary) :: {:ok, list(binary)} | {:error, term}
+  defp load_info do
+    unquote(app)
+    |> Application.get_all_env()
+    |> Map.new()
+    |> Map.take([
+      :scheduler,
+      :latency_budget,
+      :slow_cooldown,
+      :cache_max_bytes,
+      :async_threads,
+      :async_queue_size,
+      :uring,
+      :uring_depth,
+      :index,
+      :index_root,
+      :index_names,
+      :index_max_value,
+      :compress_names,
+      :dir_store,
+      :dir_store_force,
+      :stats,
+      :new_atoms
+    ])
+    |> encode_names(:index_names)
+    |> encode_names(:compress_names)
+  end
+
+  # name lists are matched against names with type tags, as they are passed
+  # to the NIFs
+  defp encode_names(info, key) do
+    case Map.fetch(info, key) do
+      {:ok, names} -> %{info | key => Enum.map(names, &encode_name/1)}
+      :error -> info
+    end
+  end
+
+  defp encode_name(name) when is_atom(name) do
+    "a$" <> Atom.to_string(name)
+  end
+
+  defp encode_name(name) when is_binary(name) do
+    "s$" <> name
+  end
+
+  # atom names which could not be made natively come separately, as binaries
+  @type list_result_t ::
+          {:ok, [binary | atom]} | {:ok, [binary | atom], [binary]} | {:error, term}
+
+  @spec listxattr_nif(iodata) :: list_result_t
   def listxattr_nif(_path) do
     :erlang.nif_error(:nif_library_not_loaded)
   end
 
-  @spec hasxattr_nif(binary, binary) :: {:ok, boolean} | {:error, term}
+  @type getall_result_t ::
+          {:ok, map} | {:ok, map, [{binary, binary}]} | {:error, term}
+
+  @spec getallxattr_nif(iodata) :: getall_result_t
+  def getallxattr_nif(_path) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec hasxattr_nif(iodata, iodata) :: {:ok, boolean} | {:error, term}
   def hasxattr_nif(_path, _name) do
     :erlang.nif_error(:nif_library_not_loaded)
   end
 
-  @spec getxattr_nif(binary, binary) :: {:ok, binary} | {:error, term}
+  @spec getxattr_nif(iodata, iodata) :: {:ok, binary} | {:error, term}
   def getxattr_nif(_path, _name) do
     :erlang.nif_error(:nif_library_not_loaded)
   end
 
-  @spec setxattr_nif(binary, binary, binary) :: :ok | {:error, term}
+  @spec setxattr_nif(iodata, iodata, binary) :: :ok | {:error, term}
   def setxattr_nif(_path, _name, _value) do
     :erlang.nif_error(:nif_library_not_loaded)
   end
 
-  @spec removexattr_nif(binary, binary) :: :ok | {:error, term}
+  @spec setxattr_mode_nif(iodata, iodata, binary, :create | :replace) ::
+          :ok | {:error, term}
+  def setxattr_mode_nif(_path, _name, _value, _mode) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec casxattr_nif(iodata, iodata, binary | nil, binary) ::
+          {:ok, boolean} | {:error, term}
+  def casxattr_nif(_path, _name, _expected, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec removexattr_nif(iodata, iodata) :: :ok | {:error, term}
   def removexattr_nif(_path, _name) do
     :erlang.nif_error(:nif_library_not_loaded)
   end
+
+  @spec listxattr_dirty_nif(iodata) :: list_result_t
+  def listxattr_dirty_nif(_path) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec getallxattr_dirty_nif(iodata) :: getall_result_t
+  def getallxattr_dirty_nif(_path) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec hasxattr_dirty_nif(iodata, iodata) :: {:ok, boolean} | {:error, term}
+  def hasxattr_dirty_nif(_path, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec getxattr_dirty_nif(iodata, iodata) :: {:ok, binary} | {:error, term}
+  def getxattr_dirty_nif(_path, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec setxattr_dirty_nif(iodata, iodata, binary) :: :ok | {:error, term}
+  def setxattr_dirty_nif(_path, _name, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec setxattr_mode_dirty_nif(iodata, iodata, binary, :create | :replace) ::
+          :ok | {:error, term}
+  def setxattr_mode_dirty_nif(_path, _name, _value, _mode) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec casxattr_dirty_nif(iodata, iodata, binary | nil, binary) ::
+          {:ok, boolean} | {:error, term}
+  def casxattr_dirty_nif(_path, _name, _expected, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec removexattr_dirty_nif(iodata, iodata) :: :ok | {:error, term}
+  def removexattr_dirty_nif(_path, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec hasxattr_many_nif(iodata | reference, [iodata]) ::
+          {:ok, [{:ok, boolean} | {:error, term}]} | {:error, term}
+  def hasxattr_many_nif(_path, _names) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec getxattr_many_nif(iodata | reference, [iodata]) ::
+          {:ok, [{:ok, binary} | {:error, term}]} | {:error, term}
+  def getxattr_many_nif(_path, _names) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec setxattr_many_nif(iodata | reference, [{iodata, binary}]) ::
+          {:ok, [:ok | {:error, term}]} | {:error, term}
+  def setxattr_many_nif(_path, _attrs) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec removexattr_many_nif(iodata | reference, [iodata]) ::
+          {:ok, [:ok | {:error, term}]} | {:error, term}
+  def removexattr_many_nif(_path, _names) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec copyxattr_nif(iodata, iodata, boolean, boolean) :: :ok | {:error, term}
+  def copyxattr_nif(_src, _dst, _sync, _data) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec hasxattr_paths_nif([iodata], iodata) :: [{:ok, boolean} | {:error, term}]
+  def hasxattr_paths_nif(_paths, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec getxattr_paths_nif([iodata], iodata) :: [{:ok, binary} | {:error, term}]
+  def getxattr_paths_nif(_paths, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec setxattr_paths_nif([iodata], iodata, binary) :: [:ok | {:error, term}]
+  def setxattr_paths_nif(_paths, _name, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec open_nif(iodata) :: {:ok, reference} | {:error, term}
+  def open_nif(_path) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec close_nif(reference) :: :ok
+  def close_nif(_handle) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec flistxattr_nif(reference) :: list_result_t
+  def flistxattr_nif(_handle) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fgetallxattr_nif(reference) :: getall_result_t
+  def fgetallxattr_nif(_handle) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fhasxattr_nif(reference, iodata) :: {:ok, boolean} | {:error, term}
+  def fhasxattr_nif(_handle, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fgetxattr_nif(reference, iodata) :: {:ok, binary} | {:error, term}
+  def fgetxattr_nif(_handle, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fsetxattr_nif(reference, iodata, binary) :: :ok | {:error, term}
+  def fsetxattr_nif(_handle, _name, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fsetxattr_mode_nif(reference, iodata, binary, :create | :replace) ::
+          :ok | {:error, term}
+  def fsetxattr_mode_nif(_handle, _name, _value, _mode) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fcasxattr_nif(reference, iodata, binary | nil, binary) ::
+          {:ok, boolean} | {:error, term}
+  def fcasxattr_nif(_handle, _name, _expected, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec fremovexattr_nif(reference, iodata) :: :ok | {:error, term}
+  def fremovexattr_nif(_handle, _name) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec cache_stats_nif() :: [%{atom => non_neg_integer}]
+  def cache_stats_nif do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec stats_nif() :: %{atom => map}
+  def stats_nif do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec subscribe_nif([iodata]) :: {:ok, reference} | {:error, term}
+  def subscribe_nif(_paths) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec unsubscribe_nif(reference) :: :ok
+  def unsubscribe_nif(_subscription) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec scan_nif(iodata, [{iodata, term}], pos_integer, pos_integer, pos_integer) ::
+          {:ok, reference, reference} | {:error, term}
+  def scan_nif(_root, _names, _threads, _chunk_size, _max_chunks) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec scan_ack_nif(reference) :: :ok
+  def scan_ack_nif(_scan) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec scan_cancel_nif(reference) :: :ok
+  def scan_cancel_nif(_scan) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec index_lookup_nif(iodata, iodata) :: {:ok, [binary]} | {:error, term}
+  def index_lookup_nif(_name, _value) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec index_builder_nif() :: {:ok, reference, binary} | {:error, term}
+  def index_builder_nif do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec index_builder_add_nif(reference, [{iodata, [{iodata, binary}]}]) ::
+          :ok | {:error, term}
+  def index_builder_add_nif(_builder, _entries) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec index_commit_nif(reference, boolean) ::
+          {:ok, non_neg_integer, non_neg_integer} | {:error, term}
+  def index_commit_nif(_builder, _reconcile) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec async_hasxattr_nif(iodata | reference, iodata, pid) :: reference
+  def async_hasxattr_nif(_path, _name, _pid) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec async_getxattr_nif(iodata | reference, iodata, pid) :: reference
+  def async_getxattr_nif(_path, _name, _pid) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec async_setxattr_nif(iodata | reference, iodata, binary, pid) :: reference
+  def async_setxattr_nif(_path, _name, _value, _pid) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
+
+  @spec async_removexattr_nif(iodata | reference, iodata, pid) :: reference
+  def async_removexattr_nif(_path, _name, _pid) do
+    :erlang.nif_error(:nif_library_not_loaded)
+  end
 end
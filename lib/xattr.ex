@@ -32,17 +32,31 @@ defmodule Xattr do
   Briefly: a file can have many contents.
 
   Attributes are stored in `ElixirXattr` data stream, which is automatically
-  created when setting an attribute and the stream does not exist. They are
-  saved in simple binary format, as a contiguous list of *size:data* cells:
+  created when setting an attribute and the stream does not exist. The stream
+  starts with a header and a table of slot offsets sorted by attribute name,
+  so lookups are binary searches reading a few small blocks:
 
   ```txt
-    v - name C-string size                          v - value binary size
-  +---+------------+---+-----------+---+----------+---+-------+
-  | 5 | n a m e \0 | 5 | v a l u e | 4 | f o o \0 | 3 | b a r |  ...
-  +---+------------+---+-----------+---+----------+---+-------+
-        ^ - name C-string, note \0 suffix               ^ - value binary data
+  +----------+-------+----------+----------+------+-------+------------------+
+  | XATTRAD2 | count | capacity | data end | free | check | offsets (sorted) | ...
+  +----------+-------+----------+----------+------+-------+------------------+
+
+  +----------+-----------+----------------+------+-----------------------+
+  | name len | value len | value capacity | name | value (+ spare room)  |
+  +----------+-----------+----------------+------+-----------------------+
   ```
 
+  Values which fit their slot are overwritten in place, longer ones move to
+  a new slot at the end of the stream. Unused slots are reclaimed by
+  rewriting the stream once they take half of it. All numbers are 32-bit
+  little endian.
+
+  The header is written last and checks the table, so a stream left behind by
+  an interrupted update is recognized and its table is rebuilt from the slots.
+
+  Streams written by earlier versions, which hold a plain list of
+  *size:data* cells, are still read and are converted on first write.
+
   ### Unicode
 
   Unicode filenames are supported (and as such proper encoding conversions
@@ -60,12 +74,252 @@ defmodule Xattr do
   For example, given Xattr backend, call `Xattr.set("foo.txt", "example", "value")`
   will create `user.ElixirXattr.s$example` extended attribute on file `foo.txt`.
 
+  ### Atom names
+
+  Names are decoded natively: `ls/1`, `get_all/1`, `scan/2` and subscriptions
+  return string names as binaries and atom names as atoms, made like
+  `String.to_atom/1` does. Names read from files can come from anywhere and
+  atoms are never garbage collected, so listing files written by someone else
+  can fill the atom table. Creating new atoms can be refused:
+
+  ```elixir
+  config :xattr, new_atoms: false
+  ```
+
+  Atom names are then only looked up among existing atoms and calls which
+  come across an unknown one fail with `{:error, :unknown_atom}` (`scan/2`
+  reports it for the file, diffs sent to subscribers key the attribute by
+  `{:atom, name}` tuple instead). Names with malformed type tags fail with
+  `{:error, :invalfmt}`.
+
   ### Extended attributes & file system links
 
   On both Unix and Windows implementations, attribute storage is attached to
   file system data, not file/link entries. Therefore attributes are shared
   between all hard links / file and its symlinks.
 
+  ### Scheduling
+
+  File system calls may block for a long time on network and FUSE mounts,
+  which would stall every process sharing a scheduler with the caller. The
+  `:scheduler` application environment key decides where NIFs are run:
+
+  * `:adaptive` (default) - calls are run on the calling scheduler, unless the
+    path lives on a remote (NFS, CIFS, FUSE, ...) file system or a recent call
+    on the same mount took longer than `:latency_budget` microseconds (defaults
+    to `1000`). In both cases the call is rescheduled to a dirty I/O
+    scheduler; slow mounts are retried on the normal scheduler after
+    `:slow_cooldown` milliseconds (defaults to `5000`)
+  * `:dirty` - all calls are run on dirty I/O schedulers
+  * `:normal` - all calls are run on the calling scheduler
+
+  ```elixir
+  config :xattr, scheduler: :adaptive, latency_budget: 500
+  ```
+
+  Mount table is read once, when the NIF library is loaded. Remote mounts are
+  recognized by path prefix only, so paths reaching them through symlinks are
+  caught by latency budget instead.
+
+  On the calling scheduler, long running calls - listings, `*_many` and
+  `*_paths` batches - report time they take as reductions and yield when the
+  caller's time slice is over, continuing where they left off when the caller
+  is scheduled again.
+
+  ### Asynchronous calls
+
+  `async_has/3`, `async_get/3`, `async_set/4` and `async_rm/3` queue the
+  call on a pool of native worker threads and return a reference right away,
+  the result arrives later as a message. The pool is started when the NIF
+  library is loaded; its size and queue length are configurable, setting
+  `:async_threads` to `0` disables it (asynchronous calls then reply with
+  `{:error, :enotsup}`). When the queue is full, calls reply with
+  `{:error, :eagain}`.
+
+  ```elixir
+  config :xattr, async_threads: 8, async_queue_size: 65536
+  ```
+
+  ### Caching
+
+  On Unix values read by `get/2` can be kept in a native cache, enabled by
+  setting its memory limit in bytes:
+
+  ```elixir
+  config :xattr, cache_max_bytes: 64 * 1024 * 1024
+  ```
+
+  Entries are keyed by device, inode and attribute name and validated by file
+  change time, which the kernel updates on every attribute change, so a hit
+  costs one `stat` instead of `getxattr` and changes made by other processes
+  are never missed. Values of files changed in the last few milliseconds are
+  not cached, because another change could keep the same change time. `set/3`
+  and `rm/2` drop affected entries. The cache is split into shards with their
+  own locks and least recently used entries are evicted when a shard exceeds
+  its share of the limit. Use `cache_stats/0` to see how well it works.
+
+  ### io_uring
+
+  On Linux 5.19 and newer `has_many/2`, `get_many/2` and `set_many/2` submit
+  all attribute operations of a call to the kernel at once through a
+  per-thread io_uring, paying for one syscall per up to `:uring_depth`
+  (defaults to `64`) attributes. It is used automatically when the kernel
+  supports it and can be turned off:
+
+  ```elixir
+  config :xattr, uring: false
+  ```
+
+  Older kernels and other systems make one syscall per attribute. Results are
+  the same either way.
+
+  ### Reverse index
+
+  On Unix an on-disk index can answer which files have an attribute set to a
+  given value (`lookup/2`) without walking the file system. It covers files
+  under `:index_root` and is kept in the file given by `:index`, optionally
+  only for attributes listed in `:index_names`; values longer than
+  `:index_max_value` bytes (defaults to `1024`) are not indexed:
+
+  ```elixir
+  config :xattr, index: "/var/lib/app/xattr.idx", index_root: "/srv/data",
+    index_names: ["status", :owner]
+  ```
+
+  The index file is a sorted run of postings mapped into memory, so lookups
+  take a binary search. Every `set/3` and `rm/2` (and their batch and
+  asynchronous variants) within the root updates an in-memory layer on top of
+  it and is appended to a journal next to the index file, which a background
+  thread merges into a new run once it grows large. Updates therefore cost an
+  extra `stat` and path resolution while the index is enabled.
+
+  Changes made by other programs, and renames or removals of files, are not
+  seen. `build_index/1` creates the index from scratch and
+  `reconcile_index/1` repairs such drift; both walk the root with `scan/2`,
+  so they are available on Linux only.
+
+  ### Large values
+
+  File systems limit the size of a single value (e.g. 64 KiB on XFS, node
+  size on Btrfs) and fail with `:e2big` or `:enospc` beyond it. Setting
+  `:chunk_size` makes `set/4` split longer values into chunks of that many
+  bytes, stored as separate attributes hidden from `ls/1`, `get_all/1` and
+  `scan/2`:
+
+  ```elixir
+  config :xattr, chunk_size: 3072
+  ```
+
+  The attribute itself then holds a small header with generation, number of
+  chunks, total length and CRC-32 of the value. `get/2` reassembles and
+  verifies the value and `stream/2` reads it lazily; a value which looks like
+  a header but has no chunks is returned as is. Writes are crash-safe:
+  chunks of a new generation are written first and the header last, so a
+  reader sees either the old value or the new one, and chunks of the old
+  generation are removed only afterwards. Concurrent writes of the same
+  chunked attribute have to be serialized by the caller.
+
+  While chunking is enabled `set/4` and `rm/2` read the attribute before
+  changing it, to remove chunks of the replaced value. `get_all/1` reassembles
+  chunked values too, while `cas/4` fails with `{:error, :enotsup}` on them.
+  Batch, multi-path and asynchronous functions see the header as the value;
+  the index and `subscribe/1` leave chunked attributes out. Ext4 keeps all attributes of a file in one block unless
+  created with `ea_inode` feature, so chunking does not raise the limit there.
+
+  ### Compression
+
+  On Unix values of attributes listed in `:compress_names` are stored
+  compressed with a built-in LZ4 block codec, which suits repetitive JSON or
+  serialized terms:
+
+  ```elixir
+  config :xattr, compress_names: ["manifest", :meta]
+  ```
+
+  Compression is transparent: `get/2`, `get_all/1`, `scan/2` and the other
+  functions return original values and `cas/4` compares them. Smaller values
+  let more attributes fit into the inode (e.g. inline area of large ext4
+  inodes), sparing a read of a separate attribute block, at the cost of some
+  CPU time on every read and write. Values which do not shrink are stored as
+  is after a 5 byte header. Compressed values are kept under a separate name
+  with `z$` tag, so reads and removals of listed attributes also look for an
+  uncompressed value written before the name was listed, and `set/3` replaces
+  it. Values of a name removed from the list are still returned by `ls/1` and
+  `get_all/1`, but not by `get/2`, until they are written again with the name
+  listed. Batch operations on listed names do not use io_uring.
+
+  ### Directory store
+
+  Some mounts do not support user attributes at all (e.g. tmpfs before Linux
+  6.6, some FUSE and network file systems) and fail with `:enotsup`. On Linux
+  attributes of files on such mounts can be kept in a store file instead,
+  one per directory:
+
+  ```elixir
+  config :xattr, dir_store: true
+  ```
+
+  Every mount is probed once, on first access, so the store never shadows
+  attributes the file system can hold. Attributes are then kept in
+  `.elixir_xattr_store` file next to the file, keyed by inode number and
+  birth time, which tells apart files reusing an inode. The store is mapped
+  into memory and indexed by hash chains: reads take no locks, writes append
+  a record under a lock shared by all processes on the host, and superseded
+  records and attributes of removed files are dropped by periodic compaction.
+  A store holds up to 64 MiB and values are limited to 64 KiB.
+
+  The store only emulates attributes: values are not compressed or cached,
+  io_uring is not used, `subscribe/1` and `scan/2` do not see them, and
+  attributes are lost when a file moves to another directory (hard links in
+  other directories have attributes of their own). The store file is visible
+  in directory listings and is not safe to share between hosts (e.g. on NFS).
+
+  Files of directories listed in `dir_store_force` use the store without
+  probing, which lets tests exercise it on any mount. Directories are matched
+  against paths as they are passed, without resolving them:
+
+  ```elixir
+  config :xattr, dir_store: true, dir_store_force: ["test/store"]
+  ```
+
+  ### Statistics
+
+  On Unix every `ls`, `get`, `has`, `set` and `rm` call (including calls on
+  file handles, asynchronous and dirty variants) is counted natively and
+  `stats/0` returns the counters. They are kept per thread, written without
+  locks or atomic instructions and only summed up when read, so they are
+  cheap enough to stay enabled; they can be disabled with:
+
+  ```elixir
+  config :xattr, stats: false
+  ```
+
+  Batch and multi-path operations count every attribute as a call, unless
+  submitted through io_uring; `get_all/1`, `cas/4` and `scan/2` are not
+  counted. Calls served by the cache or the directory store count no
+  syscalls. `Xattr.Telemetry` publishes the counters as `:telemetry` events.
+
+  ### Tracing
+
+  On Linux the native library can be built with USDT probes, which `bpftrace`
+  and `perf` attach to in a running VM:
+
+  ```sh
+  make clean && USDT=1 mix compile
+  ```
+
+  This needs `sys/sdt.h` (`systemtap-sdt-dev` or `systemtap-sdt-devel`
+  package). Probes fire at entry and return of every `ls`, `get`, `has`, `set`
+  and `rm` call with path, name, size, errno, duration and device of the file,
+  of batch operations and of files read by `scan/2`; they are listed in
+  `c_src/trace.h`. A probe costs a single `nop` while no tracer is attached.
+  Scripts in `trace/` directory print latency histograms per mount and slow
+  calls:
+
+  ```sh
+  bpftrace -p $(pgrep -f beam.smp) trace/latency_by_mount.bt
+  ```
+
   ## Errors
 
   Because of the nature of error handling on both Unix and Windows, only specific
@@ -77,16 +331,35 @@ defmodule Xattr do
   Following errors are represented as atoms and as such can be pattern matched:
 
   * `:enoattr`  - attribute was not found
+  * `:eexist`   - attribute already exists (`set/4` with `create: true`)
   * `:enotsup`  - extended attributes are not supported for this file
   * `:enoent`   - file does not exist
   * `:invalfmt` - attribute storage is corrupted and should be regenerated
+  * `:unknown_atom` - atom name is not an existing atom (with `new_atoms: false`)
+  * `:closed`   - file handle has been closed
   """
 
   @tag_atom "a$"
   @tag_str "s$"
+  @tag_chunk "c$"
+
+  # header of chunked values: magic, generation, chunk count, total length and
+  # CRC-32 of the value
+  @chunk_magic "XATTRCH1"
+
+  # number of chunks read or written at once
+  @chunk_batch 16
+
+  # number of scanned entries passed to the index builder at once
+  @index_batch_size 1000
 
   @type name_t :: String.t() | atom
 
+  @typedoc """
+  File given either by path or by handle returned from `open/1`.
+  """
+  @type target_t :: Path.t() | Xattr.Handle.t()
+
   @doc """
   Lists names of all extended attributes of `path`.
 
@@ -100,19 +373,19 @@ defmodule Xattr do
       {:ok, list} = Xattr.ls("foo.txt")
       # list should be permutation of ["hello", :foo]
   """
-  @spec ls(Path.t()) :: {:ok, [name_t]} | {:error, term}
-  def ls(path) do
-    path = IO.chardata_to_string(path) <> <<0>>
+  @spec ls(target_t) :: {:ok, [name_t]} | {:error, term}
+  def ls(%Xattr.Handle{ref: ref}) do
+    ref |> flistxattr_nif() |> decode_names()
+  end
 
-    with {:ok, lst} <- listxattr_nif(path) do
-      decode_list(lst)
-    end
+  def ls(path) do
+    path |> path_arg() |> listxattr_nif() |> decode_names()
   end
 
   @doc """
   The same as `ls/1`, but raises an exception if it fails.
   """
-  @spec ls!(Path.t()) :: [name_t] | no_return
+  @spec ls!(target_t) :: [name_t] | no_return
   def ls!(path) do
     case ls(path) do
       {:ok, result} ->
@@ -122,7 +395,7 @@ defmodule Xattr do
         raise Xattr.Error,
           reason: reason,
           action: "list all extended attributes of",
-          path: IO.chardata_to_string(path)
+          path: path_string(path)
     end
   end
 
@@ -135,17 +408,21 @@ defmodule Xattr do
       Xattr.has("foo.txt", "hello") == {:ok, true}
       Xattr.has("foo.txt", :foo) == {:ok, false}
   """
-  @spec has(Path.t(), name :: name_t) :: {:ok, boolean} | {:error, term}
+  @spec has(target_t, name :: name_t) :: {:ok, boolean} | {:error, term}
+  def has(%Xattr.Handle{ref: ref}, name) when is_binary(name) or is_atom(name) do
+    fhasxattr_nif(ref, encode_name(name))
+  end
+
   def has(path, name) when is_binary(name) or is_atom(name) do
-    path = IO.chardata_to_string(path) <> <<0>>
-    name = encode_name(name) <> <<0>>
+    path = path_arg(path)
+    name = encode_name(name)
     hasxattr_nif(path, name)
   end
 
   @doc """
   The same as `has/2`, but raises an exception if it fails.
   """
-  @spec has!(Path.t(), name :: name_t) :: boolean | no_return
+  @spec has!(target_t, name :: name_t) :: boolean | no_return
   def has!(path, name) do
     case has(path, name) do
       {:ok, result} ->
@@ -155,14 +432,15 @@ defmodule Xattr do
         raise Xattr.Error,
           reason: reason,
           action: "check attribute existence of",
-          path: IO.chardata_to_string(path)
+          path: path_string(path)
     end
   end
 
   @doc """
   Gets extended attribute value.
 
-  If attribute `name` does not exist, `{:error, :enoattr}` is returned.
+  If attribute `name` does not exist, `{:error, :enoattr}` is returned. Values
+  split into chunks (see "Large values" above) are read whole.
 
   ## Example
 
@@ -170,17 +448,15 @@ defmodule Xattr do
       Xattr.get("foo.txt", "hello") == {:ok, "world"}
       Xattr.get("foo.txt", :foo) == {:error, :enoattr}
   """
-  @spec get(Path.t(), name :: name_t) :: {:ok, binary} | {:error, term}
-  def get(path, name) when is_binary(name) or is_atom(name) do
-    path = IO.chardata_to_string(path) <> <<0>>
-    name = encode_name(name) <> <<0>>
-    getxattr_nif(path, name)
+  @spec get(target_t, name :: name_t) :: {:ok, binary} | {:error, term}
+  def get(target, name) when is_binary(name) or is_atom(name) do
+    get_chunked(target_arg(target), encode_name(name))
   end
 
   @doc """
   The same as `get/2`, but raises an exception if it fails.
   """
-  @spec get!(Path.t(), name :: name_t) :: binary | no_return
+  @spec get!(target_t, name :: name_t) :: binary | no_return
   def get!(path, name) do
     case get(path, name) do
       {:ok, result} ->
@@ -190,42 +466,217 @@ defmodule Xattr do
         raise Xattr.Error,
           reason: reason,
           action: "get attribute of",
-          path: IO.chardata_to_string(path)
+          path: path_string(path)
+    end
+  end
+
+  @doc """
+  Gets extended attribute value as a lazy stream of binaries.
+
+  Values split into chunks (see "Large values" above) are read in batches of
+  chunks as the stream is consumed, so processing can begin before the whole
+  value is loaded; other values are returned as a single binary. Enumerating
+  the stream raises `Xattr.Error` if a chunk cannot be read, or if total
+  length or checksum of the value do not match its header (`:invalfmt`), which
+  also happens when the value is rewritten meanwhile.
+
+  ## Example
+
+      Xattr.set("foo.txt", "manifest", File.read!("manifest.json"))
+      {:ok, stream} = Xattr.stream("foo.txt", "manifest")
+      Enum.into(stream, File.stream!("copy.json"))
+  """
+  @spec stream(target_t, name :: name_t) :: {:ok, Enumerable.t()} | {:error, term}
+  def stream(target, name) when is_binary(name) or is_atom(name) do
+    arg = target_arg(target)
+    name = encode_name(name)
+
+    case get_value(arg, name) do
+      {:ok, value} ->
+        case chunk_header(value) do
+          nil ->
+            {:ok, [value]}
+
+          header ->
+            next = &chunk_next(&1, arg, name, header, value, path_string(target))
+            start = fn -> {0, 0, :erlang.crc32(<<>>)} end
+            {:ok, Stream.resource(start, next, fn _ -> :ok end)}
+        end
+
+      error ->
+        error
+    end
+  end
+
+  @doc """
+  The same as `stream/2`, but raises an exception if it fails.
+  """
+  @spec stream!(target_t, name :: name_t) :: Enumerable.t() | no_return
+  def stream!(path, name) do
+    case stream(path, name) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "stream attribute of",
+          path: path_string(path)
+    end
+  end
+
+  @doc """
+  Gets all extended attributes of `path` as a map of names to values.
+
+  This is equivalent to `ls/1` followed by `get/2` for every name, but done in
+  a single native call which opens the file once and reads all values into
+  one buffer.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      Xattr.set("foo.txt", :foo, "bar")
+      Xattr.get_all("foo.txt") == {:ok, %{"hello" => "world", foo: "bar"}}
+  """
+  @spec get_all(target_t) :: {:ok, %{optional(name_t) => binary}} | {:error, term}
+  def get_all(%Xattr.Handle{ref: ref}) do
+    ref |> fgetallxattr_nif() |> decode_map() |> resolve_chunked(ref)
+  end
+
+  def get_all(path) do
+    path = path_arg(path)
+    path |> getallxattr_nif() |> decode_map() |> resolve_chunked(path)
+  end
+
+  @doc """
+  The same as `get_all/1`, but raises an exception if it fails.
+  """
+  @spec get_all!(target_t) :: %{optional(name_t) => binary} | no_return
+  def get_all!(path) do
+    case get_all(path) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "get all attributes of",
+          path: path_string(path)
     end
   end
 
   @doc """
   Sets extended attribute value.
 
-  If attribute `name` does not exist, it is created.
+  If attribute `name` does not exist, it is created. The write can be made
+  conditional on existence of the attribute, which is checked atomically by
+  the file system:
+
+  * `create: true` - fail with `{:error, :eexist}` if the attribute exists
+  * `replace: true` - fail with `{:error, :enoattr}` if it does not exist
+
+  When chunking is enabled, values longer than `:chunk_size` are split into
+  chunks (see "Large values" above).
 
   ## Example
 
       Xattr.set("foo.txt", "hello", "world")
       Xattr.get("foo.txt", "hello") == {:ok, "world"}
+      Xattr.set("foo.txt", "hello", "again", create: true) == {:error, :eexist}
   """
-  @spec set(Path.t(), name :: name_t, value :: binary) :: :ok | {:error, term}
-  def set(path, name, value)
+  @spec set(target_t, name :: name_t, value :: binary, opts :: Keyword.t()) ::
+          :ok | {:error, term}
+  def set(target, name, value, opts \\ [])
+
+  def set(target, name, value, opts)
       when (is_binary(name) or is_atom(name)) and is_binary(value) do
-    path = IO.chardata_to_string(path) <> <<0>>
-    name = encode_name(name) <> <<0>>
-    setxattr_nif(path, name, value)
+    target = target_arg(target)
+    name = encode_name(name)
+    mode = set_mode(opts)
+
+    case Application.get_env(:xattr, :chunk_size) do
+      nil -> set_value(target, name, value, mode)
+      chunk_size -> set_chunked(target, name, value, mode, chunk_size)
+    end
   end
 
   @doc """
-  The same as `set/3`, but raises an exception if it fails.
+  The same as `set/4`, but raises an exception if it fails.
   """
-  @spec set!(Path.t(), name :: name_t, value :: binary) :: :ok | no_return
-  def set!(path, name, value) do
-    case set(path, name, value) do
+  @spec set!(target_t, name :: name_t, value :: binary, opts :: Keyword.t()) ::
+          :ok | no_return
+  def set!(path, name, value, opts \\ []) do
+    case set(path, name, value, opts) do
       :ok ->
         :ok
 
       {:error, reason} ->
         raise Xattr.Error,
           reason: reason,
-          action: "remove attribute of",
-          path: IO.chardata_to_string(path)
+          action: "set attribute of",
+          path: path_string(path)
+    end
+  end
+
+  @doc """
+  Sets extended attribute to `new` value if its current value is `expected`,
+  or if it does not exist when `expected` is `nil`.
+
+  Returns `{:ok, true}` if the value has been written and `{:ok, false}` if
+  the current value did not match. The comparison and the write are done in a
+  single native call, under a lock of the file's inode, so concurrent `cas/4`
+  calls on the same file never both succeed. Plain `set/4` and `rm/2` calls
+  and other programs do not take the lock; the write still fails cleanly if
+  they create or remove the attribute in between, but a concurrent change of
+  an existing value may be overwritten.
+
+  The cache (see "Caching" above) is bypassed, the current value is always
+  read from the file.
+
+  ## Example
+
+      Xattr.cas("foo.txt", "owner", nil, "me") == {:ok, true}
+      Xattr.cas("foo.txt", "owner", nil, "you") == {:ok, false}
+      Xattr.cas("foo.txt", "owner", "me", "you") == {:ok, true}
+  """
+  @spec cas(target_t, name :: name_t, expected :: binary | nil, new :: binary) ::
+          {:ok, boolean} | {:error, term}
+  def cas(%Xattr.Handle{ref: ref}, name, expected, new)
+      when (is_binary(name) or is_atom(name)) and
+             (is_binary(expected) or is_nil(expected)) and is_binary(new) do
+    name = encode_name(name)
+
+    ref
+    |> fcasxattr_nif(name, expected, new)
+    |> reject_chunked(ref, name, expected)
+  end
+
+  def cas(path, name, expected, new)
+      when (is_binary(name) or is_atom(name)) and
+             (is_binary(expected) or is_nil(expected)) and is_binary(new) do
+    path = path_arg(path)
+    name = encode_name(name)
+
+    path
+    |> casxattr_nif(name, expected, new)
+    |> reject_chunked(path, name, expected)
+  end
+
+  @doc """
+  The same as `cas/4`, but raises an exception if it fails.
+  """
+  @spec cas!(target_t, name :: name_t, expected :: binary | nil, new :: binary) ::
+          boolean | no_return
+  def cas!(path, name, expected, new) do
+    case cas(path, name, expected, new) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "compare and set attribute of",
+          path: path_string(path)
     end
   end
 
@@ -241,17 +692,21 @@ defmodule Xattr do
       Xattr.rm("foo.txt", "foo")
       {:ok, ["hello"]} = Xattr.ls("foo.txt")
   """
-  @spec rm(Path.t(), name :: name_t) :: :ok | {:error, term}
-  def rm(path, name) when is_binary(name) or is_atom(name) do
-    path = IO.chardata_to_string(path) <> <<0>>
-    name = encode_name(name) <> <<0>>
-    removexattr_nif(path, name)
+  @spec rm(target_t, name :: name_t) :: :ok | {:error, term}
+  def rm(target, name) when is_binary(name) or is_atom(name) do
+    target = target_arg(target)
+    name = encode_name(name)
+
+    case Application.get_env(:xattr, :chunk_size) do
+      nil -> rm_value(target, name)
+      _ -> rm_chunked(target, name)
+    end
   end
 
   @doc """
   The same as `rm/2`, but raises an exception if it fails.
   """
-  @spec rm!(Path.t(), name :: name_t) :: :ok | no_return
+  @spec rm!(target_t, name :: name_t) :: :ok | no_return
   def rm!(path, name) do
     case rm(path, name) do
       :ok ->
@@ -261,60 +716,1255 @@ defmodule Xattr do
         raise Xattr.Error,
           reason: reason,
           action: "remove attribute of",
-          path: IO.chardata_to_string(path)
+          path: path_string(path)
     end
   end
 
-  defp encode_name(name) when is_atom(name) do
-    @tag_atom <> to_string(name)
+  @doc """
+  Checks whether `path` has each of extended attributes `names`.
+
+  The file is opened only once for all attributes. Results are returned in the
+  same order as `names`, each one in the form `has/2` would return it.
+  `{:error, reason}` is returned only if the file itself cannot be accessed.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      Xattr.has_many("foo.txt", ["hello", :foo]) == {:ok, [{:ok, true}, {:ok, false}]}
+  """
+  @spec has_many(target_t, names :: [name_t]) ::
+          {:ok, [{:ok, boolean} | {:error, term}]} | {:error, term}
+  def has_many(path, names) when is_list(names) do
+    hasxattr_many_nif(target_arg(path), Enum.map(names, &encode_name/1))
   end
 
-  defp encode_name(name) when is_binary(name) do
-    @tag_str <> name
+  @doc """
+  The same as `has_many/2`, but returns plain list of booleans and raises an
+  exception if any check fails.
+  """
+  @spec has_many!(target_t, names :: [name_t]) :: [boolean] | no_return
+  def has_many!(path, names) do
+    case unwrap_many(has_many(path, names)) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "check attribute existence of",
+          path: path_string(path)
+    end
   end
 
-  defp decode_name(@tag_atom <> bin) do
-    {:ok, String.to_atom(bin)}
+  @doc """
+  Gets values of extended attributes `names`.
+
+  The file is opened only once for all attributes. Results are returned in the
+  same order as `names`, each one in the form `get/2` would return it.
+  `{:error, reason}` is returned only if the file itself cannot be accessed.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      Xattr.get_many("foo.txt", ["hello", :foo]) == {:ok, [{:ok, "world"}, {:error, :enoattr}]}
+  """
+  @spec get_many(target_t, names :: [name_t]) ::
+          {:ok, [{:ok, binary} | {:error, term}]} | {:error, term}
+  def get_many(path, names) when is_list(names) do
+    getxattr_many_nif(target_arg(path), Enum.map(names, &encode_name/1))
   end
 
-  defp decode_name(@tag_str <> bin) do
-    {:ok, bin}
+  @doc """
+  The same as `get_many/2`, but returns plain list of values and raises an
+  exception if any read fails.
+  """
+  @spec get_many!(target_t, names :: [name_t]) :: [binary] | no_return
+  def get_many!(path, names) do
+    case unwrap_many(get_many(path, names)) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "get attributes of",
+          path: path_string(path)
+    end
   end
 
-  defp decode_name(_) do
-    {:error, :invalfmt}
+  @doc """
+  Sets values of many extended attributes, given as enumerable of
+  `{name, value}` pairs (e.g. a map or a keyword list).
+
+  The file is opened only once for all attributes. Results are returned in
+  enumeration order, each one in the form `set/3` would return it.
+  `{:error, reason}` is returned only if the file itself cannot be accessed.
+
+  ## Example
+
+      Xattr.set_many("foo.txt", [{"hello", "world"}, {:foo, "bar"}]) == {:ok, [:ok, :ok]}
+  """
+  @spec set_many(target_t, attrs :: Enumerable.t()) ::
+          {:ok, [:ok | {:error, term}]} | {:error, term}
+  def set_many(path, attrs) do
+    attrs = Enum.map(attrs, fn {name, value} -> {encode_name(name), value} end)
+    setxattr_many_nif(target_arg(path), attrs)
   end
 
-  defp decode_list(lst) do
-    decode_list(lst, {:ok, []})
+  @doc """
+  The same as `set_many/2`, but raises an exception if any write fails.
+  """
+  @spec set_many!(target_t, attrs :: Enumerable.t()) :: :ok | no_return
+  def set_many!(path, attrs) do
+    case unwrap_many(set_many(path, attrs)) do
+      {:ok, _} ->
+        :ok
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "set attributes of",
+          path: path_string(path)
+    end
   end
 
-  defp decode_list([], acc) do
-    acc
+  @doc """
+  Removes extended attributes `names`.
+
+  The file is opened only once for all attributes. Results are returned in the
+  same order as `names`, each one in the form `rm/2` would return it.
+  `{:error, reason}` is returned only if the file itself cannot be accessed.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      Xattr.rm_many("foo.txt", ["hello", :foo]) == {:ok, [:ok, {:error, :enoattr}]}
+  """
+  @spec rm_many(target_t, names :: [name_t]) ::
+          {:ok, [:ok | {:error, term}]} | {:error, term}
+  def rm_many(path, names) when is_list(names) do
+    removexattr_many_nif(target_arg(path), Enum.map(names, &encode_name/1))
   end
 
-  defp decode_list([name_enc | rest], {:ok, lst}) do
-    case decode_name(name_enc) do
-      {:ok, name} -> decode_list(rest, {:ok, [name | lst]})
-      err -> err
+  @doc """
+  The same as `rm_many/2`, but raises an exception if any removal fails.
+  """
+  @spec rm_many!(target_t, names :: [name_t]) :: :ok | no_return
+  def rm_many!(path, names) do
+    case unwrap_many(rm_many(path, names)) do
+      {:ok, _} ->
+        :ok
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "remove attributes of",
+          path: path_string(path)
     end
   end
-end
 
-defmodule Xattr.Error do
-  defexception [:reason, :path, action: ""]
+  @doc """
+  Checks whether each of `paths` has extended attribute `name`.
 
-  def message(%{action: action, reason: reason, path: path}) do
-    formatted = fmt(action, reason)
-    "could not #{action} #{inspect(path)}: #{formatted}"
+  Results are returned in the same order as `paths`, each one in the form
+  `has/2` would return it. Long lists are processed natively in slices, so
+  that schedulers are not starved.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      Xattr.has_paths(["foo.txt", "bar.txt"], "hello") == [{:ok, true}, {:ok, false}]
+  """
+  @spec has_paths([Path.t()], name :: name_t) :: [{:ok, boolean} | {:error, term}]
+  def has_paths(paths, name) when is_list(paths) and (is_binary(name) or is_atom(name)) do
+    hasxattr_paths_nif(Enum.map(paths, &path_arg/1), encode_name(name))
   end
 
-  defp fmt(_action, :enoattr) do
-    "no such attribute"
+  @doc """
+  The same as `has_paths/2`, but returns plain list of booleans and raises an
+  exception if any check fails.
+  """
+  @spec has_paths!([Path.t()], name :: name_t) :: [boolean] | no_return
+  def has_paths!(paths, name) do
+    paths
+    |> has_paths(name)
+    |> unwrap_paths(paths, "check attribute existence of")
   end
 
-  defp fmt(_action, :invalfmt) do
-    "corrupted attribute data"
+  @doc """
+  Gets value of extended attribute `name` of each of `paths`.
+
+  Results are returned in the same order as `paths`, each one in the form
+  `get/2` would return it. Long lists are processed natively in slices, so
+  that schedulers are not starved.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      Xattr.get_paths(["foo.txt", "bar.txt"], "hello") == [{:ok, "world"}, {:error, :enoattr}]
+  """
+  @spec get_paths([Path.t()], name :: name_t) :: [{:ok, binary} | {:error, term}]
+  def get_paths(paths, name) when is_list(paths) and (is_binary(name) or is_atom(name)) do
+    getxattr_paths_nif(Enum.map(paths, &path_arg/1), encode_name(name))
+  end
+
+  @doc """
+  The same as `get_paths/2`, but returns plain list of values and raises an
+  exception if any read fails.
+  """
+  @spec get_paths!([Path.t()], name :: name_t) :: [binary] | no_return
+  def get_paths!(paths, name) do
+    paths
+    |> get_paths(name)
+    |> unwrap_paths(paths, "get attribute of")
+  end
+
+  @doc """
+  Sets extended attribute `name` to `value` on each of `paths`.
+
+  Results are returned in the same order as `paths`, each one in the form
+  `set/3` would return it. Long lists are processed natively in slices, so
+  that schedulers are not starved.
+
+  ## Example
+
+      Xattr.set_paths(["foo.txt", "bar.txt"], "hello", "world") == [:ok, :ok]
+  """
+  @spec set_paths([Path.t()], name :: name_t, value :: binary) :: [:ok | {:error, term}]
+  def set_paths(paths, name, value)
+      when is_list(paths) and (is_binary(name) or is_atom(name)) and is_binary(value) do
+    setxattr_paths_nif(Enum.map(paths, &path_arg/1), encode_name(name), value)
+  end
+
+  @doc """
+  The same as `set_paths/3`, but raises an exception if any write fails.
+  """
+  @spec set_paths!([Path.t()], name :: name_t, value :: binary) :: :ok | no_return
+  def set_paths!(paths, name, value) do
+    paths
+    |> set_paths(name, value)
+    |> unwrap_paths(paths, "set attribute of")
+
+    :ok
+  end
+
+  @doc """
+  Copies all extended attributes of file at `src` to file at `dst`.
+
+  Both files are opened once and attributes are copied natively, values of
+  large attributes together with their chunks (see "Large values" above).
+  Values are written as configured for `dst`, so whether they end up
+  compressed follows `:compress_names` (see "Compression" above). The copy
+  always runs on a dirty I/O scheduler, regardless of `:scheduler` setting.
+
+  Options:
+
+  * `sync: true` - make attributes of `dst` equal to those of `src`: values
+    which already match are not written again and attributes which `src`
+    does not have are removed from `dst`
+  * `data: true` - copy contents of `src`, which has to be a regular file,
+    first; `dst` is created or truncated. Implies `sync: true`. On Linux the
+    contents are cloned if the file system supports it (`FICLONE`), or
+    copied within the kernel with `copy_file_range(2)`. On Windows the file
+    is copied with `CopyFileW`
+
+  If the copy fails, attributes written before the failure are left in place.
+
+  ## Example
+
+      Xattr.set("foo.txt", "hello", "world")
+      :ok = Xattr.copy("foo.txt", "bar.txt", sync: true)
+      Xattr.get("bar.txt", "hello") == {:ok, "world"}
+  """
+  @spec copy(src :: Path.t(), dst :: Path.t(), opts :: Keyword.t()) :: :ok | {:error, term}
+  def copy(src, dst, opts \\ []) do
+    sync = Keyword.get(opts, :sync, false)
+    data = Keyword.get(opts, :data, false)
+
+    unless is_boolean(sync) and is_boolean(data) do
+      raise ArgumentError, "invalid copy options: #{inspect(opts)}"
+    end
+
+    copyxattr_nif(path_arg(src), path_arg(dst), sync, data)
+  end
+
+  @doc """
+  The same as `copy/3`, but raises an exception if it fails.
+  """
+  @spec copy!(src :: Path.t(), dst :: Path.t(), opts :: Keyword.t()) :: :ok | no_return
+  def copy!(src, dst, opts \\ []) do
+    case copy(src, dst, opts) do
+      :ok ->
+        :ok
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "copy attributes of",
+          path: IO.chardata_to_string(src)
+    end
+  end
+
+  @doc """
+  Opens file at `path` for extended attribute access.
+
+  Returned handle can be passed to `ls/1`, `has/2`, `get/2`, `set/3`, `rm/2`
+  and their batch (`*_many`) and bang variants in place of a path. The path is
+  resolved only once, so operations on handle skip the path walk and keep
+  referring to the same file even if it is renamed or replaced meanwhile.
+
+  Files which cannot be opened for reading (such as sockets or files without
+  read permission) are held by an `O_PATH` descriptor on Linux; on other
+  systems opening them fails with the error of `open(2)`.
+
+  The file is closed with `close/1`, or when the handle is garbage collected.
+
+  ## Example
+
+      {:ok, file} = Xattr.open("foo.txt")
+      :ok = Xattr.set(file, "hello", "world")
+      Xattr.get(file, "hello") == {:ok, "world"}
+      :ok = Xattr.close(file)
+  """
+  @spec open(Path.t()) :: {:ok, Xattr.Handle.t()} | {:error, term}
+  def open(path) do
+    path = IO.chardata_to_string(path)
+
+    with {:ok, ref} <- open_nif(path) do
+      {:ok, %Xattr.Handle{ref: ref, path: path}}
+    end
+  end
+
+  @doc """
+  The same as `open/1`, but raises an exception if it fails.
+  """
+  @spec open!(Path.t()) :: Xattr.Handle.t() | no_return
+  def open!(path) do
+    case open(path) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "open",
+          path: IO.chardata_to_string(path)
+    end
+  end
+
+  @doc """
+  Closes file handle returned by `open/1`.
+
+  Closing already closed handle is a no-op. Operations on closed handle return
+  `{:error, :closed}`.
+  """
+  @spec close(Xattr.Handle.t()) :: :ok
+  def close(%Xattr.Handle{ref: ref}) do
+    close_nif(ref)
+  end
+
+  @doc """
+  Returns counters of the attribute cache, one map per cache shard.
+
+  Each map holds `:hits`, `:misses`, `:evictions`, current number of
+  `:entries` and `:bytes` they occupy. Returns empty list if cache is disabled.
+  See "Caching" section in module documentation.
+  """
+  @spec cache_stats() :: [%{atom => non_neg_integer}]
+  def cache_stats do
+    cache_stats_nif()
+  end
+
+  @doc """
+  Returns counters of attribute operations since the library was loaded.
+
+  Keys `:ls`, `:get`, `:has`, `:set` and `:rm` hold maps with number of
+  `:calls`, `:errors`, `:syscalls` they made, `:erange_retries` of reads
+  whose buffer turned out to be too small, `:bytes_read`, `:bytes_written`
+  and `:latency` histogram: list of `{upper_bound_ns, count}` tuples of
+  non-empty buckets, which are powers of two nanoseconds, the last bound being
+  `:infinity`. `:errors` key maps failure reasons to their counts.
+
+  All counters are zero on Windows or when statistics are disabled. See
+  "Statistics" section in module documentation.
+
+  ## Example
+
+      Xattr.stats()
+      #=> %{get: %{calls: 2, errors: 1, syscalls: 2, erange_retries: 0,
+      #=>          bytes_read: 3, bytes_written: 0,
+      #=>          latency: [{2048, 1}, {4096, 1}]},
+      #=>   errors: %{enoattr: 1},
+      #=>   ...}
+  """
+  @spec stats() :: %{atom => map}
+  def stats do
+    stats_nif()
+  end
+
+  @doc """
+  Asynchronously checks whether `path` has extended attribute `name`.
+
+  Returns a reference right away; result of `has/2` is sent later to the
+  process given in `:reply_to` option (defaults to the caller) as
+
+      {:xattr_result, ref, result}
+
+  Calls are run on a pool of native worker threads, so thousands of them can
+  be kept in flight without occupying schedulers. Use `await/2` to wait for
+  the result. See "Asynchronous calls" section in module documentation.
+  """
+  @spec async_has(target_t, name :: name_t, keyword) :: reference
+  def async_has(path, name, opts \\ []) when is_binary(name) or is_atom(name) do
+    async_hasxattr_nif(async_target(path), encode_name(name), reply_to(opts))
+  end
+
+  @doc """
+  Asynchronously gets extended attribute value, see `async_has/3` and `get/2`.
+  """
+  @spec async_get(target_t, name :: name_t, keyword) :: reference
+  def async_get(path, name, opts \\ []) when is_binary(name) or is_atom(name) do
+    async_getxattr_nif(async_target(path), encode_name(name), reply_to(opts))
+  end
+
+  @doc """
+  Asynchronously sets extended attribute value, see `async_has/3` and `set/3`.
+  """
+  @spec async_set(target_t, name :: name_t, value :: binary, keyword) :: reference
+  def async_set(path, name, value, opts \\ [])
+      when (is_binary(name) or is_atom(name)) and is_binary(value) do
+    async_setxattr_nif(async_target(path), encode_name(name), value, reply_to(opts))
+  end
+
+  @doc """
+  Asynchronously removes extended attribute, see `async_has/3` and `rm/2`.
+  """
+  @spec async_rm(target_t, name :: name_t, keyword) :: reference
+  def async_rm(path, name, opts \\ []) when is_binary(name) or is_atom(name) do
+    async_removexattr_nif(async_target(path), encode_name(name), reply_to(opts))
+  end
+
+  @doc """
+  Waits for result of asynchronous call identified by `ref`.
+
+  Exits with `:timeout` if the result does not arrive within `timeout`
+  milliseconds.
+
+  ## Example
+
+      ref = Xattr.async_get("foo.txt", "hello")
+      Xattr.await(ref) == {:ok, "world"}
+  """
+  @spec await(reference, timeout) :: term
+  def await(ref, timeout \\ 5000) when is_reference(ref) do
+    receive do
+      {:xattr_result, ^ref, result} -> result
+    after
+      timeout -> exit(:timeout)
+    end
+  end
+
+  @doc """
+  Subscribes calling process to changes of attributes of files at `paths`.
+
+  `paths` can be a single path or a list of them. For directories, changes of
+  attributes of the directory itself and of its direct children are reported.
+  Whenever attributes of a watched file change, the subscriber receives
+
+      {:xattr_changed, path, diff}
+
+  where `diff` maps names of changed or added attributes to their new values,
+  and names of removed ones to `nil`. Removing a file reports all its
+  attributes as removed. Changes which leave attributes as they were (e.g.
+  `chmod`, or setting an attribute to its current value) are not reported.
+
+  Subscriptions are backed by a native inotify thread, so they are only
+  available on Linux; elsewhere `{:error, :enotsup}` is returned. Current
+  attributes of all watched files are read when subscribing, so that later
+  changes can be compared against them. The number of watched paths is limited
+  by `fs.inotify.max_user_watches` sysctl, exceeding it returns
+  `{:error, :enospc}`.
+
+  The subscription lasts until `unsubscribe/1` is called or the subscriber
+  exits.
+
+  ## Example
+
+      {:ok, sub} = Xattr.subscribe(["foo.txt", "some/dir"])
+      Xattr.set("foo.txt", "hello", "world")
+
+      receive do
+        {:xattr_changed, "foo.txt", %{"hello" => "world"}} -> :ok
+      end
+
+      :ok = Xattr.unsubscribe(sub)
+  """
+  @spec subscribe(Path.t() | [Path.t()]) :: {:ok, Xattr.Subscription.t()} | {:error, term}
+  def subscribe(paths) when is_list(paths) and paths != [] and not is_integer(hd(paths)) do
+    with {:ok, ref} <- subscribe_nif(Enum.map(paths, &path_arg/1)) do
+      {:ok, %Xattr.Subscription{ref: ref}}
+    end
+  end
+
+  def subscribe(path) do
+    subscribe([path])
+  end
+
+  @doc """
+  The same as `subscribe/1`, but raises an exception if it fails.
+  """
+  @spec subscribe!(Path.t() | [Path.t()]) :: Xattr.Subscription.t() | no_return
+  def subscribe!(paths) do
+    case subscribe(paths) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "subscribe to",
+          path: paths |> List.wrap() |> Enum.map(&IO.chardata_to_string/1)
+    end
+  end
+
+  @doc """
+  Cancels subscription returned by `subscribe/1`.
+
+  Messages already sent to the subscriber are not flushed. Cancelling already
+  cancelled subscription is a no-op.
+  """
+  @spec unsubscribe(Xattr.Subscription.t()) :: :ok
+  def unsubscribe(%Xattr.Subscription{ref: ref}) do
+    unsubscribe_nif(ref)
+  end
+
+  @doc """
+  Scans directory tree at `root` for extended attributes.
+
+  Returns a stream of `{path, attrs}` tuples, one for each file or directory
+  in the tree (including `root`) which has any attributes, where `attrs` is a
+  map like the one returned by `get_all/1`. Entries which cannot be read are
+  returned as `{path, {:error, reason}}`. Paths are joined to `root` as given.
+  Order of entries is unspecified.
+
+  The tree is walked by a pool of native threads, which list directories with
+  `getdents64` and read attributes through descriptors opened relative to
+  them; threads which run out of directories steal them from others.
+  Symbolic links are not followed and hard linked files are reported once.
+
+  Options:
+
+  * `:names` - only read attributes with these names, entries with none of
+    them are skipped
+  * `:threads` - number of walker threads, defaults to the number of online
+    schedulers (at most 64)
+  * `:chunk_size` - number of entries sent to the caller at once, defaults to
+    `1000`
+  * `:max_chunks` - number of chunks sent ahead of the stream consumer,
+    defaults to `4`; walkers wait for the consumer beyond that, so memory use
+    stays the same however large the tree is
+
+  Chunks are sent to the calling process, so the stream has to be consumed by
+  it, and only once. Halting the stream early cancels the scan. Scans rely on
+  Linux system calls; elsewhere `{:error, :enotsup}` is returned.
+
+  ## Example
+
+      {:ok, stream} = Xattr.scan("some/dir", names: ["hello"])
+      Enum.to_list(stream) == [{"some/dir/foo.txt", %{"hello" => "world"}}]
+  """
+  @spec scan(Path.t(), keyword) :: {:ok, Enumerable.t()} | {:error, term}
+  def scan(root, opts \\ []) do
+    names = opts |> Keyword.get(:names, []) |> Enum.map(&{encode_name(&1), &1})
+    threads = min(Keyword.get(opts, :threads, System.schedulers_online()), 64)
+    chunk_size = Keyword.get(opts, :chunk_size, 1000)
+    max_chunks = Keyword.get(opts, :max_chunks, 4)
+
+    with {:ok, scan, ref} <-
+           scan_nif(path_arg(root), names, threads, chunk_size, max_chunks) do
+      {:ok, Stream.resource(fn -> {scan, ref, 0, nil} end, &scan_next/1, &scan_after/1)}
+    end
+  end
+
+  @doc """
+  The same as `scan/2`, but raises an exception if it fails.
+  """
+  @spec scan!(Path.t(), keyword) :: Enumerable.t() | no_return
+  def scan!(root, opts \\ []) do
+    case scan(root, opts) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "scan",
+          path: IO.chardata_to_string(root)
+    end
+  end
+
+  @doc """
+  Returns paths of files whose attribute `name` is set to `value`, according
+  to the reverse index.
+
+  Paths are canonical (absolute, without symlinks) and their order is
+  unspecified. Returns `{:error, :enotsup}` if the index is not enabled. See
+  "Reverse index" section in module documentation.
+
+  ## Example
+
+      Xattr.set("foo.txt", "status", "pending")
+      Xattr.lookup("status", "pending") == {:ok, [Path.expand("foo.txt")]}
+  """
+  @spec lookup(name_t, binary) :: {:ok, [Path.t()]} | {:error, term}
+  def lookup(name, value) do
+    index_lookup_nif(encode_name(name), value)
+  end
+
+  @doc """
+  The same as `lookup/2`, but raises an exception if it fails.
+  """
+  @spec lookup!(name_t, binary) :: [Path.t()] | no_return
+  def lookup!(name, value) do
+    case lookup(name, value) do
+      {:ok, result} ->
+        result
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "look up value of attribute",
+          path: name
+    end
+  end
+
+  @doc """
+  Builds the reverse index from scratch, by scanning its root with `scan/2`.
+
+  Updates made while the scan runs are kept. `:threads` option is passed to
+  `scan/2`.
+  """
+  @spec build_index(keyword) :: :ok | {:error, term}
+  def build_index(opts \\ []) do
+    with {:ok, _added, _removed} <- index_build(opts, false) do
+      :ok
+    end
+  end
+
+  @doc """
+  Rebuilds the reverse index like `build_index/1` and reports how many
+  postings (file, name and value triples) were missing in the index and how
+  many were stale, e.g. because attributes were changed by other programs.
+
+  Postings updated while the scan runs may be counted too.
+  """
+  @spec reconcile_index(keyword) ::
+          {:ok, %{added: non_neg_integer, removed: non_neg_integer}} | {:error, term}
+  def reconcile_index(opts \\ []) do
+    with {:ok, added, removed} <- index_build(opts, true) do
+      {:ok, %{added: added, removed: removed}}
+    end
+  end
+
+  # names are passed to NIFs as iodata, which is flattened natively
+  defp encode_name(name) when is_atom(name) do
+    [@tag_atom | Atom.to_string(name)]
+  end
+
+  defp encode_name(name) when is_binary(name) do
+    [@tag_str | name]
+  end
+
+  defp unwrap_many({:ok, results}) do
+    unwrap_many(results, [])
+  end
+
+  defp unwrap_many(err) do
+    err
+  end
+
+  defp unwrap_many([], acc) do
+    {:ok, Enum.reverse(acc)}
+  end
+
+  defp unwrap_many([:ok | rest], acc) do
+    unwrap_many(rest, [:ok | acc])
+  end
+
+  defp unwrap_many([{:ok, value} | rest], acc) do
+    unwrap_many(rest, [value | acc])
+  end
+
+  defp unwrap_many([err | _], _acc) do
+    err
+  end
+
+  defp unwrap_paths(results, paths, action) do
+    unwrap_paths(results, paths, action, [])
+  end
+
+  defp unwrap_paths([], [], _action, acc) do
+    Enum.reverse(acc)
+  end
+
+  defp unwrap_paths([:ok | rest], [_ | paths], action, acc) do
+    unwrap_paths(rest, paths, action, [:ok | acc])
+  end
+
+  defp unwrap_paths([{:ok, value} | rest], [_ | paths], action, acc) do
+    unwrap_paths(rest, paths, action, [value | acc])
+  end
+
+  defp unwrap_paths([{:error, reason} | _], [path | _], action, _acc) do
+    raise Xattr.Error,
+      reason: reason,
+      action: action,
+      path: IO.chardata_to_string(path)
+  end
+
+  defp target_arg(%Xattr.Handle{ref: ref}) do
+    ref
+  end
+
+  defp target_arg(path) do
+    path_arg(path)
+  end
+
+  defp path_string(%Xattr.Handle{path: path}) do
+    path
+  end
+
+  defp path_string(path) do
+    IO.chardata_to_string(path)
+  end
+
+  defp async_target(%Xattr.Handle{ref: ref}) do
+    ref
+  end
+
+  defp async_target(path) do
+    path_arg(path)
+  end
+
+  defp reply_to(opts) do
+    Keyword.get(opts, :reply_to, self())
+  end
+
+  defp get_value(target, name) when is_reference(target) do
+    fgetxattr_nif(target, name)
+  end
+
+  defp get_value(path, name) do
+    getxattr_nif(path, name)
+  end
+
+  defp set_value(target, name, value, nil) when is_reference(target) do
+    fsetxattr_nif(target, name, value)
+  end
+
+  defp set_value(target, name, value, mode) when is_reference(target) do
+    fsetxattr_mode_nif(target, name, value, mode)
+  end
+
+  defp set_value(path, name, value, nil) do
+    setxattr_nif(path, name, value)
+  end
+
+  defp set_value(path, name, value, mode) do
+    setxattr_mode_nif(path, name, value, mode)
+  end
+
+  defp rm_value(target, name) when is_reference(target) do
+    fremovexattr_nif(target, name)
+  end
+
+  defp rm_value(path, name) do
+    removexattr_nif(path, name)
+  end
+
+  defp chunk_header(
+         <<@chunk_magic, gen::little-32, count::little-32, size::little-64,
+           crc::little-32>>
+       )
+       when count > 0 and size >= count do
+    {gen, count, size, crc}
+  end
+
+  defp chunk_header(_value) do
+    nil
+  end
+
+  # get_all NIFs return headers of chunked values, which are reassembled here;
+  # attributes removed in the meantime are left out
+  defp resolve_chunked({:ok, map}, target) do
+    Enum.reduce_while(map, {:ok, map}, fn {name, value}, {:ok, acc} ->
+      case chunk_header(value) do
+        nil ->
+          {:cont, {:ok, acc}}
+
+        header ->
+          case get_chunked(target, encode_name(name), value, header) do
+            {:ok, data} -> {:cont, {:ok, Map.put(acc, name, data)}}
+            {:error, :enoattr} -> {:cont, {:ok, Map.delete(acc, name)}}
+            error -> {:halt, error}
+          end
+      end
+    end)
+  end
+
+  defp resolve_chunked(result, _target) do
+    result
+  end
+
+  # header of chunked value never equals the expected value, so cas/4 would
+  # keep failing; the value is read only once the comparison has failed
+  defp reject_chunked({:ok, false}, target, name, expected) when is_binary(expected) do
+    case get_value(target, name) do
+      {:ok, value} when value != expected ->
+        if chunk_header(value), do: {:error, :enotsup}, else: {:ok, false}
+
+      _ ->
+        {:ok, false}
+    end
+  end
+
+  defp reject_chunked(result, _target, _name, _expected) do
+    result
+  end
+
+  defp chunk_name(name, gen, index) do
+    gen = Integer.to_string(gen)
+    [@tag_chunk, gen, ?., Integer.to_string(index), ?. | name]
+  end
+
+  defp next_generation(nil) do
+    1
+  end
+
+  defp next_generation({gen, _count, _size, _crc}) do
+    rem(gen, 0xFFFFFFFF) + 1
+  end
+
+  # header of the value being replaced, nil if it is not chunked, and whether
+  # the attribute exists at all
+  defp old_header(target, name) do
+    case get_value(target, name) do
+      {:ok, value} -> {:ok, chunk_header(value), true}
+      {:error, :enoattr} -> {:ok, nil, false}
+      error -> error
+    end
+  end
+
+  defp get_chunked(target, name) do
+    case get_value(target, name) do
+      {:ok, value} ->
+        case chunk_header(value) do
+          nil -> {:ok, value}
+          header -> get_chunked(target, name, value, header)
+        end
+
+      error ->
+        error
+    end
+  end
+
+  defp get_chunked(target, name, value, header) do
+    case read_chunked(target, name, header) do
+      {:ok, data} ->
+        {:ok, data}
+
+      error ->
+        # chunks are removed once the next generation is committed, so the
+        # read fails if the value has been replaced meanwhile; a value which
+        # only looks like a header has no chunks and is returned as is
+        case {get_value(target, name), error} do
+          {{:ok, ^value}, {:error, :enoattr}} -> {:ok, value}
+          {{:ok, ^value}, _} -> error
+          _ -> get_chunked(target, name)
+        end
+    end
+  end
+
+  defp read_chunked(target, name, {gen, count, size, crc}) do
+    with {:ok, chunks} <- read_chunks(target, name, gen, 0, count, []) do
+      data = IO.iodata_to_binary(chunks)
+
+      if byte_size(data) == size and :erlang.crc32(data) == crc do
+        {:ok, data}
+      else
+        {:error, :invalfmt}
+      end
+    end
+  end
+
+  defp read_chunks(_target, _name, _gen, count, count, acc) do
+    {:ok, Enum.reverse(acc)}
+  end
+
+  defp read_chunks(target, name, gen, index, count, acc) do
+    case read_batch(target, name, gen, index, count) do
+      {:ok, values} ->
+        index = index + length(values)
+        read_chunks(target, name, gen, index, count, [values | acc])
+
+      error ->
+        error
+    end
+  end
+
+  defp read_batch(target, name, gen, index, count) do
+    last = min(index + @chunk_batch, count) - 1
+    names = Enum.map(index..last, &chunk_name(name, gen, &1))
+    unwrap_many(getxattr_many_nif(target, names))
+  end
+
+  # stream state is {next chunk, bytes read, CRC-32 so far}, or :raw once the
+  # value has turned out not to be chunked
+  defp chunk_next(:raw, _target, _name, _header, _value, _path) do
+    {:halt, :raw}
+  end
+
+  defp chunk_next({count, read, acc}, _target, _name, {_, count, size, crc}, _value, path) do
+    if read == size and acc == crc do
+      {:halt, nil}
+    else
+      raise Xattr.Error,
+        reason: :invalfmt,
+        action: "stream attribute of",
+        path: path
+    end
+  end
+
+  defp chunk_next({index, read, acc}, target, name, header, value, path) do
+    {gen, count, _size, _crc} = header
+
+    case read_batch(target, name, gen, index, count) do
+      {:ok, values} ->
+        read = read + IO.iodata_length(values)
+        {values, {index + length(values), read, :erlang.crc32(acc, values)}}
+
+      # a value which only looks like a header has no chunks
+      {:error, :enoattr} when index == 0 ->
+        {[value], :raw}
+
+      {:error, reason} ->
+        raise Xattr.Error,
+          reason: reason,
+          action: "stream attribute of",
+          path: path
+    end
+  end
+
+  defp set_chunked(target, name, value, mode, chunk_size) do
+    with {:ok, old, exists} <- old_header(target, name),
+         :ok <- check_mode(mode, exists) do
+      if byte_size(value) <= chunk_size do
+        with :ok <- set_value(target, name, value, mode) do
+          drop_chunks(target, name, old, 0)
+        end
+      else
+        gen = next_generation(old)
+        count = div(byte_size(value) + chunk_size - 1, chunk_size)
+
+        header =
+          <<@chunk_magic, gen::little-32, count::little-32,
+            byte_size(value)::little-64, :erlang.crc32(value)::little-32>>
+
+        # the header is written last, it commits the new generation; if it
+        # fails (e.g. the attribute has been created meanwhile), chunks of the
+        # new generation are orphaned
+        with :ok <- write_chunks(target, name, gen, 0, value, chunk_size),
+             :ok <- set_value(target, name, header, mode) do
+          drop_chunks(target, name, old, count)
+        else
+          error ->
+            drop_leftover_chunks(target, name, gen, 0)
+            error
+        end
+      end
+    end
+  end
+
+  # conditional writes are checked up front, so that chunks are not written
+  # in vain; the header write checks them again atomically
+  defp check_mode(:create, true) do
+    {:error, :eexist}
+  end
+
+  defp check_mode(:replace, false) do
+    {:error, :enoattr}
+  end
+
+  defp check_mode(_mode, _exists) do
+    :ok
+  end
+
+  defp write_chunks(_target, _name, _gen, _index, <<>>, _chunk_size) do
+    :ok
+  end
+
+  defp write_chunks(target, name, gen, index, value, chunk_size) do
+    {attrs, rest} =
+      take_chunks(name, gen, index, value, chunk_size, @chunk_batch, [])
+
+    case unwrap_many(setxattr_many_nif(target, attrs)) do
+      {:ok, _} ->
+        index = index + @chunk_batch
+        write_chunks(target, name, gen, index, rest, chunk_size)
+
+      error ->
+        error
+    end
+  end
+
+  defp take_chunks(_name, _gen, _index, <<>>, _chunk_size, _n, acc) do
+    {Enum.reverse(acc), <<>>}
+  end
+
+  defp take_chunks(_name, _gen, _index, value, _chunk_size, 0, acc) do
+    {Enum.reverse(acc), value}
+  end
+
+  defp take_chunks(name, gen, index, value, chunk_size, n, acc) do
+    size = min(chunk_size, byte_size(value))
+    <<chunk::binary-size(size), rest::binary>> = value
+    attr = {chunk_name(name, gen, index), chunk}
+    take_chunks(name, gen, index + 1, rest, chunk_size, n - 1, [attr | acc])
+  end
+
+  defp rm_chunked(target, name) do
+    with {:ok, old, _exists} <- old_header(target, name),
+         :ok <- rm_value(target, name) do
+      drop_chunks(target, name, old, 0)
+    end
+  end
+
+  # removes chunks of the replaced value `old`, and chunks of the next
+  # generation past the first `from` ones, which an interrupted write may have
+  # left behind; failures only leave garbage, so they are ignored
+  defp drop_chunks(_target, _name, nil, 0) do
+    :ok
+  end
+
+  defp drop_chunks(target, name, old, from) do
+    case old do
+      {gen, count, _size, _crc} when count > 0 ->
+        names = Enum.map(0..(count - 1), &chunk_name(name, gen, &1))
+        removexattr_many_nif(target, names)
+
+      _ ->
+        :ok
+    end
+
+    drop_leftover_chunks(target, name, next_generation(old), from)
+  end
+
+  # chunks are written in order, batch by batch, so leftovers end with the
+  # first batch of which none exists
+  defp drop_leftover_chunks(target, name, gen, index) do
+    last = index + @chunk_batch - 1
+    names = Enum.map(index..last, &chunk_name(name, gen, &1))
+
+    case removexattr_many_nif(target, names) do
+      {:ok, results} ->
+        if Enum.member?(results, :ok) do
+          drop_leftover_chunks(target, name, gen, index + @chunk_batch)
+        else
+          :ok
+        end
+
+      _ ->
+        :ok
+    end
+  end
+
+  defp set_mode(opts) do
+    case {Keyword.get(opts, :create, false), Keyword.get(opts, :replace, false)} do
+      {false, false} -> nil
+      {true, false} -> :create
+      {false, true} -> :replace
+      _ -> raise ArgumentError, "invalid set options: #{inspect(opts)}"
+    end
+  end
+
+  defp path_arg(path) when is_binary(path) do
+    path
+  end
+
+  defp path_arg(path) do
+    IO.chardata_to_string(path)
+  end
+
+  # scanned entries are passed to the index builder in batches
+  defp index_build(opts, reconcile) do
+    names = Application.get_env(:xattr, :index_names, [])
+    threads = Keyword.get(opts, :threads, System.schedulers_online())
+
+    with {:ok, builder, root} <- index_builder_nif(),
+         {:ok, stream} <- scan(root, names: names, threads: threads),
+         :ok <- index_add(stream, builder) do
+      index_commit_nif(builder, reconcile)
+    end
+  end
+
+  defp index_add(stream, builder) do
+    result =
+      stream
+      |> Stream.filter(&is_map(elem(&1, 1)))
+      |> Stream.map(fn {path, attrs} -> {path, Enum.map(attrs, &encode_attr/1)} end)
+      |> Enum.reduce_while({[], 0}, fn entry, {batch, size} ->
+        if size + 1 < @index_batch_size do
+          {:cont, {[entry | batch], size + 1}}
+        else
+          case index_builder_add_nif(builder, [entry | batch]) do
+            :ok -> {:cont, {[], 0}}
+            error -> {:halt, error}
+          end
+        end
+      end)
+
+    case result do
+      {batch, _size} -> index_builder_add_nif(builder, batch)
+      error -> error
+    end
+  end
+
+  defp encode_attr({name, value}) do
+    {encode_name(name), value}
+  end
+
+  # stream state is {scan, ref, chunks received, chunks sent or nil}
+  defp scan_next({_scan, _ref, received, received} = state) do
+    {:halt, state}
+  end
+
+  defp scan_next({scan, ref, received, total}) do
+    receive do
+      {:xattr_scan, ^ref, {:done, chunks}} ->
+        scan_next({scan, ref, received, chunks})
+
+      {:xattr_scan, ^ref, entries} ->
+        scan_ack_nif(scan)
+        {Enum.map(entries, &decode_entry/1), {scan, ref, received + 1, total}}
+    end
+  end
+
+  # chunks already sent are flushed, so that they do not linger in mailbox
+  defp scan_after({scan, _ref, _received, _total} = state) do
+    scan_cancel_nif(scan)
+    scan_flush(state)
+  end
+
+  defp scan_flush({_scan, _ref, received, received}) do
+    :ok
+  end
+
+  defp scan_flush({scan, ref, received, total}) do
+    receive do
+      {:xattr_scan, ^ref, {:done, chunks}} ->
+        scan_flush({scan, ref, received, chunks})
+
+      {:xattr_scan, ^ref, _entries} ->
+        scan_flush({scan, ref, received + 1, total})
+    end
+  end
+
+  defp decode_entry({path, attrs, rest}) do
+    case decode_map({:ok, attrs, rest}) do
+      {:ok, attrs} -> {path, attrs}
+      error -> {path, error}
+    end
+  end
+
+  defp decode_entry(entry) do
+    entry
+  end
+
+  # names come from NIFs already decoded, except for atom names which could
+  # not be made natively (see "Atom names" section), which come separately
+  defp decode_map({:ok, map, rest}) do
+    Enum.reduce_while(rest, {:ok, map}, fn {name, value}, {:ok, map} ->
+      case to_atom(name) do
+        {:ok, atom} -> {:cont, {:ok, Map.put(map, atom, value)}}
+        error -> {:halt, error}
+      end
+    end)
+  end
+
+  defp decode_map(result) do
+    result
+  end
+
+  defp decode_names({:ok, names, rest}) do
+    Enum.reduce_while(rest, {:ok, names}, fn name, {:ok, names} ->
+      case to_atom(name) do
+        {:ok, atom} -> {:cont, {:ok, [atom | names]}}
+        error -> {:halt, error}
+      end
+    end)
+  end
+
+  defp decode_names(result) do
+    result
+  end
+
+  defp to_atom(name) do
+    if Application.get_env(:xattr, :new_atoms, true) do
+      {:ok, String.to_atom(name)}
+    else
+      try do
+        {:ok, String.to_existing_atom(name)}
+      rescue
+        ArgumentError -> {:error, :unknown_atom}
+      end
+    end
+  end
+end
+
+defmodule Xattr.Handle do
+  @moduledoc """
+  Handle to file opened for extended attribute access with `Xattr.open/1`.
+  """
+
+  @enforce_keys [:ref, :path]
+  defstruct [:ref, :path]
+
+  @type t :: %__MODULE__{ref: reference, path: String.t()}
+end
+
+defmodule Xattr.Subscription do
+  @moduledoc """
+  Subscription to attribute changes created with `Xattr.subscribe/1`.
+  """
+
+  @enforce_keys [:ref]
+  defstruct [:ref]
+
+  @type t :: %__MODULE__{ref: reference}
+end
+
+defmodule Xattr.Error do
+  defexception [:reason, :path, action: ""]
+
+  def message(%{action: action, reason: reason, path: path}) do
+    formatted = fmt(action, reason)
+    "could not #{action} #{inspect(path)}: #{formatted}"
+  end
+
+  defp fmt(_action, :enoattr) do
+    "no such attribute"
+  end
+
+  defp fmt(_action, :eexist) do
+    "attribute already exists"
+  end
+
+  defp fmt(_action, :invalfmt) do
+    "corrupted attribute data"
+  end
+
+  defp fmt(_action, :closed) do
+    "file handle is closed"
   end
 
   defp fmt(_action, reason) do
@@ -0,0 +1,93 @@
+defmodule Xattr.Telemetry do
+  @moduledoc """
+  Publishes `Xattr.stats/0` counters as `:telemetry` events.
+
+  `dispatch_stats/0` emits, for each of `:ls`, `:get`, `:has`, `:set` and
+  `:rm` operations, a `[:xattr, :stats, op]` event with `:calls`, `:errors`,
+  `:syscalls`, `:erange_retries`, `:bytes_read` and `:bytes_written`
+  measurements and latency histogram in `:latency` metadata, followed by
+  `[:xattr, :stats, :errors]` event measuring failures by reason. Counters are
+  totals since the library was loaded. Events are not emitted unless the
+  `:telemetry` application is available; this library does not depend on it.
+
+  It can be used as a measurement of `:telemetry_poller`:
+
+      {:telemetry_poller,
+       measurements: [{Xattr.Telemetry, :dispatch_stats, []}],
+       period: 10_000}
+
+  or run by this module's own poller in a supervision tree:
+
+      children = [{Xattr.Telemetry, period: 10_000}]
+
+  ## Options
+
+    * `:period` - interval between dispatches in milliseconds, defaults to
+      `10_000`
+    * `:name` - name to register the poller under
+  """
+
+  use GenServer
+
+  @counters [:calls, :errors, :syscalls, :erange_retries, :bytes_read, :bytes_written]
+  @ops [:ls, :get, :has, :set, :rm]
+
+  @doc """
+  Emits events with current counters.
+  """
+  @spec dispatch_stats() :: :ok
+  def dispatch_stats do
+    if Code.ensure_loaded?(:telemetry) do
+      stats = Xattr.stats()
+
+      for op <- @ops do
+        op_stats = Map.fetch!(stats, op)
+        measurements = Map.take(op_stats, @counters)
+        execute([:xattr, :stats, op], measurements, %{latency: op_stats.latency})
+      end
+
+      execute([:xattr, :stats, :errors], stats.errors, %{})
+    end
+
+    :ok
+  end
+
+  # :telemetry is optional, so it is not called directly to keep compiler
+  # quiet when it is missing
+  defp execute(event, measurements, metadata) do
+    apply(:telemetry, :execute, [event, measurements, metadata])
+  end
+
+  @doc """
+  Returns child specification of the poller.
+  """
+  @spec child_spec(keyword) :: Supervisor.child_spec()
+  def child_spec(opts) do
+    %{id: __MODULE__, start: {__MODULE__, :start_link, [opts]}}
+  end
+
+  @doc """
+  Starts the poller, which calls `dispatch_stats/0` every `:period`
+  milliseconds.
+  """
+  @spec start_link(keyword) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    {period, opts} = Keyword.pop(opts, :period, 10_000)
+    GenServer.start_link(__MODULE__, period, Keyword.take(opts, [:name]))
+  end
+
+  def init(period) do
+    schedule(period)
+    {:ok, period}
+  end
+
+  def handle_info(:dispatch, period) do
+    dispatch_stats()
+    schedule(period)
+    {:noreply, period}
+  end
+
+  defp schedule(period) do
+    Process.send_after(self(), :dispatch, period)
+  end
+end
@@ -0,0 +1,414 @@
+/*
+ * Tests of the Windows attribute stream engine, run on any platform against
+ * a stream kept in memory:
+ *
+ *     make check
+ *
+ * Interrupted updates are simulated by failing a write halfway, after
+ * a given number of writes went through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "adstore.h"
+
+#define STREAM_MAX (1024 * 1024)
+#define LISTING_SIZE 16384
+
+/* The engine only allocates memory through NIF API */
+
+void *enif_alloc(size_t size) { return malloc(size); }
+
+void enif_free(void *ptr) { free(ptr); }
+
+static unsigned char stream[STREAM_MAX];
+static uint32_t stream_size;
+
+/* Writes and truncations left before one fails, or -1 */
+static int budget = -1;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);            \
+      failures++;                                                             \
+    }                                                                         \
+  } while (0)
+
+static bool mem_read(void *ctx, uint32_t offset, void *buff, size_t size) {
+  (void)ctx;
+  if (offset > stream_size || size > stream_size - offset) {
+    return false;
+  }
+  memcpy(buff, stream + offset, size);
+  return true;
+}
+
+static bool mem_write(void *ctx, uint32_t offset, const void *buff,
+                      size_t size) {
+  (void)ctx;
+  if (offset > STREAM_MAX || size > STREAM_MAX - offset) {
+    return false;
+  }
+
+  /* failed write leaves the first half of its data behind */
+  if (budget == 0) {
+    size /= 2;
+  }
+
+  if (offset > stream_size) {
+    memset(stream + stream_size, 0, offset - stream_size);
+  }
+  memcpy(stream + offset, buff, size);
+  if (offset + size > stream_size) {
+    stream_size = (uint32_t)(offset + size);
+  }
+
+  if (budget == 0) {
+    return false;
+  }
+  if (budget > 0) {
+    budget--;
+  }
+  return true;
+}
+
+static bool mem_size(void *ctx, uint32_t *size) {
+  (void)ctx;
+  *size = stream_size;
+  return true;
+}
+
+static bool mem_truncate(void *ctx, uint32_t size) {
+  (void)ctx;
+  if (budget == 0 || size > STREAM_MAX) {
+    return false;
+  }
+  if (budget > 0) {
+    budget--;
+  }
+
+  if (size > stream_size) {
+    memset(stream + stream_size, 0, size - stream_size);
+  }
+  stream_size = size;
+  return true;
+}
+
+static const adstore_io_t io = {NULL, mem_read, mem_write, mem_size,
+                                mem_truncate};
+
+static adstore_result_t set(const char *name, const char *value) {
+  return adstore_set(&io, name, value, strlen(value), SET_ANY);
+}
+
+/**
+ * Checks that attribute \a name has \a value, or does not exist if it is
+ * `NULL`.
+ */
+static bool has_value(const char *name, const char *value) {
+  char buff[1024];
+  adstore_value_t found;
+  adstore_result_t result = adstore_find(&io, name, &found);
+
+  if (value == NULL) {
+    return result == ADSTORE_NOATTR;
+  }
+
+  return result == ADSTORE_OK && found.size == strlen(value) &&
+         adstore_read(&io, &found, buff) == ADSTORE_OK &&
+         memcmp(buff, value, found.size) == 0;
+}
+
+static adstore_result_t list_visit(void *acc, const char *name, size_t len,
+                                   const unsigned char *value, size_t size) {
+  char *listing = acc;
+  size_t used = strlen(listing);
+
+  if (used + len + size + 2 >= LISTING_SIZE) {
+    return ADSTORE_NOMEM;
+  }
+
+  memcpy(listing + used, name, len);
+  listing[used + len] = '=';
+  memcpy(listing + used + len + 1, value, size);
+  strcpy(listing + used + len + 1 + size, ";");
+  return ADSTORE_OK;
+}
+
+/**
+ * Writes all attributes as `name=value;` in order of names.
+ */
+static adstore_result_t list(char *listing) {
+  listing[0] = '\0';
+  return adstore_each(&io, list_visit, listing);
+}
+
+static void write_cell(uint32_t *offset, const void *data, uint32_t size) {
+  stream[*offset] = size & 0xff;
+  stream[*offset + 1] = (size >> 8) & 0xff;
+  stream[*offset + 2] = (size >> 16) & 0xff;
+  stream[*offset + 3] = (size >> 24) & 0xff;
+  memcpy(stream + *offset + 4, data, size);
+  *offset += 4 + size;
+}
+
+static void test_v1_migration(void) {
+  char listing[LISTING_SIZE];
+  uint32_t offset = 0;
+
+  write_cell(&offset, "s$b\0", 4);
+  write_cell(&offset, "2", 1);
+  write_cell(&offset, "s$a\0", 4);
+  write_cell(&offset, "1", 1);
+  write_cell(&offset, "a$c\0", 4);
+  write_cell(&offset, "", 0);
+  stream_size = offset;
+
+  CHECK(has_value("s$a", "1"));
+  CHECK(has_value("s$b", "2"));
+  CHECK(has_value("a$c", ""));
+  CHECK(has_value("s$d", NULL));
+  CHECK(list(listing) == ADSTORE_OK &&
+        strcmp(listing, "a$c=;s$a=1;s$b=2;") == 0);
+  CHECK(memcmp(stream, "XATTRAD2", 8) != 0);
+
+  CHECK(set("s$d", "4") == ADSTORE_OK);
+  CHECK(memcmp(stream, "XATTRAD2", 8) == 0);
+  CHECK(adstore_set(&io, "s$a", "x", 1, SET_CREATE) == ADSTORE_EXISTS);
+  CHECK(list(listing) == ADSTORE_OK &&
+        strcmp(listing, "a$c=;s$a=1;s$b=2;s$d=4;") == 0);
+  CHECK(has_value("s$b", "2"));
+
+  /* removal migrates as well */
+  stream_size = 0;
+  offset = 0;
+  write_cell(&offset, "s$a\0", 4);
+  write_cell(&offset, "1", 1);
+  write_cell(&offset, "s$b\0", 4);
+  write_cell(&offset, "2", 1);
+  stream_size = offset;
+
+  CHECK(adstore_remove(&io, "s$a") == ADSTORE_OK);
+  CHECK(memcmp(stream, "XATTRAD2", 8) == 0);
+  CHECK(list(listing) == ADSTORE_OK && strcmp(listing, "s$b=2;") == 0);
+}
+
+static void test_updates(void) {
+  char listing[LISTING_SIZE];
+  char big[201];
+  uint32_t size;
+
+  stream_size = 0;
+  memset(big, 'v', 200);
+  big[200] = '\0';
+
+  CHECK(adstore_set(&io, "s$x", "abcd", 4, SET_REPLACE) == ADSTORE_NOATTR);
+  CHECK(stream_size == 0);
+  CHECK(set("s$x", "abcd") == ADSTORE_OK);
+  CHECK(set("s$y", "y") == ADSTORE_OK);
+  CHECK(adstore_set(&io, "s$x", "new", 3, SET_CREATE) == ADSTORE_EXISTS);
+
+  /* values which fit their slot do not grow the stream */
+  size = stream_size;
+  CHECK(set("s$x", "wxyz") == ADSTORE_OK);
+  CHECK(stream_size == size && has_value("s$x", "wxyz"));
+  CHECK(adstore_set(&io, "s$x", "ab", 2, SET_REPLACE) == ADSTORE_OK);
+  CHECK(stream_size == size && has_value("s$x", "ab"));
+
+  /* longer ones move to a new slot with room to grow */
+  CHECK(set("s$x", big) == ADSTORE_OK);
+  CHECK(stream_size > size + 200 && has_value("s$x", big));
+  size = stream_size;
+  big[199] = '\0';
+  CHECK(set("s$x", big) == ADSTORE_OK);
+  CHECK(stream_size == size && has_value("s$x", big));
+  CHECK(has_value("s$y", "y"));
+
+  CHECK(adstore_remove(&io, "s$x") == ADSTORE_OK);
+  CHECK(adstore_remove(&io, "s$x") == ADSTORE_NOATTR);
+  CHECK(has_value("s$x", NULL));
+  CHECK(list(listing) == ADSTORE_OK && strcmp(listing, "s$y=y;") == 0);
+
+  /* stream without attributes is empty */
+  CHECK(adstore_remove(&io, "s$y") == ADSTORE_OK);
+  CHECK(stream_size == 0);
+  CHECK(list(listing) == ADSTORE_OK && listing[0] == '\0');
+}
+
+static void test_compaction(void) {
+  char listing[LISTING_SIZE];
+  char expected[LISTING_SIZE];
+  char value[301];
+  char name[16];
+  uint32_t peak = 0;
+  int round;
+  int i;
+
+  stream_size = 0;
+  expected[0] = '\0';
+
+  /* tables full of attributes are compacted with more room */
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "s$%02d", i);
+    CHECK(set(name, "v") == ADSTORE_OK);
+  }
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "s$%02d", i);
+    CHECK(has_value(name, "v"));
+  }
+
+  /* growing values leave unused slots behind, which are reclaimed */
+  for (round = 1; round <= 3; round++) {
+    memset(value, 'a' + round, 100 * round);
+    value[100 * round] = '\0';
+    for (i = 0; i < 40; i++) {
+      sprintf(name, "s$%02d", i);
+      CHECK(set(name, value) == ADSTORE_OK);
+      if (stream_size > peak) {
+        peak = stream_size;
+      }
+    }
+  }
+
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "s$%02d", i);
+    CHECK(has_value(name, value));
+    sprintf(expected + strlen(expected), "%s=%s;", name, value);
+  }
+  CHECK(list(listing) == ADSTORE_OK && strcmp(listing, expected) == 0);
+
+  /* values take 12 KiB, every round would add more without compaction */
+  CHECK(peak < 40 * (100 + 200 + 300) * 5 / 4);
+
+  for (i = 0; i < 40; i += 2) {
+    sprintf(name, "s$%02d", i);
+    CHECK(adstore_remove(&io, name) == ADSTORE_OK);
+  }
+  CHECK(stream_size < 40 * 300);
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "s$%02d", i);
+    CHECK(has_value(name, i % 2 == 0 ? NULL : value));
+  }
+}
+
+static void baseline(void) {
+  const char *names[] = {"s$a", "s$b", "s$c", "s$d", "s$e", "s$f"};
+  size_t i;
+
+  budget = -1;
+  stream_size = 0;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    CHECK(set(names[i], names[i] + 2) == ADSTORE_OK);
+  }
+}
+
+typedef adstore_result_t (*update_t)(void);
+
+static adstore_result_t insert(void) { return set("s$cc", "new"); }
+
+static adstore_result_t move(void) {
+  return set("s$c", "a value too long for the slot");
+}
+
+static adstore_result_t remove_middle(void) {
+  return adstore_remove(&io, "s$c");
+}
+
+static adstore_result_t remove_last(void) {
+  return adstore_remove(&io, "s$f");
+}
+
+/**
+ * Interrupts \a update after every number of writes, and checks that the
+ * stream then holds attributes either as they were or as updated, and takes
+ * further updates.
+ */
+static void test_torn(update_t update, const char *updated) {
+  const char *before = "s$a=a;s$b=b;s$c=c;s$d=d;s$e=e;s$f=f;";
+  char listing[LISTING_SIZE];
+  char expected[LISTING_SIZE];
+  adstore_result_t result;
+  int writes;
+
+  for (writes = 0; writes < 10; writes++) {
+    baseline();
+    budget = writes;
+    result = update();
+    budget = -1;
+
+    CHECK(list(listing) == ADSTORE_OK);
+    CHECK(strcmp(listing, result == ADSTORE_OK ? updated : before) == 0 ||
+          (result != ADSTORE_OK && strcmp(listing, updated) == 0));
+
+    CHECK(has_value("s$a", "a") && has_value("s$e", "e"));
+    CHECK(has_value("s$cc", strstr(listing, "s$cc=") ? "new" : NULL));
+
+    /* the next update rebuilds the table */
+    strcpy(expected, listing);
+    CHECK(set("s$zz", "z") == ADSTORE_OK);
+    strcat(expected, "s$zz=z;");
+    CHECK(list(listing) == ADSTORE_OK && strcmp(listing, expected) == 0);
+    CHECK(has_value("s$zz", "z") && has_value("s$b", "b"));
+
+    if (result == ADSTORE_OK) {
+      break;
+    }
+  }
+
+  CHECK(result == ADSTORE_OK);
+}
+
+static void test_rebuild(void) {
+  char listing[LISTING_SIZE];
+
+  /* table overwritten without the header */
+  baseline();
+  memset(stream + 28, 0, 8);
+  CHECK(list(listing) == ADSTORE_OK &&
+        strcmp(listing, "s$a=a;s$b=b;s$c=c;s$d=d;s$e=e;s$f=f;") == 0);
+  CHECK(has_value("s$a", "a") && has_value("s$f", "f"));
+  CHECK(set("s$b", "B") == ADSTORE_OK);
+  CHECK(list(listing) == ADSTORE_OK &&
+        strcmp(listing, "s$a=a;s$b=B;s$c=c;s$d=d;s$e=e;s$f=f;") == 0);
+
+  /* stream cut in the middle of the last slot */
+  baseline();
+  stream_size -= 2;
+  CHECK(list(listing) == ADSTORE_OK &&
+        strcmp(listing, "s$a=a;s$b=b;s$c=c;s$d=d;s$e=e;") == 0);
+  CHECK(has_value("s$f", NULL));
+  CHECK(adstore_remove(&io, "s$a") == ADSTORE_OK);
+  CHECK(list(listing) == ADSTORE_OK &&
+        strcmp(listing, "s$b=b;s$c=c;s$d=d;s$e=e;") == 0);
+
+  /* header which does not fit the stream is rejected */
+  baseline();
+  stream[12] = 0xff;
+  CHECK(list(listing) == ADSTORE_INVALID);
+}
+
+int main(void) {
+  test_v1_migration();
+  test_updates();
+  test_compaction();
+
+  test_torn(insert, "s$a=a;s$b=b;s$c=c;s$cc=new;s$d=d;s$e=e;s$f=f;");
+  test_torn(move,
+            "s$a=a;s$b=b;s$c=a value too long for the slot;s$d=d;s$e=e;s$f=f;");
+  test_torn(remove_middle, "s$a=a;s$b=b;s$d=d;s$e=e;s$f=f;");
+  test_torn(remove_last, "s$a=a;s$b=b;s$c=c;s$d=d;s$e=e;");
+  test_rebuild();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("adstore: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,381 @@
+defmodule XattrFeaturesTest do
+  # options of optional features are only read when the NIF library is
+  # loaded, tests reload it and so can't run concurrently with other tests
+  use ExUnit.Case, async: false
+
+  @store_dir "_build/test/dir_store"
+
+  describe "compressed values" do
+    setup [:with_compression, :new_file]
+
+    test "get/2 returns original value", %{path: path} do
+      value = json_value(200)
+      :ok = Xattr.set(path, "manifest", value)
+      assert {:ok, value} == Xattr.get(path, "manifest")
+      assert {:ok, true} == Xattr.has(path, "manifest")
+    end
+
+    test "values are stored compressed under tagged name", %{path: path} do
+      value = json_value(200)
+      :ok = Xattr.set(path, "manifest", value)
+      :ok = Xattr.set(path, "plain", value)
+
+      assert {:ok, stored} = Xattr.Nif.getxattr_nif(path <> <<0>>, "z$s$manifest\0")
+      assert byte_size(stored) < div(byte_size(value), 4)
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path <> <<0>>, "s$manifest\0")
+    end
+
+    test "incompressible and empty values round trip", %{path: path} do
+      for value <- [big_value(1000), "", "x"] do
+        :ok = Xattr.set(path, :meta, value)
+        assert {:ok, value} == Xattr.get(path, :meta)
+      end
+    end
+
+    test "ls/1 and get_all/1 show original names and values", %{path: path} do
+      value = json_value(50)
+      :ok = Xattr.set(path, "manifest", value)
+      :ok = Xattr.set(path, :meta, "m")
+      :ok = Xattr.set(path, "plain", "p")
+
+      assert {:ok, list} = Xattr.ls(path)
+      assert Enum.sort(["manifest", :meta, "plain"]) == Enum.sort(list)
+      assert {:ok, %{"manifest" => value, :meta => "m", "plain" => "p"}} ==
+               Xattr.get_all(path)
+    end
+
+    test "uncompressed value written earlier is replaced", %{path: path} do
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "s$manifest\0", "old")
+      assert {:ok, "old"} == Xattr.get(path, "manifest")
+
+      :ok = Xattr.set(path, "manifest", "new")
+      assert {:ok, ["manifest"]} == Xattr.ls(path)
+      assert {:ok, "new"} == Xattr.get(path, "manifest")
+
+      :ok = Xattr.rm(path, "manifest")
+      assert {:error, :enoattr} == Xattr.get(path, "manifest")
+    end
+
+    test "both copies of a value are listed once", %{path: path} do
+      :ok = Xattr.set(path, "manifest", "new")
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "s$manifest\0", "old")
+
+      assert {:ok, ["manifest"]} == Xattr.ls(path)
+      assert {:ok, %{"manifest" => "new"}} == Xattr.get_all(path)
+    end
+
+    test "conditional set/4 sees uncompressed value written earlier", %{path: path} do
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "s$manifest\0", "old")
+      assert {:error, :eexist} == Xattr.set(path, "manifest", "new", create: true)
+      assert {:ok, "old"} == Xattr.get(path, "manifest")
+
+      assert :ok == Xattr.set(path, "manifest", "new", replace: true)
+      assert {:ok, ["manifest"]} == Xattr.ls(path)
+      assert {:ok, "new"} == Xattr.get(path, "manifest")
+    end
+
+    test "cas/4 compares uncompressed value written earlier", %{path: path} do
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "s$manifest\0", "old")
+      assert {:ok, false} == Xattr.cas(path, "manifest", nil, "new")
+      assert {:ok, false} == Xattr.cas(path, "manifest", "other", "new")
+      assert {:ok, true} == Xattr.cas(path, "manifest", "old", "new")
+      assert {:ok, ["manifest"]} == Xattr.ls(path)
+      assert {:ok, "new"} == Xattr.get(path, "manifest")
+    end
+
+    test "cas/4 compares original values", %{path: path} do
+      value = json_value(100)
+      :ok = Xattr.set(path, "manifest", value)
+      assert {:ok, false} == Xattr.cas(path, "manifest", "other", "new")
+      assert {:ok, true} == Xattr.cas(path, "manifest", value, "new")
+      assert {:ok, "new"} == Xattr.get(path, "manifest")
+    end
+
+    test "batch operations mix compressed and plain names", %{path: path} do
+      pairs = [{"a", "1"}, {"manifest", json_value(20)}, {"b", "2"}, {:meta, "3"}]
+      {:ok, [:ok, :ok, :ok, :ok]} = Xattr.set_many(path, pairs)
+
+      assert Enum.map(pairs, &elem(&1, 1)) ==
+               Xattr.get_many!(path, Enum.map(pairs, &elem(&1, 0)))
+    end
+
+    test "get/2 returns {:error, :invalfmt} on corrupted value", %{path: path} do
+      corrupted = <<1, 255, 255, 0, 0, 7>>
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "z$s$manifest\0", corrupted)
+      assert {:error, :invalfmt} == Xattr.get(path, "manifest")
+    end
+
+    test "cas/4 compares decoded values", %{path: path} do
+      # compressible value stored as is, as another codec version might do
+      value = json_value(20)
+      stored = <<0, byte_size(value)::little-32, value::binary>>
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "z$s$manifest\0", stored)
+
+      assert {:ok, false} == Xattr.cas(path, "manifest", "other", "new")
+      assert {:ok, true} == Xattr.cas(path, "manifest", value, "new")
+      assert {:ok, "new"} == Xattr.get(path, "manifest")
+    end
+  end
+
+  describe "directory store" do
+    setup [:with_dir_store, :new_dir]
+
+    test "is not used on mounts supporting attributes", %{dir: dir} do
+      path = Path.join(dir, "a/plain")
+      :ok = Xattr.set(path, "stored", "value")
+      {:ok, true} = Xattr.cas(path, "stored", "value", "new")
+
+      assert {:ok, "new"} == Xattr.get(path, "stored")
+      assert {:ok, ["stored"]} == Xattr.ls(path)
+      refute File.exists?(Path.join(dir, "a/.elixir_xattr_store"))
+    end
+  end
+
+  describe "forced directory store" do
+    setup [:with_dir_store, :new_store_file]
+
+    test "set/3, get/2, has/2, ls/1 and rm/2 work", %{path: path} do
+      :ok = Xattr.set(path, "foo", "bar")
+      :ok = Xattr.set(path, :atom, "value")
+      :ok = Xattr.set(path, "empty", "")
+
+      assert {:ok, "bar"} == Xattr.get(path, "foo")
+      assert {:ok, "value"} == Xattr.get(path, :atom)
+      assert {:ok, ""} == Xattr.get(path, "empty")
+      assert {:ok, true} == Xattr.has(path, "foo")
+      assert {:ok, false} == Xattr.has(path, "missing")
+      assert {:ok, list} = Xattr.ls(path)
+      assert Enum.sort(["empty", "foo", :atom]) == Enum.sort(list)
+      assert {:ok, %{"foo" => "bar", :atom => "value", "empty" => ""}} ==
+               Xattr.get_all(path)
+
+      :ok = Xattr.set(path, "foo", "new")
+      assert {:ok, "new"} == Xattr.get(path, "foo")
+
+      :ok = Xattr.rm(path, "foo")
+      assert {:error, :enoattr} == Xattr.get(path, "foo")
+      assert {:error, :enoattr} == Xattr.rm(path, "foo")
+      assert {:ok, false} == Xattr.has(path, "foo")
+
+      assert File.exists?(Path.join(Path.dirname(path), ".elixir_xattr_store"))
+    end
+
+    test "create: true, replace: true and cas/4 check current value", %{path: path} do
+      assert {:error, :enoattr} == Xattr.set(path, "foo", "bar", replace: true)
+      assert :ok == Xattr.set(path, "foo", "bar", create: true)
+      assert {:error, :eexist} == Xattr.set(path, "foo", "baz", create: true)
+      assert :ok == Xattr.set(path, "foo", "baz", replace: true)
+      assert {:ok, "baz"} == Xattr.get(path, "foo")
+
+      assert {:ok, false} == Xattr.cas(path, "foo", nil, "new")
+      assert {:ok, false} == Xattr.cas(path, "foo", "other", "new")
+      assert {:ok, true} == Xattr.cas(path, "foo", "baz", "new")
+      assert {:ok, true} == Xattr.cas(path, "added", nil, "value")
+      assert {:ok, "new"} == Xattr.get(path, "foo")
+      assert {:ok, "value"} == Xattr.get(path, "added")
+    end
+
+    test "new file at the same path has no attributes", %{path: path} do
+      :ok = Xattr.set(path, "foo", "bar")
+      File.rm!(path)
+      File.write!(path, "again")
+
+      assert {:ok, []} == Xattr.ls(path)
+      assert {:error, :enoattr} == Xattr.get(path, "foo")
+      :ok = Xattr.set(path, "foo", "new")
+      assert {:ok, "new"} == Xattr.get(path, "foo")
+    end
+
+    test "compaction keeps current values for concurrent readers", %{path: path} do
+      store = Path.join(Path.dirname(path), ".elixir_xattr_store")
+      value = fn i -> String.duplicate(<<i>>, 60_000) end
+      :ok = Xattr.set(path, "big", value.(0))
+      :ok = Xattr.set(path, "small", "kept")
+
+      readers =
+        for _ <- 1..4 do
+          Task.async(fn ->
+            for _ <- 1..200 do
+              {:ok, read} = Xattr.get(path, "big")
+              byte_size(read) == 60_000 and read == value.(:binary.first(read))
+            end
+          end)
+        end
+
+      for i <- 1..30, do: :ok = Xattr.set(path, "big", value.(i))
+
+      assert Enum.all?(Enum.flat_map(readers, &Task.await(&1, 30_000)))
+      assert {:ok, value.(30)} == Xattr.get(path, "big")
+      assert {:ok, "kept"} == Xattr.get(path, "small")
+      refute File.exists?(store <> ".tmp")
+      # 30 values would take 1.8 MB without compaction
+      assert File.stat!(store).size < 1_000_000
+    end
+  end
+
+  describe "attribute cache with foobar attrs" do
+    setup [:with_cache, :new_file, :with_foobar_attrs]
+
+    test "get/2 hits cache after value settles", %{path: path} do
+      # values of files changed within timestamp granularity are not cached
+      Process.sleep(50)
+      assert {:ok, "foo"} == Xattr.get(path, "foo")
+      hits = cache_hits()
+      assert {:ok, "foo"} == Xattr.get(path, "foo")
+      assert cache_hits() == hits + 1
+    end
+
+    test "set/3 and rm/2 are visible through cache", %{path: path} do
+      Process.sleep(50)
+      assert {:ok, "foo"} == Xattr.get(path, "foo")
+      :ok = Xattr.set(path, "foo", "hello")
+      assert {:ok, "hello"} == Xattr.get(path, "foo")
+      :ok = Xattr.rm(path, "foo")
+      assert {:error, :enoattr} == Xattr.get(path, "foo")
+    end
+
+    test "file handle shares cache with path", %{path: path} do
+      Process.sleep(50)
+      file = Xattr.open!(path)
+      assert {:ok, "bar"} == Xattr.get(path, "bar")
+      hits = cache_hits()
+      assert {:ok, "bar"} == Xattr.get(file, "bar")
+      assert cache_hits() == hits + 1
+      Xattr.close(file)
+    end
+  end
+
+  describe "reverse index" do
+    setup [:with_index, :new_file]
+
+    test "set/3 and rm/2 update index", %{path: path} do
+      value = "pending#{:erlang.unique_integer()}"
+      real = Path.expand(path)
+
+      :ok = Xattr.set(path, "status", value)
+      assert {:ok, [real]} == Xattr.lookup("status", value)
+
+      :ok = Xattr.set(path, "status", value <> "!")
+      assert {:ok, []} == Xattr.lookup("status", value)
+      assert {:ok, [real]} == Xattr.lookup("status", value <> "!")
+
+      :ok = Xattr.rm(path, "status")
+      assert {:ok, []} == Xattr.lookup("status", value <> "!")
+    end
+
+    test "only configured names are indexed", %{path: path} do
+      :ok = Xattr.set(path, "other", "pending")
+      assert {:ok, []} == Xattr.lookup("other", "pending")
+    end
+
+    test "reconcile_index/1 repairs drift", %{path: path} do
+      value = "pending#{:erlang.unique_integer()}"
+      gone = path <> ".gone"
+      File.write!(gone, "")
+      :ok = Xattr.set(gone, "status", value)
+      File.rm!(gone)
+      :ok = Xattr.set(path, "status", value)
+      assert {:ok, [_, _]} = Xattr.lookup("status", value)
+
+      assert {:ok, %{removed: removed}} = Xattr.reconcile_index()
+      assert removed >= 1
+      assert {:ok, [Path.expand(path)]} == Xattr.lookup("status", value)
+    end
+
+    test "build_index/1 keeps existing attrs", %{path: path} do
+      value = "pending#{:erlang.unique_integer()}"
+      :ok = Xattr.set(path, "status", value)
+      assert :ok == Xattr.build_index(threads: 2)
+      assert {:ok, [Path.expand(path)]} == Xattr.lookup("status", value)
+    end
+  end
+
+  defp cache_hits do
+    Xattr.cache_stats() |> Enum.map(& &1.hits) |> Enum.sum()
+  end
+
+  defp big_value(size) do
+    :binary.list_to_bin(for i <- 1..size, do: rem(i * 7, 256))
+  end
+
+  defp json_value(count) do
+    1..count
+    |> Enum.map(fn n -> ~s({"id": #{n}, "status": "active", "tags": ["a", "b"]}) end)
+    |> Enum.join(",")
+  end
+
+  defp with_compression(_context) do
+    reload_nif(compress_names: ["manifest", :meta])
+  end
+
+  defp with_cache(_context) do
+    reload_nif(cache_max_bytes: 1_048_576)
+  end
+
+  defp with_dir_store(_context) do
+    reload_nif(dir_store: true, dir_store_force: [@store_dir])
+  end
+
+  # index root is a fresh directory, so that index builds only walk files
+  # of the test
+  defp with_index(_context) do
+    dir = "_build/test/index/#{:erlang.unique_integer([:positive])}"
+    root = Path.join(dir, "root")
+    File.mkdir_p!(root)
+    on_exit(fn -> File.rm_rf!(dir) end)
+
+    reload_nif(index: Path.join(dir, "xattr.idx"), index_root: root, index_names: ["status"])
+    {:ok, [dir: root]}
+  end
+
+  # reloads the NIF library with given options set, and without them when
+  # test exits
+  defp reload_nif(config) do
+    for {key, value} <- config, do: Application.put_env(:xattr, key, value)
+    load_nif()
+
+    on_exit(fn ->
+      for {key, _} <- config, do: Application.delete_env(:xattr, key)
+      load_nif()
+    end)
+  end
+
+  defp load_nif do
+    :code.purge(Xattr.Nif)
+    :code.delete(Xattr.Nif)
+    :code.purge(Xattr.Nif)
+    {:module, Xattr.Nif} = :code.load_file(Xattr.Nif)
+  end
+
+  defp new_file(context) do
+    dir = Map.get(context, :dir, ".")
+    do_new_file(Path.join(dir, "#{:erlang.unique_integer([:positive])}.test"))
+  end
+
+  # file in the directory listed in dir_store_force option
+  defp new_store_file(_context) do
+    File.mkdir_p!(@store_dir)
+    do_new_file(Path.join(@store_dir, "#{:erlang.unique_integer([:positive])}.test"))
+  end
+
+  defp do_new_file(path) do
+    File.write!(path, "hello world!")
+    on_exit(fn -> File.rm!(path) end)
+    {:ok, [path: path]}
+  end
+
+  # directory with a file without attrs in a subdirectory
+  defp new_dir(_context) do
+    dir = "#{:erlang.unique_integer([:positive])}.store"
+    File.mkdir_p!(Path.join(dir, "a"))
+    on_exit(fn -> File.rm_rf!(dir) end)
+    File.write!(Path.join(dir, "a/plain"), "")
+    {:ok, [dir: dir]}
+  end
+
+  defp with_foobar_attrs(%{path: path}) do
+    :ok = Xattr.set(path, "foo", "foo")
+    :ok = Xattr.set(path, "bar", "bar")
+    {:ok, [path: path]}
+  end
+end
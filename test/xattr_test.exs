@@ -144,6 +144,10 @@ defmodule XattrTest do
          quote do
            &Xattr.ls(&1)
          end},
+        {"get_all/1",
+         quote do
+           &Xattr.get_all(&1)
+         end},
         {"has/2",
          quote do
            &Xattr.has(&1, "test")
@@ -159,6 +163,22 @@ defmodule XattrTest do
         {"rm/2",
          quote do
            &Xattr.rm(&1, "test")
+         end},
+        {"has_many/2",
+         quote do
+           &Xattr.has_many(&1, ["test"])
+         end},
+        {"get_many/2",
+         quote do
+           &Xattr.get_many(&1, ["test"])
+         end},
+        {"set_many/2",
+         quote do
+           &Xattr.set_many(&1, [{"test", "hello"}])
+         end},
+        {"rm_many/2",
+         quote do
+           &Xattr.rm_many(&1, ["test"])
          end}
       ] do
     test "with non-existing file #{name} should return {:error, :enoent}" do
@@ -194,6 +214,718 @@ defmodule XattrTest do
     end
   end
 
+  describe "batch operations with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "has_many/2 returns results in order", %{path: path} do
+      assert {:ok, [{:ok, true}, {:ok, false}, {:ok, true}]} ==
+               Xattr.has_many(path, ["foo", :foo, "bar"])
+    end
+
+    test "get_many/2 returns per-name results", %{path: path} do
+      assert {:ok, [{:ok, "bar"}, {:error, :enoattr}, {:ok, "foo"}]} ==
+               Xattr.get_many(path, ["bar", "hello", "foo"])
+    end
+
+    test "set_many/2 sets all attrs", %{path: path} do
+      assert {:ok, [:ok, :ok]} == Xattr.set_many(path, %{"foo" => "hello", :abc => ""})
+      assert {:ok, "hello"} == Xattr.get(path, "foo")
+      assert {:ok, ""} == Xattr.get(path, :abc)
+    end
+
+    test "rm_many/2 removes existing attrs", %{path: path} do
+      assert {:ok, [:ok, {:error, :enoattr}]} == Xattr.rm_many(path, ["foo", "hello"])
+      assert {:ok, ["bar"]} == Xattr.ls(path)
+    end
+
+    test "with empty list return empty results", %{path: path} do
+      assert {:ok, []} == Xattr.get_many(path, [])
+      assert {:ok, []} == Xattr.set_many(path, [])
+    end
+
+    test "bang versions unwrap results", %{path: path} do
+      assert ["foo", "bar"] == Xattr.get_many!(path, ["foo", "bar"])
+      assert [true, false] == Xattr.has_many!(path, ["foo", "hello"])
+      assert :ok == Xattr.set_many!(path, hello: "world")
+      assert :ok == Xattr.rm_many!(path, ["foo", :hello])
+      assert {:ok, ["bar"]} == Xattr.ls(path)
+
+      assert_raise Xattr.Error, fn -> Xattr.get_many!(path, ["bar", "foo"]) end
+    end
+
+    test "many attrs are submitted in chunks and keep order", %{path: path} do
+      names = for n <- 1..300, do: "name#{n}"
+      large = :binary.copy("x", 2048)
+      pairs = for name <- names, do: {name, if(name == "name150", do: large, else: name)}
+
+      assert {:ok, List.duplicate(:ok, 300)} == Xattr.set_many(path, pairs)
+      assert {:ok, results} = Xattr.get_many(path, ["missing" | names])
+      assert [{:error, :enoattr} | Enum.map(pairs, fn {_, value} -> {:ok, value} end)] == results
+      assert [true, false] == Xattr.has_many!(path, ["name300", "name301"])
+    end
+
+    test "long batches yield the scheduler", %{path: path} do
+      names = for n <- 1..20_000, do: "s$missing#{n}"
+      parent = self()
+
+      pid =
+        spawn(fn ->
+          receive do
+            :go -> send(parent, {:done, Xattr.Nif.getxattr_many_nif(path, names)})
+          end
+        end)
+
+      # the process is traced only while it runs the call
+      :erlang.trace(pid, true, [:running])
+      send(pid, :go)
+      assert_receive {:done, {:ok, results}}, 10_000
+      ref = :erlang.trace_delivered(pid)
+      assert_receive {:trace_delivered, ^pid, ^ref}
+
+      assert 20_000 == length(results)
+      assert_received {:trace, ^pid, :out, _}
+    end
+  end
+
+  describe "multi-path operations" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "get_paths/2 returns per-path results in order", %{path: path} do
+      missing = "#{:erlang.unique_integer([:positive])}.test"
+
+      assert [{:ok, "foo"}, {:error, :enoent}, {:ok, "foo"}] ==
+               Xattr.get_paths([path, missing, String.to_charlist(path)], "foo")
+    end
+
+    test "has_paths/2 returns per-path results in order", %{path: path} do
+      assert [{:ok, true}, {:ok, true}] == Xattr.has_paths([path, path], "bar")
+      assert [{:ok, false}] == Xattr.has_paths([path], :bar)
+    end
+
+    test "set_paths/3 sets attr on all paths", %{path: path} do
+      assert [:ok, :ok] == Xattr.set_paths([path, path], "hello", "world")
+      assert {:ok, "world"} == Xattr.get(path, "hello")
+    end
+
+    test "get_paths/2 processes long lists", %{path: path} do
+      paths = List.duplicate(path, 10_000)
+      assert List.duplicate({:ok, "bar"}, 10_000) == Xattr.get_paths(paths, "bar")
+    end
+
+    test "bang versions unwrap results", %{path: path} do
+      assert ["foo"] == Xattr.get_paths!([path], "foo")
+      assert [false] == Xattr.has_paths!([path], "hello")
+      assert :ok == Xattr.set_paths!([path], "hello", "world")
+
+      assert_raise Xattr.Error, ~r/no such attribute/, fn ->
+        Xattr.get_paths!([path], "nope")
+      end
+    end
+  end
+
+  describe "copying with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "copy/3 copies all attrs and keeps others", %{path: path} do
+      dst = copy_target()
+      File.write!(dst, "")
+      :ok = Xattr.set(path, :abc, "abc")
+      :ok = Xattr.set(dst, "foo", "old")
+      :ok = Xattr.set(dst, "extra", "extra")
+
+      assert :ok == Xattr.copy(path, dst)
+      assert {:ok, %{"foo" => "foo", "bar" => "bar", :abc => "abc", "extra" => "extra"}} ==
+               Xattr.get_all(dst)
+    end
+
+    test "copy/3 with sync: true removes attrs missing in source", %{path: path} do
+      dst = copy_target()
+      File.write!(dst, "")
+      :ok = Xattr.set(dst, "bar", "bar")
+      :ok = Xattr.set(dst, "extra", "extra")
+
+      assert :ok == Xattr.copy(path, dst, sync: true)
+      assert {:ok, %{"foo" => "foo", "bar" => "bar"}} == Xattr.get_all(dst)
+    end
+
+    test "copy/3 with data: true copies contents to new file", %{path: path} do
+      dst = copy_target()
+
+      assert :ok == Xattr.copy(path, dst, data: true)
+      assert "hello world!" == File.read!(dst)
+      assert {:ok, %{"foo" => "foo", "bar" => "bar"}} == Xattr.get_all(dst)
+    end
+
+    test "copy/3 copies chunks of large values", %{path: path} do
+      with_chunking(%{})
+      dst = copy_target()
+      File.write!(dst, "")
+      value = big_value(1000)
+      :ok = Xattr.set(path, "big", value)
+
+      assert :ok == Xattr.copy(path, dst)
+      assert {:ok, value} == Xattr.get(dst, "big")
+    end
+
+    test "copy/3 returns {:error, :enoent} on missing file", %{path: path} do
+      assert {:error, :enoent} == Xattr.copy(path, copy_target())
+      assert {:error, :enoent} == Xattr.copy(copy_target(), path)
+    end
+
+    test "bang version raises", %{path: path} do
+      dst = copy_target()
+      assert :ok == Xattr.copy!(path, dst, data: true)
+
+      assert_raise Xattr.Error, ~r/no such file/, fn ->
+        Xattr.copy!(copy_target(), dst)
+      end
+
+      assert_raise ArgumentError, fn -> Xattr.copy(path, dst, sync: 1) end
+    end
+  end
+
+  describe "conditional writes with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "set/4 with create: true fails if attr exists", %{path: path} do
+      assert {:error, :eexist} == Xattr.set(path, "foo", "new", create: true)
+      assert {:ok, "foo"} == Xattr.get(path, "foo")
+      assert :ok == Xattr.set(path, "hello", "world", create: true)
+      assert {:ok, "world"} == Xattr.get(path, "hello")
+    end
+
+    test "set/4 with replace: true fails if attr is missing", %{path: path} do
+      assert {:error, :enoattr} == Xattr.set(path, "hello", "world", replace: true)
+      assert {:ok, false} == Xattr.has(path, "hello")
+      assert :ok == Xattr.set(path, "foo", "new", replace: true)
+      assert {:ok, "new"} == Xattr.get(path, "foo")
+    end
+
+    test "set/4 rejects conflicting options", %{path: path} do
+      assert_raise ArgumentError, fn ->
+        Xattr.set(path, "foo", "new", create: true, replace: true)
+      end
+    end
+
+    test "cas/4 writes only if value matches", %{path: path} do
+      assert {:ok, false} == Xattr.cas(path, "foo", "fo", "new")
+      assert {:ok, false} == Xattr.cas(path, "foo", "fooo", "new")
+      assert {:ok, "foo"} == Xattr.get(path, "foo")
+      assert {:ok, true} == Xattr.cas(path, "foo", "foo", "new")
+      assert {:ok, "new"} == Xattr.get(path, "foo")
+    end
+
+    test "cas/4 with nil expects missing attr", %{path: path} do
+      assert {:ok, false} == Xattr.cas(path, "foo", nil, "new")
+      assert {:ok, false} == Xattr.cas(path, "hello", "", "world")
+      assert {:ok, true} == Xattr.cas(path, "hello", nil, "world")
+      assert {:ok, "world"} == Xattr.get(path, "hello")
+    end
+
+    test "cas/4 works with file handle", %{path: path} do
+      {:ok, file} = Xattr.open(path)
+      assert {:ok, true} == Xattr.cas(file, "bar", "bar", "new")
+      assert {:error, :eexist} == Xattr.set(file, "bar", "x", create: true)
+      :ok = Xattr.close(file)
+      assert {:ok, "new"} == Xattr.get(path, "bar")
+    end
+
+    test "concurrent cas/4 calls never lose updates", %{path: path} do
+      :ok = Xattr.set(path, "counter", "0")
+
+      1..8
+      |> Enum.map(fn _ -> Task.async(fn -> increment(path, 50) end) end)
+      |> Enum.each(&Task.await(&1, 30_000))
+
+      assert {:ok, "400"} == Xattr.get(path, "counter")
+    end
+
+    test "bang versions unwrap results", %{path: path} do
+      assert Xattr.cas!(path, "foo", "foo", "new")
+      refute Xattr.cas!(path, "foo", "foo", "newer")
+      assert :ok == Xattr.set!(path, "foo", "x", replace: true)
+
+      assert_raise Xattr.Error, ~r/already exists/, fn ->
+        Xattr.set!(path, "foo", "y", create: true)
+      end
+
+      assert_raise Xattr.Error, fn ->
+        Xattr.cas!("nonexistent.txt", "foo", nil, "y")
+      end
+    end
+  end
+
+  describe "chunked large values" do
+    setup [:new_file, :with_chunking]
+
+    test "set/3 splits value and get/2 reassembles it", %{path: path} do
+      value = big_value(1000)
+      assert :ok == Xattr.set(path, "big", value)
+      assert {:ok, value} == Xattr.get(path, "big")
+      assert {:ok, ["big"]} == Xattr.ls(path)
+      assert {:ok, true} == Xattr.has(path, "big")
+      assert {:ok, _} = Xattr.Nif.getxattr_nif(path, "c$1.9.s$big")
+    end
+
+    test "short values are stored as is", %{path: path} do
+      assert :ok == Xattr.set(path, "small", "hello")
+      assert {:ok, "hello"} == Xattr.Nif.getxattr_nif(path, "s$small")
+    end
+
+    test "get_all/1 reassembles chunked values", %{path: path} do
+      value = big_value(1000)
+      :ok = Xattr.set(path, "big", value)
+      :ok = Xattr.set(path, "small", "hello")
+      assert {:ok, %{"big" => value, "small" => "hello"}} == Xattr.get_all(path)
+    end
+
+    test "cas/4 rejects chunked values", %{path: path} do
+      value = big_value(1000)
+      :ok = Xattr.set(path, "big", value)
+      assert {:error, :enotsup} == Xattr.cas(path, "big", value, "new")
+      assert {:ok, false} == Xattr.cas(path, "big", nil, "new")
+      assert {:ok, value} == Xattr.get(path, "big")
+    end
+
+    test "stream/2 returns value lazily in chunks", %{path: path} do
+      value = big_value(1050)
+      :ok = Xattr.set(path, "big", value)
+      {:ok, stream} = Xattr.stream(path, "big")
+      chunks = Enum.to_list(stream)
+      assert 11 == length(chunks)
+      assert value == IO.iodata_to_binary(chunks)
+      :ok = Xattr.set(path, "hello", "world")
+      assert ["world"] == Xattr.stream!(path, "hello") |> Enum.to_list()
+    end
+
+    test "rewrite removes chunks of previous generation", %{path: path} do
+      :ok = Xattr.set(path, "big", big_value(1000))
+      :ok = Xattr.set(path, "big", big_value(300))
+      assert {:ok, big_value(300)} == Xattr.get(path, "big")
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$1.0.s$big")
+      assert {:ok, _} = Xattr.Nif.getxattr_nif(path, "c$2.2.s$big")
+
+      :ok = Xattr.set(path, "big", "short")
+      assert {:ok, "short"} == Xattr.get(path, "big")
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$2.0.s$big")
+    end
+
+    test "rewrite removes chunks left by interrupted write", %{path: path} do
+      :ok = Xattr.set(path, "big", big_value(200))
+      for i <- 0..39, do: :ok = Xattr.Nif.setxattr_nif(path, "c$2.#{i}.s$big", "x")
+      :ok = Xattr.set(path, "big", big_value(500))
+      assert {:ok, big_value(500)} == Xattr.get(path, "big")
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$2.5.s$big")
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$2.39.s$big")
+    end
+
+    test "rm/2 removes chunks", %{path: path} do
+      :ok = Xattr.set(path, "big", big_value(1000))
+      assert :ok == Xattr.rm(path, "big")
+      assert {:error, :enoattr} == Xattr.get(path, "big")
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$1.0.s$big")
+    end
+
+    test "corrupted chunk is detected", %{path: path} do
+      :ok = Xattr.set(path, "big", big_value(1000))
+      :ok = Xattr.Nif.setxattr_nif(path, "c$1.3.s$big", String.duplicate("x", 100))
+      assert {:error, :invalfmt} == Xattr.get(path, "big")
+      {:ok, stream} = Xattr.stream(path, "big")
+      assert_raise Xattr.Error, ~r/corrupted/, fn -> Enum.to_list(stream) end
+    end
+
+    test "failed conditional set leaves no chunks behind", %{path: path} do
+      :ok = Xattr.set(path, "big", "short")
+      assert {:error, :eexist} == Xattr.set(path, "big", big_value(1000), create: true)
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$1.0.s$big")
+      assert {:error, :enoattr} == Xattr.set(path, "other", big_value(1000), replace: true)
+      assert {:error, :enoattr} == Xattr.Nif.getxattr_nif(path, "c$1.0.s$other")
+      assert {:ok, ["big"]} == Xattr.ls(path)
+    end
+
+    test "value which only looks like a header is returned as is", %{path: path} do
+      value = <<"XATTRCH1", 1::little-32, 2::little-32, 8::little-64, 0::little-32>>
+      :ok = Xattr.Nif.setxattr_nif(path, "s$fake", value)
+      assert {:ok, value} == Xattr.get(path, "fake")
+      assert [value] == Xattr.stream!(path, "fake") |> Enum.to_list()
+    end
+
+    test "works with file handle", %{path: path} do
+      {:ok, file} = Xattr.open(path)
+      :ok = Xattr.set(file, "big", big_value(1000))
+      assert {:ok, big_value(1000)} == Xattr.get(file, "big")
+      :ok = Xattr.close(file)
+      assert {:ok, big_value(1000)} == Xattr.get(path, "big")
+    end
+  end
+
+  describe "with file handle and foobar attrs" do
+    setup [:new_file, :with_foobar_attrs, :open_file]
+
+    test "ls/1 lists all attrs", %{file: file} do
+      assert {:ok, list} = Xattr.ls(file)
+      assert ["bar", "foo"] == Enum.sort(list)
+    end
+
+    test "has/2, get/2, set/3 and rm/2 work", %{file: file, path: path} do
+      assert {:ok, true} == Xattr.has(file, "foo")
+      assert {:ok, "bar"} == Xattr.get(file, "bar")
+      assert :ok == Xattr.set(file, :hello, "world")
+      assert {:ok, "world"} == Xattr.get(path, :hello)
+      assert :ok == Xattr.rm(file, "foo")
+      assert {:error, :enoattr} == Xattr.get(file, "foo")
+    end
+
+    test "batch operations work", %{file: file} do
+      assert {:ok, [{:ok, "foo"}, {:ok, "bar"}]} == Xattr.get_many(file, ["foo", "bar"])
+      assert :ok == Xattr.set_many!(file, hello: "world")
+      assert [true] == Xattr.has_many!(file, [:hello])
+    end
+
+    test "handle follows file after rename", %{file: file, path: path} do
+      File.rename!(path, path <> ".renamed")
+      on_exit(fn -> File.rename(path <> ".renamed", path) end)
+      assert {:ok, "foo"} == Xattr.get(file, "foo")
+    end
+
+    test "handle of unreadable file follows it after rename", %{path: path} do
+      File.chmod!(path, 0o200)
+      file = Xattr.open!(path)
+      File.rename!(path, path <> ".renamed")
+      on_exit(fn -> File.rename(path <> ".renamed", path) end)
+
+      assert :ok == Xattr.set(file, "hello", "world")
+      File.chmod!(path <> ".renamed", 0o600)
+      assert {:ok, "world"} == Xattr.get(path <> ".renamed", "hello")
+      Xattr.close(file)
+    end
+
+    test "operations on closed handle return {:error, :closed}", %{file: file} do
+      assert :ok == Xattr.close(file)
+      assert :ok == Xattr.close(file)
+      assert {:error, :closed} == Xattr.get(file, "foo")
+      assert {:error, :closed} == Xattr.ls(file)
+      assert {:error, :closed} == Xattr.get_many(file, ["foo"])
+      assert_raise Xattr.Error, ~r/file handle is closed/, fn -> Xattr.get!(file, "foo") end
+    end
+  end
+
+  test "open/1 with non-existing file returns {:error, :enoent}" do
+    path = "#{:erlang.unique_integer([:positive])}.test"
+    assert {:error, :enoent} == Xattr.open(path)
+  end
+
+  describe "dirty NIF variants with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "behave the same as adaptive ones", %{path: path} do
+      cpath = path <> <<0>>
+      assert {:ok, list} = Xattr.Nif.listxattr_dirty_nif(cpath)
+      assert ["bar", "foo"] == Enum.sort(list)
+      assert {:ok, true} == Xattr.Nif.hasxattr_dirty_nif(cpath, "s$foo\0")
+      assert {:ok, "bar"} == Xattr.Nif.getxattr_dirty_nif(cpath, "s$bar\0")
+      assert :ok == Xattr.Nif.setxattr_dirty_nif(cpath, "s$foo\0", "hello")
+      assert {:ok, "hello"} == Xattr.get(path, "foo")
+      assert {:error, :eexist} == Xattr.Nif.setxattr_mode_dirty_nif(cpath, "s$foo\0", "x", :create)
+      assert :ok == Xattr.Nif.setxattr_mode_dirty_nif(cpath, "s$foo\0", "hi", :replace)
+      assert {:ok, false} == Xattr.Nif.casxattr_dirty_nif(cpath, "s$foo\0", "hello", "x")
+      assert {:ok, true} == Xattr.Nif.casxattr_dirty_nif(cpath, "s$foo\0", "hi", "hello")
+      assert {:ok, "hello"} == Xattr.get(path, "foo")
+      assert :ok == Xattr.Nif.removexattr_dirty_nif(cpath, "s$foo\0")
+      assert {:ok, ["bar"]} == Xattr.ls(path)
+    end
+  end
+
+  describe "get_all with foobar, empty and atom attrs" do
+    setup [:new_file, :with_foobar_attrs, :with_empty_attr, :with_atom_attrs]
+
+    test "get_all/1 returns all attrs", %{path: path} do
+      expected = %{
+        "foo" => "foo",
+        "bar" => "bar",
+        "empty" => "",
+        :abc => "abc",
+        Foo.Bar => "foobar",
+        :"Hello World\n" => "Hello World\n"
+      }
+
+      assert {:ok, expected} == Xattr.get_all(path)
+      assert expected == Xattr.get_all!(path)
+    end
+
+    test "get_all/1 works with file handle", %{path: path} do
+      file = Xattr.open!(path)
+      assert {:ok, Xattr.get_all!(path)} == Xattr.get_all(file)
+      Xattr.close(file)
+    end
+
+    test "get_all/1 reads values larger than initial buffer", %{path: path} do
+      large = :binary.copy("x", 10_000)
+      :ok = Xattr.set(path, "large", large)
+      assert {:ok, %{"large" => ^large, "foo" => "foo"}} = Xattr.get_all(path)
+    end
+  end
+
+  describe "get_all on file without attrs" do
+    setup [:new_file]
+
+    test "get_all/1 returns empty map", %{path: path} do
+      assert {:ok, %{}} == Xattr.get_all(path)
+    end
+
+    test "get_all/1 returns {:error, :invalfmt} on untagged name", %{path: path} do
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "x\0", "")
+      assert {:error, :invalfmt} == Xattr.get_all(path)
+    end
+  end
+
+  describe "argument marshalling with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "NIFs accept unterminated iodata paths and names", %{path: path} do
+      assert {:ok, "foo"} == Xattr.Nif.getxattr_nif(path, ["s$", "foo"])
+      assert {:ok, "bar"} == Xattr.Nif.getxattr_nif([path], [?s, ?$ | "bar"])
+      assert :ok == Xattr.Nif.setxattr_nif(path, [["s"], "$foo"], "hello")
+      assert {:ok, "hello"} == Xattr.get(path, "foo")
+    end
+
+    test "NIFs reject non-iodata arguments", %{path: path} do
+      assert_raise ArgumentError, fn -> Xattr.Nif.getxattr_nif(path, [:foo]) end
+      assert_raise ArgumentError, fn -> Xattr.Nif.getxattr_nif(path, "") end
+      assert_raise ArgumentError, fn -> Xattr.Nif.listxattr_nif([256]) end
+    end
+
+    test "paths NIFs fail non-iodata paths individually", %{path: path} do
+      assert [{:ok, true}, {:error, :einval}] ==
+               Xattr.Nif.hasxattr_paths_nif([path, :nope], "s$foo")
+
+      assert_raise ArgumentError, fn -> Xattr.Nif.hasxattr_paths_nif([path | :nope], "s$foo") end
+    end
+
+    test "batch NIFs fail malformed items individually", %{path: path} do
+      assert {:ok, [{:error, :einval}, :ok]} ==
+               Xattr.Nif.setxattr_many_nif(path, [{"s$foo", :nope}, {"s$bar", "x"}])
+
+      assert {:ok, [{:error, :einval}, {:ok, "x"}]} ==
+               Xattr.Nif.getxattr_many_nif(path, [:nope, "s$bar"])
+
+      assert_raise ArgumentError, fn -> Xattr.Nif.getxattr_many_nif(path, ["s$bar" | :nope]) end
+    end
+
+    test "names with NUL return {:error, :einval}", %{path: path} do
+      assert {:error, :einval} == Xattr.get(path, "f\0oo")
+      assert {:ok, [{:error, :einval}, {:ok, "bar"}]} == Xattr.get_many(path, ["f\0oo", "bar"])
+    end
+
+    test "too long names return {:error, :erange}", %{path: path} do
+      assert {:error, :erange} == Xattr.set(path, String.duplicate("x", 2000), "")
+      assert [{:error, :erange}] == Xattr.has_paths([path], String.duplicate("x", 2000))
+    end
+  end
+
+  describe "listing many and malformed attrs" do
+    setup [:new_file]
+
+    test "ls/1 lists many mixed attrs", %{path: path} do
+      names = for n <- 1..200, do: if(rem(n, 2) == 0, do: "s#{n}", else: :"a#{n}")
+      for name <- names, do: :ok = Xattr.set(path, name, "")
+
+      assert {:ok, list} = Xattr.ls(path)
+      assert Enum.sort(names) == Enum.sort(list)
+    end
+
+    test "ls/1 returns {:error, :invalfmt} on untagged name", %{path: path} do
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "x\0", "")
+      assert {:error, :invalfmt} == Xattr.ls(path)
+    end
+
+    test "ls/1 makes atoms of names not seen before", %{path: path} do
+      name = "fresh#{:erlang.unique_integer([:positive])}"
+      :ok = Xattr.Nif.setxattr_nif(path <> <<0>>, "a$#{name}\0", "")
+      assert {:ok, [atom]} = Xattr.ls(path)
+      assert name == Atom.to_string(atom)
+    end
+  end
+
+  describe "statistics with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "stats/0 counts calls and errors", %{path: path} do
+      before = Xattr.stats()
+      assert {:ok, "foo"} == Xattr.get(path, "foo")
+      assert {:error, :enoattr} == Xattr.get(path, "missing")
+      :ok = Xattr.set(path, "foo", "hello")
+      stats = Xattr.stats()
+
+      # counters are shared with concurrently running tests
+      assert stats.get.calls >= before.get.calls + 2
+      assert stats.get.errors >= before.get.errors + 1
+      assert stats.set.calls >= before.set.calls + 1
+      assert stats.set.bytes_written >= before.set.bytes_written + 5
+      assert Map.get(stats.errors, :enoattr, 0) >= Map.get(before.errors, :enoattr, 0) + 1
+
+      assert [{bound, count} | _] = stats.get.latency
+      assert is_integer(bound) and count > 0
+    end
+
+    test "Xattr.Telemetry.dispatch_stats/0 returns :ok" do
+      assert :ok == Xattr.Telemetry.dispatch_stats()
+    end
+  end
+
+  describe "subscriptions with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "subscriber receives changed attrs only", %{path: path} do
+      sub = Xattr.subscribe!(path)
+      :ok = Xattr.set(path, "foo", "hello")
+      assert_receive {:xattr_changed, ^path, %{"foo" => "hello"} = diff}
+      assert map_size(diff) == 1
+
+      :ok = Xattr.set(path, :abc, "abc")
+      assert_receive {:xattr_changed, ^path, %{abc: "abc"}}
+
+      :ok = Xattr.rm(path, "bar")
+      assert_receive {:xattr_changed, ^path, %{"bar" => nil}}
+
+      :ok = Xattr.unsubscribe(sub)
+    end
+
+    test "unchanged attrs do not generate events", %{path: path} do
+      sub = Xattr.subscribe!([path])
+      :ok = Xattr.set(path, "foo", "foo")
+      File.chmod!(path, 0o600)
+      refute_receive {:xattr_changed, _, _}
+      :ok = Xattr.unsubscribe(sub)
+    end
+
+    test "directory subscription reports children", %{path: path} do
+      dir = File.cwd!()
+      child = Path.join(dir, path)
+      sub = Xattr.subscribe!(dir)
+      :ok = Xattr.set(path, "foo", "hello")
+      assert_receive {:xattr_changed, ^child, %{"foo" => "hello"}}
+      :ok = Xattr.unsubscribe(sub)
+    end
+
+    test "unsubscribe/1 stops events", %{path: path} do
+      sub = Xattr.subscribe!(path)
+      :ok = Xattr.unsubscribe(sub)
+      :ok = Xattr.unsubscribe(sub)
+      :ok = Xattr.set(path, "foo", "hello")
+      refute_receive {:xattr_changed, _, _}
+    end
+
+    test "subscribe/1 returns {:error, :enoent} for missing path", %{path: path} do
+      assert {:error, :enoent} == Xattr.subscribe([path, path <> ".missing"])
+    end
+  end
+
+  describe "asynchronous calls with foobar attrs" do
+    setup [:new_file, :with_foobar_attrs]
+
+    test "results arrive as messages", %{path: path} do
+      ref = Xattr.async_get(path, "foo")
+      assert_receive {:xattr_result, ^ref, {:ok, "foo"}}
+      assert {:ok, true} == path |> Xattr.async_has("bar") |> Xattr.await()
+      assert :ok == path |> Xattr.async_set("foo", "hello") |> Xattr.await()
+      assert {:ok, "hello"} == Xattr.get(path, "foo")
+      assert :ok == path |> Xattr.async_rm("bar") |> Xattr.await()
+      assert {:error, :enoattr} == path |> Xattr.async_get("bar") |> Xattr.await()
+    end
+
+    test "many calls can be in flight", %{path: path} do
+      refs = for _ <- 1..1000, do: Xattr.async_get(path, "foo")
+      assert Enum.all?(refs, &(Xattr.await(&1) == {:ok, "foo"}))
+    end
+
+    test "works with file handle and reply_to", %{path: path} do
+      file = Xattr.open!(path)
+      parent = self()
+      task = Task.async(fn -> Xattr.async_get(file, "bar", reply_to: parent) end)
+      ref = Task.await(task)
+      assert {:ok, "bar"} == Xattr.await(ref)
+      Xattr.close(file)
+    end
+
+    test "argument errors are delivered as results", %{path: path} do
+      ref = Xattr.async_get(path, "f\0oo")
+      assert {:error, :einval} == Xattr.await(ref)
+      assert {:error, :enoent} == Xattr.await(Xattr.async_has(path <> ".missing", "foo"))
+    end
+  end
+
+  describe "directory scan" do
+    setup [:new_dir]
+
+    test "stream yields attrs of all files in tree", %{dir: dir} do
+      {:ok, stream} = Xattr.scan(dir, threads: 4, chunk_size: 2, max_chunks: 1)
+      entries = Enum.to_list(stream)
+
+      assert length(entries) == 21
+      assert {dir, %{"root" => "root"}} in entries
+      assert {Path.join(dir, "a/b/13"), %{"foo" => "13", abc: "abc"}} in entries
+      refute Enum.any?(entries, &(elem(&1, 0) == Path.join(dir, "a/plain")))
+    end
+
+    test "hard links are reported once", %{dir: dir} do
+      File.ln!(Path.join(dir, "a/0"), Path.join(dir, "link"))
+      paths = dir |> Xattr.scan!() |> Enum.map(&elem(&1, 0))
+      assert length(paths) == 21
+      assert Path.join(dir, "a/0") in paths or Path.join(dir, "link") in paths
+    end
+
+    test "names option filters attrs", %{dir: dir} do
+      entries = dir |> Xattr.scan!(names: [:abc, "missing"]) |> Enum.to_list()
+      assert length(entries) == 20
+      assert Enum.all?(entries, fn {_, attrs} -> attrs == %{abc: "abc"} end)
+    end
+
+    test "halted stream cancels scan", %{dir: dir} do
+      stream = Xattr.scan!(dir, chunk_size: 1, max_chunks: 1)
+      assert [{_, _}, {_, _}] = Enum.take(stream, 2)
+      refute_received {:xattr_scan, _, _}
+    end
+
+    test "scan/2 returns {:error, :enoent} for missing dir", %{dir: dir} do
+      assert {:error, :enoent} == Xattr.scan(Path.join(dir, "missing"))
+    end
+  end
+
+  defp increment(_path, 0) do
+    :ok
+  end
+
+  defp increment(path, n) do
+    {:ok, value} = Xattr.get(path, "counter")
+    next = Integer.to_string(String.to_integer(value) + 1)
+
+    case Xattr.cas(path, "counter", value, next) do
+      {:ok, true} -> increment(path, n - 1)
+      {:ok, false} -> increment(path, n)
+    end
+  end
+
+  defp big_value(size) do
+    :binary.list_to_bin(for i <- 1..size, do: rem(i * 7, 256))
+  end
+
+  defp with_chunking(_context) do
+    Application.put_env(:xattr, :chunk_size, 100)
+
+    on_exit(fn ->
+      Application.delete_env(:xattr, :chunk_size)
+    end)
+
+    :ok
+  end
+
+  defp copy_target do
+    path = "#{:erlang.unique_integer([:positive])}.copy"
+    on_exit(fn -> File.rm(path) end)
+    path
+  end
+
   defp new_file(_context) do
     path = "#{:erlang.unique_integer([:positive])}.test"
     do_new_file(path)
@@ -216,6 +948,29 @@ defmodule XattrTest do
     {:ok, [path: path]}
   end
 
+  # tree of 2 directories and 20 files with attrs, and one file without
+  defp new_dir(_context) do
+    dir = "#{:erlang.unique_integer([:positive])}.scan"
+    File.mkdir_p!(Path.join(dir, "a/b"))
+    on_exit(fn -> File.rm_rf!(dir) end)
+
+    :ok = Xattr.set(dir, "root", "root")
+    File.write!(Path.join(dir, "a/plain"), "")
+
+    for n <- 0..19 do
+      path = Path.join([dir, if(n < 10, do: "a", else: "a/b"), Integer.to_string(n)])
+      File.write!(path, "")
+      :ok = Xattr.set(path, "foo", Integer.to_string(n))
+      :ok = Xattr.set(path, :abc, "abc")
+    end
+
+    {:ok, [dir: dir]}
+  end
+
+  defp open_file(%{path: path}) do
+    {:ok, [file: Xattr.open!(path)]}
+  end
+
   defp with_foobar_attrs(%{path: path}) do
     :ok = Xattr.set(path, "foo", "foo")
     :ok = Xattr.set(path, "bar", "bar")